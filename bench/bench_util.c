@@ -0,0 +1,92 @@
+/**
+ * @file bench_util.c
+ * @author longdh
+ * @brief clocks and JSON report helpers of the benchmarks
+ * @version 0.1
+ * @date 2024-02-12
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <time.h>
+#include <sys/resource.h>
+
+#include "bench_util.h"
+
+/**
+ * @brief monotonic clock (ns), for durations
+ *
+ * @return uint64_t
+ */
+uint64_t bench_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * @brief unix time (ns), the clock of the sample timestamps
+ *
+ * @return uint64_t
+ */
+uint64_t bench_wall_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * @brief CPU time (user + system, ns) of the process, all threads
+ *
+ * @return uint64_t
+ */
+uint64_t bench_cpu_ns()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ((uint64_t) ru.ru_utime.tv_sec + (uint64_t) ru.ru_stime.tv_sec) * 1000000000ULL
+         + ((uint64_t) ru.ru_utime.tv_usec + (uint64_t) ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+/**
+ * @brief report destination
+ *
+ * @param path, NULL or "-" => stdout
+ * @return FILE*, NULL => error
+ */
+FILE* bench_report_open(const char* path)
+{
+    if (path == NULL || path[0] == '\0' || (path[0] == '-' && path[1] == '\0'))
+        return stdout;
+
+    return fopen(path, "w");
+}
+
+void bench_report_close(FILE* f)
+{
+    if (f != NULL && f != stdout)
+        fclose(f);
+    else if (f != NULL)
+        fflush(f);
+}
+
+/**
+ * @brief latency percentiles of a histogram (us) as JSON members
+ *
+ * @param f
+ * @param h
+ */
+void bench_report_hist(FILE* f, histogram_t* h)
+{
+    fprintf(f, "\"count\": %llu, \"p50_us\": %lld, \"p99_us\": %lld, \"p999_us\": %lld, \"max_us\": %lld",
+        (unsigned long long) h->count,
+        (long long) histogram_percentile(h, 50.0),
+        (long long) histogram_percentile(h, 99.0),
+        (long long) histogram_percentile(h, 99.9),
+        (long long) (h->count ? h->max : 0));
+}
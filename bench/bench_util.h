@@ -0,0 +1,17 @@
+#ifndef __BENCH_UTIL_H__
+#define __BENCH_UTIL_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "utils/histogram.h"
+
+uint64_t bench_now_ns();
+uint64_t bench_wall_ns();
+uint64_t bench_cpu_ns();
+
+FILE* bench_report_open(const char* path);
+void bench_report_close(FILE* f);
+void bench_report_hist(FILE* f, histogram_t* h);
+
+#endif // !__BENCH_UTIL_H__
@@ -0,0 +1,278 @@
+/**
+ * @file e2e_bench.c
+ * @author longdh
+ * @brief end-to-end benchmark: synthetic meter samples written on the
+ *        forwarder bus, through the configured sinks, to local InfluxDB-HTTP,
+ *        MQTT and Redis stand-ins (bench/mock_sinks.c)
+ * @version 0.1
+ * @date 2024-02-12
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Usage: e2e_bench [-n samples] [-r rate] [-m meters] [-f fanout] [-R reactor_threads]
+ *                  [-w idle_s] [-o report.json]
+ *
+ * The pipeline is the one of the daemon (data_forwarder_task_init with a
+ * generated configuration), the samples stand in for the sources. Latency is
+ * bus write -> arrival at the mock, the CPU time is the process's (the mocks
+ * run in a child), per sample written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <libconfig.h>
+
+#include "utils/error.h"
+#include "utils/logger.h"
+#include "utils/sbus.h"
+#include "meter/meter_data.h"
+#include "data_forwarder.h"
+
+#include "mock_sinks.h"
+#include "bench_util.h"
+
+// the bus of the forwarder (data_forwarder.c)
+extern Bus df_bus;
+
+static struct {
+    int         samples;
+    int         rate;           // samples/s, 0 => as fast as the bus takes them
+    int         meters;
+    int         fanout;
+    int         reactor_threads;
+    int         idle_s;         // give up after no progress for this long
+    const char* report;
+} opt = { 100000, 0, 16, 0, 0, 10, NULL };
+
+/**
+ * @brief configuration of the compiled-in sinks, pointed at the mocks
+ *
+ * @param m
+ * @param enabled, set per mock
+ * @param buf
+ * @param size
+ * @return int
+ */
+static int bench_config(const mock_sinks* m, int* enabled, char* buf, size_t size)
+{
+    int n = snprintf(buf, size,
+        "startup_timeout = 5000;\n"
+        "reactor_threads = %d;\n"
+        "fanout = %d;\n",
+        opt.reactor_threads, opt.fanout);
+
+#ifdef INFLUXDB
+    n += snprintf(buf + n, size - n,
+        "influx-sink = { url = \"http://127.0.0.1:%d/api/v2/write?org=bench&bucket=bench\"; "
+        "orgid = \"bench\"; token = \"bench\"; bucket = \"bench\"; measurement = \"meter_bench\"; };\n",
+        m->port[MOCK_HTTP]);
+    enabled[MOCK_HTTP] = 1;
+#endif
+
+#ifdef MQTTC
+    n += snprintf(buf + n, size - n,
+        "mqttc-sink = { host = \"127.0.0.1\"; port = %d; clientid = \"bench-mqttc\"; "
+        "topic = \"bench/meters\"; qos = 1; format = \"json\"; };\n",
+        m->port[MOCK_MQTT]);
+    enabled[MOCK_MQTT] = 1;
+#endif
+
+#ifdef REDIS
+    n += snprintf(buf + n, size - n,
+        "redis-sink = { host = \"127.0.0.1\"; port = %d; key = \"bench\"; format = \"json\"; };\n",
+        m->port[MOCK_REDIS]);
+    enabled[MOCK_REDIS] = 1;
+#endif
+
+    return (n < 0 || (size_t) n >= size) ? EGENERR : ENOERR;
+}
+
+static void bench_sample(meter_data_log* d, int i)
+{
+    memset(d, 0, sizeof(meter_data_log));
+    d->meter_id = (uint32_t) (i % opt.meters) + 1;
+    d->voltage = 230.0f + (float) (i % 7);
+    d->current = 5.0f + (float) (i % 11) * 0.1f;
+    d->power = d->voltage * d->current / 1000.0f;
+    d->reactive_power = 0.12f;
+    d->power_factor = 0.98f;
+    d->freq = 50.0f;
+    d->import_active = 1000.0f + (float) i * 0.001f;
+    d->export_active = 0.0f;
+    d->timestamp_ns = bench_wall_ns();
+}
+
+static unsigned long delivered(const mock_stats* st, const int* enabled, int* done)
+{
+    unsigned long total = 0;
+
+    *done = 1;
+    for (int k = 0; k < MOCK_KINDS; k++)
+    {
+        if (!enabled[k])
+            continue;
+
+        total += st[k].messages;
+        if (st[k].messages < (unsigned long) opt.samples)
+            *done = 0;
+    }
+
+    return total;
+}
+
+int main(int argc, char** argv)
+{
+    mock_sinks mocks;
+    mock_stats st[MOCK_KINDS];
+    int enabled[MOCK_KINDS] = { 0 };
+    char text[2048];
+    config_t cfg;
+    BusWriter* bw = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:r:m:f:R:w:o:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n': opt.samples = atoi(optarg); break;
+        case 'r': opt.rate = atoi(optarg); break;
+        case 'm': opt.meters = atoi(optarg); break;
+        case 'f': opt.fanout = atoi(optarg); break;
+        case 'R': opt.reactor_threads = atoi(optarg); break;
+        case 'w': opt.idle_s = atoi(optarg); break;
+        case 'o': opt.report = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-n samples] [-r rate] [-m meters] [-f fanout] [-R reactor_threads] "
+                            "[-w idle_s] [-o report.json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.samples < 1)
+        opt.samples = 1;
+    if (opt.meters < 1)
+        opt.meters = 1;
+
+    // before any thread, the mocks are forked
+    if (mock_sinks_start(&mocks) != ENOERR)
+    {
+        perror("mock sinks");
+        return 1;
+    }
+
+    init_logger("e2e_bench.log", 0);
+
+    config_init(&cfg);
+    if (bench_config(&mocks, enabled, text, sizeof(text)) != ENOERR || !config_read_string(&cfg, text))
+    {
+        fprintf(stderr, "bench configuration: %s\n", config_error_text(&cfg));
+        mock_sinks_stop(&mocks);
+        return 1;
+    }
+
+    // returns once the sinks are connected (or startup_timeout)
+    data_forwarder_task_init(&cfg);
+    create_bus_writer(&bw, &df_bus);
+
+    uint64_t wall0 = bench_wall_ns();
+    uint64_t start = bench_now_ns();
+    uint64_t cpu = bench_cpu_ns();
+    int errors = 0;
+
+    for (int i = 0; i < opt.samples; i++)
+    {
+        meter_data_log d;
+
+        // paced on absolute deadlines, no drift
+        if (opt.rate > 0)
+        {
+            uint64_t due = start + (uint64_t) i * 1000000000ULL / (uint64_t) opt.rate;
+            uint64_t now = bench_now_ns();
+
+            if (due > now)
+            {
+                struct timespec ts = { (time_t) ((due - now) / 1000000000ULL), (long) ((due - now) % 1000000000ULL) };
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        bench_sample(&d, i);
+        if (bus_write(bw, &d, sizeof(d)) != 0)
+            errors++;
+    }
+
+    uint64_t written = bench_now_ns();
+    unsigned long last = 0, total = 0;
+    uint64_t progress = written;
+    int done = 0;
+
+    // until every sink delivered everything, or nothing moves for idle_s
+    while (!done && bench_now_ns() - progress < (uint64_t) opt.idle_s * 1000000000ULL)
+    {
+        struct timespec ts = { 0, 20000000L };
+
+        nanosleep(&ts, NULL);
+
+        if (mock_sinks_stats(&mocks, st) != ENOERR)
+            break;
+
+        total = delivered(st, enabled, &done);
+        if (total != last)
+        {
+            last = total;
+            progress = bench_now_ns();
+        }
+    }
+
+    cpu = bench_cpu_ns() - cpu;
+    mock_sinks_stats(&mocks, st);
+    total = delivered(st, enabled, &done);
+
+    // first sample written -> last one received, by any sink
+    uint64_t last_ns = 0;
+    for (int k = 0; k < MOCK_KINDS; k++)
+        if (enabled[k] && st[k].last_ns > last_ns)
+            last_ns = st[k].last_ns;
+
+    FILE* f = bench_report_open(opt.report);
+    if (f == NULL)
+        f = stdout;
+
+    fprintf(f, "{\n  \"bench\": \"e2e\",\n  \"samples\": %d,\n  \"rate\": %d,\n  \"meters\": %d,\n"
+               "  \"fanout\": %d,\n  \"reactor_threads\": %d,\n  \"write_errors\": %d,\n"
+               "  \"complete\": %s,\n  \"write_s\": %.3f,\n  \"delivered\": %lu,\n"
+               "  \"msgs_per_s\": %.0f,\n  \"cpu_ns_per_msg\": %.0f,\n  \"sinks\": {",
+        opt.samples, opt.rate, opt.meters, opt.fanout, opt.reactor_threads, errors,
+        done ? "true" : "false", (double) (written - start) / 1e9, total,
+        last_ns > wall0 ? total * 1e9 / (double) (last_ns - wall0) : 0.0,
+        (double) cpu / opt.samples);
+
+    int first = 1;
+    for (int k = 0; k < MOCK_KINDS; k++)
+    {
+        double span;
+
+        if (!enabled[k])
+            continue;
+
+        span = st[k].last_ns > wall0 ? (double) (st[k].last_ns - wall0) / 1e9 : 0.0;
+
+        fprintf(f, "%s\n    \"%s\": { \"received\": %lu, \"requests\": %lu, \"bytes\": %lu, "
+                   "\"msgs_per_s\": %.0f, \"p50_us\": %lld, \"p99_us\": %lld, \"p999_us\": %lld, \"max_us\": %lld }",
+            first ? "" : ",", mock_names[k], st[k].messages, st[k].requests, st[k].bytes,
+            span > 0 ? st[k].messages / span : 0.0,
+            (long long) st[k].p50_us, (long long) st[k].p99_us, (long long) st[k].p999_us, (long long) st[k].max_us);
+        first = 0;
+    }
+    fprintf(f, "\n  }\n}\n");
+    bench_report_close(f);
+
+    // the sink threads end with the process, as in main()
+    mock_sinks_stop(&mocks);
+    config_destroy(&cfg);
+
+    return done ? 0 : 2;
+}
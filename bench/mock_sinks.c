@@ -0,0 +1,619 @@
+/**
+ * @file mock_sinks.c
+ * @author longdh
+ * @brief local InfluxDB-HTTP, MQTT and Redis stand-ins for the end-to-end
+ *        benchmark: they acknowledge what the sinks send and take the sample
+ *        timestamps out of the payloads (JSON "ts", line protocol timestamp)
+ * @version 0.1
+ * @date 2024-02-12
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "utils/error.h"
+#include "utils/histogram.h"
+
+#include "mock_sinks.h"
+#include "bench_util.h"
+
+#define MOCK_MAX_CONNS      64
+#define MOCK_BUF_SIZE       (256 * 1024)
+
+const char* mock_names[MOCK_KINDS] = { "influx_http", "mqtt", "redis" };
+
+typedef struct {
+    int         fd;
+    int         kind;
+    int         continued;  // HTTP: 100 Continue sent
+    size_t      len;
+    uint8_t*    buf;        // MOCK_BUF_SIZE + 1, NUL terminated
+} mock_conn;
+
+typedef struct {
+    mock_stats  st;
+    histogram_t lat;
+} mock_server;
+
+static mock_server servers[MOCK_KINDS];
+
+static void mock_send(int fd, const void* buf, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+
+        p += n;
+        len -= (size_t) n;
+    }
+}
+
+static uint64_t parse_u64(const uint8_t* p, const uint8_t* end)
+{
+    uint64_t v = 0;
+
+    while (p < end && *p >= '0' && *p <= '9')
+        v = v * 10 + (uint64_t) (*p++ - '0');
+
+    return v;
+}
+
+static void mock_record(int kind, uint64_t ts)
+{
+    mock_server* s = &servers[kind];
+    uint64_t now = bench_wall_ns();
+
+    if (ts == 0)
+        return;
+
+    histogram_record(&s->lat, now > ts ? (int64_t) ((now - ts) / 1000) : 0);
+
+    if (s->st.first_ns == 0)
+        s->st.first_ns = now;
+    s->st.last_ns = now;
+    s->st.messages++;
+}
+
+/**
+ * @brief every "ts": of a JSON payload (a sample or a batch array)
+ *
+ * @param kind
+ * @param p
+ * @param n
+ */
+static void mock_record_json(int kind, const uint8_t* p, size_t n)
+{
+    const uint8_t* end = p + n;
+
+    while (p < end)
+    {
+        const uint8_t* k = memmem(p, (size_t) (end - p), "\"ts\":", 5);
+
+        if (k == NULL)
+            break;
+
+        mock_record(kind, parse_u64(k + 5, end));
+        p = k + 5;
+    }
+}
+
+/**
+ * @brief line protocol, the timestamp is the last token of each line
+ *
+ * @param kind
+ * @param p
+ * @param n
+ */
+static void mock_record_lines(int kind, const uint8_t* p, size_t n)
+{
+    const uint8_t* end = p + n;
+
+    while (p < end)
+    {
+        const uint8_t* eol = memchr(p, '\n', (size_t) (end - p));
+        const uint8_t* sp;
+
+        if (eol == NULL)
+            eol = end;
+
+        sp = memrchr(p, ' ', (size_t) (eol - p));
+        if (sp != NULL)
+            mock_record(kind, parse_u64(sp + 1, eol));
+
+        p = eol + 1;
+    }
+}
+
+/**
+ * @brief InfluxDB write API: POST with a Content-Length body, 204 back
+ *
+ * @param c
+ * @return long, bytes used, 0 => incomplete, < 0 => close
+ */
+static long mock_http(mock_conn* c)
+{
+    static const char ok[] = "HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n";
+    static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    uint8_t* end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+    size_t hdr, body = 0;
+    char* h;
+
+    if (end == NULL)
+        return c->len >= MOCK_BUF_SIZE ? -1 : 0;
+
+    hdr = (size_t) (end - c->buf) + 4;
+
+    // the headers as a string, for the lookups
+    uint8_t saved = c->buf[hdr];
+    c->buf[hdr] = '\0';
+
+    if ((h = strcasestr((char*) c->buf, "\r\ncontent-length:")) != NULL)
+        body = (size_t) strtoul(h + 17, NULL, 10);
+
+    int expect = strcasestr((char*) c->buf, "\r\nexpect: 100-continue") != NULL;
+    c->buf[hdr] = saved;
+
+    if (hdr + body > MOCK_BUF_SIZE)
+        return -1;
+
+    if (c->len < hdr + body)
+    {
+        if (expect && !c->continued)
+        {
+            mock_send(c->fd, cont, sizeof(cont) - 1);
+            c->continued = 1;
+        }
+        return 0;
+    }
+
+    servers[MOCK_HTTP].st.requests++;
+    servers[MOCK_HTTP].st.bytes += body;
+    mock_record_lines(MOCK_HTTP, c->buf + hdr, body);
+
+    mock_send(c->fd, ok, sizeof(ok) - 1);
+    c->continued = 0;
+
+    return (long) (hdr + body);
+}
+
+/**
+ * @brief MQTT 3.1.1 broker side, no routing: CONNACK, PUBACK / PUBREC /
+ *        PUBCOMP, SUBACK, PINGRESP
+ *
+ * @param c
+ * @return long
+ */
+static long mock_mqtt(mock_conn* c)
+{
+    const uint8_t* b = c->buf;
+    size_t rl = 0, i = 1;
+    int shift = 0;
+
+    // remaining length, variable byte integer
+    do
+    {
+        if (i >= c->len)
+            return 0;
+        if (i > 4)
+            return -1;
+
+        rl |= (size_t) (b[i] & 0x7F) << shift;
+        shift += 7;
+    } while (b[i++] & 0x80);
+
+    if (i + rl > MOCK_BUF_SIZE)
+        return -1;
+    if (c->len < i + rl)
+        return 0;
+
+    const uint8_t* p = b + i;
+    const uint8_t* end = p + rl;
+    uint8_t rsp[2 + 2 + 64];
+
+    switch (b[0] >> 4)
+    {
+    case 1:     // CONNECT
+        mock_send(c->fd, "\x20\x02\x00\x00", 4);
+        break;
+
+    case 3:     // PUBLISH
+    {
+        int qos = (b[0] >> 1) & 3;
+        size_t tlen;
+
+        if (rl < 2)
+            return -1;
+
+        tlen = (size_t) (p[0] << 8 | p[1]);
+        p += 2 + tlen;
+        if (p + (qos ? 2 : 0) > end)
+            return -1;
+
+        if (qos > 0)
+        {
+            rsp[0] = qos == 1 ? 0x40 : 0x50;
+            rsp[1] = 2;
+            rsp[2] = p[0];
+            rsp[3] = p[1];
+            mock_send(c->fd, rsp, 4);
+            p += 2;
+        }
+
+        servers[MOCK_MQTT].st.requests++;
+        servers[MOCK_MQTT].st.bytes += (unsigned long) (end - p);
+        mock_record_json(MOCK_MQTT, p, (size_t) (end - p));
+        break;
+    }
+
+    case 6:     // PUBREL
+        if (rl >= 2)
+        {
+            rsp[0] = 0x70; rsp[1] = 2; rsp[2] = p[0]; rsp[3] = p[1];
+            mock_send(c->fd, rsp, 4);
+        }
+        break;
+
+    case 8:     // SUBSCRIBE, QoS 0 granted to each filter
+    {
+        int n = 0;
+
+        if (rl < 2)
+            return -1;
+
+        for (const uint8_t* t = p + 2; t + 2 <= end && n < 64; n++)
+            t += 2 + (t[0] << 8 | t[1]) + 1;
+
+        rsp[0] = 0x90; rsp[1] = (uint8_t) (2 + n); rsp[2] = p[0]; rsp[3] = p[1];
+        memset(rsp + 4, 0, (size_t) n);
+        mock_send(c->fd, rsp, (size_t) (4 + n));
+        break;
+    }
+
+    case 12:    // PINGREQ
+        mock_send(c->fd, "\xD0\x00", 2);
+        break;
+
+    case 14:    // DISCONNECT
+        return -1;
+
+    default:
+        break;
+    }
+
+    return (long) (i + rl);
+}
+
+/**
+ * @brief Redis commands (RESP arrays), SET values are the samples, +OK to
+ *        anything else
+ *
+ * @param c
+ * @return long
+ */
+static long mock_redis(mock_conn* c)
+{
+    const uint8_t* p = c->buf;
+    const uint8_t* end = c->buf + c->len;
+    const uint8_t* argv[8];
+    size_t argl[8];
+    const uint8_t* eol;
+    long argc;
+
+    if ((eol = memmem(p, (size_t) (end - p), "\r\n", 2)) == NULL)
+        return c->len >= MOCK_BUF_SIZE ? -1 : 0;
+
+    // inline command
+    if (p[0] != '*')
+    {
+        mock_send(c->fd, "+OK\r\n", 5);
+        return (long) (eol + 2 - c->buf);
+    }
+
+    argc = strtol((const char*) p + 1, NULL, 10);
+    p = eol + 2;
+
+    for (long a = 0; a < argc; a++)
+    {
+        size_t n;
+
+        if ((eol = memmem(p, (size_t) (end - p), "\r\n", 2)) == NULL)
+            return 0;
+        if (p[0] != '$')
+            return -1;
+
+        n = (size_t) strtoul((const char*) p + 1, NULL, 10);
+        p = eol + 2;
+
+        if (n + 2 > MOCK_BUF_SIZE)
+            return -1;
+        if ((size_t) (end - p) < n + 2)
+            return 0;
+
+        if (a < 8)
+        {
+            argv[a] = p;
+            argl[a] = n;
+        }
+        p += n + 2;
+    }
+
+    if (argc >= 3 && argl[0] == 3 && strncasecmp((const char*) argv[0], "SET", 3) == 0)
+    {
+        servers[MOCK_REDIS].st.requests++;
+        servers[MOCK_REDIS].st.bytes += argl[2];
+        mock_record_json(MOCK_REDIS, argv[2], argl[2]);
+        mock_send(c->fd, "+OK\r\n", 5);
+    }
+    else if (argc >= 1 && argl[0] == 4 && strncasecmp((const char*) argv[0], "PING", 4) == 0)
+        mock_send(c->fd, "+PONG\r\n", 7);
+    else
+        mock_send(c->fd, "+OK\r\n", 5);
+
+    return (long) (p - c->buf);
+}
+
+static long (*const mock_handlers[MOCK_KINDS])(mock_conn*) = { mock_http, mock_mqtt, mock_redis };
+
+static void mock_reply_stats(int ctl)
+{
+    mock_stats st[MOCK_KINDS];
+
+    for (int k = 0; k < MOCK_KINDS; k++)
+    {
+        st[k] = servers[k].st;
+        st[k].p50_us = histogram_percentile(&servers[k].lat, 50.0);
+        st[k].p99_us = histogram_percentile(&servers[k].lat, 99.0);
+        st[k].p999_us = histogram_percentile(&servers[k].lat, 99.9);
+        st[k].max_us = servers[k].lat.count ? servers[k].lat.max : 0;
+    }
+
+    mock_send(ctl, st, sizeof(st));
+}
+
+/**
+ * @brief event loop of the child, ends when the parent closes ctl
+ *
+ * @param ctl
+ * @param lfd
+ */
+static void mock_serve(int ctl, const int* lfd)
+{
+    static mock_conn conns[MOCK_MAX_CONNS];
+    int nconns = 0;
+
+    for (int k = 0; k < MOCK_KINDS; k++)
+        histogram_init(&servers[k].lat, mock_names[k]);
+
+    while (1)
+    {
+        struct pollfd fds[1 + MOCK_KINDS + MOCK_MAX_CONNS];
+        int nfds = 0;
+
+        fds[nfds++] = (struct pollfd) { .fd = ctl, .events = POLLIN };
+        for (int k = 0; k < MOCK_KINDS; k++)
+            fds[nfds++] = (struct pollfd) { .fd = lfd[k], .events = POLLIN };
+        for (int i = 0; i < nconns; i++)
+            fds[nfds++] = (struct pollfd) { .fd = conns[i].fd, .events = POLLIN };
+
+        if (poll(fds, nfds, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        if (fds[0].revents)
+        {
+            char cmd;
+
+            if (read(ctl, &cmd, 1) != 1)
+                return;
+            mock_reply_stats(ctl);
+        }
+
+        for (int k = 0; k < MOCK_KINDS; k++)
+        {
+            int fd, one = 1;
+
+            if (!(fds[1 + k].revents & POLLIN))
+                continue;
+
+            if ((fd = accept(lfd[k], NULL, NULL)) < 0)
+                continue;
+
+            if (nconns >= MOCK_MAX_CONNS)
+            {
+                close(fd);
+                continue;
+            }
+
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            conns[nconns].fd = fd;
+            conns[nconns].kind = k;
+            conns[nconns].continued = 0;
+            conns[nconns].len = 0;
+            if (conns[nconns].buf == NULL)
+                conns[nconns].buf = (uint8_t*) malloc(MOCK_BUF_SIZE + 1);
+            nconns++;
+        }
+
+        // the accepted ones are not in fds yet
+        for (int i = 0; i < nfds - 1 - MOCK_KINDS; i++)
+        {
+            mock_conn* c = &conns[i];
+            ssize_t n;
+            long used = 0;
+
+            if (!fds[1 + MOCK_KINDS + i].revents)
+                continue;
+
+            n = read(c->fd, c->buf + c->len, MOCK_BUF_SIZE - c->len);
+            if (n > 0)
+            {
+                c->len += (size_t) n;
+                c->buf[c->len] = '\0';
+
+                while (c->len > 0 && (used = mock_handlers[c->kind](c)) > 0)
+                {
+                    c->len -= (size_t) used;
+                    memmove(c->buf, c->buf + used, c->len);
+                    c->buf[c->len] = '\0';
+                }
+            }
+
+            if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN) || used < 0)
+            {
+                close(c->fd);
+                c->fd = -1;
+            }
+        }
+
+        // drop the closed ones, keep their buffers
+        for (int i = 0; i < nconns; )
+        {
+            if (conns[i].fd < 0)
+            {
+                uint8_t* buf = conns[i].buf;
+
+                conns[i] = conns[--nconns];
+                conns[nconns].buf = buf;
+            }
+            else
+                i++;
+        }
+    }
+}
+
+static int mock_listen(int* port)
+{
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = 0;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(fd, (struct sockaddr*) &sa, sizeof(sa)) != 0 || listen(fd, 16) != 0
+        || getsockname(fd, (struct sockaddr*) &sa, &len) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    *port = ntohs(sa.sin_port);
+    return fd;
+}
+
+/**
+ * @brief listen on loopback (ephemeral ports) and fork the servers, call
+ *        before any thread is started
+ *
+ * @param m
+ * @return int
+ */
+int mock_sinks_start(mock_sinks* m)
+{
+    int lfd[MOCK_KINDS];
+    int sv[2];
+
+    for (int k = 0; k < MOCK_KINDS; k++)
+    {
+        if ((lfd[k] = mock_listen(&m->port[k])) < 0)
+        {
+            while (k-- > 0)
+                close(lfd[k]);
+            return ESYSERR;
+        }
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        return ESYSERR;
+
+    m->pid = fork();
+    if (m->pid < 0)
+        return ESYSERR;
+
+    if (m->pid == 0)
+    {
+        close(sv[0]);
+        signal(SIGPIPE, SIG_IGN);
+        mock_serve(sv[1], lfd);
+        _exit(0);
+    }
+
+    close(sv[1]);
+    for (int k = 0; k < MOCK_KINDS; k++)
+        close(lfd[k]);
+
+    m->ctl = sv[0];
+
+    return ENOERR;
+}
+
+/**
+ * @brief counters and latency percentiles of the mocks so far
+ *
+ * @param m
+ * @param st, MOCK_KINDS entries
+ * @return int
+ */
+int mock_sinks_stats(mock_sinks* m, mock_stats* st)
+{
+    size_t want = sizeof(mock_stats) * MOCK_KINDS;
+    size_t got = 0;
+
+    if (write(m->ctl, "s", 1) != 1)
+        return ESYSERR;
+
+    while (got < want)
+    {
+        ssize_t n = read(m->ctl, (uint8_t*) st + got, want - got);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return ESYSERR;
+        got += (size_t) n;
+    }
+
+    return ENOERR;
+}
+
+void mock_sinks_stop(mock_sinks* m)
+{
+    if (m->pid <= 0)
+        return;
+
+    close(m->ctl);
+    waitpid(m->pid, NULL, 0);
+    m->pid = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef __MOCK_SINKS_H__
+#define __MOCK_SINKS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// stand-ins of the sink servers, one port each
+#define MOCK_HTTP       0       // InfluxDB v2 write API
+#define MOCK_MQTT       1       // MQTT 3.1.1 broker
+#define MOCK_REDIS      2       // Redis (RESP)
+#define MOCK_KINDS      3
+
+/**
+ * @brief what a mock received, latency = arrival - sample timestamp
+ *
+ */
+typedef struct {
+    unsigned long   messages;   // samples (timestamps found)
+    unsigned long   requests;   // POST / PUBLISH / command
+    unsigned long   bytes;
+    uint64_t        first_ns;   // unix time of the first / last sample, 0 => none
+    uint64_t        last_ns;
+    int64_t         p50_us;
+    int64_t         p99_us;
+    int64_t         p999_us;
+    int64_t         max_us;
+} mock_stats;
+
+/**
+ * @brief the mocks run in a child process, so that their CPU time is not
+ *        counted with the pipeline's
+ *
+ */
+typedef struct {
+    pid_t   pid;
+    int     ctl;                // socketpair to the child
+    int     port[MOCK_KINDS];
+} mock_sinks;
+
+extern const char* mock_names[MOCK_KINDS];
+
+int mock_sinks_start(mock_sinks* m);
+int mock_sinks_stats(mock_sinks* m, mock_stats* st);
+void mock_sinks_stop(mock_sinks* m);
+
+#endif // !__MOCK_SINKS_H__
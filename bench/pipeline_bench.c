@@ -0,0 +1,263 @@
+/**
+ * @file pipeline_bench.c
+ * @author longdh
+ * @brief micro benchmarks of the forwarding path: bus write / read, DataLog
+ *        parse / print, sample encoding (line protocol and the other formats)
+ * @version 0.1
+ * @date 2024-02-12
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Usage: pipeline_bench [-n rounds] [-o report.json]
+ *
+ * The report is one JSON object, stable keys, for regression comparison.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "utils/error.h"
+#include "utils/logger.h"
+#include "utils/sbus.h"
+#include "utils/encoder.h"
+#include "utils/histogram.h"
+#include "meter/datalog.h"
+#include "meter/meter_data.h"
+
+#include "bench_util.h"
+
+static const char* datalog_json =
+    "{\"status\":32,\"v_pv_1\":312.5,\"v_pv_2\":0,\"v_pv_3\":0.0,\"v_bat\":532,\"soc\":87,\"soh\":100,"
+    "\"p_pv\":2310,\"p_pv_1\":2310,\"p_pv_2\":0,\"p_pv_3\":0,\"p_charge\":480,\"p_discharge\":0,"
+    "\"v_ac_r\":231.4,\"v_ac_s\":0,\"v_ac_t\":0,\"f_ac\":50.01,\"p_inv\":1790,\"p_rec\":0,\"pf\":1000,"
+    "\"v_eps_r\":2310,\"v_eps_s\":0.0,\"v_eps_t\":0,\"f_eps\":50.0,\"p_eps\":0,\"s_eps\":0,"
+    "\"p_to_grid\":120,\"p_to_user\":0,\"e_pv_day\":12.4,\"e_pv_day_1\":12.4,\"e_pv_day_2\":0,"
+    "\"e_pv_day_3\":0,\"e_inv_day\":9.8,\"e_rec_day\":0,\"e_chg_day\":31,\"e_dischg_day\":12,"
+    "\"e_eps_day\":0,\"e_to_grid_day\":22,\"e_to_user_day\":1.3,\"v_bus_1\":380.2,\"v_bus_2\":190.1,"
+    "\"e_pv_all\":10324.5,\"e_pv_all_1\":10324.5,\"e_pv_all_2\":0,\"e_pv_all_3\":0,\"e_inv_all\":8812.1,"
+    "\"e_rec_all\":12,\"e_chg_all\":4410,\"e_dischg_all\":3980,\"e_eps_all\":0,\"e_to_grid_all\":5012,"
+    "\"e_to_user_all\":811.2,\"t_inner\":41,\"t_rad_1\":38,\"t_rad_2\":36,\"t_bat\":27,\"runtime\":8812211,"
+    "\"max_chg_curr\":500,\"max_dischg_curr\":500,\"charge_volt_ref\":560,\"dischg_cut_volt\":480,"
+    "\"bat_count\":2,\"bat_capacity\":200,\"bat_current\":9,\"bms_event_1\":0,\"bms_event_2\":0,"
+    "\"max_cell_voltage\":3342,\"min_cell_voltage\":3318,\"max_cell_temp\":28,\"min_cell_temp\":26,"
+    "\"cycle_count\":412,\"vbat_inv\":53.1,\"time\":1707700000,\"datalog\":\"BA31605780\"}";
+
+static void fill_sample(meter_data_log* d, uint32_t id)
+{
+    memset(d, 0, sizeof(meter_data_log));
+    d->meter_id = id;
+    d->voltage = 231.4f;
+    d->current = 7.82f;
+    d->power = 1.792f;
+    d->reactive_power = 0.214f;
+    d->power_factor = 0.99f;
+    d->freq = 50.01f;
+    d->import_active = 10324.5f;
+    d->export_active = 811.2f;
+    d->timestamp_ns = bench_wall_ns();
+}
+
+typedef struct {
+    BusReader*  br;
+    int         expected;
+    int         received;
+    histogram_t lat;
+} bus_bench_reader;
+
+static void* bus_reader_task(void* arg)
+{
+    bus_bench_reader* r = (bus_bench_reader*) arg;
+    void* data;
+    int len;
+
+    while (r->received < r->expected)
+    {
+        // the bus drops under pressure, stop once it stays quiet
+        if (bus_read_timeout(r->br, &data, &len, 500) != ENOERR)
+            break;
+
+        if (len == sizeof(meter_data_log))
+        {
+            uint64_t now = bench_wall_ns();
+            uint64_t ts = ((meter_data_log*) data)->timestamp_ns;
+
+            histogram_record(&r->lat, now > ts ? (int64_t) ((now - ts) / 1000) : 0);
+        }
+
+        r->received++;
+        bus_free(data);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief writer -> reader through the inproc bus, write cost and delivery latency
+ *
+ * @param f
+ * @param rounds
+ */
+static void bench_bus(FILE* f, int rounds)
+{
+    static Bus b;
+    BusWriter* bw = NULL;
+    bus_bench_reader r;
+    pthread_t t;
+    meter_data_log d;
+
+    memset(&r, 0, sizeof(r));
+    histogram_init(&r.lat, "bus");
+    r.expected = rounds;
+
+    init_bus(&b, "inproc://pipeline_bench");
+    create_bus_writer(&bw, &b);
+    create_bus_reader(&r.br, &b);
+
+    pthread_create(&t, NULL, bus_reader_task, &r);
+
+    uint64_t cpu = bench_cpu_ns();
+    uint64_t start = bench_now_ns();
+    int errors = 0;
+
+    for (int i = 0; i < rounds; i++)
+    {
+        fill_sample(&d, (uint32_t) (i & 15) + 1);
+        if (bus_write(bw, &d, sizeof(d)) != 0)
+            errors++;
+    }
+
+    uint64_t wrote = bench_now_ns();
+    pthread_join(t, NULL);
+    uint64_t end = bench_now_ns();
+    cpu = bench_cpu_ns() - cpu;
+
+    fprintf(f, "  \"bus\": { \"messages\": %d, \"received\": %d, \"write_errors\": %d, "
+               "\"write_ns_per_msg\": %.1f, \"msgs_per_s\": %.0f, \"cpu_ns_per_msg\": %.1f, ",
+        rounds, r.received, errors,
+        (double) (wrote - start) / rounds,
+        r.received * 1e9 / (double) (end - start),
+        (double) cpu / rounds);
+    bench_report_hist(f, &r.lat);
+    fprintf(f, " },\n");
+
+    close_bus_reader(r.br);
+    histogram_destroy(&r.lat);
+}
+
+static void bench_datalog(FILE* f, int rounds)
+{
+    struct DataLog* x = NULL;
+    uint64_t start = bench_now_ns();
+
+    for (int i = 0; i < rounds; i++)
+    {
+        x = cJSON_ParseDataLog(datalog_json);
+        if (i < rounds - 1)
+            cJSON_DeleteDataLog(x);
+    }
+
+    uint64_t parsed = bench_now_ns();
+    size_t len = 0;
+
+    for (int i = 0; i < rounds && x != NULL; i++)
+    {
+        char* s = cJSON_PrintDataLog(x);
+
+        if (s != NULL)
+        {
+            len = strlen(s);
+            free(s);
+        }
+    }
+
+    uint64_t printed = bench_now_ns();
+    uint8_t buf[ENC_MAX_PAYLOAD];
+    int n = -1;
+
+    for (int i = 0; i < rounds && x != NULL; i++)
+        n = encode_datalog(ENC_LINE, x, buf, sizeof(buf));
+
+    uint64_t encoded = bench_now_ns();
+
+    fprintf(f, "  \"datalog\": { \"json_bytes\": %zu, \"parse_ns\": %.1f, \"print_ns\": %.1f, "
+               "\"printed_bytes\": %zu, \"line_ns\": %.1f, \"line_bytes\": %d },\n",
+        strlen(datalog_json),
+        (double) (parsed - start) / rounds,
+        (double) (printed - parsed) / rounds, len,
+        (double) (encoded - printed) / rounds, n);
+
+    if (x != NULL)
+        cJSON_DeleteDataLog(x);
+}
+
+static void bench_encode(FILE* f, int rounds)
+{
+    static const struct { const char* name; int fmt; } formats[] = {
+        { "line", ENC_LINE }, { "json", ENC_JSON }, { "cbor", ENC_CBOR }, { "msgpack", ENC_MSGPACK },
+    };
+    uint8_t buf[ENC_MAX_PAYLOAD];
+    meter_data_log d;
+
+    fill_sample(&d, 1);
+
+    fprintf(f, "  \"encode\": {");
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        uint64_t start = bench_now_ns();
+        int n = -1;
+
+        for (int r = 0; r < rounds; r++)
+        {
+            d.timestamp_ns++;
+            n = encode_meter_data(formats[i].fmt, &d, "meter_dds666", buf, sizeof(buf));
+        }
+
+        fprintf(f, "%s \"%s\": { \"ns\": %.1f, \"bytes\": %d }", i ? "," : "", formats[i].name,
+            (double) (bench_now_ns() - start) / rounds, n);
+    }
+    fprintf(f, " }\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* report = NULL;
+    int rounds = 100000;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:o:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n': rounds = atoi(optarg); break;
+        case 'o': report = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-n rounds] [-o report.json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (rounds < 1)
+        rounds = 1;
+
+    init_logger("pipeline_bench.log", 0);
+
+    FILE* f = bench_report_open(report);
+    if (f == NULL)
+    {
+        perror(report);
+        return 1;
+    }
+
+    fprintf(f, "{\n  \"bench\": \"pipeline\",\n  \"rounds\": %d,\n", rounds);
+    bench_bus(f, rounds);
+    bench_datalog(f, rounds / 10 > 0 ? rounds / 10 : 1);
+    bench_encode(f, rounds);
+    fprintf(f, "}\n");
+
+    bench_report_close(f);
+    cleanup_logger();
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file regdecode_bench.c
+ * @author longdh
+ * @brief micro benchmark of the batch register decode (vector vs scalar)
+ * @version 0.1
+ * @date 2024-01-22
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Usage: regdecode_bench [values] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "meter/regdecode.h"
+#include "meter/regmap.h"
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static double run(regdecode_fn fn, const uint16_t* regs, int n, int type, int order,
+                  const double* scale, const double* offset, double* out, int rounds)
+{
+    double start = now_ns();
+
+    for (int r = 0; r < rounds; r++)
+        fn(regs, n, type, order, scale, offset, out);
+
+    return (now_ns() - start) / ((double) rounds * n);
+}
+
+int main(int argc, char** argv)
+{
+    static const struct { const char* name; int type; int nregs; } types[] = {
+        { "u16", REG_U16, 1 }, { "s16", REG_S16, 1 },
+        { "u32", REG_U32, 2 }, { "s32", REG_S32, 2 }, { "float32", REG_FLOAT32, 2 },
+    };
+    static const char* orders[] = { "ABCD", "CDAB", "BADC", "DCBA" };
+
+    int n = argc > 1 ? atoi(argv[1]) : 4096;
+    int rounds = argc > 2 ? atoi(argv[2]) : 2000;
+    int rc = 0;
+
+    uint16_t* regs = (uint16_t*) malloc(n * 2 * sizeof(uint16_t));
+    double* scale = (double*) malloc(n * sizeof(double));
+    double* offset = (double*) malloc(n * sizeof(double));
+    double* ref = (double*) malloc(n * sizeof(double));
+    double* out = (double*) malloc(n * sizeof(double));
+
+    srand(1);
+    for (int i = 0; i < n * 2; i++)
+        regs[i] = (uint16_t) rand();
+
+    for (int i = 0; i < n; i++)
+    {
+        scale[i] = (i % 3 == 0) ? 0.1 : ((i % 3 == 1) ? 0.001 : 1.0);
+        offset[i] = (i % 5 == 0) ? -40.0 : 0.0;
+    }
+
+    printf("vector path: %s, %d values x %d rounds\n", regdecode_impl(), n, rounds);
+    printf("%-8s %-5s %12s %12s %8s\n", "type", "order", "scalar ns", "batch ns", "speedup");
+
+    for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++)
+    {
+        for (int o = 0; o < 4; o++)
+        {
+            double ts = run(regdecode_block_scalar, regs, n, types[t].type, o, scale, offset, ref, rounds);
+            double tb = run(regdecode_block, regs, n, types[t].type, o, scale, offset, out, rounds);
+
+            for (int i = 0; i < n; i++)
+            {
+                // NaN patterns of random float32 bits compare unequal to themselves
+                if (ref[i] != out[i] && !(isnan(ref[i]) && isnan(out[i])))
+                {
+                    printf("MISMATCH %s %s [%d]: %.17g != %.17g\n", types[t].name, orders[o], i, ref[i], out[i]);
+                    rc = 1;
+                    break;
+                }
+            }
+
+            printf("%-8s %-5s %12.3f %12.3f %7.2fx\n", types[t].name, orders[o], ts, tb, ts / tb);
+        }
+    }
+
+    free(regs);
+    free(scale);
+    free(offset);
+    free(ref);
+    free(out);
+
+    return rc;
+}
@@ -0,0 +1,65 @@
+#ifndef __ALARM_SINK_H__
+#define __ALARM_SINK_H__
+
+#include <pthread.h>
+#include "nng/nng.h"
+#include "utils/sbus.h"
+#include "utils/hashtable.h"
+#include "utils/conn_state.h"
+#include "meter/rules.h"
+
+#define ALARM_MAX_SOURCES   64      // meters / DataLog topics with rule state
+#define ALARM_MAX_PENDING   64      // events kept while the broker is away
+#define ALARM_PAYLOAD_LEN   1024
+#define ALARM_MAX_TRIES     5       // publish errors before an event is dropped
+#define ALARM_RETRY_MS      1000
+
+/**
+ * @brief rules evaluated on every sample read from the bus (urgent lane
+ *        first), raised / cleared events published at once on their own topic
+ *        (queued while the broker is not connected):
+ *
+ *   {"rule":"overvoltage","meter":"25","state":"raised","value":254.1,"ts":1706688000000000000}
+ */
+typedef struct {
+    char*   host;
+    int     port;
+    char*   username;
+    char*   password;
+    char*   topic;
+    char*   client_id;
+    int     qos;
+
+    rules_program   program;
+
+    hashtable_t*    series;     // meter id / source topic => rules_series*
+    rules_series*   all[ALARM_MAX_SOURCES];
+    int             nseries;
+
+    // events not published yet, oldest first (task thread only)
+    char            pending[ALARM_MAX_PENDING][ALARM_PAYLOAD_LEN];
+    int             pending_len[ALARM_MAX_PENDING];
+    uint8_t         tries[ALARM_MAX_PENDING];
+    int             phead;
+    int             npending;
+
+    unsigned long   events;
+    unsigned long   failed;     // dropped, queue full / publish errors
+
+    nng_socket  sock;
+    nng_dialer  dialer;
+    conn_state  conn;
+
+    Bus*        b;
+    BusReader*  br;
+    pthread_t   task_thread;
+
+} alarm_sink_config;
+
+int alarm_sink_init(alarm_sink_config* cfg, Bus* b, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic);
+int alarm_sink_add_rule(alarm_sink_config* cfg, const char* name, const char* expr, const double* clear, int debounce);
+int alarm_sink_term(alarm_sink_config* cfg);
+int alarm_sink_run(alarm_sink_config* cfg);
+int alarm_sink_wait(alarm_sink_config* cfg);
+
+#endif // !__ALARM_SINK_H__
@@ -9,6 +9,9 @@
 
 
 #include "utils/sbus.h"
+#include "utils/fanout.h"
+#include "utils/conn_state.h"
+#include "utils/reactor.h"
 
 typedef struct {
     /* v1*/
@@ -29,15 +32,21 @@ typedef struct {
 
 
     Bus*        b;
-    BusReader*  br;
+    sink_input  in;     // bus or fan-out
     pthread_t task_thread;
 
+    // reactor mode (influx_sink_attach), NULL => own thread
+    reactor_t*  reactor;
+    void*       priv;
+    conn_state  conn;
+
 } influx_sink_config;
 
 int influx_sink_init(influx_sink_config* cfg, Bus* b, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic);
 int influx_sink_init2(influx_sink_config* cfg, Bus* b, const char* url, const char* orgid, const char* token, const char* measurement);
 int influx_sink_term(influx_sink_config* cfg);
 int influx_sink_run(influx_sink_config* cfg);
+int influx_sink_attach(influx_sink_config* cfg, reactor_t* r);
 int influx_sink_wait(influx_sink_config* cfg);
 
 #endif // !__INFLUXDB_H__
@@ -1,7 +1,11 @@
 #ifndef __KAFKA_SINK_H__
 #define __KAFKA_SINK_H__
 
-#include "squeue.h"
+#include <pthread.h>
+#include "utils/sbus.h"
+#include "utils/fanout.h"
+#include "utils/conn_state.h"
+#include "utils/reactor.h"
 
 typedef struct {
     char*   host;
@@ -10,15 +14,24 @@ typedef struct {
     char*   password;
     char*   topic;
     char*   client_id;
+    int     format;     // payload_format
 
-    Queue*  q;
+    conn_state  conn;
+
+    Bus*        b;
+    sink_input  in;     // bus or fan-out
     pthread_t task_thread;
 
+    // reactor mode (kafka_sink_attach), NULL => own thread
+    reactor_t*  reactor;
+    void*       priv;
+
 } kafka_sync_config;
 
-int kafka_sink_init(kafka_sync_config* cfg, Queue* q, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic);
+int kafka_sink_init(kafka_sync_config* cfg, Bus* b, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic);
 int kafka_sink_term(kafka_sync_config* cfg);
 int kafka_sink_run(kafka_sync_config* cfg);
+int kafka_sink_attach(kafka_sync_config* cfg, reactor_t* r);
 int kafka_sink_wait(kafka_sync_config* cfg);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+#ifndef DERIVE_H
+#define DERIVE_H
+
+#include <stdint.h>
+#include "meter/meter_data.h"
+#include "meter/regmap.h"
+
+#define DERIVE_MAX_EXPRS        16
+#define DERIVE_MAX_CODE         512     // instructions of all the expressions
+#define DERIVE_MAX_CONSTS       64
+#define DERIVE_MAX_FIELDS       32      // distinct sample fields used
+#define DERIVE_MAX_LAYOUTS      16
+#define DERIVE_STACK            16
+#define DERIVE_NAME_LEN         REGMAP_NAME_LEN
+
+// layout keys of derive_bind()
+#define DERIVE_LAYOUT_DATALOG   0       // meter_data_log
+#define DERIVE_LAYOUT_MAP       1       // + map_id, register map samples
+
+typedef enum {
+    DOP_CONST = 0,  // push consts[arg]
+    DOP_FIELD,      // push sample field arg
+    DOP_OUT,        // push output arg (an earlier expression)
+    DOP_ADD,
+    DOP_SUB,
+    DOP_MUL,
+    DOP_DIV,        // x / 0 => NAN
+    DOP_NEG,
+    DOP_SQRT,
+    DOP_ABS,
+    DOP_MIN,
+    DOP_MAX,
+    DOP_STORE       // output arg = pop, the stack is empty after it
+} derive_op;
+
+typedef struct {
+    uint8_t op;     // derive_op
+    uint8_t arg;
+} derive_insn;
+
+/**
+ * @brief expressions compiled at load into one flat postfix program, the
+ *        field names are bound to the value slots of a sample layout once
+ *
+ */
+typedef struct {
+    int         nexprs;
+    char        name[DERIVE_MAX_EXPRS][DERIVE_NAME_LEN];    // output fields
+
+    int         ncode;
+    derive_insn code[DERIVE_MAX_CODE];
+    int         nconsts;
+    double      consts[DERIVE_MAX_CONSTS];
+
+    int         nfields;
+    char        field[DERIVE_MAX_FIELDS][DERIVE_NAME_LEN];
+
+    int         nlayouts;
+    struct {
+        int     key;
+        int8_t  slot[DERIVE_MAX_FIELDS];                    // -1 => not in the layout
+    } layout[DERIVE_MAX_LAYOUTS];
+
+    unsigned long invalid;  // outputs not finite (missing field, x / 0), sent as 0
+} derive_program;
+
+int derive_compile(derive_program* p, const char* name, const char* expr);
+const int8_t* derive_bind(derive_program* p, int layout, const char* const* names, int n);
+void derive_eval(derive_program* p, const double* fv, double* out);
+
+int derive_map_init(reg_map* out, const derive_program* p, const reg_map* base);
+int derive_meter_data(derive_program* p, const reg_map* out, const meter_data_log* md, meter_sample* s);
+int derive_sample(derive_program* p, const reg_map* out, meter_sample* s);
+int derive_fixed(derive_program* p, const reg_map* out, meter_fixed_sample* s);
+int derive_json(derive_program* p, char* text, int size);
+
+#endif // !DERIVE_H
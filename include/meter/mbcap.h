@@ -0,0 +1,69 @@
+#ifndef MBCAP_H
+#define MBCAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <modbus/modbus.h>
+
+#define MBCAP_MAGIC         "MBCAP1\0"  // 8 bytes with the NUL
+#define MBCAP_MAX_CTX       8           // contexts captured / replayed at once
+
+#define MBCAP_RECORD        1
+#define MBCAP_REPLAY        2
+
+/**
+ * @brief file header, host byte order
+ *
+ */
+typedef struct {
+    char        magic[8];
+    uint32_t    version;        // 1
+    uint32_t    header_length;  // modbus_get_header_length(), 1 => RTU
+    uint64_t    start_ns;       // unix time of the first request
+} mbcap_file_header;
+
+/**
+ * @brief one transaction, followed by the request then the response frame
+ *        (RTU: slave, PDU, CRC as on the wire)
+ *
+ */
+typedef struct {
+    uint64_t    t_ns;           // request sent, since the capture start
+    uint32_t    dur_us;         // until the response / error
+    int32_t     err;            // errno of a failed read, 0 => response frame
+    uint16_t    req_len;
+    uint16_t    rsp_len;        // 0 => no response (timeout, ...)
+} mbcap_record_header;
+
+/**
+ * @brief capture (record) or replay of the transactions of a Modbus context
+ *
+ */
+typedef struct {
+    int         mode;           // MBCAP_RECORD, MBCAP_REPLAY
+    modbus_t*   ctx;            // the reads on it are captured / replayed
+    int         header_length;
+    int64_t     t0;             // CLOCK_MONOTONIC ns, of the capture / replay start
+
+    // record
+    FILE*       fp;
+
+    // replay, the whole file in memory
+    uint8_t*    data;
+    size_t      len;
+    size_t      pos;
+    double      speed;          // 1 => recorded timing, 0 => as fast as possible
+    int         loop;           // rewind at the end, else reads fail (ENODATA)
+
+    unsigned long transactions;
+    unsigned long mismatches;   // replayed request != recorded one
+} mbcap;
+
+int mbcap_record_open(mbcap* c, modbus_t* ctx, const char* path);
+int mbcap_replay_open(mbcap* c, modbus_t* ctx, const char* path, double speed, int loop);
+void mbcap_close(mbcap* c);
+int mbcap_replay_done(const mbcap* c);
+
+int mbcap_read_registers(modbus_t* ctx, int fc, int addr, int nb, uint16_t* dest);
+
+#endif // !MBCAP_H
@@ -1,6 +1,9 @@
 #ifndef METER_DATA_H
 #define METER_DATA_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct meter_data_log 
 {
     float voltage;
@@ -12,7 +15,44 @@ typedef struct meter_data_log
     float import_active;
     float export_active;
 
+    uint32_t meter_id;  // slave id of the meter
+    uint64_t timestamp_ns;  // poll deadline, unix time (ns), 0 => not set
+
 } meter_data_log;
 
-#endif // !METER_DATA_H
+#define METER_SAMPLE_MAX    64
+
+/**
+ * @brief sample of a device read through a register map (meter/regmap.h),
+ *        the names of the values are the points of map map_id
+ * 
+ */
+typedef struct meter_sample
+{
+    uint32_t meter_id;      // slave id
+    uint16_t map_id;        // regmap_by_id()
+    uint16_t count;         // values used
+    uint64_t timestamp_ns;  // poll deadline, unix time (ns), 0 => not set
+    double   values[METER_SAMPLE_MAX];
+
+} meter_sample;
 
+/**
+ * @brief meter_sample in fixed point: value = mant * 10^exp, exact for the
+ *        scaled integer registers (0.1 V, 0.001 A, 1 Wh)
+ * 
+ */
+typedef struct meter_fixed_sample
+{
+    uint32_t meter_id;
+    uint16_t map_id;
+    uint16_t count;
+    uint64_t timestamp_ns;
+    int64_t  mant[METER_SAMPLE_MAX];
+    int8_t   exp[METER_SAMPLE_MAX];
+
+} meter_fixed_sample;
+
+int meter_data_to_json(const meter_data_log* data, char* buf, size_t size);
+
+#endif // !METER_DATA_H
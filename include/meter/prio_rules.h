@@ -0,0 +1,23 @@
+#ifndef PRIO_RULES_H
+#define PRIO_RULES_H
+
+#include "meter/rules.h"
+
+#define PRIO_MAX_RULES      RULES_MAX
+
+/**
+ * @brief a sample matching any rule goes on the urgent bus lane: the
+ *        threshold rules of rules.c, without debounce nor hysteresis
+ *
+ */
+typedef struct {
+    int           nrules;
+    rules_program program;
+
+    unsigned long urgent;   // samples tagged so far
+} prio_rules;
+
+int prio_rules_parse(prio_rules* r, const char* spec);
+int prio_rules_eval(prio_rules* r, const void* data, int datalen);
+
+#endif // !PRIO_RULES_H
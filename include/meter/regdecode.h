@@ -0,0 +1,30 @@
+#ifndef __REGDECODE_H__
+#define __REGDECODE_H__
+
+#include <stdint.h>
+
+/**
+ * @brief decode a block of n values of one type and word order
+ *        out[i] = value(regs) * scale[i] + offset[i]
+ *
+ * @param regs, n * registers of the type, as received (host order words)
+ * @param n
+ * @param type, reg_type
+ * @param order, REG_ORDER_*
+ * @param scale, n factors
+ * @param offset, n offsets
+ * @param out, n values
+ */
+typedef void (*regdecode_fn)(const uint16_t* regs, int n, int type, int order,
+                             const double* scale, const double* offset, double* out);
+
+void regdecode_block(const uint16_t* regs, int n, int type, int order,
+                     const double* scale, const double* offset, double* out);
+void regdecode_block_scalar(const uint16_t* regs, int n, int type, int order,
+                            const double* scale, const double* offset, double* out);
+
+int64_t regdecode_int(const uint16_t* regs, int type, int order);
+
+const char* regdecode_impl();
+
+#endif // !__REGDECODE_H__
@@ -0,0 +1,122 @@
+#ifndef __REGMAP_H__
+#define __REGMAP_H__
+
+#include <stdint.h>
+#include <libconfig.h>
+#include <modbus/modbus.h>
+#include "meter/meter_data.h"
+
+#define REGMAP_NAME_LEN         32
+#define REGMAP_MAX_MAPS         16
+#define REGMAP_MAX_READ         125     // registers per request (Modbus limit)
+#define REGMAP_DEFAULT_GAP      8       // unused registers read to merge two ranges
+
+/**
+ * @brief register encoding of a point
+ * 
+ */
+typedef enum {
+    REG_U16 = 0,
+    REG_S16,
+    REG_U32,
+    REG_S32,
+    REG_FLOAT32,
+    REG_U64,
+    REG_S64,
+    REG_FLOAT64
+} reg_type;
+
+/* word order, the letters are the bytes of the value, A = most significant */
+#define REG_ORDER_ABCD          0       // big endian (Modbus default)
+#define REG_ORDER_CDAB          1       // words swapped
+#define REG_ORDER_BADC          2       // bytes swapped in each word
+#define REG_ORDER_DCBA          3       // little endian
+
+#define REG_FC_HOLDING          3
+#define REG_FC_INPUT            4
+
+/**
+ * @brief one value of the device
+ * 
+ */
+typedef struct {
+    char        name[REGMAP_NAME_LEN];
+    uint16_t    address;
+    uint8_t     fc;         // REG_FC_HOLDING, REG_FC_INPUT
+    uint8_t     type;       // reg_type
+    uint8_t     order;      // REG_ORDER_*
+    uint8_t     nregs;      // registers of the type
+    uint16_t    buf_off;    // first register in the plan buffer
+    double      scale;
+    double      offset;     // value = raw * scale + offset
+    int         field;      // meter_data_log field (METER_FID_*), -1 => none
+
+    // fixed point: mant = raw * fx_mul + fx_add, value = mant * 10^exponent
+    int8_t      exponent;
+    int64_t     fx_mul;     // 0 => not exact, rounded from the double value
+    int64_t     fx_add;
+} reg_point;
+
+/**
+ * @brief one request of the read plan
+ * 
+ */
+typedef struct {
+    uint8_t     fc;
+    uint16_t    start;
+    uint16_t    count;
+    uint16_t    buf_off;    // where the registers land in the plan buffer
+} reg_read;
+
+/**
+ * @brief consecutive points of one type & word order, adjacent in the
+ *        plan buffer: decoded as one block
+ * 
+ */
+typedef struct {
+    uint8_t     type;
+    uint8_t     order;
+    uint16_t    buf_off;
+    uint16_t    first;      // first point
+    uint16_t    count;
+} reg_run;
+
+/**
+ * @brief compiled register map: merged reads + decode table
+ * 
+ */
+typedef struct {
+    char        name[REGMAP_NAME_LEN];
+    uint16_t    id;         // regmap_register()
+
+    int         npoints;
+    reg_point*  points;     // in config order (the order of meter_sample values)
+
+    int         nreads;
+    reg_read*   reads;
+    int         nregs;      // size of the plan buffer
+
+    int         nruns;
+    reg_run*    runs;
+    double*     scales;     // per point, for the batch decode
+    double*     offsets;
+} reg_map;
+
+int regmap_load_file(reg_map* map, const char* path);
+int regmap_from_setting(reg_map* map, const config_setting_t* s);
+int regmap_compile(reg_map* map, int max_gap);
+void regmap_free(reg_map* map);
+
+int regmap_register(reg_map* map);
+const reg_map* regmap_by_id(uint16_t id);
+
+int regmap_read(const reg_map* map, modbus_t* ctx, uint16_t* regs);
+void regmap_decode(const reg_map* map, const uint16_t* regs, double* values);
+int regmap_sample(const reg_map* map, modbus_t* ctx, meter_sample* sample);
+void regmap_decode_fixed(const reg_map* map, const uint16_t* regs, int64_t* mant, int8_t* exp);
+int regmap_fixed_sample(const reg_map* map, modbus_t* ctx, meter_fixed_sample* sample);
+void regmap_to_meter_data(const reg_map* map, const double* values, meter_data_log* data);
+
+int bus_data_values(const void* data, int datalen, uint32_t* meter_id, uint64_t* ts, const char** names, double* values);
+
+#endif // !__REGMAP_H__
@@ -0,0 +1,89 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdint.h>
+
+#define RULES_MAX           32
+#define RULES_MAX_FIELDS    32      // distinct fields used by the rules
+#define RULES_MAX_LAYOUTS   16      // sample layouts bound so far
+#define RULES_NAME_LEN      32
+
+// layout keys of rules_bind()
+#define RULES_LAYOUT_DATALOG    0   // meter_data_log
+#define RULES_LAYOUT_MAP        1   // + map_id, register map samples
+
+typedef enum {
+    RULE_THRESHOLD = 0,     // field op value
+    RULE_RATE               // rate(field) op value, per second
+} rule_kind;
+
+typedef enum {
+    RULE_GT = 0,
+    RULE_GE,
+    RULE_LT,
+    RULE_LE,
+    RULE_EQ,
+    RULE_NE
+} rule_op;
+
+/**
+ * @brief one compiled rule: raised after 'debounce' samples matching 'set',
+ *        cleared after 'debounce' samples past 'clear' (hysteresis)
+ *
+ */
+typedef struct {
+    uint8_t kind;       // rule_kind
+    uint8_t op;         // rule_op
+    uint8_t field;      // rules_program.fields
+    uint8_t debounce;   // consecutive samples, >= 1
+    double  set;
+    double  clear;      // == set => no hysteresis
+} rule_insn;
+
+/**
+ * @brief rules compiled at load, the field names are bound to the value
+ *        slots of a sample layout once, on its first sample
+ *
+ */
+typedef struct {
+    int         ninsn;
+    rule_insn   insn[RULES_MAX];
+    char        name[RULES_MAX][RULES_NAME_LEN];
+
+    int         nfields;
+    char        field[RULES_MAX_FIELDS][RULES_NAME_LEN];
+    uint8_t     rate_field[RULES_MAX_FIELDS];   // previous value kept
+
+    int         nlayouts;
+    struct {
+        int     key;
+        int8_t  slot[RULES_MAX_FIELDS];         // -1 => not in the layout
+    } layout[RULES_MAX_LAYOUTS];
+} rules_program;
+
+/**
+ * @brief rule state of a meter
+ *
+ */
+typedef struct {
+    uint32_t    meter_id;
+    uint64_t    ts_prev;                    // ns, 0 => no previous sample
+    double      prev[RULES_MAX_FIELDS];
+    uint8_t     active[RULES_MAX];
+    uint8_t     count[RULES_MAX];           // samples toward the change
+} rules_series;
+
+typedef struct {
+    int         rule;       // rules_program.insn / name
+    int         raised;     // 1 => raised, 0 => cleared
+    double      value;      // field value / rate
+} rule_event;
+
+int rules_compile(rules_program* p, const char* name, const char* expr, const double* clear, int debounce);
+int rules_layout(const void* data, int datalen);
+const int8_t* rules_bind(rules_program* p, int layout, const char* const* names, int n);
+void rules_gather(const rules_program* p, const int8_t* slot, const double* values, double* fv);
+int rules_eval(const rules_program* p, rules_series* s, uint64_t ts, const double* fv, rule_event* ev, int max);
+int rules_match_any(const rules_program* p, const double* fv);
+
+#endif // !RULES_H
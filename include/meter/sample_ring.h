@@ -0,0 +1,60 @@
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "meter/meter_data.h"
+
+/**
+ * @brief bounded history of one meter, struct of arrays: the timestamps and
+ *        every field are separate columns of cap slots
+ *
+ * One writer (the bus reader), any number of readers under the rwlock.
+ * Timestamps are expected in increasing order (poll deadlines), the range
+ * lookups are binary searches.
+ */
+typedef struct {
+    uint32_t    meter_id;
+    int         nfields;
+    const char* names[METER_SAMPLE_MAX];    // not copied (map points / literals)
+
+    uint32_t    cap;
+    uint32_t    head;       // next slot written
+    uint32_t    count;      // valid slots, <= cap
+
+    int64_t*    ts;         // cap timestamps (ns)
+    double*     cols;       // column f at cols + f * cap
+
+    pthread_rwlock_t lock;
+} sample_ring;
+
+/**
+ * @brief aggregate of a downsample bucket
+ *
+ */
+typedef enum {
+    RING_AGG_AVG = 0,
+    RING_AGG_MIN,
+    RING_AGG_MAX,
+    RING_AGG_LAST,
+    RING_AGG_COUNT
+} ring_agg;
+
+int sample_ring_init(sample_ring* r, uint32_t meter_id, uint32_t cap, int nfields, const char* const* names);
+void sample_ring_free(sample_ring* r);
+
+int sample_ring_same_fields(const sample_ring* r, int nfields, const char* const* names);
+void sample_ring_push(sample_ring* r, int64_t ts, const double* values);
+
+int sample_ring_field(const sample_ring* r, const char* name);
+uint32_t sample_ring_slot(const sample_ring* r, uint32_t i);
+uint32_t sample_ring_lower_bound(const sample_ring* r, int64_t ts);
+
+uint32_t sample_ring_range(const sample_ring* r, int64_t from, int64_t to, uint32_t* first);
+uint32_t sample_ring_downsample(const sample_ring* r, int field, int64_t from, int64_t to, int64_t step, int agg,
+                                int64_t* bucket_ts, double* out, uint32_t max);
+
+int ring_agg_from_string(const char* s);
+
+#endif // !SAMPLE_RING_H
@@ -0,0 +1,75 @@
+#ifndef TSDB_H
+#define TSDB_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "meter/meter_data.h"
+
+#define TSDB_MAX_SERIES         64
+#define TSDB_CHUNK_POINTS       120     // samples per chunk (20 min at 10 s)
+
+/**
+ * @brief sparse time index, one entry per chunk (<dir>/m<meter>.tsi)
+ *
+ */
+typedef struct {
+    int64_t     t_first;
+    int64_t     t_last;
+    uint64_t    offset;     // of the chunk in the data file
+    uint32_t    npoints;
+    uint32_t    size;       // header + payload
+} tsdb_index_entry;
+
+/**
+ * @brief history of one meter: sealed chunks in <dir>/m<meter>.tsd and the
+ *        open chunk in memory
+ *
+ */
+typedef struct {
+    uint32_t    meter_id;
+    int         nfields;
+    char*       names[METER_SAMPLE_MAX];
+
+    int         fd;         // data file, append only
+    int         ifd;        // index file
+    uint64_t    size;       // of the data file
+
+    tsdb_index_entry* index;
+    uint32_t    nindex;
+    uint32_t    index_cap;
+
+    // open chunk, row major
+    int64_t*    ts;
+    double*     values;
+    uint32_t    npending;
+
+    pthread_rwlock_t lock;
+} tsdb_series;
+
+typedef struct {
+    char*       dir;
+    uint32_t    chunk_points;
+    int         sync;       // fdatasync each sealed chunk
+
+    tsdb_series* series[TSDB_MAX_SERIES];
+    int         nseries;
+    pthread_mutex_t lock;
+} tsdb_t;
+
+/**
+ * @brief called for every sample of a scan, non zero => stop
+ *
+ */
+typedef int (*tsdb_scan_fn)(void* arg, int64_t ts, const double* values, int nfields);
+
+int tsdb_open(tsdb_t* db, const char* dir, uint32_t chunk_points, int sync);
+void tsdb_close(tsdb_t* db);
+
+int tsdb_append(tsdb_t* db, uint32_t meter_id, int64_t ts, int nfields, const char* const* names, const double* values);
+int tsdb_flush(tsdb_t* db);
+
+tsdb_series* tsdb_series_get(tsdb_t* db, uint32_t meter_id);
+int tsdb_scan(tsdb_t* db, uint32_t meter_id, int64_t from, int64_t to, tsdb_scan_fn fn, void* arg);
+
+#endif // !TSDB_H
@@ -3,7 +3,23 @@
 
 #include <pthread.h>
 #include "utils/sbus.h"
+#include "utils/histogram.h"
+#include "utils/rt_sched.h"
 #include "meter/meter_data.h"
+#include "meter/regmap.h"
+#include "meter/prio_rules.h"
+#include "meter/derive.h"
+#include "meter/mbcap.h"
+
+/**
+ * @brief what a register map poll publishes
+ * 
+ */
+typedef enum {
+    MAP_OUT_SAMPLE = 0,     // meter_sample (doubles)
+    MAP_OUT_METER,          // meter_data_log, single phase meters
+    MAP_OUT_FIXED           // meter_fixed_sample (mantissa, exponent)
+} map_output;
 
 typedef struct {
     char*   mb_type; // RTU, TCP
@@ -23,6 +39,34 @@ typedef struct {
 
     int     slave_id;
 
+    // generic driver, NULL => built-in reader of mtype
+    reg_map* map;
+    int     map_output;     // map_output
+
+    // samples matching a rule go on the urgent lane, NULL => all bulk
+    prio_rules* urgent;
+
+    // derived fields appended to every sample, NULL => none
+    derive_program* derive;
+    reg_map*    derive_map;     // names of the extended samples
+
+    // timing, polls start on absolute deadlines: k * poll_ms
+    int     poll_ms;
+    int     poll_align;     // align to wall clock multiples of poll_ms
+    int     stats_polls;    // log the histograms every N polls, 0 => off
+    histogram_t jitter;     // start delay after the deadline (us)
+    histogram_t read_time;  // duration of a read (us)
+    unsigned long overruns; // deadlines missed (read longer than poll_ms)
+
+    task_sched sched;       // applied by the reader thread itself
+
+    // capture of the transactions / replay of one instead of the meter
+    char*   capture;        // file to record, NULL => off
+    char*   replay;         // file to replay, NULL => the meter
+    double  replay_speed;   // 1 => recorded pace, 0 => as fast as possible
+    int     replay_loop;
+    mbcap   cap;
+
     // other
     Bus *b;
     BusWriter *bw;
@@ -2,7 +2,11 @@
 #define __MOSQ_SINK_H__
 
 #include <pthread.h>
-#include "sbus.h"
+#include "utils/sbus.h"
+#include "utils/fanout.h"
+#include "utils/batch.h"
+#include "utils/conn_state.h"
+#include "utils/reactor.h"
 
 typedef struct {
     char*   host;
@@ -11,16 +15,32 @@ typedef struct {
     char*   password;
     char*   topic;
     char*   client_id;
+    int     format;     // payload_format
+
+    // batching, off when batch_count <= 1 and batch_ms <= 0
+    int     batch_count;
+    int     batch_ms;
+    int     batch_format;       // batch_format
+    char*   topic_template;     // "{topic}", "{meter}", NULL => source topic
+    batcher_t batcher;
+
+    conn_state  conn;
 
     Bus*        b;
-    BusReader*  br;
+    sink_input  in;     // bus or fan-out
     pthread_t task_thread;
 
+    // reactor mode (mosq_sink_attach), NULL => own thread
+    reactor_t*  reactor;
+    void*       priv;
+
 } mosq_sync_config;
 
 int mosq_sink_init(mosq_sync_config* cfg, Bus* b, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic);
 int mosq_sink_term(mosq_sync_config* cfg);
 int mosq_sink_run(mosq_sync_config* cfg);
+int mosq_sink_format(const mosq_sync_config* cfg);
+int mosq_sink_attach(mosq_sync_config* cfg, reactor_t* r);
 int mosq_sink_wait(mosq_sync_config* cfg);
 
 
@@ -3,6 +3,7 @@
 
 #include <pthread.h>
 #include "sbus.h"
+#include "meter/derive.h"
 
 typedef struct {
     char*   host;
@@ -12,6 +13,9 @@ typedef struct {
     char*   topic;
     char*   client_id;
 
+    // derived fields appended to the DataLog JSON, NULL => none
+    derive_program* derive;
+
     Bus *b;
     BusWriter *bw;
     pthread_t task_thread;
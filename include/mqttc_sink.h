@@ -1,8 +1,14 @@
 #ifndef __MQTTC_SINK_H__
 #define __MQTTC_SINK_H__
 
-#include "utils/squeue.h"
+#include <pthread.h>
 #include "utils/sbus.h"
+#include "utils/fanout.h"
+#include "utils/batch.h"
+#include "utils/conn_state.h"
+
+#define MQTTC_DEFAULT_QOS       1
+#define MQTTC_DEFAULT_INFLIGHT  16
 
 typedef struct {
     char*   host;
@@ -11,17 +17,35 @@ typedef struct {
     char*   password;
     char*   topic;
     char*   client_id;
+    int     format;     // payload_format
+
+    int     qos;        // publish QoS (0, 1)
+    int     inflight;   // max PUBLISH queued to the client (PUBACK handled by NanoNNG)
+
+    // batching, off when batch_count <= 1 and batch_ms <= 0
+    int     batch_count;
+    int     batch_ms;
+    int     batch_format;       // batch_format
+    char*   topic_template;     // "{topic}", "{meter}", NULL => source topic
+    batcher_t batcher;
 
     Bus*        b;
-    BusReader*  br;
+    sink_input  in;     // bus or fan-out
     pthread_t task_thread;
 
+    // runtime, owned by the task
+    void*           priv;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    conn_state      conn;
+
 } mqttc_sync_config;
 
 int mqttc_sink_init(mqttc_sync_config* cfg, Bus* b, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic);
 int mqttc_sink_term(mqttc_sync_config* cfg);
 int mqttc_sink_run(mqttc_sync_config* cfg);
+int mqttc_sink_format(const mqttc_sync_config* cfg);
 int mqttc_sink_wait(mqttc_sync_config* cfg);
 
 
-#endif
\ No newline at end of file
+#endif
@@ -2,6 +2,7 @@
 #define MQTTC_SRC_H 
 
 #include "utils/sbus.h"
+#include "utils/conn_state.h"
 
 
 typedef struct {
@@ -12,6 +13,8 @@ typedef struct {
     char*   topic;
     char*   client_id;
 
+    conn_state  conn;
+
     // bus reader
     Bus*        b;
     BusReader*  br;
@@ -1,7 +1,11 @@
 #ifndef __NATS_SINK_H__
 #define __NATS_SINK_H__
 
-#include "squeue.h"
+#include <pthread.h>
+#include "utils/sbus.h"
+#include "utils/fanout.h"
+#include "utils/conn_state.h"
+#include "utils/reactor.h"
 
 typedef struct {
     char*   host;
@@ -10,15 +14,24 @@ typedef struct {
     char*   password;
     char*   topic;
     char*   client_id;
+    int     format;     // payload_format
 
-    Queue*  q;
+    conn_state  conn;
+
+    Bus*        b;
+    sink_input  in;     // bus or fan-out
     pthread_t task_thread;
 
+    // reactor mode (nats_sink_attach), NULL => own thread
+    reactor_t*  reactor;
+    void*       priv;
+
 } nats_sync_config;
 
-int nats_sink_init(nats_sync_config* cfg, Queue* q, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic);
+int nats_sink_init(nats_sync_config* cfg, Bus* b, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic);
 int nats_sink_term(nats_sync_config* cfg);
 int nats_sink_run(nats_sync_config* cfg);
+int nats_sink_attach(nats_sync_config* cfg, reactor_t* r);
 int nats_sink_wait(nats_sync_config* cfg);
 
 #endif
\ No newline at end of file
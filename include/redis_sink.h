@@ -1,7 +1,11 @@
 #ifndef REDIS_SINK_H
 #define REDIS_SINK_H
 
-#include "squeue.h"
+#include <pthread.h>
+#include "utils/sbus.h"
+#include "utils/fanout.h"
+#include "utils/conn_state.h"
+#include "utils/reactor.h"
 
 typedef struct {
     char*   host;
@@ -10,15 +14,24 @@ typedef struct {
     char*   password;
     char*   key;
     char*   client_id;
+    int     format;     // payload_format
 
-    Queue*  q;
+    conn_state  conn;
+
+    Bus*        b;
+    sink_input  in;     // bus or fan-out
     pthread_t task_thread;
 
+    // reactor mode (redis_sink_attach), NULL => own thread
+    reactor_t*  reactor;
+    void*       priv;
+
 } redis_sync_config;
 
-int redis_sink_init(redis_sync_config* cfg, Queue* q, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic);
+int redis_sink_init(redis_sync_config* cfg, Bus* b, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic);
 int redis_sink_term(redis_sync_config* cfg);
 int redis_sink_run(redis_sync_config* cfg);
+int redis_sink_attach(redis_sync_config* cfg, reactor_t* r);
 int redis_sink_wait(redis_sync_config* cfg);
 
 #endif
\ No newline at end of file
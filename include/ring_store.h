@@ -0,0 +1,43 @@
+#ifndef RING_STORE_H
+#define RING_STORE_H
+
+#include <pthread.h>
+#include "utils/sbus.h"
+#include "utils/hashtable.h"
+#include "meter/sample_ring.h"
+
+#define RING_MAX_METERS     64
+
+/**
+ * @brief recent samples of every meter seen on the bus, served over HTTP:
+ *
+ *   GET <prefix>/meters
+ *   GET <prefix>/range?meter=25[&from=ns][&to=ns][&last=ms][&fields=a,b][&limit=n]
+ *   GET <prefix>/downsample?meter=25&field=power&step=ms[&agg=avg|min|max|last|count][&from=..]
+ */
+typedef struct {
+    uint32_t    capacity;   // samples per meter
+    char*       url;        // http://0.0.0.0:8088
+    char*       prefix;     // /api
+
+    hashtable_t*    rings;  // meter id => sample_ring*
+    sample_ring*    all[RING_MAX_METERS];
+    int             nrings;
+    pthread_mutex_t lock;   // all / nrings
+
+    void*       server;     // nng_http_server
+
+    Bus*        b;
+    BusReader*  br;
+    pthread_t   task_thread;
+
+} ring_store_config;
+
+int ring_store_init(ring_store_config* cfg, Bus* b, uint32_t capacity, const char* url, const char* prefix);
+int ring_store_term(ring_store_config* cfg);
+int ring_store_run(ring_store_config* cfg);
+int ring_store_wait(ring_store_config* cfg);
+
+sample_ring* ring_store_get(ring_store_config* cfg, uint32_t meter_id);
+
+#endif // !RING_STORE_H
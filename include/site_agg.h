@@ -0,0 +1,65 @@
+#ifndef SITE_AGG_H
+#define SITE_AGG_H
+
+#include <pthread.h>
+#include "utils/sbus.h"
+#include "utils/hashtable.h"
+#include "meter/regmap.h"
+
+#define SITE_MAX_MEMBERS    64
+#define SITE_MAX_FIELDS     8
+
+/**
+ * @brief latest sample of a meter of the site
+ *
+ */
+typedef struct {
+    uint32_t    meter_id;
+    uint64_t    ts;                     // ns, of the sample held
+    int         fresh;                  // counted in the totals
+    int         layout;                 // datalen / map the slots are for, -1 => none
+    int8_t      slot[SITE_MAX_FIELDS];  // -1 => not in the samples
+    double      v[SITE_MAX_FIELDS];     // contribution to the totals
+} site_member;
+
+/**
+ * @brief site totals of a group of meters: each sample replaces the
+ *        contribution of its meter in running sums (O(fields) per sample),
+ *        one record per aligned tick, members older than stale_ms left out
+ *
+ *   meter_sample { meter_id = site_id, map "<name>": <fields...>, members, stale }
+ */
+typedef struct {
+    char*       name;
+    uint32_t    site_id;        // meter id of the records
+    int         tick_ms;
+    int         stale_ms;
+
+    int         nfields;
+    char        field[SITE_MAX_FIELDS][REGMAP_NAME_LEN];
+    double      total[SITE_MAX_FIELDS];
+
+    site_member member[SITE_MAX_MEMBERS];
+    int         nmembers;
+    int         nfresh;
+    hashtable_t* ids;           // meter id => site_member*
+
+    reg_map     map;            // names of the records
+
+    unsigned long samples;
+    unsigned long late;         // older than the one held, dropped
+    unsigned long records;
+
+    Bus*        b;
+    BusReader*  br;
+    BusWriter*  bw;
+    pthread_t   task_thread;
+
+} site_agg_config;
+
+int site_agg_init(site_agg_config* cfg, Bus* b, const char* name, uint32_t site_id, const char* meters, const char* fields, int tick_ms, int stale_ms);
+int site_agg_term(site_agg_config* cfg);
+int site_agg_run(site_agg_config* cfg);
+int site_agg_wait(site_agg_config* cfg);
+
+#endif // !SITE_AGG_H
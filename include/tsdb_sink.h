@@ -0,0 +1,27 @@
+#ifndef TSDB_SINK_H
+#define TSDB_SINK_H
+
+#include <pthread.h>
+#include "utils/sbus.h"
+#include "meter/tsdb.h"
+
+typedef struct {
+    char*       dir;            // store directory (SD card)
+    int         chunk_points;   // samples per chunk
+    int         flush_s;        // seal the open chunks every N s, 0 => when full
+    int         sync;           // fdatasync each chunk
+
+    tsdb_t      db;
+
+    Bus*        b;
+    BusReader*  br;
+    pthread_t   task_thread;
+
+} tsdb_sink_config;
+
+int tsdb_sink_init(tsdb_sink_config* cfg, Bus* b, const char* dir, int chunk_points, int flush_s, int sync);
+int tsdb_sink_term(tsdb_sink_config* cfg);
+int tsdb_sink_run(tsdb_sink_config* cfg);
+int tsdb_sink_wait(tsdb_sink_config* cfg);
+
+#endif // !TSDB_SINK_H
@@ -0,0 +1,60 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "utils/hashtable.h"
+
+/* binary frame: "XB", version, reserved, count (u16 BE), then per item: len (u16 BE) + bytes */
+#define BATCH_FRAME_MAGIC0      'X'
+#define BATCH_FRAME_MAGIC1      'B'
+#define BATCH_FRAME_VERSION     1
+#define BATCH_FRAME_HDR_SIZE    6
+
+#define BATCH_MAX_PAYLOAD       (64 * 1024)
+
+typedef enum {
+    BATCH_FMT_JSON = 0,     // [item,item,...], items must be JSON values
+    BATCH_FMT_BINARY        // length-prefixed frame
+} batch_format;
+
+// first: log seq of the first item (batcher_add), 0 => none
+typedef int (*batch_publish_fn)(void* ctx, const char* topic, const void* payload, size_t len, uint64_t first);
+
+typedef struct batch_s {
+    char*       topic;
+    char*       buf;
+    size_t      len;
+    size_t      cap;
+    int         count;
+    int64_t     first_ms;   // arrival of the first item
+    uint64_t    first_seq;  // log seq of the first item, 0 => none
+    struct batch_s* next;   // all batches of the batcher, walked on flush/timeout
+} batch_t;
+
+typedef struct {
+    int             max_count;  // flush when N items are packed
+    int             max_ms;     // flush when the oldest item is T ms old
+    batch_format    fmt;
+
+    hashtable_t*    batches;    // topic -> batch_t
+    batch_t*        list;       // same batches, no key snapshot on the hot path
+    batch_publish_fn publish;
+    void*           ctx;
+} batcher_t;
+
+int batch_format_from_string(const char* s);
+int64_t batch_now_ms();
+
+int batcher_init(batcher_t* b, int max_count, int max_ms, batch_format fmt, batch_publish_fn publish, void* ctx);
+int batcher_enabled(const batcher_t* b);
+int batcher_add(batcher_t* b, const char* topic, const void* item, size_t len, uint64_t seq);
+int batcher_flush_due(batcher_t* b);
+int batcher_flush_all(batcher_t* b);
+int batcher_next_timeout(batcher_t* b);
+uint64_t batcher_held(batcher_t* b);
+void batcher_term(batcher_t* b);
+
+int topic_template_expand(const char* tmpl, const char* src_topic, uint32_t meter_id, char* out, size_t size);
+
+#endif // !__BATCH_H__
@@ -0,0 +1,40 @@
+#ifndef __CONN_STATE_H__
+#define __CONN_STATE_H__
+
+#include <pthread.h>
+
+/**
+ * @brief Connection state of one client instance
+ * 
+ */
+typedef enum {
+    CONN_IDLE = 0,
+    CONN_CONNECTING,
+    CONN_CONNECTED,
+    CONN_DISCONNECTED,
+    CONN_CLOSED
+} conn_status;
+
+typedef struct {
+    const char*     name;
+    int             state;
+    unsigned int    generation;     // +1 on every (re)connect
+    int             efd;            // eventfd, readable while connected
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} conn_state;
+
+int conn_state_init(conn_state* cs, const char* name);
+void conn_state_destroy(conn_state* cs);
+
+void conn_state_set(conn_state* cs, int state);
+int conn_state_get(conn_state* cs);
+int conn_state_fd(conn_state* cs);
+
+int conn_state_wait(conn_state* cs, int state, int timeout_ms);
+int conn_state_wait_all(conn_state** list, int n, int timeout_ms);
+
+const char* conn_state_str(int state);
+
+#endif // !__CONN_STATE_H__
@@ -0,0 +1,52 @@
+#ifndef __ENCODER_H__
+#define __ENCODER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "meter/meter_data.h"
+
+#define ENC_MAX_PAYLOAD     2048
+
+/**
+ * @brief Wire format of a sink payload
+ * 
+ */
+typedef enum {
+    ENC_RAW = 0,    // bus bytes as they are
+    ENC_JSON,       // JSON text
+    ENC_LINE,       // InfluxDB line protocol
+    ENC_CBOR,       // CBOR map, field-id keys
+    ENC_MSGPACK     // MessagePack map, field-id keys
+} payload_format;
+
+/**
+ * @brief field ids of meter_data_log in CBOR/MessagePack maps
+ * 
+ */
+enum {
+    METER_FID_METER = 0,
+    METER_FID_VOLTAGE,
+    METER_FID_CURRENT,
+    METER_FID_POWER,
+    METER_FID_REACTIVE_POWER,
+    METER_FID_POWER_FACTOR,
+    METER_FID_FREQ,
+    METER_FID_IMPORT_ACTIVE,
+    METER_FID_EXPORT_ACTIVE,
+    METER_FID_TIMESTAMP,        // unix time (ns)
+};
+
+struct DataLog;
+
+int payload_format_from_string(const char* s, int default_format);
+
+int encode_meter_data(int fmt, const meter_data_log* data, const char* measurement, uint8_t* buf, size_t size);
+int encode_meter_sample(int fmt, const meter_sample* x, const char* measurement, uint8_t* buf, size_t size);
+int encode_meter_fixed_sample(int fmt, const meter_fixed_sample* x, const char* measurement, uint8_t* buf, size_t size);
+int encode_datalog(int fmt, const struct DataLog* x, uint8_t* buf, size_t size);
+int encode_bus_data(int fmt, const void* data, int datalen, const char* measurement, uint8_t* buf, size_t size);
+
+int encode_json_string(const char* s, char* buf, size_t size);
+int datalog_field_id(const char* name);
+
+#endif // !__ENCODER_H__
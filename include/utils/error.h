@@ -11,6 +11,9 @@
 #define ESYSERR         2   /* Loi he thong     */
 #define ESVRERR         3   /* Loi may chu      */
 #define EQUERR          4   /* Loi hang doi     */
+#define EQTIMEDOUT      5   /* Het thoi gian cho */
+#define EQEMPTY         6   /* Hang doi rong */
+#define EBUFSIZE        7   /* Bo dem qua nho */
 
 
 // __END_CDECLS
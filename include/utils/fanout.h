@@ -0,0 +1,141 @@
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "utils/sbus.h"
+#include "utils/encoder.h"
+#include "utils/wal.h"
+
+#define FANOUT_MAX_OUTPUTS      8       // distinct (format, measurement)
+#define FANOUT_MAX_SUBS         16
+#define FANOUT_QUEUE_SIZE       256     // per subscriber, power of 2
+
+#define SINK_UNACKED_MAX        512     // publishes of a sink waiting for the server
+#define SINK_UNACKED_HIGH       (SINK_UNACKED_MAX / 2)  // the sink stops reading past it
+
+/**
+ * @brief a bus sample and its encodings, shared by the subscribers and
+ *        released by the last one (one slab block)
+ *
+ */
+typedef struct {
+    atomic_int  refs;
+    int         datalen;
+    void*       data;                           // bus bytes
+    int         len[FANOUT_MAX_OUTPUTS];        // -1 => not encoded / failed
+    uint8_t*    payload[FANOUT_MAX_OUTPUTS];    // NUL terminated
+} fanout_msg;
+
+/**
+ * @brief queues of one sink, one per bus priority lane: single producer
+ *        (fan-out thread), single consumer (the sink), eventfd readable
+ *        while not empty
+ *
+ */
+typedef struct {
+    int         output;
+    int         efd;
+    bus_filter* filter;     // NULL => everything
+    fanout_msg* ring[BUS_PRIO_LANES][FANOUT_QUEUE_SIZE];
+    atomic_uint head[BUS_PRIO_LANES];   // next pop
+    atomic_uint tail[BUS_PRIO_LANES];   // next push
+    atomic_ulong dropped;   // queue full
+} fanout_sub;
+
+typedef struct {
+    BusReader*  br;
+
+    int         noutputs;
+    int         fmt[FANOUT_MAX_OUTPUTS];
+    char*       measurement[FANOUT_MAX_OUTPUTS];
+
+    fanout_sub* subs[FANOUT_MAX_SUBS];
+    int         nsubs;
+
+    unsigned long messages;
+    unsigned long encodes;
+
+    pthread_t   task_thread;
+    int         running;
+} fanout_t;
+
+/**
+ * @brief publishes of a defer_ack sink not confirmed yet, in any order: the
+ *        log is acknowledged below the lowest sample still in one of them
+ *
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    struct {
+        uint64_t    id;     // of the client: message id, opaque ...
+        uint64_t    first;  // lowest seq published in it, 0 => confirmed before sent
+        int         ok;
+    } sent[SINK_UNACKED_MAX];
+    int         nsent;
+
+    uint64_t    floor;      // lowest seq not published yet (batched or unread)
+    uint64_t    rewind;     // lowest seq of a failed publish, read again, 0 => none
+    uint64_t    stuck;      // lowest seq of a publish not tracked (table full), 0 => none
+    uint64_t    acked;
+} sink_acks;
+
+/**
+ * @brief what a sink reads: its own bus reader (encoding itself), a
+ *        fan-out subscription (encodings shared with the other sinks) or
+ *        a cursor in the write-ahead log (replayed after a restart)
+ *
+ */
+typedef struct {
+    BusReader*  br;
+    fanout_sub* sub;        // NULL => br
+    int         sub_fmt;
+    bus_filter* filter;     // NULL => everything
+    wal_cursor* cur;        // != NULL => the log, instead of br / sub
+    uint8_t*    wal_buf;    // WAL_MAX_RECORD
+    uint64_t    seq;        // log sequence of the current sample
+    int         defer_ack;  // log acknowledged by sink_input_ack(), not on release
+    sink_acks*  acks;       // defer_ack with confirmations per publish, sink_input_defer()
+
+    // current sample
+    void*       data;
+    int         datalen;
+    fanout_msg* msg;
+    const uint8_t* payload;
+    int         len;        // < 0 => not encodable
+    uint8_t     buf[ENC_MAX_PAYLOAD];
+} sink_input;
+
+int fanout_init(fanout_t* f, Bus* b);
+int fanout_term(fanout_t* f);
+int fanout_run(fanout_t* f);
+int fanout_wait(fanout_t* f);
+
+fanout_sub* fanout_subscribe(fanout_t* f, int fmt, const char* measurement);
+void fanout_msg_release(fanout_msg* m);
+void fanout_log_stats(fanout_t* f);
+
+void sink_input_init(sink_input* in, Bus* b);
+int sink_input_use_fanout(sink_input* in, fanout_t* f, int fmt, const char* measurement);
+int sink_input_use_wal(sink_input* in, wal_t* w, const char* name);
+int sink_input_set_filter(sink_input* in, const bus_filter* filter);
+int sink_input_fd(sink_input* in);
+int sink_input_read(sink_input* in, int fmt, const char* measurement, int timeout_ms);
+int sink_input_encode(sink_input* in, int fmt, const char* measurement);
+void sink_input_done(sink_input* in);
+void sink_input_retry(sink_input* in);
+void sink_input_ack(sink_input* in, uint64_t seq);
+
+int sink_input_defer(sink_input* in);
+void sink_input_sent(sink_input* in, uint64_t id, uint64_t first);
+void sink_input_confirmed(sink_input* in, uint64_t id, int ok);
+void sink_input_resend(sink_input* in, uint64_t first);
+void sink_input_hold(sink_input* in, uint64_t held);
+int sink_input_unacked(sink_input* in);
+void sink_input_wait_unacked(sink_input* in, int below, int timeout_ms);
+
+#endif // !__FANOUT_H__
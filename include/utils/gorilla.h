@@ -0,0 +1,63 @@
+#ifndef GORILLA_H
+#define GORILLA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief bit stream, MSB first, err is set once the buffer is too small
+ *
+ */
+typedef struct {
+    uint8_t*    p;
+    size_t      cap;    // bytes
+    size_t      bits;   // written
+    int         err;
+} bit_writer;
+
+typedef struct {
+    const uint8_t*  p;
+    size_t          nbits;
+    size_t          pos;
+    int             err;    // read past the end
+} bit_reader;
+
+void bw_init(bit_writer* w, uint8_t* buf, size_t cap);
+void bw_put(bit_writer* w, uint64_t v, int n);
+size_t bw_bytes(const bit_writer* w);
+
+void br_init(bit_reader* r, const uint8_t* buf, size_t nbytes);
+uint64_t br_get(bit_reader* r, int n);
+
+/**
+ * @brief timestamp column: delta of delta, variable length buckets
+ *
+ */
+typedef struct {
+    int64_t prev;
+    int64_t delta;
+    int     n;      // values so far
+} gorilla_ts;
+
+/**
+ * @brief value column: XOR with the previous value, leading / trailing
+ *        zero window reused while the change fits in it
+ *
+ */
+typedef struct {
+    uint64_t prev;
+    int     lead;
+    int     trail;
+    int     n;
+} gorilla_val;
+
+void gorilla_ts_put(bit_writer* w, gorilla_ts* s, int64_t t);
+int64_t gorilla_ts_get(bit_reader* r, gorilla_ts* s);
+
+void gorilla_val_put(bit_writer* w, gorilla_val* s, double v);
+double gorilla_val_get(bit_reader* r, gorilla_val* s);
+
+void gorilla_f32_put(bit_writer* w, gorilla_val* s, float v);
+float gorilla_f32_get(bit_reader* r, gorilla_val* s);
+
+#endif // !GORILLA_H
@@ -96,23 +96,44 @@ then using the HASHTABLE_API_VISIBILITY flag to "export" the same symbols the wa
 /******************************************************************************/
 
 /**
- * Hashtable element
+ * Hashtable element (slot of the open addressing table)
  */
-typedef struct hashtable_element_s {
-    struct hashtable_element_s *next; /**< Next element of the hashtable */
-    char *                      key;  /**< Element key */
-    void *                      e;    /**< Element itself */
+typedef struct {
+    uint32_t hash; /**< Cached hash of the key */
+    uint32_t dist; /**< Robin Hood probe distance + 1, 0 if the slot is empty */
+    char *   key;  /**< Element key */
+    void *   e;    /**< Element itself */
 } hashtable_element_t;
 
+/**
+ * Hashtable table of slots
+ */
+typedef struct {
+    size_t              size;    /**< Number of slots, power of 2 */
+    hashtable_element_t slots[]; /**< Slots */
+} hashtable_table_t;
+
+/**
+ * Memory released once no lock-free reader is running
+ */
+typedef struct hashtable_retired_s {
+    struct hashtable_retired_s *next; /**< Next retired memory */
+    void *                      ptr;  /**< Retired memory */
+} hashtable_retired_t;
+
 /**
  * Hashtable instance
  */
 typedef struct {
-    hashtable_element_t **table; /**< Table of lists of elements */
-    size_t                size;  /**< Size of the table of lists of elements */
-    size_t                count; /**< Number of elements in the hashtable */
-    bool                  alloc; /**< Flag to indicate if elements are allocated when they are added in the hashtable */
-    sem_t                 sem;   /**< Semaphore used to protect the access to the hashtable */
+    hashtable_table_t *  table;    /**< Current table of elements */
+    hashtable_table_t *  old;      /**< Table being migrated to the current one, NULL if no resize is in progress */
+    size_t               migrated; /**< Next slot of the old table to be migrated */
+    size_t               count;    /**< Number of elements in the hashtable */
+    bool                 alloc;    /**< Flag to indicate if elements are allocated when they are added in the hashtable */
+    unsigned int         seq;      /**< Sequence counter, odd while a writer modifies the tables */
+    unsigned int         readers;  /**< Number of lock-free lookups in progress */
+    hashtable_retired_t *retired;  /**< Keys, elements and tables waiting to be released */
+    sem_t                sem;      /**< Semaphore used to serialize the writers */
 } hashtable_t;
 
 /******************************************************************************/
@@ -121,7 +142,7 @@ typedef struct {
 
 /**
  * @brief Function used to create hashtable instance
- * @param size Horizontal size of the hashtable
+ * @param size Expected number of elements, the hashtable grows when needed
  * @param alloc true if element should be allocated when they are added in the hashtable, false for a copy only
  * @return Hashtable instance if the function succeeded, NULL otherwise
  */
@@ -161,7 +182,7 @@ HASHTABLE_PUBLIC(bool) hashtable_has_key(hashtable_t *hashtable, char *key);
 HASHTABLE_PUBLIC(size_t) hashtable_get_keys(hashtable_t *hashtable, char ***keys);
 
 /**
- * @brief Lookup element of the hashtable
+ * @brief Lookup element of the hashtable, does not block on the writers
  * @param hashtable Hashtable instance
  * @param key Key of the element
  * @return Element of the hashtable, NULL if not found
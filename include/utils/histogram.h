@@ -0,0 +1,35 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* log2 buckets split in 4 linear steps, ~19% resolution up to 2^40 */
+#define HIST_SUB_BITS       2
+#define HIST_SUB            (1 << HIST_SUB_BITS)
+#define HIST_NBUCKETS       (41 * HIST_SUB)
+
+/**
+ * @brief latency / jitter distribution (any unit, usually us)
+ *
+ */
+typedef struct {
+    const char*     name;
+    pthread_mutex_t lock;
+
+    uint64_t        count;
+    int64_t         min;
+    int64_t         max;
+    int64_t         sum;
+    uint64_t        buckets[HIST_NBUCKETS];
+} histogram_t;
+
+void histogram_init(histogram_t* h, const char* name);
+void histogram_destroy(histogram_t* h);
+void histogram_reset(histogram_t* h);
+
+void histogram_record(histogram_t* h, int64_t value);
+int64_t histogram_percentile(histogram_t* h, double p);
+void histogram_log(histogram_t* h, const char* unit);
+
+#endif // !__HISTOGRAM_H__
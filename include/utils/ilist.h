@@ -0,0 +1,232 @@
+/**
+ * @file      ilist.h
+ * @brief     Intrusive list library
+ *
+ * Nodes are embedded in the caller's structures (no allocation on insert),
+ * iteration state belongs to the caller, nodes can be taken from a pool and
+ * a lock-free queue covers the producer/consumer hand-over between threads.
+ */
+
+#ifndef __ILIST_H__
+#define __ILIST_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <semaphore.h>
+
+/******************************************************************************/
+/* Definitions                                                                */
+/******************************************************************************/
+
+/**
+ * @brief Get the structure containing a node
+ * @param ptr Pointer to the node
+ * @param type Type of the containing structure
+ * @param member Name of the node in the structure
+ */
+#define ilist_entry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/**
+ * @brief Parse all nodes of the list, the current node must not be removed
+ * @param pos Node cursor
+ * @param list List instance
+ */
+#define ilist_for_each(pos, list) for ((pos) = (list)->head.next; (pos) != &(list)->head; (pos) = (pos)->next)
+
+/**
+ * @brief Parse all nodes of the list, the current node can be removed
+ * @param pos Node cursor
+ * @param n Next node
+ * @param list List instance
+ */
+#define ilist_for_each_safe(pos, n, list) \
+    for ((pos) = (list)->head.next, (n) = (pos)->next; (pos) != &(list)->head; (pos) = (n), (n) = (pos)->next)
+
+/**
+ * List node, embedded in the element
+ */
+typedef struct ilist_node_s {
+    struct ilist_node_s *prev; /**< Previous node of the list */
+    struct ilist_node_s *next; /**< Next node of the list */
+} ilist_node_t;
+
+/**
+ * List instance (circular, head is a sentinel), not synchronized
+ */
+typedef struct {
+    ilist_node_t head;  /**< Sentinel node */
+    size_t       count; /**< Number of nodes in the list */
+} ilist_t;
+
+/**
+ * Iterator, one per caller
+ */
+typedef struct {
+    ilist_t *     list; /**< List instance */
+    ilist_node_t *curr; /**< Current node, the sentinel before the first call */
+} ilist_iter_t;
+
+/**
+ * Pool of fixed size elements
+ */
+typedef struct {
+    size_t       size;   /**< Size of one element */
+    size_t       count;  /**< Number of elements per block */
+    void *       free;   /**< Free elements */
+    void *       blocks; /**< Allocated blocks */
+    size_t       used;   /**< Number of elements in use */
+    sem_t        sem;    /**< Semaphore used to protect the access to the pool */
+} ilist_pool_t;
+
+/**
+ * Lock-free queue of nodes, many producers, one consumer
+ */
+typedef struct {
+    ilist_node_t *head; /**< Next node to pop, owned by the consumer */
+    ilist_node_t *tail; /**< Last pushed node, shared by the producers */
+    ilist_node_t  stub; /**< Stub node, keeps the queue never empty */
+} ilist_mpsc_t;
+
+/******************************************************************************/
+/* Prototypes                                                                 */
+/******************************************************************************/
+
+/**
+ * @brief Initialize an empty list
+ * @param list List instance
+ */
+void ilist_init(ilist_t *list);
+
+/**
+ * @brief Add node to the head of the list
+ * @param list List instance
+ * @param node Node to be added
+ */
+void ilist_add_head(ilist_t *list, ilist_node_t *node);
+
+/**
+ * @brief Add node to the tail of the list
+ * @param list List instance
+ * @param node Node to be added
+ */
+void ilist_add_tail(ilist_t *list, ilist_node_t *node);
+
+/**
+ * @brief Remove node of the list, the node is not released
+ * @param list List instance
+ * @param node Node to be removed
+ */
+void ilist_remove(ilist_t *list, ilist_node_t *node);
+
+/**
+ * @brief Remove the head node of the list
+ * @param list List instance
+ * @return Head node of the list, NULL if the list is empty
+ */
+ilist_node_t *ilist_pop_head(ilist_t *list);
+
+/**
+ * @brief Get number of nodes in the list
+ * @param list List instance
+ * @return Number of nodes in the list
+ */
+size_t ilist_get_count(ilist_t *list);
+
+/**
+ * @brief Check if the list is empty
+ * @param list List instance
+ * @return true if the list is empty, false otherwise
+ */
+bool ilist_is_empty(ilist_t *list);
+
+/**
+ * @brief Start an iteration of the list
+ * @param it Iterator
+ * @param list List instance
+ */
+void ilist_iter_init(ilist_iter_t *it, ilist_t *list);
+
+/**
+ * @brief Get next node of the iteration
+ * @param it Iterator
+ * @return Next node, NULL if the end of the list is reached
+ */
+ilist_node_t *ilist_iter_next(ilist_iter_t *it);
+
+/**
+ * @brief Get previous node of the iteration
+ * @param it Iterator
+ * @return Previous node, NULL if the beginning of the list is reached
+ */
+ilist_node_t *ilist_iter_prev(ilist_iter_t *it);
+
+/**
+ * @brief Initialize a pool of elements
+ * @param pool Pool instance
+ * @param size Size of one element
+ * @param count Number of elements allocated at once
+ * @return 0 if the function succeeded, -1 otherwise
+ */
+int ilist_pool_init(ilist_pool_t *pool, size_t size, size_t count);
+
+/**
+ * @brief Get an element of the pool, the pool grows when needed
+ * @param pool Pool instance
+ * @return Element (not initialized), NULL if the memory is exhausted
+ */
+void *ilist_pool_get(ilist_pool_t *pool);
+
+/**
+ * @brief Give an element back to the pool
+ * @param pool Pool instance
+ * @param e Element
+ */
+void ilist_pool_put(ilist_pool_t *pool, void *e);
+
+/**
+ * @brief Release the pool and all of its elements
+ * @param pool Pool instance
+ */
+void ilist_pool_release(ilist_pool_t *pool);
+
+/**
+ * @brief Initialize an empty queue
+ * @param q Queue instance
+ */
+void ilist_mpsc_init(ilist_mpsc_t *q);
+
+/**
+ * @brief Append a node, lock-free, can be called from any thread
+ * @param q Queue instance
+ * @param node Node to be added
+ */
+void ilist_mpsc_push(ilist_mpsc_t *q, ilist_node_t *node);
+
+/**
+ * @brief Pop the oldest node, lock-free, only called from the consumer thread
+ * @param q Queue instance
+ * @return Oldest node, NULL if the queue is empty (or a push is not complete yet)
+ */
+ilist_node_t *ilist_mpsc_pop(ilist_mpsc_t *q);
+
+/**
+ * @brief Check if the queue is empty, only called from the consumer thread
+ * @param q Queue instance
+ * @return true if the queue is empty, false otherwise
+ */
+bool ilist_mpsc_is_empty(ilist_mpsc_t *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ILIST_H__ */
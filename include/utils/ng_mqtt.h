@@ -1,6 +1,14 @@
 #ifndef NNG_MQTT_CLIENT_HH
 #define NNG_MQTT_CLIENT_HH
- 
 
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "nng/nng.h"
+#include "utils/conn_state.h"
+
+int ng_mqtt_connect(nng_socket *sock, nng_dialer *dialer, conn_state* conn, const char *url, 
+    const char* client_id, const char* username, const char* password, bool verbose);
+int ng_mqtt_publish(nng_socket sock, const char *topic, const uint8_t *payload, uint32_t payload_len, uint8_t qos);
 
 #endif // !NNG_MQTT_CLIENT_HH
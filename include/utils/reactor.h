@@ -0,0 +1,52 @@
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#define REACTOR_MAX_EVENTS      32
+
+typedef struct reactor_s reactor_t;
+typedef struct reactor_handler_s reactor_handler;
+
+/**
+ * @brief called on the reactor thread when fd is ready
+ *
+ */
+typedef void (*reactor_cb)(reactor_t* r, reactor_handler* h, uint32_t events, void* arg);
+
+struct reactor_handler_s {
+    int                 fd;
+    uint32_t            events;     // EPOLLIN, EPOLLOUT
+    int                 timer;      // fd is a timerfd, read on expiry
+    reactor_cb          cb;
+    void*               arg;
+    reactor_handler*    next;       // deferred release
+};
+
+struct reactor_s {
+    const char*         name;
+    int                 epfd;
+    int                 wakefd;     // eventfd, wakes the loop for reactor_stop()
+    volatile int        running;
+    pthread_t           thread;
+
+    reactor_handler*    zombies;    // removed during dispatch, freed after it
+};
+
+int reactor_init(reactor_t* r, const char* name);
+void reactor_term(reactor_t* r);
+
+reactor_handler* reactor_add(reactor_t* r, int fd, uint32_t events, reactor_cb cb, void* arg);
+int reactor_mod(reactor_t* r, reactor_handler* h, uint32_t events);
+void reactor_del(reactor_t* r, reactor_handler* h);
+
+reactor_handler* reactor_timer_add(reactor_t* r, reactor_cb cb, void* arg);
+int reactor_timer_set(reactor_handler* h, int timeout_ms, int period_ms);
+
+int reactor_run(reactor_t* r);
+void reactor_stop(reactor_t* r);
+int reactor_wait(reactor_t* r);
+
+#endif // !__REACTOR_H__
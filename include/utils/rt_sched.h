@@ -0,0 +1,30 @@
+#ifndef __RT_SCHED_H__
+#define __RT_SCHED_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define RT_MAX_CPUS             64
+
+/**
+ * @brief scheduling of one task thread
+ *
+ */
+typedef struct {
+    int         policy;         // SCHED_OTHER, SCHED_FIFO, SCHED_RR
+    int         priority;       // 1..99 for FIFO / RR
+    uint64_t    cpus;           // affinity mask, bit n => cpu n, 0 => any
+    size_t      prefault_stack; // bytes of stack touched at thread start, 0 => off
+} task_sched;
+
+void task_sched_default(task_sched* ts);
+int task_sched_policy_from_string(const char* s);
+
+int task_sched_apply(pthread_t thread, const task_sched* ts, const char* name);
+int task_sched_apply_self(const task_sched* ts, const char* name);
+
+void task_sched_prefault_stack(size_t bytes);
+int task_sched_lock_memory();
+
+#endif // !__RT_SCHED_H__
@@ -1,6 +1,35 @@
 #ifndef __SBUS_H__
 #define __SBUS_H__
 
+#include <stdint.h>
+
+// message types, told apart by their size
+#define BUS_TYPE_DATALOG        0x01    // meter_data_log
+#define BUS_TYPE_SAMPLE         0x02    // meter_sample
+#define BUS_TYPE_FIXED          0x04    // meter_fixed_sample
+#define BUS_TYPE_MESSAGE        0x08    // struct Message (source payload)
+#define BUS_TYPE_ANY            0xFF
+
+#define BUS_FILTER_MAX_METERS   16
+
+// priority lanes, one bus0 socket each, readers drain the highest first
+#define BUS_PRIO_BULK           0       // telemetry
+#define BUS_PRIO_URGENT         1       // alarms, tagged by the sources
+#define BUS_PRIO_LANES          2
+
+/**
+ * @brief what a reader wants, checked before the message is copied out of
+ *        the bus. The topic prefix only matches struct Message (source
+ *        topic), the meter ids only the meter samples
+ * 
+ */
+typedef struct {
+    unsigned    types;                          // BUS_TYPE_*, 0 => any
+    int         nmeters;                        // 0 => any meter
+    uint32_t    meters[BUS_FILTER_MAX_METERS];
+    char        topic[128];                     // prefix, "" => any topic
+} bus_filter;
+
 typedef struct {
     char* bus_address; // in-memory address 
     void* data;
@@ -16,12 +45,29 @@ typedef struct {
     void* data;
 } BusWriter;
 
+struct wal;
+
 int init_bus(Bus* b, const char* b_name);
+int bus_attach_wal(Bus* b, struct wal* w);
 
 int create_bus_writer(BusWriter** bw, Bus* b);
 int create_bus_reader(BusReader** br, Bus* b);
+void close_bus_reader(BusReader* br);
 
 int bus_write(BusWriter* bw, void* data, int datalen);
+int bus_write_prio(BusWriter* bw, void* data, int datalen, int prio);
 int bus_read(BusReader* bw, void** data, int* datalen);
+int bus_read_timeout(BusReader* br, void** data, int* datalen, int timeout_ms);
+void bus_free(void* data);
+
+int bus_reader_fd(BusReader* br);
+int bus_try_read(BusReader* br, void** data, int* datalen);
+
+int bus_type_of(const void* data, int datalen, uint32_t* meter_id);
+int bus_filter_match(const bus_filter* f, const void* data, int datalen);
+int bus_filter_from_string(bus_filter* f, const char* types, const char* meters, const char* topic);
+int bus_reader_set_filter(BusReader* br, const bus_filter* f);
+unsigned long bus_reader_filtered(BusReader* br);
+int bus_reader_prio(BusReader* br);
 
 #endif
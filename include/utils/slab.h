@@ -0,0 +1,35 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* size classes (object + header), bigger requests go to malloc */
+#define SLAB_CLASS_SIZES        { 64, 128, 256, 512, 1024, 2048, 2560, 4096 }
+#define SLAB_NCLASSES           8
+
+#define SLAB_CHUNK_SIZE         (64 * 1024)     // carved into objects of one class
+#define SLAB_TCACHE_MAX         32              // objects cached per thread & class
+
+/**
+ * @brief statistics of one size class
+ *
+ */
+typedef struct {
+    size_t  size;       // object size of the class (0 => large objects, malloc)
+    size_t  chunks;     // chunks taken from the system
+    size_t  in_use;     // objects owned by the callers
+    size_t  peak;       // max of in_use
+    size_t  depot;      // free objects in the shared depot (thread caches excluded)
+    uint64_t allocs;
+    uint64_t frees;
+} slab_stats_t;
+
+void* slab_alloc(size_t size);
+void* slab_calloc(size_t size);
+void slab_free(void* ptr);
+
+int slab_stats(slab_stats_t* stats, int n);
+void slab_stats_log();
+
+#endif // !__SLAB_H__
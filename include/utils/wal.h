@@ -0,0 +1,94 @@
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define WAL_MAX_CURSORS         16
+#define WAL_MAX_SEGMENTS        1024
+#define WAL_MAX_RECORD          4096    // bus message, largest is meter_fixed_sample
+#define WAL_NAME_LEN            64
+
+#define WAL_DEFAULT_SEGMENT_KB  1024
+#define WAL_DEFAULT_COMMIT_MS   1000
+#define WAL_DEFAULT_COMMIT_KB   64
+#define WAL_DEFAULT_MAX_MB      64
+
+struct wal;
+
+/**
+ * @brief read position of a sink: everything up to 'acked' was delivered,
+ *        persisted in <dir>/<name>.cursor with the group commits
+ *
+ */
+typedef struct {
+    struct wal* w;
+    char        name[WAL_NAME_LEN];
+    int         efd;        // readable after a commit, reactor mode
+
+    uint64_t    acked;      // last delivered seq
+    uint64_t    saved;      // acked as last persisted
+    uint64_t    next;       // seq to read next (> acked while in flight)
+
+    // position of 'next'
+    int         fd;         // segment, -1 => look it up
+    uint64_t    seg_first;
+    uint64_t    off;
+    uint64_t    bad_off;    // + 1, bad record reported at this offset
+} wal_cursor;
+
+/**
+ * @brief source side write-ahead log of the bus messages: segment files
+ *        <dir>/wal-<first seq>.log of records { len, crc, seq, bytes }.
+ *        Appends go to the page cache, a commit thread makes them durable
+ *        in groups (commit_ms / commit_kb), the cursors only see committed
+ *        records. Segments every cursor is past are removed
+ *
+ */
+typedef struct wal {
+    char*       dir;
+    uint64_t    segment_bytes;
+    int         commit_ms;
+    uint64_t    commit_bytes;
+    uint64_t    max_bytes;      // oldest segments dropped past it, acked or not
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    int         fd;             // current segment, append only
+    uint64_t    seg_size;
+    int         sealed_fd;      // full segment, synced and closed by the commit thread
+    int         dir_dirty;      // segment created since the last directory sync
+    uint64_t    segs[WAL_MAX_SEGMENTS];     // first seq of each, ascending
+    uint64_t    seg_bytes[WAL_MAX_SEGMENTS];
+    int         nsegs;
+
+    uint64_t    next_seq;
+    uint64_t    committed;      // last durable seq
+    uint64_t    pending;        // bytes since the last commit
+
+    wal_cursor* cursors[WAL_MAX_CURSORS];
+    int         ncursors;
+
+    unsigned long commits;
+    unsigned long appends;
+    unsigned long dropped;      // records removed unacked (max_bytes)
+
+    pthread_t   task_thread;
+    int         running;
+} wal_t;
+
+int wal_init(wal_t* w, const char* dir, int segment_kb, int commit_ms, int commit_kb, int max_mb);
+int wal_term(wal_t* w);
+int wal_run(wal_t* w);
+int wal_wait(wal_t* w);
+
+int wal_append(wal_t* w, const void* data, int len, uint64_t* seq);
+int wal_commit(wal_t* w);
+
+wal_cursor* wal_cursor_open(wal_t* w, const char* name);
+int wal_cursor_read(wal_cursor* c, void* buf, int size, int* len, uint64_t* seq);
+void wal_cursor_ack(wal_cursor* c, uint64_t seq);
+void wal_cursor_rewind(wal_cursor* c, uint64_t seq);
+
+#endif // !__WAL_H__
@@ -0,0 +1,655 @@
+/**
+ * @file meter_sim.c
+ * @author longdh
+ * @brief simulated meter fleet: DDSU666 and PZEM-016 slaves served with
+ *        libmodbus over Modbus TCP (unit id = slave id) and one pty per slave
+ * @version 0.1
+ * @date 2024-02-09
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Usage: meter_sim [options]
+ *   -d, --ddsu666 N        DDSU666 slaves, ids 1..N (default 4)
+ *   -z, --pzem016 N        PZEM-016 slaves, ids after the DDSU666 ones (default 0)
+ *   -t, --tcp PORT         Modbus TCP gateway port, 0 => off (default 1502)
+ *   -p, --pty              a pty (RTU) per slave, its path is printed
+ *   -L, --link-dir DIR     symlink the ptys as DIR/<type>-<id>
+ *   -l, --latency MS[:J]   reply delay, + 0..J ms of jitter
+ *   -c, --crc-rate P       fraction of the replies corrupted (RTU: CRC, TCP: byte count)
+ *   -o, --timeout-rate P   fraction of the requests not answered
+ *   -s, --seed N           random seed (default 1)
+ *
+ * The readings follow a random walk (voltage around 230 V, 50 Hz, varying
+ * load), the energy counters integrate the power. One thread serves all the
+ * slaves: delayed replies wait in a queue, so a slow slave does not hold up
+ * the others.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <getopt.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <modbus/modbus.h>
+
+#define SIM_MAX_METERS      247         // Modbus slave ids
+#define SIM_MAX_CLIENTS     64
+#define SIM_MAX_PENDING     1024
+#define SIM_UPDATE_MS       1000
+
+#define NSEC_PER_MSEC       1000000LL
+
+enum { SIM_DDSU666 = 0, SIM_PZEM016 };
+
+static const char* sim_type_names[] = { "ddsu666", "pzem016" };
+
+/**
+ * @brief a simulated slave
+ *
+ */
+typedef struct {
+    int         id;
+    int         type;
+    modbus_mapping_t* map;
+
+    // readings
+    double      voltage;    // V
+    double      current;    // A
+    double      pf;
+    double      freq;       // Hz
+    double      import_wh;
+    double      export_wh;
+
+    // RTU over a pty, master < 0 => none
+    int         master;
+    int         slave;
+    modbus_t*   rtu;
+    char        link[256];
+} sim_meter;
+
+/**
+ * @brief a reply waiting for its delay
+ *
+ */
+typedef struct {
+    int64_t     due;
+    sim_meter*  m;          // NULL => unknown unit
+    modbus_t*   ctx;
+    int         fd;         // TCP client, -1 => RTU
+    int         corrupt;
+    int         len;
+    uint8_t     req[MODBUS_TCP_MAX_ADU_LENGTH];
+} sim_reply;
+
+static struct {
+    int         nddsu;
+    int         npzem;
+    int         tcp_port;
+    int         pty;
+    const char* link_dir;
+    int         latency_ms;
+    int         jitter_ms;
+    double      crc_rate;
+    double      timeout_rate;
+    unsigned    seed;
+} opt = { 4, 0, 1502, 0, NULL, 0, 0, 0.0, 0.0, 1 };
+
+static sim_meter meters[SIM_MAX_METERS];
+static sim_meter* by_id[SIM_MAX_METERS + 1];
+static int nmeters;
+
+static sim_reply pending[SIM_MAX_PENDING];
+static int npending;
+
+static unsigned long requests, replies, dropped, corrupted, overflow;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void) sig;
+    stop = 1;
+}
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double rnd()
+{
+    return (double) rand() / ((double) RAND_MAX + 1.0);
+}
+
+static double clamp(double v, double lo, double hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+/**
+ * @brief next readings of a slave, written to its registers
+ *
+ * @param m
+ * @param dt, s since the last update
+ */
+static void sim_update(sim_meter* m, double dt)
+{
+    m->voltage = clamp(m->voltage + (rnd() - 0.5) * 2.0 + (230.0 - m->voltage) * 0.1, 200.0, 255.0);
+    m->current = clamp(m->current + (rnd() - 0.5) * 1.5, 0.1, 60.0);
+    m->pf = clamp(m->pf + (rnd() - 0.5) * 0.02, 0.7, 1.0);
+    m->freq = clamp(m->freq + (rnd() - 0.5) * 0.02 + (50.0 - m->freq) * 0.2, 49.8, 50.2);
+
+    double p = m->voltage * m->current * m->pf;                         // W
+    double q = m->voltage * m->current * sin(acos(m->pf));              // var
+
+    // a few slaves export (solar), the others import
+    if (m->id % 5 == 0)
+        m->export_wh += p * dt / 3600.0;
+    else
+        m->import_wh += p * dt / 3600.0;
+
+    if (m->type == SIM_DDSU666)
+    {
+        // holding registers from 0x2000, float32 DCBA, kW / kvar / kVA / kWh
+        uint16_t* r = m->map->tab_registers;
+
+        modbus_set_float_dcba((float) m->voltage, &r[0x00]);
+        modbus_set_float_dcba((float) m->current, &r[0x02]);
+        modbus_set_float_dcba((float) (p / 1000.0), &r[0x04]);
+        modbus_set_float_dcba((float) (q / 1000.0), &r[0x06]);
+        modbus_set_float_dcba((float) (m->voltage * m->current / 1000.0), &r[0x08]);
+        modbus_set_float_dcba((float) m->pf, &r[0x0A]);
+        modbus_set_float_dcba((float) m->freq, &r[0x0E]);
+        modbus_set_float_dcba((float) (m->import_wh / 1000.0), &r[0x2000]);
+        modbus_set_float_dcba((float) (m->export_wh / 1000.0), &r[0x200A]);
+    }
+    else
+    {
+        // input registers from 0, 32 bit values low word first
+        uint16_t* r = m->map->tab_input_registers;
+        uint32_t i = (uint32_t) lround(m->current * 1000.0);
+        uint32_t w = (uint32_t) lround(p * 10.0);
+        uint32_t e = (uint32_t) lround(m->import_wh + m->export_wh);
+
+        r[0] = (uint16_t) lround(m->voltage * 10.0);
+        r[1] = (uint16_t) i;
+        r[2] = (uint16_t) (i >> 16);
+        r[3] = (uint16_t) w;
+        r[4] = (uint16_t) (w >> 16);
+        r[5] = (uint16_t) e;
+        r[6] = (uint16_t) (e >> 16);
+        r[7] = (uint16_t) lround(m->freq * 10.0);
+        r[8] = (uint16_t) lround(m->pf * 100.0);
+        r[9] = 0;
+    }
+}
+
+/**
+ * @brief pty of a slave, raw so the frames pass unchanged
+ *
+ * @param m
+ * @return int
+ */
+static int sim_open_pty(sim_meter* m)
+{
+    struct termios tio;
+    char name[128];
+
+    if (openpty(&m->master, &m->slave, name, NULL, NULL) != 0)
+    {
+        fprintf(stderr, "openpty: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // the slave end stays open: the pty survives the pollers reconnecting
+    tcgetattr(m->slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(m->slave, TCSANOW, &tio);
+
+    // the RTU context is never connected, it works on the master fd
+    m->rtu = modbus_new_rtu("/dev/null", 9600, 'N', 8, 1);
+    if (m->rtu == NULL)
+        return -1;
+
+    modbus_set_slave(m->rtu, m->id);
+    modbus_set_socket(m->rtu, m->master);
+
+    if (opt.link_dir != NULL)
+    {
+        snprintf(m->link, sizeof(m->link), "%s/%s-%d", opt.link_dir, sim_type_names[m->type], m->id);
+        unlink(m->link);
+        if (symlink(name, m->link) != 0)
+        {
+            fprintf(stderr, "symlink %s: %s\n", m->link, strerror(errno));
+            m->link[0] = '\0';
+        }
+    }
+
+    printf("%s %3d  %s%s%s\n", sim_type_names[m->type], m->id, name, m->link[0] ? "  " : "", m->link);
+
+    return 0;
+}
+
+static int sim_add_meter(int type)
+{
+    sim_meter* m = &meters[nmeters];
+
+    memset(m, 0, sizeof(sim_meter));
+    m->id = nmeters + 1;
+    m->type = type;
+    m->master = m->slave = -1;
+
+    if (type == SIM_DDSU666)
+        m->map = modbus_mapping_new_start_address(0, 0, 0, 0, 0x2000, 0x2010, 0, 0);
+    else
+        m->map = modbus_mapping_new_start_address(0, 0, 0, 0, 0x0000, 0x10, 0x0000, 10);
+
+    if (m->map == NULL)
+        return -1;
+
+    m->voltage = 225.0 + rnd() * 10.0;
+    m->current = 1.0 + rnd() * 20.0;
+    m->pf = 0.85 + rnd() * 0.15;
+    m->freq = 50.0;
+    m->import_wh = rnd() * 1e6;
+    sim_update(m, 0.0);
+
+    if (opt.pty && sim_open_pty(m) != 0)
+        return -1;
+
+    by_id[m->id] = m;
+    nmeters++;
+
+    return 0;
+}
+
+/**
+ * @brief a read reply with a broken check: RTU CRC inverted, TCP byte count off
+ *
+ * @param r
+ * @return int, -1 => not a read, reply normally
+ */
+static int sim_send_corrupt(sim_reply* r)
+{
+    int hdr = modbus_get_header_length(r->ctx);
+    int fc = r->req[hdr];
+    int addr = r->req[hdr + 1] << 8 | r->req[hdr + 2];
+    int nb = r->req[hdr + 3] << 8 | r->req[hdr + 4];
+    const modbus_mapping_t* map = r->m->map;
+    const uint16_t* regs;
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+    int n = hdr;
+
+    if (fc == MODBUS_FC_READ_HOLDING_REGISTERS)
+    {
+        regs = map->tab_registers;
+        addr -= map->start_registers;
+        if (addr < 0 || addr + nb > map->nb_registers)
+            return -1;
+    }
+    else if (fc == MODBUS_FC_READ_INPUT_REGISTERS)
+    {
+        regs = map->tab_input_registers;
+        addr -= map->start_input_registers;
+        if (addr < 0 || addr + nb > map->nb_input_registers)
+            return -1;
+    }
+    else
+        return -1;
+
+    if (nb < 1 || nb > MODBUS_MAX_READ_REGISTERS)
+        return -1;
+
+    memcpy(rsp, r->req, hdr);
+    rsp[n++] = (uint8_t) fc;
+    rsp[n++] = (uint8_t) (2 * nb + (r->fd >= 0 ? 2 : 0));
+    for (int i = 0; i < nb; i++)
+    {
+        rsp[n++] = (uint8_t) (regs[addr + i] >> 8);
+        rsp[n++] = (uint8_t) regs[addr + i];
+    }
+
+    if (r->fd >= 0)
+    {
+        // MBAP length: unit id + PDU
+        rsp[4] = (uint8_t) ((n - 6) >> 8);
+        rsp[5] = (uint8_t) (n - 6);
+    }
+    else
+    {
+        uint16_t crc = 0xFFFF;
+
+        for (int i = 0; i < n; i++)
+        {
+            crc ^= rsp[i];
+            for (int b = 0; b < 8; b++)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+
+        crc = (uint16_t) ~crc;
+        rsp[n++] = (uint8_t) crc;
+        rsp[n++] = (uint8_t) (crc >> 8);
+    }
+
+    if (write(r->fd >= 0 ? r->fd : r->m->master, rsp, n) != n)
+        fprintf(stderr, "slave %d: short write\n", r->m->id);
+
+    return 0;
+}
+
+static void sim_send(sim_reply* r)
+{
+    if (r->fd >= 0)
+        modbus_set_socket(r->ctx, r->fd);
+
+    if (r->m == NULL)
+        modbus_reply_exception(r->ctx, r->req, MODBUS_EXCEPTION_GATEWAY_TARGET);
+    else if (r->corrupt && sim_send_corrupt(r) == 0)
+        corrupted++;
+    else
+        modbus_reply(r->ctx, r->req, r->len, r->m->map);
+
+    replies++;
+}
+
+/**
+ * @brief queue the reply of a request, or drop it (timeout injection)
+ *
+ * @param ctx
+ * @param fd, TCP client, -1 => RTU
+ * @param m, NULL => unknown unit
+ * @param req
+ * @param len
+ */
+static void sim_request(modbus_t* ctx, int fd, sim_meter* m, const uint8_t* req, int len)
+{
+    double r = rnd();
+    sim_reply* p;
+
+    requests++;
+
+    if (m != NULL && r < opt.timeout_rate)
+    {
+        dropped++;
+        return;
+    }
+
+    if (npending >= SIM_MAX_PENDING)
+    {
+        overflow++;
+        return;
+    }
+
+    p = &pending[npending++];
+    p->due = now_ns() + (int64_t) (opt.latency_ms + (opt.jitter_ms > 0 ? rnd() * opt.jitter_ms : 0)) * NSEC_PER_MSEC;
+    p->m = m;
+    p->ctx = ctx;
+    p->fd = fd;
+    p->corrupt = (m != NULL && r < opt.timeout_rate + opt.crc_rate);
+    p->len = len;
+    memcpy(p->req, req, len);
+}
+
+/**
+ * @brief send the replies due, returns the ms until the next one
+ *
+ * @param now
+ * @return int64_t, -1 => none pending
+ */
+static int64_t sim_flush(int64_t now)
+{
+    int64_t next = -1;
+
+    for (int i = 0; i < npending; )
+    {
+        if (pending[i].due <= now)
+        {
+            sim_send(&pending[i]);
+            pending[i] = pending[--npending];
+            continue;
+        }
+
+        if (next < 0 || pending[i].due < next)
+            next = pending[i].due;
+        i++;
+    }
+
+    return next < 0 ? -1 : (next - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+}
+
+/**
+ * @brief forget the replies of a closed TCP client
+ *
+ * @param fd
+ */
+static void sim_drop_client(int fd)
+{
+    for (int i = 0; i < npending; )
+    {
+        if (pending[i].fd == fd)
+            pending[i] = pending[--npending];
+        else
+            i++;
+    }
+
+    close(fd);
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+        "usage: %s [-d ddsu666] [-z pzem016] [-t port] [-p] [-L dir] [-l ms[:jitter]] [-c crc_rate] [-o timeout_rate] [-s seed]\n",
+        prog);
+}
+
+int main(int argc, char** argv)
+{
+    static const struct option longopts[] = {
+        { "ddsu666",      required_argument, NULL, 'd' },
+        { "pzem016",      required_argument, NULL, 'z' },
+        { "tcp",          required_argument, NULL, 't' },
+        { "pty",          no_argument,       NULL, 'p' },
+        { "link-dir",     required_argument, NULL, 'L' },
+        { "latency",      required_argument, NULL, 'l' },
+        { "crc-rate",     required_argument, NULL, 'c' },
+        { "timeout-rate", required_argument, NULL, 'o' },
+        { "seed",         required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+    modbus_t* tcp = NULL;
+    int listen_fd = -1;
+    int clients[SIM_MAX_CLIENTS];
+    int nclients = 0;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "d:z:t:pL:l:c:o:s:", longopts, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'd': opt.nddsu = atoi(optarg); break;
+        case 'z': opt.npzem = atoi(optarg); break;
+        case 't': opt.tcp_port = atoi(optarg); break;
+        case 'p': opt.pty = 1; break;
+        case 'L': opt.link_dir = optarg; break;
+        case 'l': sscanf(optarg, "%d:%d", &opt.latency_ms, &opt.jitter_ms); break;
+        case 'c': opt.crc_rate = atof(optarg); break;
+        case 'o': opt.timeout_rate = atof(optarg); break;
+        case 's': opt.seed = (unsigned) strtoul(optarg, NULL, 10); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.nddsu < 0 || opt.npzem < 0 || opt.nddsu + opt.npzem > SIM_MAX_METERS || opt.nddsu + opt.npzem == 0)
+    {
+        fprintf(stderr, "1 to %d slaves\n", SIM_MAX_METERS);
+        return 1;
+    }
+
+    srand(opt.seed);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < opt.nddsu + opt.npzem; i++)
+    {
+        if (sim_add_meter(i < opt.nddsu ? SIM_DDSU666 : SIM_PZEM016) != 0)
+        {
+            fprintf(stderr, "cannot create slave %d\n", i + 1);
+            return 1;
+        }
+    }
+
+    if (opt.tcp_port > 0)
+    {
+        tcp = modbus_new_tcp("0.0.0.0", opt.tcp_port);
+        if (tcp == NULL || (listen_fd = modbus_tcp_listen(tcp, SIM_MAX_CLIENTS)) < 0)
+        {
+            fprintf(stderr, "modbus tcp :%d: %s\n", opt.tcp_port, modbus_strerror(errno));
+            return 1;
+        }
+        printf("modbus tcp :%d, units 1..%d\n", opt.tcp_port, nmeters);
+    }
+
+    printf("%d ddsu666 + %d pzem016, latency %d+%d ms, crc %.3f, timeout %.3f\n",
+        opt.nddsu, opt.npzem, opt.latency_ms, opt.jitter_ms, opt.crc_rate, opt.timeout_rate);
+    fflush(stdout);
+
+    int64_t next_update = now_ns() + SIM_UPDATE_MS * NSEC_PER_MSEC;
+
+    while (!stop)
+    {
+        struct pollfd fds[1 + SIM_MAX_CLIENTS + SIM_MAX_METERS];
+        int nfds = 0;
+        int64_t now = now_ns();
+        int64_t wait = sim_flush(now);
+        int64_t upd = (next_update - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+
+        if (upd <= 0)
+        {
+            for (int i = 0; i < nmeters; i++)
+                sim_update(&meters[i], SIM_UPDATE_MS / 1000.0);
+            next_update += SIM_UPDATE_MS * NSEC_PER_MSEC;
+            continue;
+        }
+
+        if (wait < 0 || upd < wait)
+            wait = upd;
+
+        if (listen_fd >= 0)
+            fds[nfds++] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+        for (int i = 0; i < nclients; i++)
+            fds[nfds++] = (struct pollfd) { .fd = clients[i], .events = POLLIN };
+        for (int i = 0; i < nmeters; i++)
+            if (meters[i].master >= 0)
+                fds[nfds++] = (struct pollfd) { .fd = meters[i].master, .events = POLLIN };
+
+        if (poll(fds, nfds, (int) wait) <= 0)
+            continue;
+
+        int k = 0;
+
+        if (listen_fd >= 0 && (fds[k++].revents & POLLIN))
+        {
+            int fd = modbus_tcp_accept(tcp, &listen_fd);
+
+            if (fd >= 0 && nclients < SIM_MAX_CLIENTS)
+                clients[nclients++] = fd;
+            else if (fd >= 0)
+                close(fd);
+        }
+
+        for (int i = 0; i < nclients; i++, k++)
+        {
+            uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+            int rc;
+
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            modbus_set_socket(tcp, clients[i]);
+            rc = modbus_receive(tcp, req);
+
+            if (rc > 0)
+            {
+                // MBAP header, then the unit id
+                int unit = req[6];
+                sim_request(tcp, clients[i], (unit >= 1 && unit <= nmeters) ? by_id[unit] : NULL, req, rc);
+            }
+            else if (rc < 0)
+            {
+                sim_drop_client(clients[i]);
+                clients[i] = -1;
+            }
+        }
+
+        // compact the closed clients after the loop, the poll indexes follow them
+        for (int i = 0; i < nclients; )
+        {
+            if (clients[i] < 0)
+                clients[i] = clients[--nclients];
+            else
+                i++;
+        }
+
+        for (int i = 0; i < nmeters; i++)
+        {
+            uint8_t req[MODBUS_RTU_MAX_ADU_LENGTH];
+            int rc;
+
+            if (meters[i].master < 0)
+                continue;
+
+            if (!(fds[k++].revents & POLLIN))
+                continue;
+
+            rc = modbus_receive(meters[i].rtu, req);
+            if (rc > 0)
+                sim_request(meters[i].rtu, -1, &meters[i], req, rc);
+            else if (rc < 0)
+                modbus_flush(meters[i].rtu);
+        }
+    }
+
+    printf("\n%lu requests, %lu replies, %lu dropped, %lu corrupted, %lu over the queue\n",
+        requests, replies, dropped, corrupted, overflow);
+
+    for (int i = 0; i < nclients; i++)
+        close(clients[i]);
+
+    if (tcp != NULL)
+    {
+        if (listen_fd >= 0)
+            close(listen_fd);
+        modbus_free(tcp);
+    }
+
+    for (int i = 0; i < nmeters; i++)
+    {
+        sim_meter* m = &meters[i];
+
+        if (m->link[0])
+            unlink(m->link);
+        if (m->rtu != NULL)
+            modbus_free(m->rtu);
+        if (m->master >= 0)
+            close(m->master);
+        if (m->slave >= 0)
+            close(m->slave);
+        modbus_mapping_free(m->map);
+    }
+
+    return 0;
+}
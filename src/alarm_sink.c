@@ -0,0 +1,418 @@
+/**
+ * @file alarm_sink.c
+ * @author longdh
+ * @brief threshold / rate alarms raised in the stream, published on a
+ *        dedicated MQTT topic
+ * @version 0.1
+ * @date 2024-01-31
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * The task reads the bus itself (the urgent lane is drained first), so an
+ * event goes out as soon as the sample that raised it is read, not after the
+ * sinks have shipped it. The rules are compiled once by alarm_sink_add_rule(),
+ * a sample costs a hashtable lookup of its meter and one compare per rule.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "cjson/cJSON.h"
+
+#include "alarm_sink.h"
+#include "utils/ng_mqtt.h"
+#include "utils/encoder.h"
+#include "utils/message.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+#include "meter/regmap.h"
+
+//FIXME
+extern char* strdup(const char*);
+
+#define ALARM_MAX_EVENTS    RULES_MAX
+
+/**
+ * @brief rule state of a meter / topic, created on its first sample
+ *
+ * @param cfg
+ * @param key
+ * @param meter_id
+ * @return rules_series*, NULL => too many sources
+ */
+static rules_series* alarm_series(alarm_sink_config* cfg, char* key, uint32_t meter_id)
+{
+    rules_series* s = (rules_series*) hashtable_lookup(cfg->series, key);
+
+    if (s != NULL)
+        return s;
+
+    if (cfg->nseries >= ALARM_MAX_SOURCES)
+        return NULL;
+
+    s = (rules_series*) calloc(1, sizeof(rules_series));
+    if (s == NULL)
+        return NULL;
+
+    s->meter_id = meter_id;
+    hashtable_add(cfg->series, key, s, 0);
+    cfg->all[cfg->nseries++] = s;
+
+    return s;
+}
+
+/**
+ * @brief keep an event until it is published, the oldest one is dropped
+ *        when the queue is full
+ *
+ * @param cfg
+ * @param payload
+ * @param len
+ */
+static void alarm_queue(alarm_sink_config* cfg, const char* payload, int len)
+{
+    if (cfg->npending == ALARM_MAX_PENDING)
+    {
+        cfg->phead = (cfg->phead + 1) % ALARM_MAX_PENDING;
+        cfg->npending--;
+
+        if ((cfg->failed++ % 100) == 0)
+            log_message(LOG_WARNING, "alarm-sink: %s, %lu events dropped\n",
+                conn_state_str(conn_state_get(&cfg->conn)), cfg->failed);
+    }
+
+    int slot = (cfg->phead + cfg->npending) % ALARM_MAX_PENDING;
+
+    memcpy(cfg->pending[slot], payload, len);
+    cfg->pending_len[slot] = len;
+    cfg->tries[slot] = 0;
+    cfg->npending++;
+}
+
+/**
+ * @brief publish the queued events while the broker is connected, an event
+ *        failing ALARM_MAX_TRIES times is dropped
+ *
+ * @param cfg
+ */
+static void alarm_flush(alarm_sink_config* cfg)
+{
+    while (cfg->npending > 0 && conn_state_get(&cfg->conn) == CONN_CONNECTED)
+    {
+        int slot = cfg->phead;
+
+        if (0 != ng_mqtt_publish(cfg->sock, cfg->topic, (const uint8_t*) cfg->pending[slot],
+                (uint32_t) cfg->pending_len[slot], (uint8_t) cfg->qos))
+        {
+            // tried again after the next sample / ALARM_RETRY_MS
+            if (++cfg->tries[slot] < ALARM_MAX_TRIES)
+                return;
+
+            cfg->failed++;
+            log_message(LOG_WARNING, "alarm-sink: event dropped after %d tries\n", ALARM_MAX_TRIES);
+        }
+
+        cfg->phead = (cfg->phead + 1) % ALARM_MAX_PENDING;
+        cfg->npending--;
+    }
+}
+
+/**
+ * @brief queue the events of a sample, published by alarm_flush()
+ *
+ * @param cfg
+ * @param source, meter id / topic
+ * @param ts
+ * @param ev
+ * @param n
+ */
+static void alarm_publish(alarm_sink_config* cfg, const char* source, uint64_t ts, const rule_event* ev, int n)
+{
+    char payload[ALARM_PAYLOAD_LEN];
+    char rule[RULES_NAME_LEN * 6 + 3];
+    char meter[256];
+
+    // a topic may hold quotes / control characters
+    if (encode_json_string(source, meter, sizeof(meter)) < 0)
+        return;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (encode_json_string(cfg->program.name[ev[i].rule], rule, sizeof(rule)) < 0)
+            continue;
+
+        int len = snprintf(payload, sizeof(payload),
+            "{\"rule\":%s,\"meter\":%s,\"state\":\"%s\",\"value\":%.6g,\"ts\":%llu}",
+            rule, meter, ev[i].raised ? "raised" : "cleared",
+            ev[i].value, (unsigned long long) ts);
+
+        if (len >= (int) sizeof(payload))
+            continue;
+
+        log_message(LOG_WARNING, "alarm: %s\n", payload);
+
+        cfg->events++;
+        alarm_queue(cfg, payload, len);
+    }
+}
+
+/**
+ * @brief run the rules on a bus sample / DataLog message
+ *
+ * @param cfg
+ * @param data
+ * @param datalen
+ */
+static void alarm_feed(alarm_sink_config* cfg, const void* data, int datalen)
+{
+    rules_program* p = &cfg->program;
+    const char* names[METER_SAMPLE_MAX];
+    double values[METER_SAMPLE_MAX];
+    double fv[RULES_MAX_FIELDS];
+    rule_event ev[ALARM_MAX_EVENTS];
+    rules_series* s;
+    uint32_t meter_id = 0;
+    uint64_t ts = 0;
+    char key[128];
+    int n;
+
+    if (datalen == sizeof(struct Message))
+    {
+        // DataLog JSON of the mqtt source, the fields are looked up by name
+        const struct Message* msg = (const struct Message*) data;
+        char text[sizeof(msg->data) + 1];
+        int len = msg->datalen;
+        cJSON* root;
+
+        if (len < 0 || len > (int) sizeof(msg->data))
+            return;
+
+        memcpy(text, msg->data, len);
+        text[len] = '\0';
+
+        if ((root = cJSON_Parse(text)) == NULL)
+            return;
+
+        for (int f = 0; f < p->nfields; f++)
+        {
+            const cJSON* item = cJSON_GetObjectItemCaseSensitive(root, p->field[f]);
+            fv[f] = cJSON_IsNumber(item) ? item->valuedouble : NAN;
+        }
+        cJSON_Delete(root);
+
+        snprintf(key, sizeof(key), "%s", msg->source_topic);
+    }
+    else
+    {
+        const int8_t* slot;
+
+        if ((n = bus_data_values(data, datalen, &meter_id, &ts, names, values)) <= 0)
+            return;
+
+        if ((slot = rules_bind(p, rules_layout(data, datalen), names, n)) == NULL)
+            return;
+
+        rules_gather(p, slot, values, fv);
+
+        sprintf(key, "%u", meter_id);
+    }
+
+    if (ts == 0)
+    {
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        ts = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+
+    if ((s = alarm_series(cfg, key, meter_id)) == NULL)
+        return;
+
+    if ((n = rules_eval(p, s, ts, fv, ev, ALARM_MAX_EVENTS)) > 0)
+        alarm_publish(cfg, key, ts, ev, n);
+}
+
+/**
+ * @brief bus reader thread
+ *
+ * @param arg
+ * @return void*
+ */
+static void* alarm_sink_task(void* arg)
+{
+    alarm_sink_config* cfg = (alarm_sink_config*) arg;
+    char addr[256];
+
+    snprintf(addr, sizeof(addr), "mqtt-tcp://%s:%d", cfg->host, cfg->port);
+
+    // does not block, the readiness is published to cfg->conn
+    if (ng_mqtt_connect(&cfg->sock, &cfg->dialer, &cfg->conn, addr,
+            cfg->client_id, cfg->username, cfg->password, false) != 0)
+    {
+        conn_state_set(&cfg->conn, CONN_CLOSED);
+        exit(ESVRERR);
+    }
+
+    while (1)
+    {
+        void* data;
+        int datalen;
+        int rc;
+
+        // wake up to retry the events left while the broker was away
+        if (cfg->npending > 0)
+            rc = bus_read_timeout(cfg->br, &data, &datalen, ALARM_RETRY_MS);
+        else
+            rc = bus_read(cfg->br, &data, &datalen);
+
+        if (0 == rc)
+        {
+            alarm_feed(cfg, data, datalen);
+            bus_free(data);
+        }
+
+        // the events of this sample at once, then what is left
+        alarm_flush(cfg);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Init alarm task, the rules are added before alarm_sink_run()
+ *
+ * @param cfg
+ * @param b
+ * @param host
+ * @param port
+ * @param username
+ * @param password
+ * @param client_id
+ * @param topic, of the events
+ * @return int
+ */
+int alarm_sink_init(alarm_sink_config* cfg, Bus* b, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic)
+{
+    memset(cfg, 0, sizeof(alarm_sink_config));
+
+    cfg->b = b;
+    create_bus_reader(&cfg->br, cfg->b);
+
+    if (host != NULL)
+        cfg->host = strdup(host);
+
+    cfg->port = port;
+    if (username != NULL)
+        cfg->username = strdup(username);
+
+    if (password != NULL)
+        cfg->password = strdup(password);
+
+    cfg->topic = strdup(topic != NULL ? topic : "alarms");
+
+    if (client_id != NULL)
+        cfg->client_id = strdup(client_id);
+    else
+    {
+        char id[128];
+        sprintf(id, "alarm_%lu", (unsigned long) time(NULL));
+
+        cfg->client_id = strdup(id);
+    }
+
+    conn_state_init(&cfg->conn, "alarm-sink");
+
+    cfg->series = hashtable_create(ALARM_MAX_SOURCES, false);
+    if (cfg->series == NULL)
+        return ESYSERR;
+
+    return ENOERR;
+}
+
+/**
+ * @brief compile a rule
+ *
+ * @param cfg
+ * @param name
+ * @param expr, "voltage > 253", "rate(power) > 500", "bms_event_1 != 0"
+ * @param clear, hysteresis level, NULL => none
+ * @param debounce, consecutive samples
+ * @return int
+ */
+int alarm_sink_add_rule(alarm_sink_config* cfg, const char* name, const char* expr, const double* clear, int debounce)
+{
+    return rules_compile(&cfg->program, name, expr, clear, debounce);
+}
+
+/**
+ * @brief Free task's data
+ *
+ * @param cfg
+ * @return int
+ */
+int alarm_sink_term(alarm_sink_config* cfg)
+{
+    if (cfg->events > 0)
+        log_message(LOG_INFO, "alarm-sink: %lu events, %lu dropped, %d pending\n", cfg->events, cfg->failed, cfg->npending);
+
+    for (int i = 0; i < cfg->nseries; i++)
+        free(cfg->all[i]);
+    cfg->nseries = 0;
+
+    if (cfg->series != NULL)
+        hashtable_release(cfg->series);
+
+    if (cfg->br != NULL)
+        close_bus_reader(cfg->br);
+
+    if (cfg->host != NULL)
+        free(cfg->host);
+
+    if (cfg->username != NULL)
+        free(cfg->username);
+
+    if (cfg->password != NULL)
+        free(cfg->password);
+
+    if (cfg->client_id != NULL)
+        free(cfg->client_id);
+
+    if (cfg->topic != NULL)
+        free(cfg->topic);
+
+    conn_state_destroy(&cfg->conn);
+
+    return 0;
+}
+
+/**
+ * @brief Do the task
+ *
+ * @param cfg
+ * @return int
+ */
+int alarm_sink_run(alarm_sink_config* cfg)
+{
+    if (cfg->program.ninsn == 0)
+    {
+        log_message(LOG_WARNING, "alarm-sink: no rules\n");
+        return EGENERR;
+    }
+
+    return
+        pthread_create(&cfg->task_thread, NULL, alarm_sink_task, cfg);
+}
+
+/**
+ * @brief Wait until end
+ *
+ * @param cfg
+ * @return int
+ */
+int alarm_sink_wait(alarm_sink_config* cfg)
+{
+    return
+        pthread_join(cfg->task_thread, NULL);
+}
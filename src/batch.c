@@ -0,0 +1,416 @@
+/**
+ * @file batch.c
+ * @author longdh
+ * @brief pack many samples into one payload (per topic)
+ * @version 0.1
+ * @date 2024-01-08
+ * 
+ * @copyright Copyright (c) 2023
+ * 
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "utils/batch.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+#define BATCH_TABLE_SIZE    64
+
+/**
+ * @brief monotonic clock in ms
+ * 
+ * @return int64_t 
+ */
+int64_t batch_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief "json" / "binary"
+ * 
+ * @param s 
+ * @return int 
+ */
+int batch_format_from_string(const char* s)
+{
+    if (s != NULL && 0 == strcasecmp(s, "binary"))
+        return BATCH_FMT_BINARY;
+
+    return BATCH_FMT_JSON;
+}
+
+/**
+ * @brief append raw bytes, grow the buffer if needed
+ * 
+ * @param bt 
+ * @param data 
+ * @param len 
+ * @return int 
+ */
+static int batch_append(batch_t* bt, const void* data, size_t len)
+{
+    if (bt->len + len > bt->cap)
+    {
+        size_t cap = bt->cap ? bt->cap : 1024;
+        while (cap < bt->len + len)
+            cap *= 2;
+
+        char* buf = (char*) realloc(bt->buf, cap);
+        if (buf == NULL)
+            return ESYSERR;
+
+        bt->buf = buf;
+        bt->cap = cap;
+    }
+
+    memcpy(bt->buf + bt->len, data, len);
+    bt->len += len;
+
+    return ENOERR;
+}
+
+/**
+ * @brief start an empty batch
+ * 
+ * @param b 
+ * @param bt 
+ */
+static void batch_reset(batcher_t* b, batch_t* bt)
+{
+    bt->len = 0;
+    bt->count = 0;
+    bt->first_ms = 0;
+    bt->first_seq = 0;
+
+    if (b->fmt == BATCH_FMT_BINARY)
+    {
+        const char hdr[BATCH_FRAME_HDR_SIZE] = { BATCH_FRAME_MAGIC0, BATCH_FRAME_MAGIC1, BATCH_FRAME_VERSION, 0, 0, 0 };
+        batch_append(bt, hdr, sizeof(hdr));
+    }
+    else
+    {
+        batch_append(bt, "[", 1);
+    }
+}
+
+/**
+ * @brief finish and publish one batch
+ * 
+ * @param b 
+ * @param topic 
+ * @param bt 
+ * @return int 
+ */
+static int batch_flush(batcher_t* b, const char* topic, batch_t* bt)
+{
+    int rc = ENOERR;
+
+    if (bt->count == 0)
+        return ENOERR;
+
+    if (b->fmt == BATCH_FMT_BINARY)
+    {
+        bt->buf[4] = (char) ((bt->count >> 8) & 0xFF);
+        bt->buf[5] = (char) (bt->count & 0xFF);
+    }
+    else
+    {
+        batch_append(bt, "]", 1);
+    }
+
+    rc = b->publish(b->ctx, topic, bt->buf, bt->len, bt->first_seq);
+
+    batch_reset(b, bt);
+
+    return rc;
+}
+
+/**
+ * @brief Init the batcher, max_count <= 1 and max_ms <= 0 disable batching
+ * 
+ * @param b 
+ * @param max_count 
+ * @param max_ms 
+ * @param fmt 
+ * @param publish 
+ * @param ctx 
+ * @return int 
+ */
+int batcher_init(batcher_t* b, int max_count, int max_ms, batch_format fmt, batch_publish_fn publish, void* ctx)
+{
+    memset(b, 0, sizeof(batcher_t));
+
+    b->max_count = max_count;
+    b->max_ms = max_ms;
+    b->fmt = fmt;
+    b->publish = publish;
+    b->ctx = ctx;
+
+    if (!batcher_enabled(b))
+        return ENOERR;
+
+    // a batch without count limit is bounded by the frame size
+    if (b->max_count <= 1)
+        b->max_count = 0xFFFF;
+
+    b->batches = hashtable_create(BATCH_TABLE_SIZE, false);
+    if (b->batches == NULL)
+        return ESYSERR;
+
+    return ENOERR;
+}
+
+/**
+ * @brief 
+ * 
+ * @param b 
+ * @return int 
+ */
+int batcher_enabled(const batcher_t* b)
+{
+    return (b->max_count > 1) || (b->max_ms > 0);
+}
+
+/**
+ * @brief add one item to the batch of the topic, publish directly if batching is off
+ * 
+ * @param b 
+ * @param topic 
+ * @param item 
+ * @param len 
+ * @param seq, in the log, 0 => none
+ * @return int 
+ */
+int batcher_add(batcher_t* b, const char* topic, const void* item, size_t len, uint64_t seq)
+{
+    if (!batcher_enabled(b))
+        return b->publish(b->ctx, topic, item, len, seq);
+
+    if (len > 0xFFFF)
+    {
+        log_message(LOG_ERR, "batch: item too large (%zu)\n", len);
+        return EGENERR;
+    }
+
+    batch_t* bt = (batch_t*) hashtable_lookup(b->batches, (char*) topic);
+    if (bt == NULL)
+    {
+        bt = (batch_t*) calloc(1, sizeof(batch_t));
+        if (bt == NULL)
+            return ESYSERR;
+
+        bt->topic = strdup(topic);
+        if (bt->topic == NULL || hashtable_add(b->batches, (char*) topic, bt, 0) != 0)
+        {
+            free(bt->topic);
+            free(bt);
+            return ESYSERR;
+        }
+
+        batch_reset(b, bt);
+        bt->next = b->list;
+        b->list = bt;
+    }
+
+    // keep the payload bounded
+    if (bt->len + len + 3 > BATCH_MAX_PAYLOAD)
+        batch_flush(b, topic, bt);
+
+    if (b->fmt == BATCH_FMT_BINARY)
+    {
+        uint8_t l[2] = { (uint8_t) (len >> 8), (uint8_t) (len & 0xFF) };
+        batch_append(bt, l, sizeof(l));
+    }
+    else if (bt->count > 0)
+    {
+        batch_append(bt, ",", 1);
+    }
+
+    if (batch_append(bt, item, len) != ENOERR)
+        return ESYSERR;
+
+    if (bt->count++ == 0)
+    {
+        bt->first_ms = batch_now_ms();
+        bt->first_seq = seq;
+    }
+
+    if (bt->count >= b->max_count)
+        return batch_flush(b, topic, bt);
+
+    return ENOERR;
+}
+
+/**
+ * @brief flush batches older than max_ms
+ * 
+ * @param b 
+ * @return int, number of published batches
+ */
+int batcher_flush_due(batcher_t* b)
+{
+    int flushed = 0;
+
+    if (!batcher_enabled(b) || b->max_ms <= 0)
+        return 0;
+
+    int64_t now = batch_now_ms();
+
+    for (batch_t* bt = b->list; bt; bt = bt->next)
+    {
+        if (bt->count > 0 && (now - bt->first_ms) >= b->max_ms)
+        {
+            batch_flush(b, bt->topic, bt);
+            flushed++;
+        }
+    }
+
+    return flushed;
+}
+
+/**
+ * @brief publish everything pending
+ * 
+ * @param b 
+ * @return int 
+ */
+int batcher_flush_all(batcher_t* b)
+{
+    int count = 0;
+
+    if (!batcher_enabled(b))
+        return 0;
+
+    for (batch_t* bt = b->list; bt; bt = bt->next)
+    {
+        batch_flush(b, bt->topic, bt);
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * @brief time until the oldest pending batch is due
+ * 
+ * @param b 
+ * @return int, ms, -1 => nothing pending (wait forever)
+ */
+int batcher_next_timeout(batcher_t* b)
+{
+    int64_t timeout = -1;
+
+    if (!batcher_enabled(b) || b->max_ms <= 0)
+        return -1;
+
+    int64_t now = batch_now_ms();
+
+    for (batch_t* bt = b->list; bt; bt = bt->next)
+    {
+        if (bt->count > 0)
+        {
+            int64_t left = bt->first_ms + b->max_ms - now;
+            if (left < 0) 
+                left = 0;
+
+            if (timeout < 0 || left < timeout)
+                timeout = left;
+        }
+    }
+
+    return (int) timeout;
+}
+
+/**
+ * @brief lowest log seq still waiting in a batch
+ * 
+ * @param b 
+ * @return uint64_t, 0 => none
+ */
+uint64_t batcher_held(batcher_t* b)
+{
+    uint64_t held = 0;
+
+    if (!batcher_enabled(b))
+        return 0;
+
+    for (batch_t* bt = b->list; bt; bt = bt->next)
+        if (bt->count > 0 && bt->first_seq != 0 && (held == 0 || bt->first_seq < held))
+            held = bt->first_seq;
+
+    return held;
+}
+
+/**
+ * @brief free the batches (pending data is dropped, flush first)
+ * 
+ * @param b 
+ */
+void batcher_term(batcher_t* b)
+{
+    if (b->batches == NULL)
+        return;
+
+    while (b->list)
+    {
+        batch_t* bt = b->list;
+        b->list = bt->next;
+
+        free(bt->topic);
+        free(bt->buf);
+        free(bt);
+    }
+
+    hashtable_release(b->batches);
+    b->batches = NULL;
+}
+
+/**
+ * @brief Expand "{topic}" (source topic) and "{meter}" (meter id) in a topic template
+ * 
+ * @param tmpl 
+ * @param src_topic 
+ * @param meter_id 
+ * @param out 
+ * @param size 
+ * @return int 
+ */
+int topic_template_expand(const char* tmpl, const char* src_topic, uint32_t meter_id, char* out, size_t size)
+{
+    size_t n = 0;
+
+    if (size == 0)
+        return EGENERR;
+
+    while (*tmpl && n + 1 < size)
+    {
+        if (0 == strncmp(tmpl, "{topic}", 7))
+        {
+            n += snprintf(out + n, size - n, "%s", src_topic ? src_topic : "");
+            tmpl += 7;
+        }
+        else if (0 == strncmp(tmpl, "{meter}", 7))
+        {
+            n += snprintf(out + n, size - n, "%u", meter_id);
+            tmpl += 7;
+        }
+        else
+        {
+            out[n++] = *tmpl++;
+        }
+    }
+
+    if (n >= size)
+        n = size - 1;
+    out[n] = '\0';
+
+    return ENOERR;
+}
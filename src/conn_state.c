@@ -0,0 +1,245 @@
+/**
+ * @file conn_state.c
+ * @author longdh
+ * @brief per-instance connection state machine with blocking readiness
+ * @version 0.1
+ * @date 2024-01-12
+ * 
+ * @copyright Copyright (c) 2023
+ * 
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "utils/conn_state.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+/**
+ * @brief absolute CLOCK_MONOTONIC deadline
+ * 
+ * @param ts 
+ * @param timeout_ms 
+ */
+static void deadline_after(struct timespec* ts, int timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * @brief Init the state (CONN_IDLE)
+ * 
+ * @param cs 
+ * @param name, for logging (not copied)
+ * @return int 
+ */
+int conn_state_init(conn_state* cs, const char* name)
+{
+    pthread_condattr_t attr;
+
+    memset(cs, 0, sizeof(conn_state));
+
+    cs->name = name;
+    cs->state = CONN_IDLE;
+
+    cs->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cs->efd < 0)
+        return ESYSERR;
+
+    pthread_mutex_init(&cs->lock, NULL);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cs->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return ENOERR;
+}
+
+/**
+ * @brief 
+ * 
+ * @param cs 
+ */
+void conn_state_destroy(conn_state* cs)
+{
+    if (cs->efd >= 0)
+        close(cs->efd);
+    cs->efd = -1;
+
+    pthread_mutex_destroy(&cs->lock);
+    pthread_cond_destroy(&cs->cond);
+}
+
+/**
+ * @brief Move to a new state, wake up waiters
+ * 
+ * @param cs 
+ * @param state 
+ */
+void conn_state_set(conn_state* cs, int state)
+{
+    uint64_t v;
+
+    pthread_mutex_lock(&cs->lock);
+
+    if (cs->state != state)
+    {
+        if (state == CONN_CONNECTED)
+        {
+            cs->generation++;
+
+            v = 1;
+            if (write(cs->efd, &v, sizeof(v)) < 0) { /* already signalled */ }
+        }
+        else if (cs->state == CONN_CONNECTED)
+        {
+            // drain
+            if (read(cs->efd, &v, sizeof(v)) < 0) { /* not signalled */ }
+        }
+
+        log_message(LOG_INFO, "%s: %s -> %s\n", cs->name ? cs->name : "conn", 
+            conn_state_str(cs->state), conn_state_str(state));
+
+        cs->state = state;
+        pthread_cond_broadcast(&cs->cond);
+    }
+
+    pthread_mutex_unlock(&cs->lock);
+}
+
+/**
+ * @brief 
+ * 
+ * @param cs 
+ * @return int 
+ */
+int conn_state_get(conn_state* cs)
+{
+    int state;
+
+    pthread_mutex_lock(&cs->lock);
+    state = cs->state;
+    pthread_mutex_unlock(&cs->lock);
+
+    return state;
+}
+
+/**
+ * @brief eventfd readable while the client is connected (poll/epoll)
+ * 
+ * @param cs 
+ * @return int 
+ */
+int conn_state_fd(conn_state* cs)
+{
+    return cs->efd;
+}
+
+/**
+ * @brief Block until the state is reached (or CONN_CLOSED)
+ * 
+ * @param cs 
+ * @param state 
+ * @param timeout_ms, < 0 => forever
+ * @return int ENOERR, EQTIMEDOUT, EGENERR => closed
+ */
+int conn_state_wait(conn_state* cs, int state, int timeout_ms)
+{
+    struct timespec ts;
+    int rc = ENOERR;
+
+    if (timeout_ms >= 0)
+        deadline_after(&ts, timeout_ms);
+
+    pthread_mutex_lock(&cs->lock);
+
+    while (cs->state != state && cs->state != CONN_CLOSED)
+    {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&cs->cond, &cs->lock);
+        else if (pthread_cond_timedwait(&cs->cond, &cs->lock, &ts) == ETIMEDOUT)
+        {
+            rc = EQTIMEDOUT;
+            break;
+        }
+    }
+
+    if (rc == ENOERR && cs->state != state)
+        rc = EGENERR;
+
+    pthread_mutex_unlock(&cs->lock);
+
+    return rc;
+}
+
+/**
+ * @brief Wait until every client is connected, with one shared deadline
+ * 
+ * @param list 
+ * @param n 
+ * @param timeout_ms 
+ * @return int, number of clients not connected
+ */
+int conn_state_wait_all(conn_state** list, int n, int timeout_ms)
+{
+    struct timespec start, now;
+    int pending = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < n; i++)
+    {
+        int left = timeout_ms;
+
+        if (timeout_ms >= 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int spent = (int) ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+
+            left = spent >= timeout_ms ? 0 : timeout_ms - spent;
+        }
+
+        if (conn_state_wait(list[i], CONN_CONNECTED, left) != ENOERR)
+        {
+            log_message(LOG_WARNING, "%s: not connected (%s)\n", 
+                list[i]->name ? list[i]->name : "conn", conn_state_str(conn_state_get(list[i])));
+            pending++;
+        }
+    }
+
+    return pending;
+}
+
+/**
+ * @brief 
+ * 
+ * @param state 
+ * @return const char* 
+ */
+const char* conn_state_str(int state)
+{
+    switch (state)
+    {
+    case CONN_IDLE:         return "idle";
+    case CONN_CONNECTING:   return "connecting";
+    case CONN_CONNECTED:    return "connected";
+    case CONN_DISCONNECTED: return "disconnected";
+    case CONN_CLOSED:       return "closed";
+    default:                return "unknown";
+    }
+}
@@ -3,11 +3,270 @@
 #include "utils/logger.h"
 #include "utils/configuration.h"
 #include "utils/sbus.h"
+#include "utils/encoder.h"
+#include "utils/fanout.h"
+#include "utils/wal.h"
+#include "utils/conn_state.h"
+#include "utils/reactor.h"
+#include "utils/rt_sched.h"
+#include "meter/derive.h"
+
+//FIXME
+extern char* strdup(const char*);
 
 // queue 
 Bus   df_bus;
 #define URL "inproc://dfqueue"
 
+// connection of the started sinks, sources start once they are ready
+#define DF_MAX_CONNS                16
+#define DF_DEFAULT_STARTUP_TIMEOUT  10000   // ms
+
+static conn_state* df_conns[DF_MAX_CONNS];
+static int df_nconns = 0;
+
+/**
+ * @brief remember a sink connection, waited for before the sources start
+ * 
+ * @param conn 
+ */
+static void df_register_conn(conn_state* conn)
+{
+    if (df_nconns < DF_MAX_CONNS)
+        df_conns[df_nconns++] = conn;
+}
+
+/**
+ * @brief read the optional 'sched' group of a task:
+ *        sched = { policy = "fifo"; priority = 50; cpus = [ 1 ]; prefault_stack = 65536; };
+ * 
+ * @param task, setting of the task
+ * @param ts 
+ * @return int, 1 => present
+ */
+static int df_read_sched(config_setting_t* task, task_sched* ts)
+{
+    config_setting_t* s = config_setting_get_member(task, "sched");
+
+    task_sched_default(ts);
+    if (s == NULL)
+        return 0;
+
+    char* policy = read_string_setting(s, "policy", "other");
+    ts->policy = task_sched_policy_from_string(policy);
+    free(policy);
+
+    ts->priority = read_int_setting(s, "priority", 0);
+    ts->prefault_stack = (size_t) read_int_setting(s, "prefault_stack", 0);
+
+    config_setting_t* cpus = config_setting_get_member(s, "cpus");
+    if (cpus != NULL)
+    {
+        for (int i = 0; i < config_setting_length(cpus); i++)
+        {
+            int cpu = config_setting_get_int_elem(cpus, i);
+            if (cpu >= 0 && cpu < RT_MAX_CPUS)
+                ts->cpus |= (uint64_t) 1 << cpu;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief apply the 'sched' group of a task to its (running) thread
+ * 
+ * @param task 
+ * @param thread 
+ * @param name 
+ */
+static void df_sched_thread(config_setting_t* task, pthread_t thread, const char* name)
+{
+    task_sched ts;
+
+    if (df_read_sched(task, &ts))
+        task_sched_apply(thread, &ts, name);
+}
+
+// optional event loops shared by the sinks (reactor_threads > 0),
+// otherwise each sink runs its own thread
+#define DF_MAX_REACTORS             8
+
+static reactor_t df_reactors[DF_MAX_REACTORS];
+static int df_nreactors = 0;
+static int df_next = 0;
+
+/**
+ * @brief pick the reactor of the next sink (round robin)
+ * 
+ * @return reactor_t*, NULL => thread per sink
+ */
+static reactor_t* df_next_reactor()
+{
+    if (df_nreactors == 0)
+        return NULL;
+
+    return &df_reactors[df_next++ % df_nreactors];
+}
+
+// optional serialize-once stage between the bus and the sinks (fanout = 1)
+static fanout_t df_fanout;
+static int df_fanout_on = 0;
+
+/**
+ * @brief read a sink from the fan-out, before the sink runs
+ * 
+ * @param in 
+ * @param fmt, payload_format the sink asks for
+ * @param measurement, line protocol only
+ * @param name 
+ */
+static void df_use_fanout(sink_input* in, int fmt, const char* measurement, const char* name)
+{
+    // the log readers replay on their own
+    if (in->cur != NULL)
+        return;
+
+    if (df_fanout_on && ENOERR != sink_input_use_fanout(in, &df_fanout, fmt, measurement))
+        log_message(LOG_WARNING, "%s: fanout full, reading the bus\n", name);
+}
+
+// write-ahead log of the bus, see the 'wal' group
+static wal_t df_wal;
+static int df_wal_on = 0;
+
+/**
+ * @brief open the log and attach it to the bus, before the sinks init
+ * 
+ * @param cfg 
+ * @return int 
+ */
+static int df_wal_init(config_t* cfg)
+{
+    config_setting_t* wal = config_lookup(cfg, "wal");
+
+    if (wal == NULL)
+        return 0;
+
+    char* dir = (char*) read_string_setting(wal, "dir", "/var/lib/xmeterlogger/wal");
+    int segment_kb = read_int_setting(wal, "segment_kb", WAL_DEFAULT_SEGMENT_KB);
+    int commit_ms = read_int_setting(wal, "commit_ms", WAL_DEFAULT_COMMIT_MS);
+    int commit_kb = read_int_setting(wal, "commit_kb", WAL_DEFAULT_COMMIT_KB);
+    int max_mb = read_int_setting(wal, "max_mb", WAL_DEFAULT_MAX_MB);
+
+    if (ENOERR == wal_init(&df_wal, dir, segment_kb, commit_ms, commit_kb, max_mb))
+    {
+        bus_attach_wal(&df_bus, &df_wal);
+        wal_run(&df_wal);
+        df_wal_on = 1;
+    }
+    else
+        log_message(LOG_ERR, "wal: cannot open %s, the sinks read the bus\n", dir);
+
+    if (dir != NULL) free(dir);
+
+    return 0;
+}
+
+/**
+ * @brief sink with 'wal = 1': reads the log from its cursor instead of the
+ *        bus, what it had not delivered before a restart is sent again
+ * 
+ * @param setting, group of the sink
+ * @param in 
+ * @param name, also the cursor file name
+ */
+static void df_use_wal(config_setting_t* setting, sink_input* in, const char* name)
+{
+    if (!read_int_setting(setting, "wal", 0))
+        return;
+
+    if (!df_wal_on)
+    {
+        log_message(LOG_WARNING, "%s: wal = 1 but no 'wal' group, reading the bus\n", name);
+        return;
+    }
+
+    if (ENOERR != sink_input_use_wal(in, &df_wal, name))
+        log_message(LOG_WARNING, "%s: no log cursor, reading the bus\n", name);
+}
+
+/**
+ * @brief optional 'filter' group of a sink, the rest is dropped before the
+ *        sink copies it
+ * 
+ * @param setting, group of the sink
+ * @param in 
+ * @param name 
+ */
+static void df_read_filter(config_setting_t* setting, sink_input* in, const char* name)
+{
+    config_setting_t* fs = config_setting_get_member(setting, "filter");
+    const char* types = NULL;
+    const char* meters = NULL;
+    const char* topic = NULL;
+    bus_filter f;
+
+    if (fs == NULL)
+        return;
+
+    config_setting_lookup_string(fs, "types", &types);
+    config_setting_lookup_string(fs, "meters", &meters);
+    config_setting_lookup_string(fs, "topic", &topic);
+
+    if (ENOERR == bus_filter_from_string(&f, types, meters, topic))
+        sink_input_set_filter(in, &f);
+    else
+        log_message(LOG_ERR, "%s: bad filter, ignored\n", name);
+}
+
+/**
+ * @brief optional 'derived' list of a source:
+ *        derived = ( { name = "apparent_power"; expr = "sqrt(power * power + reactive_power * reactive_power)"; } );
+ * 
+ * @param setting, group of the source
+ * @param name 
+ * @return derive_program*, NULL => none
+ */
+static derive_program* df_read_derived(config_setting_t* setting, const char* name)
+{
+    config_setting_t* list = config_setting_get_member(setting, "derived");
+    int n = list ? config_setting_length(list) : 0;
+    derive_program* p;
+
+    if (n == 0)
+        return NULL;
+
+    p = (derive_program*) calloc(1, sizeof(derive_program));
+    if (p == NULL)
+        return NULL;
+
+    for (int i = 0; i < n; i++)
+    {
+        config_setting_t* d = config_setting_get_elem(list, i);
+        const char* out = NULL;
+        const char* expr = NULL;
+
+        if (!config_setting_lookup_string(d, "name", &out) || !config_setting_lookup_string(d, "expr", &expr))
+        {
+            log_message(LOG_ERR, "%s: derived %d needs 'name' and 'expr'\n", name, i);
+            continue;
+        }
+
+        derive_compile(p, out, expr);
+    }
+
+    if (p->nexprs == 0)
+    {
+        free(p);
+        return NULL;
+    }
+
+    log_message(LOG_INFO, "%s: %d derived field(s), %d instructions\n", name, p->nexprs, p->ncode);
+
+    return p;
+}
+
 #ifdef MOSQUITTO
 #include "mosquitto.h"
 #include "mosq_sink.h"
@@ -30,7 +289,40 @@ int mosq_sink_task_init(config_t* cfg)
         char* topic = (char*)read_string_setting(mosq_src, "topic", "lxd/BA31605780");
 
         mosq_sink_init(&mosq_sink_conf, &df_bus, host, port, username, password, clientid, topic);
-        mosq_sink_run(&mosq_sink_conf);
+
+        char* format = (char*)read_string_setting(mosq_src, "format", "json");
+        mosq_sink_conf.format = payload_format_from_string(format, ENC_JSON);
+        free(format);
+
+        // optional batching
+        char* batch_format = (char*)read_string_setting(mosq_src, "batch_format", "json");
+        mosq_sink_conf.batch_count = read_int_setting(mosq_src, "batch_count", 0);
+        mosq_sink_conf.batch_ms = read_int_setting(mosq_src, "batch_ms", 0);
+        mosq_sink_conf.batch_format = batch_format_from_string(batch_format);
+        free(batch_format);
+
+        const char* topic_template = NULL;
+        if (config_setting_lookup_string(mosq_src, "topic_template", &topic_template))
+            mosq_sink_conf.topic_template = strdup(topic_template);
+
+        df_read_filter(mosq_src, &mosq_sink_conf.in, "mosq-sink");
+
+        df_use_wal(mosq_src, &mosq_sink_conf.in, "mosq-sink");
+        df_use_fanout(&mosq_sink_conf.in, mosq_sink_format(&mosq_sink_conf), NULL, "mosq-sink");
+
+        reactor_t* r = df_next_reactor();
+        if (r != NULL && ENOERR != mosq_sink_attach(&mosq_sink_conf, r))
+        {
+            log_message(LOG_WARNING, "mosq-sink: reactor mode failed, own thread\n");
+            r = NULL;
+        }
+
+        if (r == NULL)
+        {
+            mosq_sink_run(&mosq_sink_conf);
+            df_sched_thread(mosq_src, mosq_sink_conf.task_thread, "mosq-sink");
+        }
+        df_register_conn(&mosq_sink_conf.conn);
 
     } 
     else 
@@ -63,10 +355,8 @@ int mosq_source_task_init(config_t* cfg)
         char* clientid = (char*)read_string_setting(mosq_src, "clientid", "sourcetaskcli-01");
         char* topic = (char*)read_string_setting(mosq_src, "topic", "lxp/BA31605780");
 
-        // init queue
-        init_bus(&df_bus, URL);
-
         mosq_source_init(&mosq_source_conf, &df_bus, host, port, username, password, clientid, topic);
+        mosq_source_conf.derive = df_read_derived(mosq_src, "mosq-src");
         mosq_source_run(&mosq_source_conf);
 
 
@@ -122,7 +412,25 @@ int influx_sink_task_init(config_t* cfg)
         printf("measurement: %s\n", measurement);
     
         influx_sink_init2(&influx_sink_conf, &df_bus, url, orgid, token, measurement);
-        influx_sink_run(&influx_sink_conf);
+        df_read_filter(influx_sink, &influx_sink_conf.in, "influx-sink");
+        df_use_wal(influx_sink, &influx_sink_conf.in, "influx-sink");
+        df_use_fanout(&influx_sink_conf.in, ENC_LINE, measurement, "influx-sink");
+
+        // only the reactor mode tracks the connection
+        reactor_t* r = df_next_reactor();
+        if (r != NULL && ENOERR != influx_sink_attach(&influx_sink_conf, r))
+        {
+            log_message(LOG_WARNING, "influx-sink: reactor mode failed, own thread\n");
+            r = NULL;
+        }
+
+        if (r != NULL)
+            df_register_conn(&influx_sink_conf.conn);
+        else
+        {
+            influx_sink_run(&influx_sink_conf);
+            df_sched_thread(influx_sink, influx_sink_conf.task_thread, "influx-sink");
+        }
 
     } else {
         fprintf(stderr, "The 'influx-sink' subsetting is missing.\n");
@@ -140,6 +448,304 @@ int influx_sink_task_cleanup()
 }
 #endif
 
+#ifdef MQTTC
+#include "mqttc_sink.h"
+
+mqttc_sync_config mqttc_sink_conf;
+int mqttc_sink_task_init(config_t* cfg)
+{
+    // Access the 'mqttc-sink' subsetting
+    config_setting_t* mqttc_sink = config_lookup(cfg, "mqttc-sink");
+
+    if (mqttc_sink != NULL) 
+    {
+        char* host = (char*)read_string_setting(mqttc_sink, "host", "103.161.39.186");
+        int port = read_int_setting(mqttc_sink, "port", 1883);
+        char* username = (char*)read_string_setting(mqttc_sink, "username", "lxdvinhnguyen01");
+        char* password = (char*)read_string_setting(mqttc_sink, "password", "lxd@123");
+        char* clientid = (char*)read_string_setting(mqttc_sink, "clientid", "sinktaskcli-01");
+        char* topic = (char*)read_string_setting(mqttc_sink, "topic", "lxd/BA31605780");
+
+        mqttc_sink_init(&mqttc_sink_conf, &df_bus, host, port, username, password, clientid, topic);
+        mqttc_sink_conf.qos = read_int_setting(mqttc_sink, "qos", MQTTC_DEFAULT_QOS);
+        mqttc_sink_conf.inflight = read_int_setting(mqttc_sink, "inflight", MQTTC_DEFAULT_INFLIGHT);
+
+        char* format = (char*)read_string_setting(mqttc_sink, "format", "json");
+        mqttc_sink_conf.format = payload_format_from_string(format, ENC_JSON);
+        free(format);
+
+        // optional batching
+        char* batch_format = (char*)read_string_setting(mqttc_sink, "batch_format", "json");
+        mqttc_sink_conf.batch_count = read_int_setting(mqttc_sink, "batch_count", 0);
+        mqttc_sink_conf.batch_ms = read_int_setting(mqttc_sink, "batch_ms", 0);
+        mqttc_sink_conf.batch_format = batch_format_from_string(batch_format);
+        free(batch_format);
+
+        const char* topic_template = NULL;
+        if (config_setting_lookup_string(mqttc_sink, "topic_template", &topic_template))
+            mqttc_sink_conf.topic_template = strdup(topic_template);
+
+        df_read_filter(mqttc_sink, &mqttc_sink_conf.in, "mqttc-sink");
+
+        df_use_wal(mqttc_sink, &mqttc_sink_conf.in, "mqttc-sink");
+        df_use_fanout(&mqttc_sink_conf.in, mqttc_sink_format(&mqttc_sink_conf), NULL, "mqttc-sink");
+
+        mqttc_sink_run(&mqttc_sink_conf);
+        df_sched_thread(mqttc_sink, mqttc_sink_conf.task_thread, "mqttc-sink");
+        df_register_conn(&mqttc_sink_conf.conn);
+
+        if (host != NULL) free(host);
+        if (username != NULL) free(username);
+        if (password != NULL) free(password);
+        if (clientid != NULL) free(clientid);
+        if (topic != NULL) free(topic);
+    } 
+    else 
+    {
+        log_message(LOG_ERR, "The 'mqttc-sink' subsetting is missing.\n");
+    }   
+
+    return 0;
+}
+
+int mqttc_sink_task_cleanup()
+{
+    mqttc_sink_wait(&mqttc_sink_conf);
+    mqttc_sink_term(&mqttc_sink_conf);
+
+    return 0;
+}
+#endif // MQTTC
+
+#ifdef KAFKA
+#include "kafka_sink.h"
+
+kafka_sync_config kafka_sink_conf;
+int kafka_sink_task_init(config_t* cfg)
+{
+    // Access the 'kafka-sink' subsetting
+    config_setting_t* kafka_sink = config_lookup(cfg, "kafka-sink");
+
+    if (kafka_sink != NULL) 
+    {
+        char* host = (char*)read_string_setting(kafka_sink, "host", "103.161.39.186");
+        int port = read_int_setting(kafka_sink, "port", 9092);
+        char* username = (char*)read_string_setting(kafka_sink, "username", "");
+        char* password = (char*)read_string_setting(kafka_sink, "password", "");
+        char* clientid = (char*)read_string_setting(kafka_sink, "clientid", "sinktaskcli-01");
+        char* topic = (char*)read_string_setting(kafka_sink, "topic", "lxdb_BA31605780");
+        char* format = (char*)read_string_setting(kafka_sink, "format", "json");
+
+        kafka_sink_init(&kafka_sink_conf, &df_bus, host, port, username, password, clientid, topic);
+        kafka_sink_conf.format = payload_format_from_string(format, ENC_JSON);
+        df_read_filter(kafka_sink, &kafka_sink_conf.in, "kafka-sink");
+        df_use_wal(kafka_sink, &kafka_sink_conf.in, "kafka-sink");
+        df_use_fanout(&kafka_sink_conf.in, kafka_sink_conf.format, NULL, "kafka-sink");
+
+        reactor_t* r = df_next_reactor();
+        if (r != NULL && ENOERR != kafka_sink_attach(&kafka_sink_conf, r))
+        {
+            log_message(LOG_WARNING, "kafka-sink: reactor mode failed, own thread\n");
+            r = NULL;
+        }
+
+        if (r == NULL)
+        {
+            kafka_sink_run(&kafka_sink_conf);
+            df_sched_thread(kafka_sink, kafka_sink_conf.task_thread, "kafka-sink");
+        }
+        df_register_conn(&kafka_sink_conf.conn);
+
+        if (host != NULL) free(host);
+        if (username != NULL) free(username);
+        if (password != NULL) free(password);
+        if (clientid != NULL) free(clientid);
+        if (topic != NULL) free(topic);
+        if (format != NULL) free(format);
+    } 
+    else 
+    {
+        log_message(LOG_ERR, "The 'kafka-sink' subsetting is missing.\n");
+    }   
+
+    return 0;
+}
+
+int kafka_sink_task_cleanup()
+{
+    kafka_sink_wait(&kafka_sink_conf);
+    kafka_sink_term(&kafka_sink_conf);
+
+    return 0;
+}
+#endif // KAFKA
+
+#ifdef NATS
+#include "nats_sink.h"
+
+nats_sync_config nats_sink_conf;
+int nats_sink_task_init(config_t* cfg)
+{
+    // Access the 'nats-sink' subsetting
+    config_setting_t* nats_sink = config_lookup(cfg, "nats-sink");
+
+    if (nats_sink != NULL) 
+    {
+        char* host = (char*)read_string_setting(nats_sink, "host", "103.161.39.186");
+        int port = read_int_setting(nats_sink, "port", 4222);
+        char* username = (char*)read_string_setting(nats_sink, "username", "");
+        char* password = (char*)read_string_setting(nats_sink, "password", "");
+        char* clientid = (char*)read_string_setting(nats_sink, "clientid", "sinktaskcli-01");
+        char* topic = (char*)read_string_setting(nats_sink, "topic", "lxdb.BA31605780");
+        char* format = (char*)read_string_setting(nats_sink, "format", "json");
+
+        nats_sink_init(&nats_sink_conf, &df_bus, host, port, username, password, clientid, topic);
+        nats_sink_conf.format = payload_format_from_string(format, ENC_JSON);
+        df_read_filter(nats_sink, &nats_sink_conf.in, "nats-sink");
+        df_use_wal(nats_sink, &nats_sink_conf.in, "nats-sink");
+        df_use_fanout(&nats_sink_conf.in, nats_sink_conf.format, NULL, "nats-sink");
+
+        reactor_t* r = df_next_reactor();
+        if (r != NULL && ENOERR != nats_sink_attach(&nats_sink_conf, r))
+        {
+            log_message(LOG_WARNING, "nats-sink: reactor mode failed, own thread\n");
+            r = NULL;
+        }
+
+        if (r == NULL)
+        {
+            nats_sink_run(&nats_sink_conf);
+            df_sched_thread(nats_sink, nats_sink_conf.task_thread, "nats-sink");
+        }
+        df_register_conn(&nats_sink_conf.conn);
+
+        if (host != NULL) free(host);
+        if (username != NULL) free(username);
+        if (password != NULL) free(password);
+        if (clientid != NULL) free(clientid);
+        if (topic != NULL) free(topic);
+        if (format != NULL) free(format);
+    } 
+    else 
+    {
+        log_message(LOG_ERR, "The 'nats-sink' subsetting is missing.\n");
+    }   
+
+    return 0;
+}
+
+int nats_sink_task_cleanup()
+{
+    nats_sink_wait(&nats_sink_conf);
+    nats_sink_term(&nats_sink_conf);
+
+    return 0;
+}
+#endif // NATS
+
+#ifdef REDIS
+#include "redis_sink.h"
+
+redis_sync_config redis_sink_conf;
+int redis_sink_task_init(config_t* cfg)
+{
+    // Access the 'redis-sink' subsetting
+    config_setting_t* redis_sink = config_lookup(cfg, "redis-sink");
+
+    if (redis_sink != NULL) 
+    {
+        char* host = (char*)read_string_setting(redis_sink, "host", "103.161.39.186");
+        int port = read_int_setting(redis_sink, "port", 6379);
+        char* username = (char*)read_string_setting(redis_sink, "username", "");
+        char* password = (char*)read_string_setting(redis_sink, "password", "");
+        char* clientid = (char*)read_string_setting(redis_sink, "clientid", "sinktaskcli-01");
+        char* key = (char*)read_string_setting(redis_sink, "key", "lxdb_BA31605780");
+        char* format = (char*)read_string_setting(redis_sink, "format", "json");
+
+        redis_sink_init(&redis_sink_conf, &df_bus, host, port, username, password, clientid, key);
+        redis_sink_conf.format = payload_format_from_string(format, ENC_JSON);
+        df_read_filter(redis_sink, &redis_sink_conf.in, "redis-sink");
+        df_use_wal(redis_sink, &redis_sink_conf.in, "redis-sink");
+        df_use_fanout(&redis_sink_conf.in, redis_sink_conf.format, NULL, "redis-sink");
+
+        reactor_t* r = df_next_reactor();
+        if (r != NULL && ENOERR != redis_sink_attach(&redis_sink_conf, r))
+        {
+            log_message(LOG_WARNING, "redis-sink: reactor mode failed, own thread\n");
+            r = NULL;
+        }
+
+        if (r == NULL)
+        {
+            redis_sink_run(&redis_sink_conf);
+            df_sched_thread(redis_sink, redis_sink_conf.task_thread, "redis-sink");
+        }
+        df_register_conn(&redis_sink_conf.conn);
+
+        if (host != NULL) free(host);
+        if (username != NULL) free(username);
+        if (password != NULL) free(password);
+        if (clientid != NULL) free(clientid);
+        if (key != NULL) free(key);
+        if (format != NULL) free(format);
+    } 
+    else 
+    {
+        log_message(LOG_ERR, "The 'redis-sink' subsetting is missing.\n");
+    }   
+
+    return 0;
+}
+
+int redis_sink_task_cleanup()
+{
+    redis_sink_wait(&redis_sink_conf);
+    redis_sink_term(&redis_sink_conf);
+
+    return 0;
+}
+#endif // REDIS
+
+#ifdef TSDB
+#include "tsdb_sink.h"
+
+tsdb_sink_config tsdb_sink_conf;
+int tsdb_sink_task_init(config_t* cfg)
+{
+    config_setting_t* tsdb_sink = config_lookup(cfg, "tsdb-sink");
+
+    if (tsdb_sink != NULL) 
+    {
+        char* dir = (char*) read_string_setting(tsdb_sink, "dir", "/var/lib/xmeterlogger/tsdb");
+        int chunk_points = read_int_setting(tsdb_sink, "chunk_points", 120);
+        int flush_s = read_int_setting(tsdb_sink, "flush_s", 0);
+        int sync = read_int_setting(tsdb_sink, "sync", 0);
+
+        if (ENOERR == tsdb_sink_init(&tsdb_sink_conf, &df_bus, dir, chunk_points, flush_s, sync))
+        {
+            tsdb_sink_run(&tsdb_sink_conf);
+            df_sched_thread(tsdb_sink, tsdb_sink_conf.task_thread, "tsdb-sink");
+        }
+
+        if (dir != NULL) free(dir);
+    } 
+    else 
+    {
+        log_message(LOG_ERR, "The 'tsdb-sink' subsetting is missing.\n");
+    }   
+
+    return 0;
+}
+
+int tsdb_sink_task_cleanup()
+{
+    tsdb_sink_wait(&tsdb_sink_conf);
+    tsdb_sink_term(&tsdb_sink_conf);
+
+    return 0;
+}
+#endif // TSDB
+
 #ifdef MODBUSMS
 #include "modbus_src.h"
 
@@ -159,10 +765,86 @@ int modbus_source_task_init(config_t* cfg)
         int stop_bit = read_int_setting(modbus_src, "stop_bit", (int) 1);
         int slave_id = read_int_setting(modbus_src, "slave_id", (int) 25);
 
-        // init queue
-        init_bus(&df_bus, URL);
-
         modbus_source_init(&modbus_source_conf, &df_bus, mtype, mb_type, NULL, 0, path, baud, (char) parity, data_bit, stop_bit, slave_id);
+
+        modbus_source_conf.poll_ms = read_int_setting(modbus_src, "poll_ms", 10000);
+        modbus_source_conf.poll_align = read_int_setting(modbus_src, "poll_align", 0);
+        modbus_source_conf.stats_polls = read_int_setting(modbus_src, "stats_polls", 0);
+        if (modbus_source_conf.poll_ms <= 0)
+            modbus_source_conf.poll_ms = 10000;
+
+        df_read_sched(modbus_src, &modbus_source_conf.sched);
+
+        // threshold rules, the matching samples overtake the bulk telemetry
+        const char* urgent = NULL;
+        if (config_setting_lookup_string(modbus_src, "urgent", &urgent))
+        {
+            prio_rules* rules = (prio_rules*) malloc(sizeof(prio_rules));
+
+            if (rules != NULL && ENOERR == prio_rules_parse(rules, urgent) && rules->nrules > 0)
+                modbus_source_conf.urgent = rules;
+            else
+                free(rules);
+        }
+
+        // generic driver, the register map of the device in its own file
+        const char* map_file = NULL;
+        if (config_setting_lookup_string(modbus_src, "register_map", &map_file))
+        {
+            static reg_map modbus_map;
+
+            if (ENOERR == regmap_load_file(&modbus_map, map_file) && regmap_register(&modbus_map) >= 0)
+            {
+                char* map_output = (char*) read_string_setting(modbus_src, "map_output", "sample");
+
+                modbus_source_conf.map = &modbus_map;
+                if (0 == strcmp(map_output, "meter"))
+                    modbus_source_conf.map_output = MAP_OUT_METER;
+                else if (0 == strcmp(map_output, "fixed"))
+                    modbus_source_conf.map_output = MAP_OUT_FIXED;
+                else
+                    modbus_source_conf.map_output = MAP_OUT_SAMPLE;
+                free(map_output);
+            }
+            else
+                log_message(LOG_ERR, "register map %s not usable, built-in meter %d\n", map_file, mtype);
+        }
+
+        // record the Modbus transactions, or replay a recording instead of the meter
+        const char* capture = NULL;
+        const char* replay = NULL;
+        if (config_setting_lookup_string(modbus_src, "capture", &capture))
+            modbus_source_conf.capture = strdup(capture);
+        if (config_setting_lookup_string(modbus_src, "replay", &replay))
+        {
+            modbus_source_conf.replay = strdup(replay);
+            modbus_source_conf.replay_loop = read_int_setting(modbus_src, "replay_loop", 0);
+            modbus_source_conf.replay_speed = 1.0;
+            config_setting_lookup_float(modbus_src, "replay_speed", &modbus_source_conf.replay_speed);
+        }
+
+        // derived fields, named after the source fields / map points
+        derive_program* derive = df_read_derived(modbus_src, "modbus-src");
+        if (derive != NULL)
+        {
+            const reg_map* base = (modbus_source_conf.map != NULL && modbus_source_conf.map_output != MAP_OUT_METER) ?
+                modbus_source_conf.map : NULL;
+            reg_map* map = (reg_map*) calloc(1, sizeof(reg_map));
+
+            if (map != NULL && ENOERR == derive_map_init(map, derive, base) && regmap_register(map) >= 0)
+            {
+                modbus_source_conf.derive = derive;
+                modbus_source_conf.derive_map = map;
+            }
+            else
+            {
+                if (map != NULL)
+                    regmap_free(map);
+                free(map);
+                free(derive);
+            }
+        }
+
         modbus_source_run(&modbus_source_conf);
 
 
@@ -186,29 +868,358 @@ int modbus_source_task_init(config_t* cfg)
 int modbus_source_task_cleanup()
 {
     modbus_source_wait(&modbus_source_conf);
+
+    if (modbus_source_conf.map != NULL)
+        regmap_free(modbus_source_conf.map);
     modbus_source_term(&modbus_source_conf);
 
     return 0;
 }
 #endif
 
+#include "ring_store.h"
+
+static ring_store_config ring_store_conf;
+static int ring_store_started = 0;
+
+/**
+ * @brief optional in-memory history of the meters with its HTTP query API
+ * 
+ * @param cfg 
+ * @return int 
+ */
+int ring_store_task_init(config_t* cfg)
+{
+    config_setting_t* ring = config_lookup(cfg, "ring-store");
+
+    if (ring == NULL)
+        return 0;
+
+    int capacity = read_int_setting(ring, "capacity", 360);
+    char* url = (char*) read_string_setting(ring, "url", "http://0.0.0.0:8088");
+    char* prefix = (char*) read_string_setting(ring, "prefix", "/api");
+
+    if (ENOERR == ring_store_init(&ring_store_conf, &df_bus, (uint32_t) capacity, url, prefix) &&
+        0 == ring_store_run(&ring_store_conf))
+    {
+        df_sched_thread(ring, ring_store_conf.task_thread, "ring-store");
+        ring_store_started = 1;
+    }
+    else
+        ring_store_term(&ring_store_conf);
+
+    free(url);
+    free(prefix);
+
+    return 0;
+}
+
+int ring_store_task_cleanup()
+{
+    if (!ring_store_started)
+        return 0;
+
+    ring_store_wait(&ring_store_conf);
+    ring_store_term(&ring_store_conf);
+    ring_store_started = 0;
+
+    return 0;
+}
+
+#include "alarm_sink.h"
+
+static alarm_sink_config alarm_sink_conf;
+static int alarm_sink_started = 0;
+
+/**
+ * @brief optional alarm rules on the bus samples, events on their own topic:
+ *        rules = ( { name = "overvoltage"; expr = "voltage > 253"; clear = 250.0; debounce = 3; } );
+ * 
+ * @param cfg 
+ * @return int 
+ */
+int alarm_sink_task_init(config_t* cfg)
+{
+    config_setting_t* alarm = config_lookup(cfg, "alarm-sink");
+
+    if (alarm == NULL)
+        return 0;
+
+    char* host = (char*) read_string_setting(alarm, "host", "103.161.39.186");
+    int port = read_int_setting(alarm, "port", 1883);
+    char* username = (char*) read_string_setting(alarm, "username", "lxdvinhnguyen01");
+    char* password = (char*) read_string_setting(alarm, "password", "lxd@123");
+    char* clientid = (char*) read_string_setting(alarm, "clientid", "alarmtaskcli-01");
+    char* topic = (char*) read_string_setting(alarm, "topic", "lxdb/BA31605780/alarms");
+    config_setting_t* rules = config_setting_get_member(alarm, "rules");
+    int nrules = rules ? config_setting_length(rules) : 0;
+
+    alarm_sink_init(&alarm_sink_conf, &df_bus, host, port, username, password, clientid, topic);
+    alarm_sink_conf.qos = read_int_setting(alarm, "qos", 1);
+
+    for (int i = 0; i < nrules; i++)
+    {
+        config_setting_t* rule = config_setting_get_elem(rules, i);
+        const char* name = NULL;
+        const char* expr = NULL;
+        double clear;
+        int debounce = 1;
+
+        if (!config_setting_lookup_string(rule, "expr", &expr))
+        {
+            log_message(LOG_ERR, "alarm-sink: rule %d has no 'expr'\n", i);
+            continue;
+        }
+
+        if (!config_setting_lookup_string(rule, "name", &name))
+            name = expr;
+
+        config_setting_lookup_int(rule, "debounce", &debounce);
+
+        alarm_sink_add_rule(&alarm_sink_conf, name, expr,
+            config_setting_lookup_float(rule, "clear", &clear) ? &clear : NULL, debounce);
+    }
+
+    if (0 == alarm_sink_run(&alarm_sink_conf))
+    {
+        df_sched_thread(alarm, alarm_sink_conf.task_thread, "alarm-sink");
+        df_register_conn(&alarm_sink_conf.conn);
+        alarm_sink_started = 1;
+    }
+    else
+        alarm_sink_term(&alarm_sink_conf);
+
+    free(host);
+    free(username);
+    free(password);
+    free(clientid);
+    free(topic);
+
+    return 0;
+}
+
+int alarm_sink_task_cleanup()
+{
+    if (!alarm_sink_started)
+        return 0;
+
+    alarm_sink_wait(&alarm_sink_conf);
+    alarm_sink_term(&alarm_sink_conf);
+    alarm_sink_started = 0;
+
+    return 0;
+}
+
+#include "site_agg.h"
+
+#define DF_MAX_SITES    4
+
+static site_agg_config site_agg_conf[DF_MAX_SITES];
+static int site_agg_count = 0;
+
+/**
+ * @brief optional site totals, a list of groups of meters:
+ *        site-agg = ( { name = "site"; site_id = 1000; meters = "1,2,3"; fields = "power"; tick_ms = 10000; } );
+ * 
+ * @param cfg 
+ * @return int 
+ */
+int site_agg_task_init(config_t* cfg)
+{
+    config_setting_t* sites = config_lookup(cfg, "site-agg");
+    int n = sites ? config_setting_length(sites) : 0;
+
+    for (int i = 0; i < n && site_agg_count < DF_MAX_SITES; i++)
+    {
+        config_setting_t* site = config_setting_get_elem(sites, i);
+        site_agg_config* sa = &site_agg_conf[site_agg_count];
+
+        char* name = (char*) read_string_setting(site, "name", "site");
+        char* meters = (char*) read_string_setting(site, "meters", "");
+        char* fields = (char*) read_string_setting(site, "fields", "power,import_active,export_active");
+        int site_id = read_int_setting(site, "site_id", 1000 + i);
+        int tick_ms = read_int_setting(site, "tick_ms", 10000);
+        int stale_ms = read_int_setting(site, "stale_ms", 0);
+
+        if (ENOERR == site_agg_init(sa, &df_bus, name, (uint32_t) site_id, meters, fields, tick_ms, stale_ms) &&
+            0 == site_agg_run(sa))
+        {
+            df_sched_thread(site, sa->task_thread, "site-agg");
+            site_agg_count++;
+        }
+        else
+            site_agg_term(sa);
+
+        free(name);
+        free(meters);
+        free(fields);
+    }
+
+    return 0;
+}
+
+int site_agg_task_cleanup()
+{
+    for (int i = 0; i < site_agg_count; i++)
+    {
+        site_agg_wait(&site_agg_conf[i]);
+        site_agg_term(&site_agg_conf[i]);
+    }
+    site_agg_count = 0;
+
+    return 0;
+}
+
 int data_forwarder_task_init(config_t* cfg)
 {
-    // mqtt source task
-    log_message(LOG_INFO, "Init Modbus source reader task\n");
-    modbus_source_task_init(cfg);
+    int startup_timeout = DF_DEFAULT_STARTUP_TIMEOUT;
+    int reactor_threads = 0;
+    int pending;
+
+    // init queue
+    init_bus(&df_bus, URL);
+
+    // every sample logged before the sinks see it
+    df_wal_init(cfg);
+
+    // event loops for the sinks, mqttc keeps its own aio thread
+    config_lookup_int(cfg, "reactor_threads", &reactor_threads);
+    if (reactor_threads > DF_MAX_REACTORS)
+        reactor_threads = DF_MAX_REACTORS;
+
+    for (int i = 0; i < reactor_threads; i++)
+    {
+        if (reactor_init(&df_reactors[i], "sink-reactor") != ENOERR)
+            break;
+        df_nreactors++;
+    }
+
+    // the sinks subscribe to it while they init
+    config_lookup_int(cfg, "fanout", &df_fanout_on);
+    if (df_fanout_on)
+        fanout_init(&df_fanout, &df_bus);
 
     // influx
     log_message(LOG_INFO, "Init Influxdb send task\n");
     influx_sink_task_init(cfg);
 
+#ifdef MOSQUITTO
+    log_message(LOG_INFO, "Init Mosquitto MQTT send task\n");
+    mosq_sink_task_init(cfg);
+#endif
+
+#ifdef MQTTC
+    // nanonng mqtt
+    log_message(LOG_INFO, "Init NanoNNG MQTT send task\n");
+    mqttc_sink_task_init(cfg);
+#endif
+
+#ifdef KAFKA
+    log_message(LOG_INFO, "Init Kafka send task\n");
+    kafka_sink_task_init(cfg);
+#endif
+
+#ifdef NATS
+    log_message(LOG_INFO, "Init NATS send task\n");
+    nats_sink_task_init(cfg);
+#endif
+
+#ifdef REDIS
+    log_message(LOG_INFO, "Init Redis send task\n");
+    redis_sink_task_init(cfg);
+#endif
+
+#ifdef TSDB
+    log_message(LOG_INFO, "Init time series store task\n");
+    tsdb_sink_task_init(cfg);
+#endif
+
+    log_message(LOG_INFO, "Init ring store task\n");
+    ring_store_task_init(cfg);
+
+    log_message(LOG_INFO, "Init alarm rules task\n");
+    alarm_sink_task_init(cfg);
+
+    log_message(LOG_INFO, "Init site aggregation task\n");
+    site_agg_task_init(cfg);
+
+    if (df_fanout_on)
+        fanout_run(&df_fanout);
+
+    for (int i = 0; i < df_nreactors; i++)
+        reactor_run(&df_reactors[i]);
+
+    // the sinks connect in parallel, wait for all of them (bounded)
+    config_lookup_int(cfg, "startup_timeout", &startup_timeout);
+
+    pending = conn_state_wait_all(df_conns, df_nconns, startup_timeout);
+    if (pending > 0)
+        log_message(LOG_WARNING, "%d sink(s) not connected after %d ms, starting anyway\n", pending, startup_timeout);
+
+    // mqtt source task
+    log_message(LOG_INFO, "Init Modbus source reader task\n");
+    modbus_source_task_init(cfg);
+
     return ENOERR;
 }
 
 int data_forwarder_task_cleanup()
 {
     modbus_source_task_cleanup();
+
+    // the attached sinks are released with their loop stopped
+    for (int i = 0; i < df_nreactors; i++)
+    {
+        reactor_stop(&df_reactors[i]);
+        reactor_wait(&df_reactors[i]);
+    }
+
     influx_sink_task_cleanup();
+    ring_store_task_cleanup();
+    alarm_sink_task_cleanup();
+    site_agg_task_cleanup();
+
+#ifdef MOSQUITTO
+    mosq_sink_task_cleanup();
+#endif
+
+#ifdef MQTTC
+    mqttc_sink_task_cleanup();
+#endif
+
+#ifdef KAFKA
+    kafka_sink_task_cleanup();
+#endif
+
+#ifdef NATS
+    nats_sink_task_cleanup();
+#endif
+
+#ifdef REDIS
+    redis_sink_task_cleanup();
+#endif
+
+#ifdef TSDB
+    tsdb_sink_task_cleanup();
+#endif
+
+    if (df_fanout_on)
+    {
+        fanout_wait(&df_fanout);
+        fanout_term(&df_fanout);
+    }
+
+    for (int i = 0; i < df_nreactors; i++)
+        reactor_term(&df_reactors[i]);
+    df_nreactors = 0;
+
+    // last commit, the cursors as far as the sinks got
+    if (df_wal_on)
+    {
+        wal_wait(&df_wal);
+        wal_term(&df_wal);
+        df_wal_on = 0;
+    }
 
     return ENOERR;
 }
\ No newline at end of file
@@ -0,0 +1,631 @@
+/**
+ * @file derive.c
+ * @author longdh
+ * @brief derived metrics: arithmetic expressions over the sample fields,
+ *        appended to the sample before it is serialized
+ * @version 0.1
+ * @date 2024-02-02
+ *
+ * @copyright Copyright (c) 2023
+ *
+ *   apparent_power = "sqrt(power * power + reactive_power * reactive_power)"
+ *   imbalance      = "(max(i_a, max(i_b, i_c)) - min(i_a, min(i_b, i_c))) / ((i_a + i_b + i_c) / 3)"
+ *
+ * The expressions are parsed once (recursive descent) into a single postfix
+ * program, a sample is one pass over it on a small value stack. An expression
+ * may use the outputs of the expressions above it. Functions: sqrt, abs,
+ * min, max.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "cjson/cJSON.h"
+
+#include "meter/derive.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+#define DERIVE_FIXED_EXP    -3      // exponent of the derived fixed point values
+
+/**
+ * @brief parser state of one expression
+ *
+ */
+typedef struct {
+    derive_program* p;
+    const char*     s;
+    int             depth;  // stack depth at this point of the code
+    int             err;
+} derive_parser;
+
+static void parse_expr(derive_parser* ps);
+
+static void skip_space(derive_parser* ps)
+{
+    while (isspace((unsigned char) *ps->s))
+        ps->s++;
+}
+
+/**
+ * @brief consume c after the spaces, the end of the string is never passed
+ *
+ * @param ps
+ * @param c
+ * @return int, 0 => not there, ps->err set
+ */
+static int expect(derive_parser* ps, char c)
+{
+    skip_space(ps);
+
+    if (*ps->s != c)
+    {
+        ps->err = 1;
+        return 0;
+    }
+
+    ps->s++;
+    return 1;
+}
+
+static void emit(derive_parser* ps, int op, int arg)
+{
+    derive_program* p = ps->p;
+
+    if (ps->err)
+        return;
+
+    if (p->ncode >= DERIVE_MAX_CODE)
+    {
+        ps->err = 1;
+        return;
+    }
+
+    switch (op)
+    {
+    case DOP_CONST: case DOP_FIELD: case DOP_OUT:
+        ps->depth++;
+        break;
+    case DOP_ADD: case DOP_SUB: case DOP_MUL: case DOP_DIV: case DOP_MIN: case DOP_MAX:
+        ps->depth--;
+        break;
+    default:
+        break;
+    }
+
+    if (ps->depth > DERIVE_STACK)
+        ps->err = 1;
+
+    p->code[p->ncode].op = (uint8_t) op;
+    p->code[p->ncode].arg = (uint8_t) arg;
+    p->ncode++;
+}
+
+/**
+ * @brief index of a sample field, added when new
+ *
+ * @param p
+ * @param name
+ * @return int, -1 => too many fields
+ */
+static int derive_field(derive_program* p, const char* name)
+{
+    for (int f = 0; f < p->nfields; f++)
+        if (0 == strcmp(p->field[f], name))
+            return f;
+
+    if (p->nfields >= DERIVE_MAX_FIELDS)
+        return -1;
+
+    snprintf(p->field[p->nfields], DERIVE_NAME_LEN, "%s", name);
+
+    return p->nfields++;
+}
+
+/**
+ * @brief number | name | function(args) | ( expr ) | - primary
+ *
+ * @param ps
+ */
+static void parse_primary(derive_parser* ps)
+{
+    static const struct { const char* name; int op; int nargs; } funcs[] = {
+        { "sqrt", DOP_SQRT, 1 }, { "abs", DOP_ABS, 1 },
+        { "min", DOP_MIN, 2 },   { "max", DOP_MAX, 2 },
+    };
+    derive_program* p = ps->p;
+    char name[DERIVE_NAME_LEN];
+    size_t len = 0;
+
+    if (ps->err)
+        return;
+
+    skip_space(ps);
+
+    if (*ps->s == '-')
+    {
+        ps->s++;
+        parse_primary(ps);
+        emit(ps, DOP_NEG, 0);
+        return;
+    }
+
+    if (*ps->s == '(')
+    {
+        ps->s++;
+        parse_expr(ps);
+        if (!ps->err)
+            expect(ps, ')');
+        return;
+    }
+
+    if (isdigit((unsigned char) *ps->s) || *ps->s == '.')
+    {
+        char* end;
+        double v = strtod(ps->s, &end);
+
+        if (end == ps->s || p->nconsts >= DERIVE_MAX_CONSTS)
+        {
+            ps->err = 1;
+            return;
+        }
+
+        ps->s = end;
+        p->consts[p->nconsts] = v;
+        emit(ps, DOP_CONST, p->nconsts++);
+        return;
+    }
+
+    while (isalnum((unsigned char) *ps->s) || *ps->s == '_')
+    {
+        if (len + 1 >= sizeof(name))
+        {
+            ps->err = 1;
+            return;
+        }
+        name[len++] = *ps->s++;
+    }
+    name[len] = '\0';
+
+    if (len == 0)
+    {
+        ps->err = 1;
+        return;
+    }
+
+    skip_space(ps);
+
+    if (*ps->s == '(')
+    {
+        size_t i;
+
+        for (i = 0; i < sizeof(funcs) / sizeof(funcs[0]); i++)
+            if (0 == strcmp(funcs[i].name, name))
+                break;
+
+        if (i == sizeof(funcs) / sizeof(funcs[0]))
+        {
+            ps->err = 1;
+            return;
+        }
+
+        ps->s++;
+        for (int a = 0; a < funcs[i].nargs; a++)
+        {
+            if (a > 0 && !expect(ps, ','))
+                return;
+
+            parse_expr(ps);
+            if (ps->err)
+                return;
+        }
+
+        if (!expect(ps, ')'))
+            return;
+
+        emit(ps, funcs[i].op, 0);
+        return;
+    }
+
+    // an earlier output, else a field of the sample
+    for (int o = 0; o < p->nexprs; o++)
+    {
+        if (0 == strcmp(p->name[o], name))
+        {
+            emit(ps, DOP_OUT, o);
+            return;
+        }
+    }
+
+    int f = derive_field(p, name);
+    if (f < 0)
+        ps->err = 1;
+    else
+        emit(ps, DOP_FIELD, f);
+}
+
+static void parse_term(derive_parser* ps)
+{
+    parse_primary(ps);
+
+    while (!ps->err)
+    {
+        skip_space(ps);
+
+        if (*ps->s != '*' && *ps->s != '/')
+            return;
+
+        int op = (*ps->s++ == '*') ? DOP_MUL : DOP_DIV;
+        parse_primary(ps);
+        emit(ps, op, 0);
+    }
+}
+
+static void parse_expr(derive_parser* ps)
+{
+    if (ps->err)
+        return;
+
+    parse_term(ps);
+
+    while (!ps->err)
+    {
+        skip_space(ps);
+
+        if (*ps->s != '+' && *ps->s != '-')
+            return;
+
+        int op = (*ps->s++ == '+') ? DOP_ADD : DOP_SUB;
+        parse_term(ps);
+        emit(ps, op, 0);
+    }
+}
+
+/**
+ * @brief compile an expression, its value is the output field 'name'
+ *
+ * @param p, zeroed before the first expression
+ * @param name
+ * @param expr
+ * @return int, EGENERR => syntax error / program full (p unchanged)
+ */
+int derive_compile(derive_program* p, const char* name, const char* expr)
+{
+    derive_parser ps = { .p = p, .s = expr };
+    int ncode = p->ncode;
+    int nconsts = p->nconsts;
+    int nfields = p->nfields;
+
+    if (p->nexprs >= DERIVE_MAX_EXPRS || strlen(name) >= DERIVE_NAME_LEN)
+        ps.err = 1;
+
+    parse_expr(&ps);
+    skip_space(&ps);
+
+    if (*ps.s != '\0' || ps.depth != 1)
+        ps.err = 1;
+
+    emit(&ps, DOP_STORE, p->nexprs);
+
+    if (ps.err)
+    {
+        p->ncode = ncode;
+        p->nconsts = nconsts;
+        p->nfields = nfields;
+
+        log_message(LOG_ERR, "derive: %s: cannot compile '%s'\n", name, expr);
+        return EGENERR;
+    }
+
+    snprintf(p->name[p->nexprs++], DERIVE_NAME_LEN, "%s", name);
+
+    return ENOERR;
+}
+
+/**
+ * @brief value slots of the fields in a layout, resolved on first use
+ *
+ * @param p
+ * @param layout, DERIVE_LAYOUT_*
+ * @param names, value names of the layout
+ * @param n
+ * @return const int8_t*, NULL => too many layouts
+ */
+const int8_t* derive_bind(derive_program* p, int layout, const char* const* names, int n)
+{
+    int l;
+
+    for (l = 0; l < p->nlayouts; l++)
+        if (p->layout[l].key == layout)
+            return p->layout[l].slot;
+
+    if (p->nlayouts >= DERIVE_MAX_LAYOUTS)
+        return NULL;
+
+    p->layout[l].key = layout;
+
+    for (int f = 0; f < p->nfields; f++)
+    {
+        p->layout[l].slot[f] = -1;
+
+        for (int i = 0; i < n && i < 128; i++)
+        {
+            if (0 == strcmp(names[i], p->field[f]))
+            {
+                p->layout[l].slot[f] = (int8_t) i;
+                break;
+            }
+        }
+
+        if (p->layout[l].slot[f] < 0)
+            log_message(LOG_WARNING, "derive: no field '%s' in the samples\n", p->field[f]);
+    }
+
+    p->nlayouts++;
+
+    return p->layout[l].slot;
+}
+
+/**
+ * @brief run the program
+ *
+ * @param p
+ * @param fv, field values (NAN => missing)
+ * @param out, p->nexprs values, not finite => 0
+ */
+void derive_eval(derive_program* p, const double* fv, double* out)
+{
+    double st[DERIVE_STACK];
+    int sp = 0;
+
+    for (int pc = 0; pc < p->ncode; pc++)
+    {
+        const derive_insn* in = &p->code[pc];
+
+        switch (in->op)
+        {
+        case DOP_CONST: st[sp++] = p->consts[in->arg]; break;
+        case DOP_FIELD: st[sp++] = fv[in->arg]; break;
+        case DOP_OUT:   st[sp++] = out[in->arg]; break;
+        case DOP_ADD:   sp--; st[sp - 1] += st[sp]; break;
+        case DOP_SUB:   sp--; st[sp - 1] -= st[sp]; break;
+        case DOP_MUL:   sp--; st[sp - 1] *= st[sp]; break;
+        case DOP_DIV:   sp--; st[sp - 1] = st[sp] != 0.0 ? st[sp - 1] / st[sp] : NAN; break;
+        case DOP_NEG:   st[sp - 1] = -st[sp - 1]; break;
+        case DOP_SQRT:  st[sp - 1] = sqrt(st[sp - 1]); break;
+        case DOP_ABS:   st[sp - 1] = fabs(st[sp - 1]); break;
+        case DOP_MIN:   sp--; st[sp - 1] = fmin(st[sp - 1], st[sp]); break;
+        case DOP_MAX:   sp--; st[sp - 1] = fmax(st[sp - 1], st[sp]); break;
+        case DOP_STORE:
+            out[in->arg] = st[--sp];
+            if (!isfinite(out[in->arg]))
+            {
+                out[in->arg] = 0.0;
+                p->invalid++;
+            }
+            break;
+        default: break;
+        }
+    }
+}
+
+/**
+ * @brief register map naming the derived samples: the fields of the source
+ *        (meter_data_log or base) then the outputs
+ *
+ * @param out, zeroed, registered by the caller
+ * @param p
+ * @param base, NULL => meter_data_log
+ * @return int
+ */
+int derive_map_init(reg_map* out, const derive_program* p, const reg_map* base)
+{
+    const char* names[METER_SAMPLE_MAX];
+    double values[METER_SAMPLE_MAX];
+    int n;
+
+    if (base == NULL)
+    {
+        meter_data_log md = { 0 };
+        uint32_t meter_id;
+        uint64_t ts;
+
+        n = bus_data_values(&md, sizeof(md), &meter_id, &ts, names, values);
+    }
+    else
+    {
+        n = base->npoints;
+        for (int i = 0; i < n && i < METER_SAMPLE_MAX; i++)
+            names[i] = base->points[i].name;
+    }
+
+    if (n < 0 || n + p->nexprs > METER_SAMPLE_MAX)
+    {
+        log_message(LOG_ERR, "derive: %d fields + %d outputs, max %d\n", n, p->nexprs, METER_SAMPLE_MAX);
+        return EGENERR;
+    }
+
+    memset(out, 0, sizeof(reg_map));
+    snprintf(out->name, sizeof(out->name), "%s+derived", base != NULL ? base->name : "meter");
+
+    out->npoints = n + p->nexprs;
+    out->points = (reg_point*) calloc(out->npoints, sizeof(reg_point));
+    if (out->points == NULL)
+        return ESYSERR;
+
+    for (int i = 0; i < out->npoints; i++)
+    {
+        if (i < n && base != NULL)
+            out->points[i] = base->points[i];
+        else
+        {
+            snprintf(out->points[i].name, REGMAP_NAME_LEN, "%s", i < n ? names[i] : p->name[i - n]);
+            out->points[i].scale = 1.0;
+            out->points[i].field = -1;
+            out->points[i].exponent = DERIVE_FIXED_EXP;
+        }
+    }
+
+    return ENOERR;
+}
+
+/**
+ * @brief outputs of a sample of a layout
+ *
+ * @param p
+ * @param layout
+ * @param names
+ * @param values
+ * @param n
+ * @param out
+ * @return int, EGENERR => not bound
+ */
+static int derive_values(derive_program* p, int layout, const char** names, const double* values, int n, double* out)
+{
+    double fv[DERIVE_MAX_FIELDS];
+    const int8_t* slot = derive_bind(p, layout, names, n);
+
+    if (slot == NULL)
+        return EGENERR;
+
+    for (int f = 0; f < p->nfields; f++)
+        fv[f] = (slot[f] >= 0 && slot[f] < n) ? values[slot[f]] : NAN;
+
+    derive_eval(p, fv, out);
+
+    return ENOERR;
+}
+
+/**
+ * @brief meter_data_log => sample of the map out with the outputs appended
+ *
+ * @param p
+ * @param out, derive_map_init(base NULL)
+ * @param md
+ * @param s
+ * @return int
+ */
+int derive_meter_data(derive_program* p, const reg_map* out, const meter_data_log* md, meter_sample* s)
+{
+    const char* names[METER_SAMPLE_MAX];
+    int n = bus_data_values(md, sizeof(meter_data_log), &s->meter_id, &s->timestamp_ns, names, s->values);
+
+    if (n < 0 || ENOERR != derive_values(p, DERIVE_LAYOUT_DATALOG, names, s->values, n, &s->values[n]))
+        return EGENERR;
+
+    s->map_id = out->id;
+    s->count = (uint16_t) (n + p->nexprs);
+
+    return ENOERR;
+}
+
+/**
+ * @brief append the outputs to a register map sample
+ *
+ * @param p
+ * @param out, derive_map_init(base = the map of s)
+ * @param s
+ * @return int
+ */
+int derive_sample(derive_program* p, const reg_map* out, meter_sample* s)
+{
+    const char* names[METER_SAMPLE_MAX];
+    double values[METER_SAMPLE_MAX];
+    uint32_t meter_id;
+    uint64_t ts;
+    int n = bus_data_values(s, sizeof(meter_sample), &meter_id, &ts, names, values);
+
+    if (n < 0 || n + p->nexprs > METER_SAMPLE_MAX ||
+        ENOERR != derive_values(p, DERIVE_LAYOUT_MAP + s->map_id, names, s->values, n, &s->values[n]))
+        return EGENERR;
+
+    s->map_id = out->id;
+    s->count = (uint16_t) (n + p->nexprs);
+
+    return ENOERR;
+}
+
+/**
+ * @brief append the outputs to a fixed point sample, mantissa of 10^DERIVE_FIXED_EXP
+ *
+ * @param p
+ * @param out, derive_map_init(base = the map of s)
+ * @param s
+ * @return int
+ */
+int derive_fixed(derive_program* p, const reg_map* out, meter_fixed_sample* s)
+{
+    const char* names[METER_SAMPLE_MAX];
+    double values[METER_SAMPLE_MAX];
+    double res[DERIVE_MAX_EXPRS];
+    uint32_t meter_id;
+    uint64_t ts;
+    int n = bus_data_values(s, sizeof(meter_fixed_sample), &meter_id, &ts, names, values);
+
+    if (n < 0 || n + p->nexprs > METER_SAMPLE_MAX ||
+        ENOERR != derive_values(p, DERIVE_LAYOUT_MAP + s->map_id, names, values, n, res))
+        return EGENERR;
+
+    for (int o = 0; o < p->nexprs; o++)
+    {
+        s->mant[n + o] = (int64_t) llround(res[o] * pow(10.0, -DERIVE_FIXED_EXP));
+        s->exp[n + o] = DERIVE_FIXED_EXP;
+    }
+
+    s->map_id = out->id;
+    s->count = (uint16_t) (n + p->nexprs);
+
+    return ENOERR;
+}
+
+/**
+ * @brief append the outputs to a DataLog JSON object, the fields by name
+ *
+ * @param p
+ * @param text, NUL terminated, rewritten in place
+ * @param size, of text
+ * @return int, length, < 0 => unchanged (not JSON / too long)
+ */
+int derive_json(derive_program* p, char* text, int size)
+{
+    double fv[DERIVE_MAX_FIELDS];
+    double out[DERIVE_MAX_EXPRS];
+    cJSON* root = cJSON_Parse(text);
+    int len = -1;
+
+    if (root == NULL)
+        return -1;
+
+    if (cJSON_IsObject(root))
+    {
+        for (int f = 0; f < p->nfields; f++)
+        {
+            const cJSON* item = cJSON_GetObjectItemCaseSensitive(root, p->field[f]);
+            fv[f] = cJSON_IsNumber(item) ? item->valuedouble : NAN;
+        }
+
+        derive_eval(p, fv, out);
+
+        for (int o = 0; o < p->nexprs; o++)
+            cJSON_AddNumberToObject(root, p->name[o], out[o]);
+
+        char* s = cJSON_PrintUnformatted(root);
+        if (s != NULL)
+        {
+            size_t n = strlen(s);
+
+            if (n < (size_t) size)
+            {
+                memcpy(text, s, n + 1);
+                len = (int) n;
+            }
+            cJSON_free(s);
+        }
+    }
+
+    cJSON_Delete(root);
+
+    return len;
+}
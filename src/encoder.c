@@ -0,0 +1,994 @@
+/**
+ * @file encoder.c
+ * @author longdh
+ * @brief sink payload encoders: raw, json, line protocol, CBOR, MessagePack
+ * @version 0.1
+ * @date 2024-01-10
+ * 
+ * @copyright Copyright (c) 2023
+ * 
+ * CBOR/MessagePack maps use small integer keys (field id) instead of the 
+ * field names, see METER_FID_* and the DataLog field table below.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <stdarg.h>
+
+#include "utils/encoder.h"
+#include "utils/message.h"
+#include "utils/logger.h"
+#include "meter/datalog.h"
+#include "meter/regmap.h"
+
+typedef enum {
+    ENC_FIELD_INT = 0,
+    ENC_FIELD_DOUBLE,
+    ENC_FIELD_STRING
+} enc_field_type;
+
+typedef struct {
+    const char* name;
+    size_t      offset;
+    int         type;
+} enc_field;
+
+/* DataLog field table, field id = index */
+static const enc_field datalog_fields[] = {
+    { "status", offsetof(struct DataLog, status), ENC_FIELD_INT },
+    { "v_pv_1", offsetof(struct DataLog, v_pv_1), ENC_FIELD_DOUBLE },
+    { "v_pv_2", offsetof(struct DataLog, v_pv_2), ENC_FIELD_INT },
+    { "v_pv_3", offsetof(struct DataLog, v_pv_3), ENC_FIELD_DOUBLE },
+    { "v_bat", offsetof(struct DataLog, v_bat), ENC_FIELD_INT },
+    { "soc", offsetof(struct DataLog, soc), ENC_FIELD_INT },
+    { "soh", offsetof(struct DataLog, soh), ENC_FIELD_INT },
+    { "p_pv", offsetof(struct DataLog, p_pv), ENC_FIELD_INT },
+    { "p_pv_1", offsetof(struct DataLog, p_pv_1), ENC_FIELD_INT },
+    { "p_pv_2", offsetof(struct DataLog, p_pv_2), ENC_FIELD_INT },
+    { "p_pv_3", offsetof(struct DataLog, p_pv_3), ENC_FIELD_INT },
+    { "p_charge", offsetof(struct DataLog, p_charge), ENC_FIELD_INT },
+    { "p_discharge", offsetof(struct DataLog, p_discharge), ENC_FIELD_INT },
+    { "v_ac_r", offsetof(struct DataLog, v_ac_r), ENC_FIELD_DOUBLE },
+    { "v_ac_s", offsetof(struct DataLog, v_ac_s), ENC_FIELD_INT },
+    { "v_ac_t", offsetof(struct DataLog, v_ac_t), ENC_FIELD_INT },
+    { "f_ac", offsetof(struct DataLog, f_ac), ENC_FIELD_DOUBLE },
+    { "p_inv", offsetof(struct DataLog, p_inv), ENC_FIELD_INT },
+    { "p_rec", offsetof(struct DataLog, p_rec), ENC_FIELD_INT },
+    { "pf", offsetof(struct DataLog, pf), ENC_FIELD_INT },
+    { "v_eps_r", offsetof(struct DataLog, v_eps_r), ENC_FIELD_INT },
+    { "v_eps_s", offsetof(struct DataLog, v_eps_s), ENC_FIELD_DOUBLE },
+    { "v_eps_t", offsetof(struct DataLog, v_eps_t), ENC_FIELD_INT },
+    { "f_eps", offsetof(struct DataLog, f_eps), ENC_FIELD_DOUBLE },
+    { "p_eps", offsetof(struct DataLog, p_eps), ENC_FIELD_INT },
+    { "s_eps", offsetof(struct DataLog, s_eps), ENC_FIELD_INT },
+    { "p_to_grid", offsetof(struct DataLog, p_to_grid), ENC_FIELD_INT },
+    { "p_to_user", offsetof(struct DataLog, p_to_user), ENC_FIELD_INT },
+    { "e_pv_day", offsetof(struct DataLog, e_pv_day), ENC_FIELD_DOUBLE },
+    { "e_pv_day_1", offsetof(struct DataLog, e_pv_day_1), ENC_FIELD_DOUBLE },
+    { "e_pv_day_2", offsetof(struct DataLog, e_pv_day_2), ENC_FIELD_INT },
+    { "e_pv_day_3", offsetof(struct DataLog, e_pv_day_3), ENC_FIELD_INT },
+    { "e_inv_day", offsetof(struct DataLog, e_inv_day), ENC_FIELD_DOUBLE },
+    { "e_rec_day", offsetof(struct DataLog, e_rec_day), ENC_FIELD_INT },
+    { "e_chg_day", offsetof(struct DataLog, e_chg_day), ENC_FIELD_INT },
+    { "e_dischg_day", offsetof(struct DataLog, e_dischg_day), ENC_FIELD_INT },
+    { "e_eps_day", offsetof(struct DataLog, e_eps_day), ENC_FIELD_INT },
+    { "e_to_grid_day", offsetof(struct DataLog, e_to_grid_day), ENC_FIELD_INT },
+    { "e_to_user_day", offsetof(struct DataLog, e_to_user_day), ENC_FIELD_DOUBLE },
+    { "v_bus_1", offsetof(struct DataLog, v_bus_1), ENC_FIELD_DOUBLE },
+    { "v_bus_2", offsetof(struct DataLog, v_bus_2), ENC_FIELD_DOUBLE },
+    { "e_pv_all", offsetof(struct DataLog, e_pv_all), ENC_FIELD_DOUBLE },
+    { "e_pv_all_1", offsetof(struct DataLog, e_pv_all_1), ENC_FIELD_DOUBLE },
+    { "e_pv_all_2", offsetof(struct DataLog, e_pv_all_2), ENC_FIELD_INT },
+    { "e_pv_all_3", offsetof(struct DataLog, e_pv_all_3), ENC_FIELD_INT },
+    { "e_inv_all", offsetof(struct DataLog, e_inv_all), ENC_FIELD_DOUBLE },
+    { "e_rec_all", offsetof(struct DataLog, e_rec_all), ENC_FIELD_INT },
+    { "e_chg_all", offsetof(struct DataLog, e_chg_all), ENC_FIELD_INT },
+    { "e_dischg_all", offsetof(struct DataLog, e_dischg_all), ENC_FIELD_INT },
+    { "e_eps_all", offsetof(struct DataLog, e_eps_all), ENC_FIELD_INT },
+    { "e_to_grid_all", offsetof(struct DataLog, e_to_grid_all), ENC_FIELD_INT },
+    { "e_to_user_all", offsetof(struct DataLog, e_to_user_all), ENC_FIELD_DOUBLE },
+    { "t_inner", offsetof(struct DataLog, t_inner), ENC_FIELD_INT },
+    { "t_rad_1", offsetof(struct DataLog, t_rad_1), ENC_FIELD_INT },
+    { "t_rad_2", offsetof(struct DataLog, t_rad_2), ENC_FIELD_INT },
+    { "t_bat", offsetof(struct DataLog, t_bat), ENC_FIELD_INT },
+    { "runtime", offsetof(struct DataLog, runtime), ENC_FIELD_INT },
+    { "max_chg_curr", offsetof(struct DataLog, max_chg_curr), ENC_FIELD_INT },
+    { "max_dischg_curr", offsetof(struct DataLog, max_dischg_curr), ENC_FIELD_INT },
+    { "charge_volt_ref", offsetof(struct DataLog, charge_volt_ref), ENC_FIELD_INT },
+    { "dischg_cut_volt", offsetof(struct DataLog, dischg_cut_volt), ENC_FIELD_INT },
+    { "bat_status_0", offsetof(struct DataLog, bat_status_0), ENC_FIELD_INT },
+    { "bat_status_1", offsetof(struct DataLog, bat_status_1), ENC_FIELD_INT },
+    { "bat_status_2", offsetof(struct DataLog, bat_status_2), ENC_FIELD_INT },
+    { "bat_status_3", offsetof(struct DataLog, bat_status_3), ENC_FIELD_INT },
+    { "bat_status_4", offsetof(struct DataLog, bat_status_4), ENC_FIELD_INT },
+    { "bat_status_5", offsetof(struct DataLog, bat_status_5), ENC_FIELD_INT },
+    { "bat_status_6", offsetof(struct DataLog, bat_status_6), ENC_FIELD_INT },
+    { "bat_status_7", offsetof(struct DataLog, bat_status_7), ENC_FIELD_INT },
+    { "bat_status_8", offsetof(struct DataLog, bat_status_8), ENC_FIELD_INT },
+    { "bat_status_9", offsetof(struct DataLog, bat_status_9), ENC_FIELD_INT },
+    { "bat_status_inv", offsetof(struct DataLog, bat_status_inv), ENC_FIELD_INT },
+    { "bat_count", offsetof(struct DataLog, bat_count), ENC_FIELD_INT },
+    { "bat_capacity", offsetof(struct DataLog, bat_capacity), ENC_FIELD_INT },
+    { "bat_current", offsetof(struct DataLog, bat_current), ENC_FIELD_INT },
+    { "bms_event_1", offsetof(struct DataLog, bms_event_1), ENC_FIELD_INT },
+    { "bms_event_2", offsetof(struct DataLog, bms_event_2), ENC_FIELD_INT },
+    { "max_cell_voltage", offsetof(struct DataLog, max_cell_voltage), ENC_FIELD_INT },
+    { "min_cell_voltage", offsetof(struct DataLog, min_cell_voltage), ENC_FIELD_INT },
+    { "max_cell_temp", offsetof(struct DataLog, max_cell_temp), ENC_FIELD_INT },
+    { "min_cell_temp", offsetof(struct DataLog, min_cell_temp), ENC_FIELD_INT },
+    { "bms_fw_update_state", offsetof(struct DataLog, bms_fw_update_state), ENC_FIELD_INT },
+    { "cycle_count", offsetof(struct DataLog, cycle_count), ENC_FIELD_INT },
+    { "vbat_inv", offsetof(struct DataLog, vbat_inv), ENC_FIELD_DOUBLE },
+    { "time", offsetof(struct DataLog, time), ENC_FIELD_INT },
+    { "datalog", offsetof(struct DataLog, datalog), ENC_FIELD_STRING },
+};
+
+#define DATALOG_NFIELDS (sizeof(datalog_fields) / sizeof(datalog_fields[0]))
+
+/**
+ * @brief output buffer, err is set once the buffer is too small
+ * 
+ */
+typedef struct {
+    uint8_t*    p;
+    size_t      len;
+    size_t      cap;
+    int         err;
+} enc_buf;
+
+static inline void put_u8(enc_buf* b, uint8_t v)
+{
+    if (b->len + 1 > b->cap) 
+    {
+        b->err = 1;
+        return;
+    }
+
+    b->p[b->len++] = v;
+}
+
+static inline void put_be(enc_buf* b, uint64_t v, int nbytes)
+{
+    if (b->len + nbytes > b->cap) 
+    {
+        b->err = 1;
+        return;
+    }
+
+    for (int i = nbytes - 1; i >= 0; i--)
+        b->p[b->len++] = (uint8_t) (v >> (8 * i));
+}
+
+static inline void put_bytes(enc_buf* b, const void* data, size_t len)
+{
+    if (b->len + len > b->cap) 
+    {
+        b->err = 1;
+        return;
+    }
+
+    memcpy(b->p + b->len, data, len);
+    b->len += len;
+}
+
+/* text, NUL written but not counted */
+static void put_printf(enc_buf* b, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (b->err)
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf((char*) b->p + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t) n >= b->cap - b->len)
+    {
+        b->err = 1;
+        return;
+    }
+
+    b->len += n;
+}
+
+/* JSON string, quoted and escaped */
+static void put_json_string(enc_buf* b, const char* s)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    put_u8(b, '"');
+
+    for (; *s != '\0' && !b->err; s++)
+    {
+        uint8_t c = (uint8_t) *s;
+
+        switch (c)
+        {
+        case '"':  put_bytes(b, "\\\"", 2); break;
+        case '\\': put_bytes(b, "\\\\", 2); break;
+        case '\n': put_bytes(b, "\\n", 2); break;
+        case '\r': put_bytes(b, "\\r", 2); break;
+        case '\t': put_bytes(b, "\\t", 2); break;
+        default:
+            if (c < 0x20)
+            {
+                char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+                put_bytes(b, u, sizeof(u));
+            }
+            else
+                put_u8(b, c);
+        }
+    }
+
+    put_u8(b, '"');
+}
+
+static inline uint32_t float_bits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static inline uint64_t double_bits(double d)
+{
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    return u;
+}
+
+/******************************************************************************/
+/* CBOR (RFC 8949)                                                            */
+/******************************************************************************/
+
+static void cbor_head(enc_buf* b, uint8_t major, uint64_t v)
+{
+    major <<= 5;
+
+    if (v < 24)
+        put_u8(b, major | (uint8_t) v);
+    else if (v <= 0xFF)
+    {
+        put_u8(b, major | 24);
+        put_be(b, v, 1);
+    }
+    else if (v <= 0xFFFF)
+    {
+        put_u8(b, major | 25);
+        put_be(b, v, 2);
+    }
+    else if (v <= 0xFFFFFFFFULL)
+    {
+        put_u8(b, major | 26);
+        put_be(b, v, 4);
+    }
+    else
+    {
+        put_u8(b, major | 27);
+        put_be(b, v, 8);
+    }
+}
+
+static void cbor_int(enc_buf* b, int64_t v)
+{
+    if (v >= 0)
+        cbor_head(b, 0, (uint64_t) v);
+    else
+        cbor_head(b, 1, (uint64_t) (-1 - v));
+}
+
+static void cbor_float(enc_buf* b, float f)
+{
+    put_u8(b, 0xFA);
+    put_be(b, float_bits(f), 4);
+}
+
+static void cbor_double(enc_buf* b, double d)
+{
+    // smallest exact representation
+    if (d > -1e15 && d < 1e15 && d == (double) (int64_t) d)
+        cbor_int(b, (int64_t) d);
+    else if ((double) (float) d == d)
+        cbor_float(b, (float) d);
+    else
+    {
+        put_u8(b, 0xFB);
+        put_be(b, double_bits(d), 8);
+    }
+}
+
+static void cbor_string(enc_buf* b, const char* s)
+{
+    size_t len = strlen(s);
+
+    cbor_head(b, 3, len);
+    put_bytes(b, s, len);
+}
+
+/******************************************************************************/
+/* MessagePack                                                                */
+/******************************************************************************/
+
+static void mp_map(enc_buf* b, uint32_t n)
+{
+    if (n < 16)
+        put_u8(b, 0x80 | (uint8_t) n);
+    else if (n <= 0xFFFF)
+    {
+        put_u8(b, 0xDE);
+        put_be(b, n, 2);
+    }
+    else
+    {
+        put_u8(b, 0xDF);
+        put_be(b, n, 4);
+    }
+}
+
+static void mp_int(enc_buf* b, int64_t v)
+{
+    if (v >= 0)
+    {
+        if (v < 128)
+            put_u8(b, (uint8_t) v);
+        else if (v <= 0xFF)
+        {
+            put_u8(b, 0xCC);
+            put_be(b, v, 1);
+        }
+        else if (v <= 0xFFFF)
+        {
+            put_u8(b, 0xCD);
+            put_be(b, v, 2);
+        }
+        else if (v <= 0xFFFFFFFFLL)
+        {
+            put_u8(b, 0xCE);
+            put_be(b, v, 4);
+        }
+        else
+        {
+            put_u8(b, 0xCF);
+            put_be(b, v, 8);
+        }
+    }
+    else
+    {
+        if (v >= -32)
+            put_u8(b, (uint8_t) (int8_t) v);
+        else if (v >= -128)
+        {
+            put_u8(b, 0xD0);
+            put_be(b, (uint8_t) (int8_t) v, 1);
+        }
+        else if (v >= -32768)
+        {
+            put_u8(b, 0xD1);
+            put_be(b, (uint16_t) (int16_t) v, 2);
+        }
+        else if (v >= -2147483648LL)
+        {
+            put_u8(b, 0xD2);
+            put_be(b, (uint32_t) (int32_t) v, 4);
+        }
+        else
+        {
+            put_u8(b, 0xD3);
+            put_be(b, (uint64_t) v, 8);
+        }
+    }
+}
+
+static void mp_float(enc_buf* b, float f)
+{
+    put_u8(b, 0xCA);
+    put_be(b, float_bits(f), 4);
+}
+
+static void mp_double(enc_buf* b, double d)
+{
+    if (d > -1e15 && d < 1e15 && d == (double) (int64_t) d)
+        mp_int(b, (int64_t) d);
+    else if ((double) (float) d == d)
+        mp_float(b, (float) d);
+    else
+    {
+        put_u8(b, 0xCB);
+        put_be(b, double_bits(d), 8);
+    }
+}
+
+static void mp_string(enc_buf* b, const char* s)
+{
+    size_t len = strlen(s);
+
+    if (len < 32)
+        put_u8(b, 0xA0 | (uint8_t) len);
+    else if (len <= 0xFF)
+    {
+        put_u8(b, 0xD9);
+        put_be(b, len, 1);
+    }
+    else
+    {
+        put_u8(b, 0xDA);
+        put_be(b, len, 2);
+    }
+    put_bytes(b, s, len);
+}
+
+/******************************************************************************/
+/* Generic map writer                                                         */
+/******************************************************************************/
+
+static void map_begin(enc_buf* b, int fmt, uint32_t n)
+{
+    if (fmt == ENC_CBOR)
+        cbor_head(b, 5, n);
+    else
+        mp_map(b, n);
+}
+
+static void map_key(enc_buf* b, int fmt, uint32_t id)
+{
+    if (fmt == ENC_CBOR)
+        cbor_head(b, 0, id);
+    else
+        mp_int(b, id);
+}
+
+static void map_int(enc_buf* b, int fmt, int64_t v)
+{
+    if (fmt == ENC_CBOR)
+        cbor_int(b, v);
+    else
+        mp_int(b, v);
+}
+
+static void map_float(enc_buf* b, int fmt, float f)
+{
+    if (fmt == ENC_CBOR)
+        cbor_float(b, f);
+    else
+        mp_float(b, f);
+}
+
+static void map_double(enc_buf* b, int fmt, double d)
+{
+    if (fmt == ENC_CBOR)
+        cbor_double(b, d);
+    else
+        mp_double(b, d);
+}
+
+static void map_string(enc_buf* b, int fmt, const char* s)
+{
+    if (fmt == ENC_CBOR)
+        cbor_string(b, s);
+    else
+        mp_string(b, s);
+}
+
+/******************************************************************************/
+/* Public API                                                                 */
+/******************************************************************************/
+
+/**
+ * @brief "raw", "json", "line", "cbor", "msgpack"
+ * 
+ * @param s 
+ * @param default_format 
+ * @return int 
+ */
+int payload_format_from_string(const char* s, int default_format)
+{
+    if (s == NULL)
+        return default_format;
+
+    if (0 == strcasecmp(s, "raw"))
+        return ENC_RAW;
+    if (0 == strcasecmp(s, "json"))
+        return ENC_JSON;
+    if (0 == strcasecmp(s, "line"))
+        return ENC_LINE;
+    if (0 == strcasecmp(s, "cbor"))
+        return ENC_CBOR;
+    if (0 == strcasecmp(s, "msgpack"))
+        return ENC_MSGPACK;
+
+    log_message(LOG_WARNING, "Unknown payload format '%s'\n", s);
+
+    return default_format;
+}
+
+/**
+ * @brief JSON string of a text, quoted and escaped
+ * 
+ * @param s 
+ * @param buf 
+ * @param size 
+ * @return int, length without the NUL, -1 => buffer too small
+ */
+int encode_json_string(const char* s, char* buf, size_t size)
+{
+    enc_buf b = { (uint8_t*) buf, 0, size, 0 };
+
+    put_json_string(&b, s);
+    put_u8(&b, '\0');
+
+    return b.err ? -1 : (int) b.len - 1;
+}
+
+/**
+ * @brief field id of a DataLog field name
+ * 
+ * @param name 
+ * @return int, -1 => unknown
+ */
+int datalog_field_id(const char* name)
+{
+    for (size_t i = 0; i < DATALOG_NFIELDS; i++)
+    {
+        if (0 == strcmp(datalog_fields[i].name, name))
+            return (int) i;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief encode one meter sample
+ * 
+ * @param fmt 
+ * @param data 
+ * @param measurement, line protocol only
+ * @param buf 
+ * @param size 
+ * @return int, payload length, -1 => error / buffer too small
+ */
+int encode_meter_data(int fmt, const meter_data_log* data, const char* measurement, uint8_t* buf, size_t size)
+{
+    int n;
+
+    switch (fmt)
+    {
+    case ENC_RAW:
+        if (size < sizeof(meter_data_log))
+            return -1;
+
+        memcpy(buf, data, sizeof(meter_data_log));
+        return sizeof(meter_data_log);
+
+    case ENC_JSON:
+        n = meter_data_to_json(data, (char*) buf, size);
+        return (n < 0 || (size_t) n >= size) ? -1 : n;
+
+    case ENC_LINE:
+        n = snprintf((char*) buf, size, "%s,meter=%u "
+                            "voltage=%f,"
+                            "current=%f,"
+                            "power=%f,"
+                            "reactive_power=%f,"
+                            "power_factor=%f,"
+                            "freq=%f,"
+                            "import_active=%f,"
+                            "export_active=%f",
+            measurement ? measurement : "meter", data->meter_id, 
+            data->voltage, data->current, data->power, data->reactive_power,
+            data->power_factor, data->freq, data->import_active, data->export_active);
+        if (n < 0 || (size_t) n >= size)
+            return -1;
+
+        // ns precision, the server time is used without it
+        if (data->timestamp_ns != 0)
+        {
+            int m = snprintf((char*) buf + n, size - n, " %llu", (unsigned long long) data->timestamp_ns);
+            if (m < 0 || (size_t) m >= size - n)
+                return -1;
+            n += m;
+        }
+        return n;
+
+    case ENC_CBOR:
+    case ENC_MSGPACK:
+        {
+            enc_buf b = { buf, 0, size, 0 };
+
+            map_begin(&b, fmt, data->timestamp_ns != 0 ? 10 : 9);
+            map_key(&b, fmt, METER_FID_METER);          map_int(&b, fmt, data->meter_id);
+            map_key(&b, fmt, METER_FID_VOLTAGE);        map_float(&b, fmt, data->voltage);
+            map_key(&b, fmt, METER_FID_CURRENT);        map_float(&b, fmt, data->current);
+            map_key(&b, fmt, METER_FID_POWER);          map_float(&b, fmt, data->power);
+            map_key(&b, fmt, METER_FID_REACTIVE_POWER); map_float(&b, fmt, data->reactive_power);
+            map_key(&b, fmt, METER_FID_POWER_FACTOR);   map_float(&b, fmt, data->power_factor);
+            map_key(&b, fmt, METER_FID_FREQ);           map_float(&b, fmt, data->freq);
+            map_key(&b, fmt, METER_FID_IMPORT_ACTIVE);  map_float(&b, fmt, data->import_active);
+            map_key(&b, fmt, METER_FID_EXPORT_ACTIVE);  map_float(&b, fmt, data->export_active);
+            if (data->timestamp_ns != 0)
+            {
+                map_key(&b, fmt, METER_FID_TIMESTAMP);  map_int(&b, fmt, (int64_t) data->timestamp_ns);
+            }
+
+            return b.err ? -1 : (int) b.len;
+        }
+
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief encode a register map sample, the keys are the point names
+ * 
+ * @param fmt 
+ * @param x 
+ * @param measurement, line protocol only
+ * @param buf 
+ * @param size 
+ * @return int, payload length, -1 => unknown map / buffer too small
+ */
+int encode_meter_sample(int fmt, const meter_sample* x, const char* measurement, uint8_t* buf, size_t size)
+{
+    const reg_map* map = regmap_by_id(x->map_id);
+    int count = x->count;
+
+    if (fmt == ENC_RAW)
+    {
+        if (size < sizeof(meter_sample))
+            return -1;
+
+        memcpy(buf, x, sizeof(meter_sample));
+        return sizeof(meter_sample);
+    }
+
+    if (map == NULL || count > map->npoints)
+        return -1;
+
+    switch (fmt)
+    {
+    case ENC_JSON:
+        {
+            enc_buf b = { buf, 0, size, 0 };
+
+            put_printf(&b, "{\"meter\":%u,\"ts\":%llu", x->meter_id, (unsigned long long) x->timestamp_ns);
+            for (int i = 0; i < count; i++)
+                put_printf(&b, ",\"%s\":%.9g", map->points[i].name, x->values[i]);
+            put_printf(&b, "}");
+
+            return b.err ? -1 : (int) b.len;
+        }
+
+    case ENC_LINE:
+        {
+            enc_buf b = { buf, 0, size, 0 };
+
+            put_printf(&b, "%s,meter=%u,device=%s ", measurement ? measurement : "meter", x->meter_id, map->name);
+            for (int i = 0; i < count; i++)
+                put_printf(&b, "%s%s=%.9g", i ? "," : "", map->points[i].name, x->values[i]);
+            if (x->timestamp_ns != 0)
+                put_printf(&b, " %llu", (unsigned long long) x->timestamp_ns);
+
+            return b.err ? -1 : (int) b.len;
+        }
+
+    case ENC_CBOR:
+    case ENC_MSGPACK:
+        {
+            enc_buf b = { buf, 0, size, 0 };
+
+            map_begin(&b, fmt, count + 2);
+            map_string(&b, fmt, "meter");   map_int(&b, fmt, x->meter_id);
+            map_string(&b, fmt, "ts");      map_int(&b, fmt, (int64_t) x->timestamp_ns);
+
+            for (int i = 0; i < count; i++)
+            {
+                map_string(&b, fmt, map->points[i].name);
+                map_double(&b, fmt, x->values[i]);
+            }
+
+            return b.err ? -1 : (int) b.len;
+        }
+
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief exact decimal text of mant * 10^exp, no floating point
+ * 
+ * @param b 
+ * @param mant 
+ * @param exp 
+ */
+static void put_fixed(enc_buf* b, int64_t mant, int exp)
+{
+    char digits[24];
+    char text[48];
+    uint64_t u = mant < 0 ? (uint64_t) 0 - (uint64_t) mant : (uint64_t) mant;
+    int nd = 0, n = 0;
+
+    do {
+        digits[nd++] = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+
+    if (mant < 0)
+        text[n++] = '-';
+
+    if (exp >= 0)
+    {
+        while (nd > 0)
+            text[n++] = digits[--nd];
+        for (int i = 0; i < exp && n < (int) sizeof(text); i++)
+            text[n++] = '0';
+    }
+    else
+    {
+        int frac = -exp;
+
+        // leading zeros of the fraction
+        if (nd <= frac)
+        {
+            text[n++] = '0';
+            text[n++] = '.';
+            for (int i = nd; i < frac; i++)
+                text[n++] = '0';
+        }
+
+        while (nd > 0)
+        {
+            if (nd == frac && n > 0 && text[n - 1] != '.')
+                text[n++] = '.';
+            text[n++] = digits[--nd];
+        }
+    }
+
+    put_bytes(b, text, n);
+}
+
+/**
+ * @brief encode a fixed point sample, value = mant * 10^exp
+ * 
+ * Text formats get exact decimals (integer fields as 123i in line protocol),
+ * CBOR a decimal fraction (tag 4, [exp, mant]) and MessagePack an int or
+ * [exp, mant].
+ * 
+ * @param fmt 
+ * @param x 
+ * @param measurement, line protocol only
+ * @param buf 
+ * @param size 
+ * @return int, payload length, -1 => unknown map / buffer too small
+ */
+int encode_meter_fixed_sample(int fmt, const meter_fixed_sample* x, const char* measurement, uint8_t* buf, size_t size)
+{
+    const reg_map* map = regmap_by_id(x->map_id);
+    int count = x->count;
+
+    if (fmt == ENC_RAW)
+    {
+        if (size < sizeof(meter_fixed_sample))
+            return -1;
+
+        memcpy(buf, x, sizeof(meter_fixed_sample));
+        return sizeof(meter_fixed_sample);
+    }
+
+    if (map == NULL || count > map->npoints)
+        return -1;
+
+    switch (fmt)
+    {
+    case ENC_JSON:
+        {
+            enc_buf b = { buf, 0, size, 0 };
+
+            put_printf(&b, "{\"meter\":%u,\"ts\":%llu", x->meter_id, (unsigned long long) x->timestamp_ns);
+            for (int i = 0; i < count; i++)
+            {
+                put_printf(&b, ",\"%s\":", map->points[i].name);
+                put_fixed(&b, x->mant[i], x->exp[i]);
+            }
+            put_printf(&b, "}");
+
+            return b.err ? -1 : (int) b.len;
+        }
+
+    case ENC_LINE:
+        {
+            enc_buf b = { buf, 0, size, 0 };
+
+            put_printf(&b, "%s,meter=%u,device=%s ", measurement ? measurement : "meter", x->meter_id, map->name);
+            for (int i = 0; i < count; i++)
+            {
+                put_printf(&b, "%s%s=", i ? "," : "", map->points[i].name);
+                put_fixed(&b, x->mant[i], x->exp[i]);
+                if (x->exp[i] >= 0)
+                    put_u8(&b, 'i');
+            }
+            if (x->timestamp_ns != 0)
+                put_printf(&b, " %llu", (unsigned long long) x->timestamp_ns);
+
+            return b.err ? -1 : (int) b.len;
+        }
+
+    case ENC_CBOR:
+    case ENC_MSGPACK:
+        {
+            enc_buf b = { buf, 0, size, 0 };
+
+            map_begin(&b, fmt, count + 2);
+            map_string(&b, fmt, "meter");   map_int(&b, fmt, x->meter_id);
+            map_string(&b, fmt, "ts");      map_int(&b, fmt, (int64_t) x->timestamp_ns);
+
+            for (int i = 0; i < count; i++)
+            {
+                map_string(&b, fmt, map->points[i].name);
+
+                if (fmt == ENC_CBOR)
+                {
+                    cbor_head(&b, 6, 4);    // decimal fraction
+                    cbor_head(&b, 4, 2);
+                    cbor_int(&b, x->exp[i]);
+                    cbor_int(&b, x->mant[i]);
+                }
+                else if (x->exp[i] == 0)
+                    mp_int(&b, x->mant[i]);
+                else
+                {
+                    put_u8(&b, 0x92);       // fixarray [exp, mant]
+                    mp_int(&b, x->exp[i]);
+                    mp_int(&b, x->mant[i]);
+                }
+            }
+
+            return b.err ? -1 : (int) b.len;
+        }
+
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief encode an inverter datalog, only the fields present are written
+ * 
+ * @param fmt ENC_CBOR, ENC_MSGPACK or ENC_JSON
+ * @param x 
+ * @param buf 
+ * @param size 
+ * @return int, payload length, -1 => error / buffer too small
+ */
+int encode_datalog(int fmt, const struct DataLog* x, uint8_t* buf, size_t size)
+{
+    if (fmt == ENC_CBOR || fmt == ENC_MSGPACK)
+    {
+        enc_buf b = { buf, 0, size, 0 };
+        uint32_t n = 0;
+
+        for (size_t i = 0; i < DATALOG_NFIELDS; i++)
+        {
+            if (*(void* const*) ((const char*) x + datalog_fields[i].offset) != NULL)
+                n++;
+        }
+
+        map_begin(&b, fmt, n);
+
+        for (size_t i = 0; i < DATALOG_NFIELDS; i++)
+        {
+            const void* p = *(void* const*) ((const char*) x + datalog_fields[i].offset);
+            if (p == NULL)
+                continue;
+
+            map_key(&b, fmt, (uint32_t) i);
+
+            switch (datalog_fields[i].type)
+            {
+            case ENC_FIELD_INT:
+                map_int(&b, fmt, *(const int64_t*) p);
+                break;
+            case ENC_FIELD_DOUBLE:
+                map_double(&b, fmt, *(const double*) p);
+                break;
+            default:
+                map_string(&b, fmt, (const char*) p);
+                break;
+            }
+        }
+
+        return b.err ? -1 : (int) b.len;
+    }
+
+    if (fmt == ENC_JSON)
+    {
+        char* s = cJSON_PrintDataLog(x);
+        int n = -1;
+
+        if (s != NULL)
+        {
+            size_t len = strlen(s);
+            if (len < size)
+            {
+                memcpy(buf, s, len + 1);
+                n = (int) len;
+            }
+            cJSON_free(s);
+        }
+
+        return n;
+    }
+
+    return -1;
+}
+
+// the bus payload type is told apart by its size
+_Static_assert(sizeof(meter_fixed_sample) != sizeof(meter_sample), "bus payload sizes must differ");
+_Static_assert(sizeof(meter_fixed_sample) != sizeof(meter_data_log), "bus payload sizes must differ");
+_Static_assert(sizeof(meter_fixed_sample) != sizeof(struct Message), "bus payload sizes must differ");
+
+/**
+ * @brief encode whatever arrived on the bus
+ * 
+ * meter_data_log is encoded field by field, meter_sample / meter_fixed_sample
+ * with the point names of its register map. struct Message carries the source
+ * payload (DataLog JSON), it is re-encoded only for CBOR/MessagePack and 
+ * passed through for the text formats.
+ * 
+ * @param fmt 
+ * @param data 
+ * @param datalen 
+ * @param measurement 
+ * @param buf 
+ * @param size 
+ * @return int, payload length, -1 => unknown data / error
+ */
+int encode_bus_data(int fmt, const void* data, int datalen, const char* measurement, uint8_t* buf, size_t size)
+{
+    if (datalen == sizeof(meter_data_log))
+        return encode_meter_data(fmt, (const meter_data_log*) data, measurement, buf, size);
+
+    if (datalen == sizeof(meter_sample))
+        return encode_meter_sample(fmt, (const meter_sample*) data, measurement, buf, size);
+
+    if (datalen == sizeof(meter_fixed_sample))
+        return encode_meter_fixed_sample(fmt, (const meter_fixed_sample*) data, measurement, buf, size);
+
+    if (datalen == sizeof(struct Message))
+    {
+        const struct Message* msg = (const struct Message*) data;
+        int len = msg->datalen;
+
+        if (len < 0 || len > (int) sizeof(msg->data))
+            return -1;
+
+        if (fmt == ENC_CBOR || fmt == ENC_MSGPACK)
+        {
+            char text[sizeof(msg->data) + 1];
+            memcpy(text, msg->data, len);
+            text[len] = '\0';
+
+            struct DataLog* x = cJSON_ParseDataLog(text);
+            if (x != NULL)
+            {
+                int n = encode_datalog(fmt, x, buf, size);
+                cJSON_DeleteDataLog(x);
+
+                return n;
+            }
+        }
+
+        // pass through
+        if ((size_t) len > size)
+            return -1;
+
+        memcpy(buf, msg->data, len);
+        return len;
+    }
+
+    return -1;
+}
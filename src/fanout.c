@@ -0,0 +1,948 @@
+/**
+ * @file fanout.c
+ * @author longdh
+ * @brief serialize once, share with every sink of the same format
+ * @version 0.1
+ * @date 2024-01-29
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * The fan-out thread is the single bus reader of the subscribed sinks. Each
+ * sample is encoded once per output (format, measurement) and the result is
+ * handed to the subscribers through their single producer / single consumer
+ * queues, the last subscriber done with it frees it. A sink whose queue is
+ * full loses the sample, the others are not held back.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "utils/fanout.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+#include "utils/slab.h"
+
+//FIXME
+extern char* strdup(const char*);
+
+/**
+ * @brief Init, the outputs are added by fanout_subscribe()
+ *
+ * @param f
+ * @param b
+ * @return int
+ */
+int fanout_init(fanout_t* f, Bus* b)
+{
+    memset(f, 0, sizeof(fanout_t));
+
+    return create_bus_reader(&f->br, b);
+}
+
+/**
+ * @brief output of a format, shared when already there
+ *
+ * @param f
+ * @param fmt
+ * @param measurement, line protocol only
+ * @return int, -1 => too many
+ */
+static int fanout_output(fanout_t* f, int fmt, const char* measurement)
+{
+    if (fmt != ENC_LINE)
+        measurement = NULL;
+
+    for (int o = 0; o < f->noutputs; o++)
+    {
+        if (f->fmt[o] != fmt)
+            continue;
+
+        if ((f->measurement[o] == NULL && measurement == NULL) ||
+            (f->measurement[o] != NULL && measurement != NULL && 0 == strcmp(f->measurement[o], measurement)))
+            return o;
+    }
+
+    if (f->noutputs >= FANOUT_MAX_OUTPUTS)
+        return -1;
+
+    f->fmt[f->noutputs] = fmt;
+    f->measurement[f->noutputs] = measurement ? strdup(measurement) : NULL;
+
+    return f->noutputs++;
+}
+
+/**
+ * @brief queue of a sink, before fanout_run()
+ *
+ * @param f
+ * @param fmt, payload_format the sink publishes
+ * @param measurement, line protocol only
+ * @return fanout_sub*, NULL => too many sinks / formats
+ */
+fanout_sub* fanout_subscribe(fanout_t* f, int fmt, const char* measurement)
+{
+    int o;
+
+    if (f->running || f->nsubs >= FANOUT_MAX_SUBS || (o = fanout_output(f, fmt, measurement)) < 0)
+        return NULL;
+
+    fanout_sub* sub = (fanout_sub*) calloc(1, sizeof(fanout_sub));
+    if (sub == NULL)
+        return NULL;
+
+    sub->output = o;
+    sub->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sub->efd < 0)
+    {
+        free(sub);
+        return NULL;
+    }
+
+    for (int prio = 0; prio < BUS_PRIO_LANES; prio++)
+    {
+        atomic_init(&sub->head[prio], 0);
+        atomic_init(&sub->tail[prio], 0);
+    }
+    atomic_init(&sub->dropped, 0);
+
+    f->subs[f->nsubs++] = sub;
+
+    return sub;
+}
+
+/**
+ * @brief drop a reference, the last one frees the sample
+ *
+ * @param m
+ */
+void fanout_msg_release(fanout_msg* m)
+{
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1)
+        slab_free(m);
+}
+
+/**
+ * @brief queue a sample for a sink (fan-out thread)
+ *
+ * @param sub
+ * @param m
+ * @param prio, lane it came from
+ * @return int, 0 => queue full
+ */
+static int fanout_push(fanout_sub* sub, fanout_msg* m, int prio)
+{
+    unsigned int tail = atomic_load_explicit(&sub->tail[prio], memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&sub->head[prio], memory_order_acquire);
+    uint64_t one = 1;
+
+    if (tail - head >= FANOUT_QUEUE_SIZE)
+        return 0;
+
+    sub->ring[prio][tail & (FANOUT_QUEUE_SIZE - 1)] = m;
+    atomic_store_explicit(&sub->tail[prio], tail + 1, memory_order_release);
+
+    // wake the sink, a full counter only means it is awake already
+    if (write(sub->efd, &one, sizeof(one)) < 0) {}
+
+    return 1;
+}
+
+/**
+ * @brief next sample of a sink, urgent lane first (sink thread)
+ *
+ * @param sub
+ * @return fanout_msg*, NULL => empty
+ */
+static fanout_msg* fanout_pop(fanout_sub* sub)
+{
+    for (int prio = BUS_PRIO_LANES - 1; prio >= 0; prio--)
+    {
+        unsigned int head = atomic_load_explicit(&sub->head[prio], memory_order_relaxed);
+        unsigned int tail = atomic_load_explicit(&sub->tail[prio], memory_order_acquire);
+
+        if (head == tail)
+            continue;
+
+        fanout_msg* m = sub->ring[prio][head & (FANOUT_QUEUE_SIZE - 1)];
+        atomic_store_explicit(&sub->head[prio], head + 1, memory_order_release);
+
+        return m;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief encode a bus sample for every output and pass it on
+ *
+ * @param f
+ * @param data
+ * @param datalen
+ * @param prio, bus lane
+ */
+static void fanout_dispatch(fanout_t* f, const void* data, int datalen, int prio)
+{
+    static uint8_t enc[FANOUT_MAX_OUTPUTS][ENC_MAX_PAYLOAD];
+    int len[FANOUT_MAX_OUTPUTS];
+    int wanted[FANOUT_MAX_SUBS];
+    unsigned outputs = 0;
+    size_t total = sizeof(fanout_msg) + datalen;
+
+    for (int i = 0; i < f->nsubs; i++)
+    {
+        wanted[i] = bus_filter_match(f->subs[i]->filter, data, datalen);
+        if (wanted[i])
+            outputs |= 1u << f->subs[i]->output;
+    }
+
+    // filtered out by every sink
+    if (outputs == 0)
+        return;
+
+    for (int o = 0; o < f->noutputs; o++)
+    {
+        len[o] = -1;
+        if ((outputs & (1u << o)) == 0)
+            continue;
+
+        len[o] = encode_bus_data(f->fmt[o], data, datalen, f->measurement[o], enc[o], ENC_MAX_PAYLOAD - 1);
+        if (len[o] >= 0)
+            total += len[o] + 1;
+        f->encodes++;
+    }
+
+    // the sample, its bytes and the encodings in one block
+    fanout_msg* m = (fanout_msg*) slab_alloc(total);
+    if (m == NULL)
+        return;
+
+    uint8_t* p = (uint8_t*) (m + 1);
+
+    m->datalen = datalen;
+    m->data = p;
+    memcpy(p, data, datalen);
+    p += datalen;
+
+    for (int o = 0; o < FANOUT_MAX_OUTPUTS; o++)
+    {
+        m->len[o] = (o < f->noutputs) ? len[o] : -1;
+        m->payload[o] = NULL;
+
+        if (m->len[o] >= 0)
+        {
+            m->payload[o] = p;
+            memcpy(p, enc[o], len[o]);
+            p[len[o]] = '\0';
+            p += len[o] + 1;
+        }
+    }
+
+    // one reference held until all the queues have it
+    atomic_init(&m->refs, 1);
+
+    for (int i = 0; i < f->nsubs; i++)
+    {
+        if (!wanted[i])
+            continue;
+
+        atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+
+        if (!fanout_push(f->subs[i], m, prio))
+        {
+            if ((atomic_fetch_add(&f->subs[i]->dropped, 1) % 100) == 0)
+                log_message(LOG_WARNING, "fanout: sink queue %d full, sample dropped\n", i);
+            fanout_msg_release(m);
+        }
+    }
+
+    fanout_msg_release(m);
+    f->messages++;
+}
+
+/**
+ * @brief fan-out thread
+ *
+ * @param arg
+ * @return void*
+ */
+static void* fanout_task(void* arg)
+{
+    fanout_t* f = (fanout_t*) arg;
+
+    while (1)
+    {
+        void* data;
+        int datalen;
+
+        if (0 == bus_read(f->br, &data, &datalen))
+        {
+            fanout_dispatch(f, data, datalen, bus_reader_prio(f->br));
+            bus_free(data);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Do the task, nothing to do without subscribers
+ *
+ * @param f
+ * @return int
+ */
+int fanout_run(fanout_t* f)
+{
+    if (f->nsubs == 0)
+        return 0;
+
+    log_message(LOG_INFO, "fanout: %d sink(s), %d format(s)\n", f->nsubs, f->noutputs);
+
+    f->running = 1;
+
+    return
+        pthread_create(&f->task_thread, NULL, fanout_task, f);
+}
+
+/**
+ * @brief Wait until end
+ *
+ * @param f
+ * @return int
+ */
+int fanout_wait(fanout_t* f)
+{
+    if (!f->running)
+        return 0;
+
+    return
+        pthread_join(f->task_thread, NULL);
+}
+
+void fanout_log_stats(fanout_t* f)
+{
+    log_message(LOG_INFO, "fanout: %lu samples, %lu encodes\n", f->messages, f->encodes);
+
+    for (int i = 0; i < f->nsubs; i++)
+        log_message(LOG_INFO, "fanout: sink queue %d (format %d), %lu dropped\n",
+            i, f->fmt[f->subs[i]->output], (unsigned long) atomic_load(&f->subs[i]->dropped));
+}
+
+/**
+ * @brief Free task's data
+ *
+ * @param f
+ * @return int
+ */
+int fanout_term(fanout_t* f)
+{
+    fanout_log_stats(f);
+
+    for (int i = 0; i < f->nsubs; i++)
+    {
+        fanout_sub* sub = f->subs[i];
+        fanout_msg* m;
+
+        while ((m = fanout_pop(sub)) != NULL)
+            fanout_msg_release(m);
+
+        close(sub->efd);
+        free(sub->filter);
+        free(sub);
+    }
+    f->nsubs = 0;
+
+    for (int o = 0; o < f->noutputs; o++)
+        free(f->measurement[o]);
+    f->noutputs = 0;
+
+    close_bus_reader(f->br);
+    f->br = NULL;
+
+    return 0;
+}
+
+/**
+ * @brief input of a sink, its own bus reader until sink_input_use_fanout()
+ *
+ * @param in
+ * @param b
+ */
+void sink_input_init(sink_input* in, Bus* b)
+{
+    memset(in, 0, sizeof(sink_input));
+
+    create_bus_reader(&in->br, b);
+}
+
+/**
+ * @brief read from the fan-out instead of the bus, before the sink runs
+ *
+ * @param in
+ * @param f
+ * @param fmt, format the sink will ask for
+ * @param measurement
+ * @return int
+ */
+int sink_input_use_fanout(sink_input* in, fanout_t* f, int fmt, const char* measurement)
+{
+    fanout_sub* sub = fanout_subscribe(f, fmt, measurement);
+
+    if (sub == NULL)
+        return EGENERR;
+
+    // the bus copy of the sink is not read any more
+    close_bus_reader(in->br);
+    in->br = NULL;
+
+    in->sub = sub;
+    in->sub_fmt = fmt;
+
+    return sink_input_set_filter(in, in->filter);
+}
+
+/**
+ * @brief read from the write-ahead log instead of the bus, before the sink
+ *        runs: resumes after the last sample the sink delivered
+ *
+ * @param in
+ * @param w
+ * @param name, of the cursor (sink)
+ * @return int
+ */
+int sink_input_use_wal(sink_input* in, wal_t* w, const char* name)
+{
+    if ((in->wal_buf = (uint8_t*) malloc(WAL_MAX_RECORD)) == NULL)
+        return ESYSERR;
+
+    if ((in->cur = wal_cursor_open(w, name)) == NULL)
+    {
+        free(in->wal_buf);
+        in->wal_buf = NULL;
+        return EGENERR;
+    }
+
+    if (in->br != NULL)
+        close_bus_reader(in->br);
+    in->br = NULL;
+
+    return ENOERR;
+}
+
+/**
+ * @brief only read what passes the filter, set before the sink runs
+ *
+ * @param in
+ * @param filter, NULL => everything
+ * @return int
+ */
+int sink_input_set_filter(sink_input* in, const bus_filter* filter)
+{
+    bus_filter* copy = NULL;
+
+    if (filter != NULL)
+    {
+        if ((copy = (bus_filter*) malloc(sizeof(bus_filter))) == NULL)
+            return ESYSERR;
+        memcpy(copy, filter, sizeof(bus_filter));
+    }
+
+    free(in->filter);
+    in->filter = copy;
+
+    if (in->sub != NULL)
+    {
+        // checked by the fan-out thread before it encodes
+        free(in->sub->filter);
+        in->sub->filter = NULL;
+
+        if (copy != NULL && (in->sub->filter = (bus_filter*) malloc(sizeof(bus_filter))) != NULL)
+            memcpy(in->sub->filter, copy, sizeof(bus_filter));
+
+        return ENOERR;
+    }
+
+    // checked as the log is read
+    if (in->cur != NULL)
+        return ENOERR;
+
+    return bus_reader_set_filter(in->br, copy);
+}
+
+/**
+ * @brief fd readable while samples are pending (reactor mode)
+ *
+ * @param in
+ * @return int
+ */
+int sink_input_fd(sink_input* in)
+{
+    if (in->cur != NULL)
+        return in->cur->efd;
+
+    return in->sub != NULL ? in->sub->efd : bus_reader_fd(in->br);
+}
+
+/**
+ * @brief next committed record of the sink's log cursor
+ *
+ * @param in
+ * @param timeout_ms
+ * @return int
+ */
+static int sink_input_read_wal(sink_input* in, int timeout_ms)
+{
+    uint64_t v;
+    int rc;
+
+    // a publish failed, everything from its first sample is read again
+    if (in->acks != NULL)
+    {
+        pthread_mutex_lock(&in->acks->lock);
+        uint64_t from = in->acks->rewind;
+        in->acks->rewind = 0;
+        if (from != 0 && from < in->acks->floor)
+            in->acks->floor = from;
+        pthread_mutex_unlock(&in->acks->lock);
+
+        if (from != 0)
+            wal_cursor_rewind(in->cur, from);
+    }
+
+    while (1)
+    {
+        rc = wal_cursor_read(in->cur, in->wal_buf, WAL_MAX_RECORD, &in->datalen, &in->seq);
+        if (rc == ENOERR)
+        {
+            // not for this sink, as good as delivered (with the next ack when deferred)
+            if (in->filter != NULL && !bus_filter_match(in->filter, in->wal_buf, in->datalen))
+            {
+                if (!in->defer_ack)
+                    wal_cursor_ack(in->cur, in->seq);
+                continue;
+            }
+
+            in->data = in->wal_buf;
+            return ENOERR;
+        }
+
+        if (rc != EQEMPTY)
+            return rc;
+
+        struct pollfd pfd = { in->cur->efd, POLLIN, 0 };
+
+        // clear the counter and look again, a commit after it sets it again
+        if (read(in->cur->efd, &v, sizeof(v)) > 0)
+            continue;
+
+        if (timeout_ms == 0)
+            return EQEMPTY;
+
+        if (poll(&pfd, 1, timeout_ms) == 0)
+            return EQTIMEDOUT;
+    }
+}
+
+/**
+ * @brief next sample, encoded in fmt. Release with sink_input_done()
+ *
+ * @param in
+ * @param fmt, < 0 => not encoded, see sink_input_encode()
+ * @param measurement, line protocol only
+ * @param timeout_ms, < 0 => wait forever, 0 => do not wait
+ * @return int, 0 => in->data / in->payload set, EQEMPTY / EQTIMEDOUT => nothing
+ */
+int sink_input_read(sink_input* in, int fmt, const char* measurement, int timeout_ms)
+{
+    int rc;
+
+    if (in->cur != NULL)
+    {
+        if ((rc = sink_input_read_wal(in, timeout_ms)) != 0)
+            return rc;
+    }
+    else if (in->sub == NULL)
+    {
+        if (timeout_ms < 0)
+            rc = bus_read(in->br, &in->data, &in->datalen);
+        else if (timeout_ms == 0)
+            rc = bus_try_read(in->br, &in->data, &in->datalen);
+        else
+            rc = bus_read_timeout(in->br, &in->data, &in->datalen, timeout_ms);
+        if (rc != 0)
+            return rc;
+    }
+    else
+    {
+        uint64_t v;
+
+        while ((in->msg = fanout_pop(in->sub)) == NULL)
+        {
+            struct pollfd pfd = { in->sub->efd, POLLIN, 0 };
+
+            // clear the counter and look again, a push after it sets it again
+            if (read(in->sub->efd, &v, sizeof(v)) > 0)
+                continue;
+
+            if (timeout_ms == 0)
+                return EQEMPTY;
+
+            if (poll(&pfd, 1, timeout_ms) == 0)
+                return EQTIMEDOUT;
+        }
+
+        in->data = in->msg->data;
+        in->datalen = in->msg->datalen;
+    }
+
+    in->payload = NULL;
+    in->len = -1;
+
+    if (fmt >= 0)
+        sink_input_encode(in, fmt, measurement);
+
+    return 0;
+}
+
+/**
+ * @brief encoding of the current sample, shared when the fan-out made it
+ *
+ * @param in
+ * @param fmt
+ * @param measurement, line protocol only
+ * @return int, in->len
+ */
+int sink_input_encode(sink_input* in, int fmt, const char* measurement)
+{
+    // encoded once for all the sinks of the format
+    if (in->msg != NULL && fmt == in->sub_fmt)
+    {
+        in->payload = in->msg->payload[in->sub->output];
+        in->len = in->msg->len[in->sub->output];
+        return in->len;
+    }
+
+    in->len = encode_bus_data(fmt, in->data, in->datalen, measurement, in->buf, sizeof(in->buf) - 1);
+    if (in->len >= 0)
+        in->buf[in->len] = '\0';
+    in->payload = in->buf;
+
+    return in->len;
+}
+
+/**
+ * @brief release the sample of the last sink_input_read()
+ *
+ * @param in
+ */
+void sink_input_done(sink_input* in)
+{
+    if (in->cur != NULL)
+    {
+        // handed over: acknowledged, persisted with the next commit
+        if (in->data != NULL && !in->defer_ack)
+            wal_cursor_ack(in->cur, in->seq);
+    }
+    else if (in->msg != NULL)
+        fanout_msg_release(in->msg);
+    else if (in->data != NULL)
+        bus_free(in->data);
+
+    in->msg = NULL;
+    in->data = NULL;
+    in->payload = NULL;
+}
+
+/**
+ * @brief release the sample of the last sink_input_read(), not delivered:
+ *        read again from the log, dropped when reading the bus
+ *
+ * @param in
+ */
+void sink_input_retry(sink_input* in)
+{
+    if (in->cur != NULL && in->data != NULL)
+    {
+        wal_cursor_rewind(in->cur, in->seq);
+
+        in->data = NULL;
+        in->payload = NULL;
+        return;
+    }
+
+    sink_input_done(in);
+}
+
+/**
+ * @brief delivered up to seq, for a sink acknowledging the log itself
+ *        (defer_ack) once its server confirmed. Any thread
+ *
+ * @param in
+ * @param seq, in->seq of the last sample delivered, 0 => none
+ */
+void sink_input_ack(sink_input* in, uint64_t seq)
+{
+    if (in->cur != NULL && seq != 0)
+        wal_cursor_ack(in->cur, seq);
+}
+
+/**
+ * @brief the log acknowledged as the server confirms each publish, whatever
+ *        the order: sink_input_sent() / sink_input_confirmed(). Before the
+ *        sink runs
+ *
+ * @param in
+ * @return int
+ */
+int sink_input_defer(sink_input* in)
+{
+    in->defer_ack = 1;
+
+    // nothing to acknowledge on the bus
+    if (in->cur == NULL || in->acks != NULL)
+        return ENOERR;
+
+    if ((in->acks = (sink_acks*) calloc(1, sizeof(sink_acks))) == NULL)
+    {
+        in->defer_ack = 0;
+        return ESYSERR;
+    }
+
+    pthread_mutex_init(&in->acks->lock, NULL);
+    pthread_cond_init(&in->acks->cond, NULL);
+
+    return ENOERR;
+}
+
+/**
+ * @brief acknowledge below the lowest sample not confirmed, called with the lock
+ *
+ * @param in
+ */
+static void sink_acks_update(sink_input* in)
+{
+    sink_acks* a = in->acks;
+    uint64_t low = a->floor;
+
+    if (a->rewind != 0 && a->rewind < low)
+        low = a->rewind;
+    if (a->stuck != 0 && a->stuck < low)
+        low = a->stuck;
+
+    for (int i = 0; i < a->nsent; i++)
+        if (a->sent[i].first != 0 && a->sent[i].first < low)
+            low = a->sent[i].first;
+
+    if (low > a->acked + 1)
+    {
+        a->acked = low - 1;
+        wal_cursor_ack(in->cur, a->acked);
+    }
+}
+
+/**
+ * @brief a failed publish is read again from first, called with the lock
+ *
+ * @param a
+ * @param first
+ */
+static void sink_acks_rewind(sink_acks* a, uint64_t first)
+{
+    if (first != 0 && (a->rewind == 0 || first < a->rewind))
+        a->rewind = first;
+}
+
+/**
+ * @brief a publish holding the samples from first on went to the client,
+ *        by the reader
+ *
+ * @param in
+ * @param id, confirmed with it
+ * @param first
+ */
+void sink_input_sent(sink_input* in, uint64_t id, uint64_t first)
+{
+    sink_acks* a = in->acks;
+    int i;
+
+    if (a == NULL || first == 0)
+        return;
+
+    pthread_mutex_lock(&a->lock);
+
+    // the confirmation was quicker than the caller
+    for (i = 0; i < a->nsent; i++)
+        if (a->sent[i].id == id && a->sent[i].first == 0)
+            break;
+
+    if (i < a->nsent)
+    {
+        if (!a->sent[i].ok)
+            sink_acks_rewind(a, first);
+        a->sent[i] = a->sent[--a->nsent];
+    }
+    else if (a->nsent < SINK_UNACKED_MAX)
+    {
+        a->sent[a->nsent].id = id;
+        a->sent[a->nsent].first = first;
+        a->sent[a->nsent].ok = 0;
+        a->nsent++;
+    }
+    else
+    {
+        // not followed, the log stays acknowledged below it until a restart
+        if (a->stuck == 0)
+            log_message(LOG_WARNING, "sink: %d publishes unconfirmed, acknowledging stops at %llu\n",
+                SINK_UNACKED_MAX, (unsigned long long) first);
+        if (a->stuck == 0 || first < a->stuck)
+            a->stuck = first;
+    }
+
+    sink_acks_update(in);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * @brief the server confirmed (ok) or refused a publish. Any thread
+ *
+ * @param in
+ * @param id, of sink_input_sent()
+ * @param ok, 0 => read its samples again
+ */
+void sink_input_confirmed(sink_input* in, uint64_t id, int ok)
+{
+    sink_acks* a = in->acks;
+    int i;
+
+    if (a == NULL)
+        return;
+
+    pthread_mutex_lock(&a->lock);
+
+    for (i = 0; i < a->nsent; i++)
+        if (a->sent[i].id == id && a->sent[i].first != 0)
+            break;
+
+    if (i < a->nsent)
+    {
+        if (!ok)
+            sink_acks_rewind(a, a->sent[i].first);
+        a->sent[i] = a->sent[--a->nsent];
+    }
+    else if (a->nsent < SINK_UNACKED_MAX)
+    {
+        // before sink_input_sent(), it finishes the job
+        a->sent[a->nsent].id = id;
+        a->sent[a->nsent].first = 0;
+        a->sent[a->nsent].ok = ok;
+        a->nsent++;
+    }
+
+    sink_acks_update(in);
+    pthread_cond_broadcast(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * @brief a publish of the samples from first on could not go, they are read
+ *        again, by the reader
+ *
+ * @param in
+ * @param first
+ */
+void sink_input_resend(sink_input* in, uint64_t first)
+{
+    sink_acks* a = in->acks;
+
+    if (a == NULL)
+        return;
+
+    pthread_mutex_lock(&a->lock);
+    sink_acks_rewind(a, first);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * @brief what was read is published, but from held on (kept in batches),
+ *        by the reader after it handed samples over
+ *
+ * @param in
+ * @param held, lowest seq the sink keeps unpublished, 0 => none
+ */
+void sink_input_hold(sink_input* in, uint64_t held)
+{
+    sink_acks* a = in->acks;
+
+    if (a == NULL)
+        return;
+
+    pthread_mutex_lock(&a->lock);
+
+    a->floor = in->cur->next;
+    if (held != 0 && held < a->floor)
+        a->floor = held;
+
+    sink_acks_update(in);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * @brief publishes waiting for their confirmation
+ *
+ * @param in
+ * @return int
+ */
+int sink_input_unacked(sink_input* in)
+{
+    int n;
+
+    if (in->acks == NULL)
+        return 0;
+
+    pthread_mutex_lock(&in->acks->lock);
+    n = in->acks->nsent;
+    pthread_mutex_unlock(&in->acks->lock);
+
+    return n;
+}
+
+/**
+ * @brief wait until less than 'below' publishes are unconfirmed (thread mode)
+ *
+ * @param in
+ * @param below
+ * @param timeout_ms, < 0 => forever
+ */
+void sink_input_wait_unacked(sink_input* in, int below, int timeout_ms)
+{
+    sink_acks* a = in->acks;
+    struct timespec deadline;
+
+    if (a == NULL)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (timeout_ms > 0)
+    {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&a->lock);
+    while (a->nsent >= below && timeout_ms != 0)
+    {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&a->cond, &a->lock);
+        else if (pthread_cond_timedwait(&a->cond, &a->lock, &deadline) != 0)
+            break;
+    }
+    pthread_mutex_unlock(&a->lock);
+}
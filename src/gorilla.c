@@ -0,0 +1,410 @@
+/**
+ * @file gorilla.c
+ * @author longdh
+ * @brief Gorilla style compression of time series (timestamps + doubles)
+ * @version 0.1
+ * @date 2024-01-26
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Timestamps (ns) are written as delta of delta:
+ *   0                      dod == 0 (deadline polling, the usual case)
+ *   10   + 7 bits          |dod| < 2^6
+ *   110  + 14 bits         |dod| < 2^13
+ *   1110 + 24 bits         |dod| < 2^23  (ms jitter)
+ *   11110 + 32 bits
+ *   11111 + 64 bits
+ * Values are XORed with the previous one:
+ *   0                      same value
+ *   10   + bits            inside the previous leading / trailing window
+ *   11   + 6 bits leading + 6 bits length-1 + bits
+ * Columns of float values (meter_data_log, float32 registers) use the same
+ * scheme on 32 bits with 5 bit window fields.
+ */
+#include <string.h>
+
+#include "utils/gorilla.h"
+
+void bw_init(bit_writer* w, uint8_t* buf, size_t cap)
+{
+    w->p = buf;
+    w->cap = cap;
+    w->bits = 0;
+    w->err = 0;
+}
+
+/**
+ * @brief append the n low bits of v
+ *
+ * @param w
+ * @param v
+ * @param n, 0..64
+ */
+void bw_put(bit_writer* w, uint64_t v, int n)
+{
+    if (n < 64)
+        v &= ((uint64_t) 1 << n) - 1;
+
+    while (n > 0 && !w->err)
+    {
+        size_t byte = w->bits >> 3;
+        int used = (int) (w->bits & 7);
+        int room = 8 - used;
+        int take = n < room ? n : room;
+
+        if (byte >= w->cap)
+        {
+            w->err = 1;
+            return;
+        }
+
+        if (used == 0)
+            w->p[byte] = 0;
+
+        w->p[byte] |= (uint8_t) (((v >> (n - take)) & ((1u << take) - 1)) << (room - take));
+        w->bits += take;
+        n -= take;
+    }
+}
+
+size_t bw_bytes(const bit_writer* w)
+{
+    return (w->bits + 7) >> 3;
+}
+
+void br_init(bit_reader* r, const uint8_t* buf, size_t nbytes)
+{
+    r->p = buf;
+    r->nbits = nbytes * 8;
+    r->pos = 0;
+    r->err = 0;
+}
+
+/**
+ * @brief next n bits
+ *
+ * @param r
+ * @param n, 0..64
+ * @return uint64_t
+ */
+uint64_t br_get(bit_reader* r, int n)
+{
+    uint64_t v = 0;
+
+    if (r->pos + n > r->nbits)
+    {
+        r->err = 1;
+        r->pos = r->nbits;
+        return 0;
+    }
+
+    while (n > 0)
+    {
+        int used = (int) (r->pos & 7);
+        int room = 8 - used;
+        int take = n < room ? n : room;
+        uint8_t byte = r->p[r->pos >> 3];
+
+        v = (v << take) | ((byte >> (room - take)) & ((1u << take) - 1));
+        r->pos += take;
+        n -= take;
+    }
+
+    return v;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+/**
+ * @brief append a timestamp
+ *
+ * @param w
+ * @param s
+ * @param t
+ */
+void gorilla_ts_put(bit_writer* w, gorilla_ts* s, int64_t t)
+{
+    if (s->n == 0)
+    {
+        bw_put(w, (uint64_t) t, 64);
+    }
+    else
+    {
+        int64_t delta = t - s->prev;
+        int64_t dod = delta - s->delta;
+        uint64_t z = zigzag(dod);
+
+        if (dod == 0)
+            bw_put(w, 0x0, 1);
+        else if (z < ((uint64_t) 1 << 7))
+        {
+            bw_put(w, 0x2, 2);
+            bw_put(w, z, 7);
+        }
+        else if (z < ((uint64_t) 1 << 14))
+        {
+            bw_put(w, 0x6, 3);
+            bw_put(w, z, 14);
+        }
+        else if (z < ((uint64_t) 1 << 24))
+        {
+            bw_put(w, 0xE, 4);
+            bw_put(w, z, 24);
+        }
+        else if (z < ((uint64_t) 1 << 32))
+        {
+            bw_put(w, 0x1E, 5);
+            bw_put(w, z, 32);
+        }
+        else
+        {
+            bw_put(w, 0x1F, 5);
+            bw_put(w, z, 64);
+        }
+
+        s->delta = delta;
+    }
+
+    s->prev = t;
+    s->n++;
+}
+
+/**
+ * @brief next timestamp
+ *
+ * @param r
+ * @param s
+ * @return int64_t
+ */
+int64_t gorilla_ts_get(bit_reader* r, gorilla_ts* s)
+{
+    if (s->n == 0)
+        s->prev = (int64_t) br_get(r, 64);
+    else
+    {
+        int ones = 0;
+        static const int widths[] = { 0, 7, 14, 24, 32, 64 };
+
+        while (ones < 5 && br_get(r, 1) == 1)
+            ones++;
+
+        int64_t dod = ones == 0 ? 0 : unzigzag(br_get(r, widths[ones]));
+
+        s->delta += dod;
+        s->prev += s->delta;
+    }
+
+    s->n++;
+
+    return s->prev;
+}
+
+/**
+ * @brief append a value
+ *
+ * @param w
+ * @param s
+ * @param v
+ */
+void gorilla_val_put(bit_writer* w, gorilla_val* s, double v)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &v, sizeof(bits));
+
+    if (s->n++ == 0)
+    {
+        bw_put(w, bits, 64);
+        s->prev = bits;
+        s->lead = 64;   // no window yet
+        s->trail = 0;
+        return;
+    }
+
+    uint64_t x = bits ^ s->prev;
+    s->prev = bits;
+
+    if (x == 0)
+    {
+        bw_put(w, 0x0, 1);
+        return;
+    }
+
+    int lead = __builtin_clzll(x);
+    int trail = __builtin_ctzll(x);
+
+    if (lead > 63)
+        lead = 63;
+
+    if (s->lead < 64 && lead >= s->lead && trail >= s->trail)
+    {
+        bw_put(w, 0x2, 2);
+        bw_put(w, x >> s->trail, 64 - s->lead - s->trail);
+        return;
+    }
+
+    int len = 64 - lead - trail;
+
+    bw_put(w, 0x3, 2);
+    bw_put(w, (uint64_t) lead, 6);
+    bw_put(w, (uint64_t) (len - 1), 6);
+    bw_put(w, x >> trail, len);
+
+    s->lead = lead;
+    s->trail = trail;
+}
+
+/**
+ * @brief next value
+ *
+ * @param r
+ * @param s
+ * @return double
+ */
+double gorilla_val_get(bit_reader* r, gorilla_val* s)
+{
+    double v;
+
+    if (s->n++ == 0)
+    {
+        s->prev = br_get(r, 64);
+        s->lead = 64;
+        s->trail = 0;
+    }
+    else if (br_get(r, 1) == 1)
+    {
+        if (br_get(r, 1) == 0)
+        {
+            int len = 64 - s->lead - s->trail;
+
+            if (s->lead >= 64 || len <= 0)
+                r->err = 1;
+            else
+                s->prev ^= br_get(r, len) << s->trail;
+        }
+        else
+        {
+            int lead = (int) br_get(r, 6);
+            int len = (int) br_get(r, 6) + 1;
+            int trail = 64 - lead - len;
+
+            if (trail < 0)
+                r->err = 1;
+            else
+            {
+                s->prev ^= br_get(r, len) << trail;
+                s->lead = lead;
+                s->trail = trail;
+            }
+        }
+    }
+
+    memcpy(&v, &s->prev, sizeof(v));
+
+    return v;
+}
+
+/**
+ * @brief append a value of a float column (32 bit XOR, 5 bit window fields)
+ *
+ * @param w
+ * @param s
+ * @param v
+ */
+void gorilla_f32_put(bit_writer* w, gorilla_val* s, float v)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &v, sizeof(bits));
+
+    if (s->n++ == 0)
+    {
+        bw_put(w, bits, 32);
+        s->prev = bits;
+        s->lead = 32;
+        s->trail = 0;
+        return;
+    }
+
+    uint32_t x = bits ^ (uint32_t) s->prev;
+    s->prev = bits;
+
+    if (x == 0)
+    {
+        bw_put(w, 0x0, 1);
+        return;
+    }
+
+    int lead = __builtin_clz(x);
+    int trail = __builtin_ctz(x);
+
+    if (s->lead < 32 && lead >= s->lead && trail >= s->trail)
+    {
+        bw_put(w, 0x2, 2);
+        bw_put(w, x >> s->trail, 32 - s->lead - s->trail);
+        return;
+    }
+
+    int len = 32 - lead - trail;
+
+    bw_put(w, 0x3, 2);
+    bw_put(w, (uint64_t) lead, 5);
+    bw_put(w, (uint64_t) (len - 1), 5);
+    bw_put(w, x >> trail, len);
+
+    s->lead = lead;
+    s->trail = trail;
+}
+
+float gorilla_f32_get(bit_reader* r, gorilla_val* s)
+{
+    uint32_t bits;
+    float v;
+
+    if (s->n++ == 0)
+    {
+        s->prev = br_get(r, 32);
+        s->lead = 32;
+        s->trail = 0;
+    }
+    else if (br_get(r, 1) == 1)
+    {
+        if (br_get(r, 1) == 0)
+        {
+            int len = 32 - s->lead - s->trail;
+
+            if (s->lead >= 32 || len <= 0)
+                r->err = 1;
+            else
+                s->prev ^= br_get(r, len) << s->trail;
+        }
+        else
+        {
+            int lead = (int) br_get(r, 5);
+            int len = (int) br_get(r, 5) + 1;
+            int trail = 32 - lead - len;
+
+            if (trail < 0)
+                r->err = 1;
+            else
+            {
+                s->prev ^= br_get(r, len) << trail;
+                s->lead = lead;
+                s->trail = trail;
+            }
+        }
+    }
+
+    bits = (uint32_t) s->prev;
+    memcpy(&v, &bits, sizeof(v));
+
+    return v;
+}
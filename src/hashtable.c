@@ -34,20 +34,110 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sched.h>
 
 #include "hashtable.h"
 
+/******************************************************************************/
+/* Definitions                                                                */
+/******************************************************************************/
+
+/* Minimum number of slots of a table */
+#define HASHTABLE_MIN_SIZE (8)
+
+/* Grow when the table is 7/8 full */
+#define HASHTABLE_MAX_LOAD(size) (((size) >> 3) * 7)
+
+/* Number of old slots migrated on each write during a resize */
+#define HASHTABLE_MIGRATE_STEP (16)
+
+/* Relaxed access to the slots, which are read concurrently by the lookups */
+#define HT_LOAD(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+#define HT_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
 /******************************************************************************/
 /* Prototypes                                                                 */
 /******************************************************************************/
 
 /**
  * @brief Compute hash value of the wanted key
- * @param hashtable Hashtable instance
  * @param key Key as string
- * @return Hash value modulo hashtable size to be used in the hashtable table
+ * @return Hash value of the key
  */
-static size_t hashtable_compute_hash(hashtable_t *hashtable, char *key);
+static uint32_t hashtable_compute_hash(const char *key);
+
+/**
+ * @brief Allocate an empty table
+ * @param size Number of slots, power of 2
+ * @return Table if the function succeeded, NULL otherwise
+ */
+static hashtable_table_t *hashtable_table_alloc(size_t size);
+
+/**
+ * @brief Find the slot of the wanted key in a table
+ * @param table Table
+ * @param hash Hash value of the key
+ * @param key Key of the element
+ * @return Slot index if found, -1 otherwise
+ */
+static long hashtable_table_find(hashtable_table_t *table, uint32_t hash, const char *key);
+
+/**
+ * @brief Insert a new element in a table (the key must not be present)
+ * @param table Table
+ * @param hash Hash value of the key
+ * @param key Key of the element
+ * @param e Element
+ */
+static void hashtable_table_insert(hashtable_table_t *table, uint32_t hash, char *key, void *e);
+
+/**
+ * @brief Remove the element at the wanted slot (backward shift deletion)
+ * @param table Table
+ * @param index Slot index
+ */
+static void hashtable_table_delete(hashtable_table_t *table, size_t index);
+
+/**
+ * @brief Migrate some slots of the old table to the current one, called with the writer lock
+ * @param hashtable Hashtable instance
+ * @param steps Maximum number of slots to be migrated, 0 to finish the migration
+ */
+static void hashtable_migrate(hashtable_t *hashtable, size_t steps);
+
+/**
+ * @brief Defer the release of memory that a lookup may still read
+ * @param hashtable Hashtable instance
+ * @param ptr Memory to be released
+ */
+static void hashtable_retire(hashtable_t *hashtable, void *ptr);
+
+/**
+ * @brief Release retired memory if no lookup is in progress, called with the writer lock
+ * @param hashtable Hashtable instance
+ */
+static void hashtable_reclaim(hashtable_t *hashtable);
+
+/**
+ * @brief Start a modification of the tables, called with the writer lock
+ * @param hashtable Hashtable instance
+ */
+static void hashtable_write_begin(hashtable_t *hashtable);
+
+/**
+ * @brief End a modification of the tables, called with the writer lock
+ * @param hashtable Hashtable instance
+ */
+static void hashtable_write_end(hashtable_t *hashtable);
+
+/**
+ * @brief Lock-free lookup of the wanted key
+ * @param hashtable Hashtable instance
+ * @param key Key of the element
+ * @param e Element found (may be NULL)
+ * @return true if the key is found, false otherwise
+ */
+static bool hashtable_find(hashtable_t *hashtable, char *key, void **e);
 
 /******************************************************************************/
 /* Functions                                                                  */
@@ -55,7 +145,7 @@ static size_t hashtable_compute_hash(hashtable_t *hashtable, char *key);
 
 /**
  * @brief Function used to create hashtable instance
- * @param size Horizontal size of the hashtable
+ * @param size Expected number of elements, the hashtable grows when needed
  * @param alloc true if element should be allocated when they are added in the hashtable, false for a copy only
  * @return Hashtable instance if the function succeeded, NULL otherwise
  */
@@ -70,19 +160,23 @@ hashtable_create(size_t size, bool alloc) {
     }
     memset(hashtable, 0, sizeof(hashtable_t));
 
+    /* Round the table up to a power of 2 holding size elements under the max load */
+    size_t slots = HASHTABLE_MIN_SIZE;
+    while (HASHTABLE_MAX_LOAD(slots) < size) {
+        slots <<= 1;
+    }
+
     /* Create table */
-    if (NULL == (hashtable->table = (hashtable_element_t **)malloc(size * sizeof(hashtable_element_t *)))) {
+    if (NULL == (hashtable->table = hashtable_table_alloc(slots))) {
         /* Unable to allocate memory */
         free(hashtable);
         return NULL;
     }
-    memset(hashtable->table, 0, size * sizeof(hashtable_element_t *));
 
-    /* Save size and alloc flag */
-    hashtable->size  = size;
+    /* Save alloc flag */
     hashtable->alloc = alloc;
 
-    /* Initialize semaphore used to access the hashtable */
+    /* Initialize semaphore used to serialize the writers */
     sem_init(&hashtable->sem, 0, 1);
 
     return hashtable;
@@ -102,77 +196,87 @@ hashtable_add(hashtable_t *hashtable, char *key, void *e, size_t size) {
     assert(NULL != hashtable);
     assert(NULL != key);
 
-    /* Wait semaphore */
-    sem_wait(&hashtable->sem);
+    /* Prepare the element outside of the write section */
+    void *elem = e;
+    if ((true == hashtable->alloc) && (NULL != e) && (0 != size)) {
+        if (NULL == (elem = malloc(size))) {
+            /* Unable to allocate memory */
+            return -1;
+        }
+        memcpy(elem, e, size);
+    }
 
     /* Compute hash value of the wanted key */
-    size_t hash = hashtable_compute_hash(hashtable, key);
+    uint32_t hash = hashtable_compute_hash(key);
+
+    /* Wait semaphore */
+    sem_wait(&hashtable->sem);
 
     /* Check if the element already exist, update the element in this case */
-    hashtable_element_t *last = NULL;
-    hashtable_element_t *curr = hashtable->table[hash];
-    while (NULL != curr) {
-        if (!strcmp(curr->key, key)) {
-            /* Element found */
-            if ((true == hashtable->alloc) && (NULL != curr->e)) {
-                free(curr->e);
-                curr->e = NULL;
-            }
-            if ((true == hashtable->alloc) && (NULL != e) && (0 != size)) {
-                if (NULL == (curr->e = malloc(size))) {
-                    /* Unable to allocate memory */
-                    sem_post(&hashtable->sem);
-                    return -1;
-                }
-                memcpy(curr->e, e, size);
-            } else {
-                curr->e = e;
-            }
-            sem_post(&hashtable->sem);
-            return 0;
-        }
-        last = curr;
-        curr = curr->next;
+    hashtable_table_t *table = NULL;
+    long               index = hashtable_table_find(hashtable->table, hash, key);
+    if (0 <= index) {
+        table = hashtable->table;
+    } else if ((NULL != hashtable->old) && (0 <= (index = hashtable_table_find(hashtable->old, hash, key)))) {
+        table = hashtable->old;
     }
 
-    /* Element not found, create a new hashtable element */
-    hashtable_element_t *hashtable_element = (hashtable_element_t *)malloc(sizeof(hashtable_element_t));
-    if (NULL == hashtable_element) {
-        /* Unable to allocate memory */
+    if (NULL != table) {
+        /* Element found, a lookup may still be reading the previous one */
+        void *prev = table->slots[index].e;
+        HT_STORE(&table->slots[index].e, elem);
+        if ((true == hashtable->alloc) && (NULL != prev)) {
+            hashtable_retire(hashtable, prev);
+        }
+        hashtable_reclaim(hashtable);
         sem_post(&hashtable->sem);
-        return -1;
+        return 0;
     }
-    memset(hashtable_element, 0, sizeof(hashtable_element_t));
 
-    /* Store key */
-    if (NULL == (hashtable_element->key = strdup(key))) {
+    /* Element not found, store key */
+    char *k = strdup(key);
+    if (NULL == k) {
         /* Unable to allocate memory */
-        free(hashtable_element);
+        if (elem != e) {
+            free(elem);
+        }
         sem_post(&hashtable->sem);
         return -1;
     }
 
-    /* Store element */
-    if ((true == hashtable->alloc) && (NULL != e) && (0 != size)) {
-        if (NULL == (hashtable_element->e = malloc(size))) {
+    /* Start a resize when the table is full, the elements are moved by the next writes */
+    hashtable_table_t *grown = NULL;
+    if (hashtable->count + 1 > HASHTABLE_MAX_LOAD(hashtable->table->size)) {
+        if (NULL == (grown = hashtable_table_alloc(hashtable->table->size << 1))) {
             /* Unable to allocate memory */
-            free(hashtable_element->key);
-            free(hashtable_element);
+            free(k);
+            if (elem != e) {
+                free(elem);
+            }
             sem_post(&hashtable->sem);
             return -1;
         }
-        memcpy(hashtable_element->e, e, size);
-    } else {
-        hashtable_element->e = e;
     }
 
-    /* Add element to the hashtable */
-    if (NULL == last) {
-        hashtable->table[hash] = hashtable_element;
-    } else {
-        last->next = hashtable_element;
+    hashtable_write_begin(hashtable);
+
+    if (NULL != grown) {
+        /* Previous resize must be complete before starting another one */
+        hashtable_migrate(hashtable, 0);
+        __atomic_store_n(&hashtable->old, hashtable->table, __ATOMIC_RELAXED);
+        hashtable->migrated = 0;
+        __atomic_store_n(&hashtable->table, grown, __ATOMIC_RELAXED);
     }
-    hashtable->count++;
+
+    /* Add element to the hashtable */
+    hashtable_table_insert(hashtable->table, hash, k, elem);
+    __atomic_store_n(&hashtable->count, hashtable->count + 1, __ATOMIC_RELAXED);
+
+    /* Move some of the old elements */
+    hashtable_migrate(hashtable, HASHTABLE_MIGRATE_STEP);
+
+    hashtable_write_end(hashtable);
+    hashtable_reclaim(hashtable);
 
     /* Release semaphore */
     sem_post(&hashtable->sem);
@@ -190,18 +294,7 @@ hashtable_get_count(hashtable_t *hashtable) {
 
     assert(NULL != hashtable);
 
-    size_t count = 0;
-
-    /* Wait semaphore */
-    sem_wait(&hashtable->sem);
-
-    /* Get number of elements */
-    count = hashtable->count;
-
-    /* Release semaphore */
-    sem_post(&hashtable->sem);
-
-    return count;
+    return __atomic_load_n(&hashtable->count, __ATOMIC_RELAXED);
 }
 
 /**
@@ -216,29 +309,9 @@ hashtable_has_key(hashtable_t *hashtable, char *key) {
     assert(NULL != hashtable);
     assert(NULL != key);
 
-    bool found = false;
+    void *e;
 
-    /* Wait semaphore */
-    sem_wait(&hashtable->sem);
-
-    /* Compute hash value of the wanted key */
-    size_t hash = hashtable_compute_hash(hashtable, key);
-
-    /* Lookup for the wanted element */
-    hashtable_element_t *curr = hashtable->table[hash];
-    while (NULL != curr) {
-        if (!strcmp(curr->key, key)) {
-            /* Element found */
-            found = true;
-            break;
-        }
-        curr = curr->next;
-    }
-
-    /* Release semaphore */
-    sem_post(&hashtable->sem);
-
-    return found;
+    return hashtable_find(hashtable, key, &e);
 }
 
 /**
@@ -266,14 +339,18 @@ hashtable_get_keys(hashtable_t *hashtable, char ***keys) {
         /* Create table of keys */
         if (NULL != (*keys = (char **)malloc(count * sizeof(char *)))) {
 
-            /* Parse table and store keys */
-            size_t index = 0;
-            for (size_t hash = 0; hash < hashtable->size; hash++) {
-                hashtable_element_t *curr = hashtable->table[hash];
-                while (NULL != curr) {
-                    (*keys)[index] = curr->key;
-                    index++;
-                    curr = curr->next;
+            /* Parse tables and store keys */
+            size_t             index     = 0;
+            hashtable_table_t *tables[2] = { hashtable->table, hashtable->old };
+            for (int t = 0; t < 2; t++) {
+                if (NULL == tables[t]) {
+                    continue;
+                }
+                for (size_t i = 0; i < tables[t]->size; i++) {
+                    if (0 != tables[t]->slots[i].dist) {
+                        (*keys)[index] = tables[t]->slots[i].key;
+                        index++;
+                    }
                 }
             }
         }
@@ -286,7 +363,7 @@ hashtable_get_keys(hashtable_t *hashtable, char ***keys) {
 }
 
 /**
- * @brief Lookup element of the hashtable
+ * @brief Lookup element of the hashtable, does not block on the writers
  * @param hashtable Hashtable instance
  * @param key Key of the element
  * @return Element of the hashtable, NULL if not found
@@ -299,26 +376,10 @@ hashtable_lookup(hashtable_t *hashtable, char *key) {
 
     void *e = NULL;
 
-    /* Wait semaphore */
-    sem_wait(&hashtable->sem);
-
-    /* Compute hash value of the wanted key */
-    size_t hash = hashtable_compute_hash(hashtable, key);
-
-    /* Lookup for the wanted element */
-    hashtable_element_t *curr = hashtable->table[hash];
-    while (NULL != curr) {
-        if (!strcmp(curr->key, key)) {
-            /* Element found */
-            e = curr->e;
-            break;
-        }
-        curr = curr->next;
+    if (false == hashtable_find(hashtable, key, &e)) {
+        return NULL;
     }
 
-    /* Release semaphore */
-    sem_post(&hashtable->sem);
-
     return e;
 }
 
@@ -336,32 +397,35 @@ hashtable_remove(hashtable_t *hashtable, char *key) {
 
     void *e = NULL;
 
+    /* Compute hash value of the wanted key */
+    uint32_t hash = hashtable_compute_hash(key);
+
     /* Wait semaphore */
     sem_wait(&hashtable->sem);
 
-    /* Compute hash value of the wanted key */
-    size_t hash = hashtable_compute_hash(hashtable, key);
-
     /* Lookup for the wanted element */
-    hashtable_element_t *last = NULL;
-    hashtable_element_t *curr = hashtable->table[hash];
-    while (NULL != curr) {
-        if (!strcmp(curr->key, key)) {
-            /* Element found */
-            e = curr->e;
-            /* Update the list of elements */
-            if (NULL == last) {
-                hashtable->table[hash] = curr->next;
-            } else {
-                last->next = curr->next;
-            }
-            /* Release memory */
-            free(curr->key);
-            free(curr);
-            break;
-        }
-        last = curr;
-        curr = curr->next;
+    hashtable_table_t *table = hashtable->table;
+    long               index = hashtable_table_find(table, hash, key);
+    if ((0 > index) && (NULL != hashtable->old)) {
+        table = hashtable->old;
+        index = hashtable_table_find(table, hash, key);
+    }
+
+    if (0 <= index) {
+        /* Element found */
+        e       = table->slots[index].e;
+        char *k = table->slots[index].key;
+
+        /* Update the table of elements */
+        hashtable_write_begin(hashtable);
+        hashtable_table_delete(table, (size_t)index);
+        __atomic_store_n(&hashtable->count, hashtable->count - 1, __ATOMIC_RELAXED);
+        hashtable_migrate(hashtable, HASHTABLE_MIGRATE_STEP);
+        hashtable_write_end(hashtable);
+
+        /* Release memory once no lookup can read the key */
+        hashtable_retire(hashtable, k);
+        hashtable_reclaim(hashtable);
     }
 
     /* Release semaphore */
@@ -384,21 +448,31 @@ hashtable_release(hashtable_t *hashtable) {
         sem_wait(&hashtable->sem);
 
         /* Release hashtable elements */
-        for (size_t hash = 0; hash < hashtable->size; hash++) {
-            hashtable_element_t *curr = hashtable->table[hash];
-            while (NULL != curr) {
-                hashtable_element_t *tmp = curr;
-                curr                     = curr->next;
-                free(tmp->key);
-                if ((true == hashtable->alloc) && (NULL != tmp->e)) {
-                    free(tmp->e);
+        hashtable_table_t *tables[2] = { hashtable->table, hashtable->old };
+        for (int t = 0; t < 2; t++) {
+            if (NULL == tables[t]) {
+                continue;
+            }
+            for (size_t i = 0; i < tables[t]->size; i++) {
+                hashtable_element_t *curr = &tables[t]->slots[i];
+                if (0 != curr->dist) {
+                    free(curr->key);
+                    if ((true == hashtable->alloc) && (NULL != curr->e)) {
+                        free(curr->e);
+                    }
                 }
-                free(tmp);
             }
+            free(tables[t]);
         }
 
-        /* Release table */
-        free(hashtable->table);
+        /* Release retired memory, no lookup can be running at this point */
+        hashtable_retired_t *curr = hashtable->retired;
+        while (NULL != curr) {
+            hashtable_retired_t *tmp = curr;
+            curr                     = curr->next;
+            free(tmp->ptr);
+            free(tmp);
+        }
 
         /* Release semaphore */
         sem_post(&hashtable->sem);
@@ -411,22 +485,316 @@ hashtable_release(hashtable_t *hashtable) {
 
 /**
  * @brief Compute hash value of the wanted key
- * @param hashtable Hashtable instance
  * @param key Key as string
- * @return Hash value modulo hashtable size to be used in the hashtable table
+ * @return Hash value of the key
  */
-static size_t
-hashtable_compute_hash(hashtable_t *hashtable, char *key) {
+static uint32_t
+hashtable_compute_hash(const char *key) {
 
-    assert(NULL != hashtable);
     assert(NULL != key);
 
-    /* Compute djb2 hash */
-    int           c;
-    unsigned long hash = 5381;
-    while (0 != (c = *key++)) {
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    /* Process the key 8 bytes at a time */
+    size_t   len  = strlen(key);
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (len * 0xff51afd7ed558ccdULL);
+    uint64_t word;
+
+    while (len >= sizeof(uint64_t)) {
+        memcpy(&word, key, sizeof(uint64_t));
+        hash ^= word * 0xc4ceb9fe1a85ec53ULL;
+        hash = ((hash << 31) | (hash >> 33)) * 0x9e3779b97f4a7c15ULL;
+        key += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
     }
 
-    return hash % hashtable->size;
+    if (0 < len) {
+        word = 0;
+        memcpy(&word, key, len);
+        hash ^= word * 0xc4ceb9fe1a85ec53ULL;
+        hash = ((hash << 31) | (hash >> 33)) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    /* Final avalanche */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return (uint32_t)(hash >> 32);
+}
+
+/**
+ * @brief Allocate an empty table
+ * @param size Number of slots, power of 2
+ * @return Table if the function succeeded, NULL otherwise
+ */
+static hashtable_table_t *
+hashtable_table_alloc(size_t size) {
+
+    hashtable_table_t *table = (hashtable_table_t *)calloc(1, sizeof(hashtable_table_t) + size * sizeof(hashtable_element_t));
+    if (NULL == table) {
+        /* Unable to allocate memory */
+        return NULL;
+    }
+    table->size = size;
+
+    return table;
+}
+
+/**
+ * @brief Find the slot of the wanted key in a table
+ * @param table Table
+ * @param hash Hash value of the key
+ * @param key Key of the element
+ * @return Slot index if found, -1 otherwise
+ */
+static long
+hashtable_table_find(hashtable_table_t *table, uint32_t hash, const char *key) {
+
+    size_t mask = table->size - 1;
+    size_t pos  = hash & mask;
+
+    /* Robin Hood: the key can not be further than an element closer to its home */
+    for (uint32_t dist = 1; dist <= table->size; dist++) {
+        hashtable_element_t *curr = &table->slots[pos];
+        uint32_t             d    = HT_LOAD(&curr->dist);
+        if (d < dist) {
+            return -1;
+        }
+        if (HT_LOAD(&curr->hash) == hash) {
+            const char *k = HT_LOAD(&curr->key);
+            if ((NULL != k) && (!strcmp(k, key))) {
+                return (long)pos;
+            }
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Insert a new element in a table (the key must not be present)
+ * @param table Table
+ * @param hash Hash value of the key
+ * @param key Key of the element
+ * @param e Element
+ */
+static void
+hashtable_table_insert(hashtable_table_t *table, uint32_t hash, char *key, void *e) {
+
+    size_t              mask = table->size - 1;
+    size_t              pos  = hash & mask;
+    hashtable_element_t elem = { .hash = hash, .dist = 1, .key = key, .e = e };
+
+    for (;;) {
+        hashtable_element_t *curr = &table->slots[pos];
+
+        if (0 == curr->dist) {
+            /* Empty slot */
+            HT_STORE(&curr->hash, elem.hash);
+            HT_STORE(&curr->key, elem.key);
+            HT_STORE(&curr->e, elem.e);
+            HT_STORE(&curr->dist, elem.dist);
+            return;
+        }
+
+        if (curr->dist < elem.dist) {
+            /* Take the slot of the richer element and move it further */
+            hashtable_element_t tmp = *curr;
+            HT_STORE(&curr->hash, elem.hash);
+            HT_STORE(&curr->key, elem.key);
+            HT_STORE(&curr->e, elem.e);
+            HT_STORE(&curr->dist, elem.dist);
+            elem = tmp;
+        }
+
+        elem.dist++;
+        pos = (pos + 1) & mask;
+    }
+}
+
+/**
+ * @brief Remove the element at the wanted slot (backward shift deletion)
+ * @param table Table
+ * @param index Slot index
+ */
+static void
+hashtable_table_delete(hashtable_table_t *table, size_t index) {
+
+    size_t mask = table->size - 1;
+    size_t pos  = index;
+
+    for (;;) {
+        hashtable_element_t *curr = &table->slots[pos];
+        hashtable_element_t *next = &table->slots[(pos + 1) & mask];
+
+        if (next->dist <= 1) {
+            /* Next element is empty or at home */
+            HT_STORE(&curr->dist, 0);
+            HT_STORE(&curr->key, NULL);
+            HT_STORE(&curr->e, NULL);
+            return;
+        }
+
+        /* Shift the next element back */
+        HT_STORE(&curr->hash, next->hash);
+        HT_STORE(&curr->key, next->key);
+        HT_STORE(&curr->e, next->e);
+        HT_STORE(&curr->dist, next->dist - 1);
+
+        pos = (pos + 1) & mask;
+    }
+}
+
+/**
+ * @brief Migrate some slots of the old table to the current one, called with the writer lock
+ * @param hashtable Hashtable instance
+ * @param steps Maximum number of slots to be migrated, 0 to finish the migration
+ */
+static void
+hashtable_migrate(hashtable_t *hashtable, size_t steps) {
+
+    hashtable_table_t *old = hashtable->old;
+    if (NULL == old) {
+        return;
+    }
+
+    size_t done = 0;
+    while (hashtable->migrated < old->size) {
+        hashtable_element_t *curr = &old->slots[hashtable->migrated];
+
+        /* The deletion shifts the next elements back, empty the slot before moving on */
+        if (0 != curr->dist) {
+            hashtable_table_insert(hashtable->table, curr->hash, curr->key, curr->e);
+            hashtable_table_delete(old, hashtable->migrated);
+        } else {
+            hashtable->migrated++;
+        }
+
+        if ((0 != steps) && (++done >= steps)) {
+            return;
+        }
+    }
+
+    /* Old table is empty */
+    __atomic_store_n(&hashtable->old, NULL, __ATOMIC_RELAXED);
+    hashtable_retire(hashtable, old);
+}
+
+/**
+ * @brief Defer the release of memory that a lookup may still read
+ * @param hashtable Hashtable instance
+ * @param ptr Memory to be released
+ */
+static void
+hashtable_retire(hashtable_t *hashtable, void *ptr) {
+
+    hashtable_retired_t *retired = (hashtable_retired_t *)malloc(sizeof(hashtable_retired_t));
+    if (NULL == retired) {
+        /* Unable to allocate memory, leak rather than release memory in use */
+        return;
+    }
+
+    retired->ptr       = ptr;
+    retired->next      = hashtable->retired;
+    hashtable->retired = retired;
+}
+
+/**
+ * @brief Release retired memory if no lookup is in progress, called with the writer lock
+ * @param hashtable Hashtable instance
+ */
+static void
+hashtable_reclaim(hashtable_t *hashtable) {
+
+    if (NULL == hashtable->retired) {
+        return;
+    }
+
+    /* Pairs with the fence of the lookup: a lookup started after this point can not see retired memory */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (0 != __atomic_load_n(&hashtable->readers, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    hashtable_retired_t *curr = hashtable->retired;
+    hashtable->retired        = NULL;
+    while (NULL != curr) {
+        hashtable_retired_t *tmp = curr;
+        curr                     = curr->next;
+        free(tmp->ptr);
+        free(tmp);
+    }
+}
+
+/**
+ * @brief Start a modification of the tables, called with the writer lock
+ * @param hashtable Hashtable instance
+ */
+static void
+hashtable_write_begin(hashtable_t *hashtable) {
+
+    __atomic_store_n(&hashtable->seq, hashtable->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * @brief End a modification of the tables, called with the writer lock
+ * @param hashtable Hashtable instance
+ */
+static void
+hashtable_write_end(hashtable_t *hashtable) {
+
+    __atomic_store_n(&hashtable->seq, hashtable->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Lock-free lookup of the wanted key
+ * @param hashtable Hashtable instance
+ * @param key Key of the element
+ * @param e Element found (may be NULL)
+ * @return true if the key is found, false otherwise
+ */
+static bool
+hashtable_find(hashtable_t *hashtable, char *key, void **e) {
+
+    uint32_t hash  = hashtable_compute_hash(key);
+    bool     found = false;
+
+    /* Keep retired keys and tables alive while reading */
+    __atomic_fetch_add(&hashtable->readers, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (;;) {
+        unsigned int seq = __atomic_load_n(&hashtable->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            /* Writer in progress */
+            sched_yield();
+            continue;
+        }
+
+        found                    = false;
+        *e                       = NULL;
+        hashtable_table_t *table = __atomic_load_n(&hashtable->table, __ATOMIC_RELAXED);
+        hashtable_table_t *old   = __atomic_load_n(&hashtable->old, __ATOMIC_RELAXED);
+
+        long index = hashtable_table_find(table, hash, key);
+        if (0 > index && NULL != old) {
+            table = old;
+            index = hashtable_table_find(table, hash, key);
+        }
+        if (0 <= index) {
+            found = true;
+            *e    = HT_LOAD(&table->slots[index].e);
+        }
+
+        /* Retry if a writer moved the elements meanwhile */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hashtable->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+
+    __atomic_fetch_sub(&hashtable->readers, 1, __ATOMIC_RELEASE);
+
+    return found;
 }
@@ -0,0 +1,175 @@
+/**
+ * @file histogram.c
+ * @author longdh
+ * @brief fixed-size log-linear histogram (timing of the poll loops)
+ * @version 0.1
+ * @date 2024-01-19
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Negative values (early wake-ups) are counted in the first bucket but kept
+ * in min / sum.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "utils/histogram.h"
+#include "utils/logger.h"
+
+/**
+ * @brief bucket of a value: octave * HIST_SUB + linear step inside the octave
+ *
+ * @param v
+ * @return int
+ */
+static int hist_bucket(int64_t v)
+{
+    if (v < HIST_SUB)
+        return v < 0 ? 0 : (int) v;
+
+    int msb = 63 - __builtin_clzll((uint64_t) v);
+    int sub = (int) ((uint64_t) v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    int b = (msb - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+
+    return b < HIST_NBUCKETS ? b : HIST_NBUCKETS - 1;
+}
+
+/**
+ * @brief upper bound of a bucket
+ *
+ * @param b
+ * @return int64_t
+ */
+static int64_t hist_bucket_high(int b)
+{
+    if (b < HIST_SUB)
+        return b;
+
+    int msb = b / HIST_SUB + HIST_SUB_BITS - 1;
+    int64_t step = (int64_t) 1 << (msb - HIST_SUB_BITS);
+
+    return ((int64_t) 1 << msb) + (b % HIST_SUB + 1) * step - 1;
+}
+
+/**
+ * @brief Init
+ *
+ * @param h
+ * @param name, for logging (not copied)
+ */
+void histogram_init(histogram_t* h, const char* name)
+{
+    memset(h, 0, sizeof(histogram_t));
+
+    h->name = name;
+    pthread_mutex_init(&h->lock, NULL);
+}
+
+void histogram_destroy(histogram_t* h)
+{
+    pthread_mutex_destroy(&h->lock);
+}
+
+/**
+ * @brief start a new period
+ *
+ * @param h
+ */
+void histogram_reset(histogram_t* h)
+{
+    pthread_mutex_lock(&h->lock);
+
+    h->count = 0;
+    h->min = h->max = h->sum = 0;
+    memset(h->buckets, 0, sizeof(h->buckets));
+
+    pthread_mutex_unlock(&h->lock);
+}
+
+/**
+ * @brief Add a value
+ *
+ * @param h
+ * @param value
+ */
+void histogram_record(histogram_t* h, int64_t value)
+{
+    pthread_mutex_lock(&h->lock);
+
+    if (h->count == 0 || value < h->min)
+        h->min = value;
+    if (h->count == 0 || value > h->max)
+        h->max = value;
+
+    h->count++;
+    h->sum += value;
+    h->buckets[hist_bucket(value)]++;
+
+    pthread_mutex_unlock(&h->lock);
+}
+
+/**
+ * @brief value below which p % of the samples are (bucket upper bound)
+ *
+ * @param h
+ * @param p, 0..100
+ * @return int64_t
+ */
+int64_t histogram_percentile(histogram_t* h, double p)
+{
+    int64_t v = 0;
+
+    pthread_mutex_lock(&h->lock);
+
+    if (h->count > 0)
+    {
+        uint64_t rank = (uint64_t) (p / 100.0 * (double) h->count + 0.5);
+        uint64_t seen = 0;
+
+        if (rank == 0)
+            rank = 1;
+
+        v = h->max;
+        for (int b = 0; b < HIST_NBUCKETS; b++)
+        {
+            seen += h->buckets[b];
+            if (seen >= rank)
+            {
+                v = hist_bucket_high(b);
+                break;
+            }
+        }
+
+        // the bucket bound may overshoot the real extremes
+        if (v > h->max)
+            v = h->max;
+        if (v < h->min)
+            v = h->min;
+    }
+
+    pthread_mutex_unlock(&h->lock);
+
+    return v;
+}
+
+/**
+ * @brief log count, min, mean, percentiles, max
+ *
+ * @param h
+ * @param unit, label of the values
+ */
+void histogram_log(histogram_t* h, const char* unit)
+{
+    int64_t p50 = histogram_percentile(h, 50.0);
+    int64_t p99 = histogram_percentile(h, 99.0);
+    int64_t p999 = histogram_percentile(h, 99.9);
+
+    pthread_mutex_lock(&h->lock);
+
+    if (h->count > 0)
+        log_message(LOG_INFO, "%s: n=%llu min=%lld avg=%lld p50=%lld p99=%lld p99.9=%lld max=%lld %s\n",
+            h->name, (unsigned long long) h->count, (long long) h->min, (long long) (h->sum / (int64_t) h->count),
+            (long long) p50, (long long) p99, (long long) p999, (long long) h->max, unit);
+
+    pthread_mutex_unlock(&h->lock);
+}
@@ -0,0 +1,451 @@
+/**
+ * @file ilist.c
+ * @author longdh
+ * @brief intrusive list, element pool and lock-free queue
+ * @version 0.1
+ * @date 2024-01-15
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ilist.h"
+
+/******************************************************************************/
+/* Definitions                                                                */
+/******************************************************************************/
+
+/* Elements of a pool must hold the free list link */
+#define ILIST_POOL_ALIGN (sizeof(void *))
+
+/* Header of a block of the pool, elements follow */
+typedef struct ilist_pool_block_s {
+    struct ilist_pool_block_s *next;
+} ilist_pool_block_t;
+
+/******************************************************************************/
+/* List                                                                       */
+/******************************************************************************/
+
+/**
+ * @brief Initialize an empty list
+ * @param list List instance
+ */
+void
+ilist_init(ilist_t *list) {
+
+    assert(NULL != list);
+
+    list->head.prev = &list->head;
+    list->head.next = &list->head;
+    list->count     = 0;
+}
+
+/**
+ * @brief Link node between two nodes
+ * @param node Node to be added
+ * @param prev Previous node
+ * @param next Next node
+ */
+static inline void
+ilist_link(ilist_node_t *node, ilist_node_t *prev, ilist_node_t *next) {
+
+    node->prev = prev;
+    node->next = next;
+    prev->next = node;
+    next->prev = node;
+}
+
+/**
+ * @brief Add node to the head of the list
+ * @param list List instance
+ * @param node Node to be added
+ */
+void
+ilist_add_head(ilist_t *list, ilist_node_t *node) {
+
+    assert(NULL != list);
+    assert(NULL != node);
+
+    ilist_link(node, &list->head, list->head.next);
+    list->count++;
+}
+
+/**
+ * @brief Add node to the tail of the list
+ * @param list List instance
+ * @param node Node to be added
+ */
+void
+ilist_add_tail(ilist_t *list, ilist_node_t *node) {
+
+    assert(NULL != list);
+    assert(NULL != node);
+
+    ilist_link(node, list->head.prev, &list->head);
+    list->count++;
+}
+
+/**
+ * @brief Remove node of the list, the node is not released
+ * @param list List instance
+ * @param node Node to be removed
+ */
+void
+ilist_remove(ilist_t *list, ilist_node_t *node) {
+
+    assert(NULL != list);
+    assert(NULL != node);
+    assert(node != &list->head);
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev       = NULL;
+    node->next       = NULL;
+    list->count--;
+}
+
+/**
+ * @brief Remove the head node of the list
+ * @param list List instance
+ * @return Head node of the list, NULL if the list is empty
+ */
+ilist_node_t *
+ilist_pop_head(ilist_t *list) {
+
+    assert(NULL != list);
+
+    if (list->head.next == &list->head) {
+        return NULL;
+    }
+
+    ilist_node_t *node = list->head.next;
+    ilist_remove(list, node);
+
+    return node;
+}
+
+/**
+ * @brief Get number of nodes in the list
+ * @param list List instance
+ * @return Number of nodes in the list
+ */
+size_t
+ilist_get_count(ilist_t *list) {
+
+    assert(NULL != list);
+
+    return list->count;
+}
+
+/**
+ * @brief Check if the list is empty
+ * @param list List instance
+ * @return true if the list is empty, false otherwise
+ */
+bool
+ilist_is_empty(ilist_t *list) {
+
+    assert(NULL != list);
+
+    return list->head.next == &list->head;
+}
+
+/******************************************************************************/
+/* Iterator                                                                   */
+/******************************************************************************/
+
+/**
+ * @brief Start an iteration of the list
+ * @param it Iterator
+ * @param list List instance
+ */
+void
+ilist_iter_init(ilist_iter_t *it, ilist_t *list) {
+
+    assert(NULL != it);
+    assert(NULL != list);
+
+    it->list = list;
+    it->curr = &list->head;
+}
+
+/**
+ * @brief Get next node of the iteration
+ * @param it Iterator
+ * @return Next node, NULL if the end of the list is reached
+ */
+ilist_node_t *
+ilist_iter_next(ilist_iter_t *it) {
+
+    assert(NULL != it);
+
+    if (it->curr->next == &it->list->head) {
+        return NULL;
+    }
+    it->curr = it->curr->next;
+
+    return it->curr;
+}
+
+/**
+ * @brief Get previous node of the iteration
+ * @param it Iterator
+ * @return Previous node, NULL if the beginning of the list is reached
+ */
+ilist_node_t *
+ilist_iter_prev(ilist_iter_t *it) {
+
+    assert(NULL != it);
+
+    if (it->curr->prev == &it->list->head) {
+        return NULL;
+    }
+    it->curr = it->curr->prev;
+
+    return it->curr;
+}
+
+/******************************************************************************/
+/* Pool                                                                       */
+/******************************************************************************/
+
+/**
+ * @brief Initialize a pool of elements
+ * @param pool Pool instance
+ * @param size Size of one element
+ * @param count Number of elements allocated at once
+ * @return 0 if the function succeeded, -1 otherwise
+ */
+int
+ilist_pool_init(ilist_pool_t *pool, size_t size, size_t count) {
+
+    assert(NULL != pool);
+
+    if ((0 == size) || (0 == count)) {
+        return -1;
+    }
+
+    memset(pool, 0, sizeof(ilist_pool_t));
+
+    /* A free element stores the link to the next free element */
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    pool->size  = (size + ILIST_POOL_ALIGN - 1) & ~(ILIST_POOL_ALIGN - 1);
+    pool->count = count;
+
+    sem_init(&pool->sem, 0, 1);
+
+    return 0;
+}
+
+/**
+ * @brief Allocate a new block and chain its elements to the free list, called with the semaphore
+ * @param pool Pool instance
+ * @return 0 if the function succeeded, -1 otherwise
+ */
+static int
+ilist_pool_grow(ilist_pool_t *pool) {
+
+    ilist_pool_block_t *block = (ilist_pool_block_t *)malloc(sizeof(ilist_pool_block_t) + pool->size * pool->count);
+    if (NULL == block) {
+        /* Unable to allocate memory */
+        return -1;
+    }
+
+    block->next  = (ilist_pool_block_t *)pool->blocks;
+    pool->blocks = block;
+
+    char *e = (char *)(block + 1);
+    for (size_t i = 0; i < pool->count; i++, e += pool->size) {
+        *(void **)e = pool->free;
+        pool->free  = e;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get an element of the pool, the pool grows when needed
+ * @param pool Pool instance
+ * @return Element (not initialized), NULL if the memory is exhausted
+ */
+void *
+ilist_pool_get(ilist_pool_t *pool) {
+
+    assert(NULL != pool);
+
+    void *e = NULL;
+
+    /* Wait semaphore */
+    sem_wait(&pool->sem);
+
+    if ((NULL != pool->free) || (0 == ilist_pool_grow(pool))) {
+        e          = pool->free;
+        pool->free = *(void **)e;
+        pool->used++;
+    }
+
+    /* Release semaphore */
+    sem_post(&pool->sem);
+
+    return e;
+}
+
+/**
+ * @brief Give an element back to the pool
+ * @param pool Pool instance
+ * @param e Element
+ */
+void
+ilist_pool_put(ilist_pool_t *pool, void *e) {
+
+    assert(NULL != pool);
+
+    if (NULL == e) {
+        return;
+    }
+
+    /* Wait semaphore */
+    sem_wait(&pool->sem);
+
+    *(void **)e = pool->free;
+    pool->free  = e;
+    pool->used--;
+
+    /* Release semaphore */
+    sem_post(&pool->sem);
+}
+
+/**
+ * @brief Release the pool and all of its elements
+ * @param pool Pool instance
+ */
+void
+ilist_pool_release(ilist_pool_t *pool) {
+
+    assert(NULL != pool);
+
+    /* Wait semaphore */
+    sem_wait(&pool->sem);
+
+    ilist_pool_block_t *block = (ilist_pool_block_t *)pool->blocks;
+    while (NULL != block) {
+        ilist_pool_block_t *tmp = block;
+        block                   = block->next;
+        free(tmp);
+    }
+    pool->blocks = NULL;
+    pool->free   = NULL;
+    pool->used   = 0;
+
+    /* Release semaphore */
+    sem_post(&pool->sem);
+    sem_close(&pool->sem);
+}
+
+/******************************************************************************/
+/* Lock-free queue                                                            */
+/******************************************************************************/
+
+/**
+ * @brief Initialize an empty queue
+ * @param q Queue instance
+ */
+void
+ilist_mpsc_init(ilist_mpsc_t *q) {
+
+    assert(NULL != q);
+
+    q->stub.next = NULL;
+    q->head      = &q->stub;
+    q->tail      = &q->stub;
+}
+
+/**
+ * @brief Append a node, lock-free, can be called from any thread
+ * @param q Queue instance
+ * @param node Node to be added
+ */
+void
+ilist_mpsc_push(ilist_mpsc_t *q, ilist_node_t *node) {
+
+    assert(NULL != q);
+    assert(NULL != node);
+
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+
+    /* Take the tail, then publish the link (the consumer waits for it) */
+    ilist_node_t *prev = __atomic_exchange_n(&q->tail, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Pop the oldest node, lock-free, only called from the consumer thread
+ * @param q Queue instance
+ * @return Oldest node, NULL if the queue is empty (or a push is not complete yet)
+ */
+ilist_node_t *
+ilist_mpsc_pop(ilist_mpsc_t *q) {
+
+    assert(NULL != q);
+
+    ilist_node_t *head = q->head;
+    ilist_node_t *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    /* Skip the stub */
+    if (head == &q->stub) {
+        if (NULL == next) {
+            return NULL;
+        }
+        q->head = next;
+        head    = next;
+        next    = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (NULL != next) {
+        q->head = next;
+        return head;
+    }
+
+    /* Last node: a push is in progress if it is not the tail anymore */
+    if (head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    /* Put the stub back behind the last node to be able to take it */
+    ilist_mpsc_push(q, &q->stub);
+
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (NULL != next) {
+        q->head = next;
+        return head;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Check if the queue is empty, only called from the consumer thread
+ * @param q Queue instance
+ * @return true if the queue is empty, false otherwise
+ */
+bool
+ilist_mpsc_is_empty(ilist_mpsc_t *q) {
+
+    assert(NULL != q);
+
+    ilist_node_t *head = q->head;
+    ilist_node_t *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    return (head == &q->stub) && (NULL == next);
+}
@@ -20,13 +20,36 @@
 #include "utils/logger.h"
 #include "utils/error.h"
 #include "utils/message.h"
+#include "utils/slab.h"
+#include "utils/encoder.h"
 
 #define NNG
 #define DEBUG
 
+#define INFLUX_LINE_SIZE    256
+#define INFLUX_RETRY_MS     1000
+
 //FIXME
 extern char* strdup(const char*);
 
+/**
+ * @brief outcome of a write request from its HTTP status
+ * 
+ * @param status 
+ * @return int, ENOERR => written, EGENERR => the lines are refused (syntax,
+ *         size), sending them again cannot help, ESVRERR => try again
+ */
+static int influx_write_status(unsigned int status)
+{
+    if (status >= 200 && status <= 299)
+        return ENOERR;
+
+    if (status == 400 || status == 413 || status == 422)
+        return EGENERR;
+
+    return ESVRERR;
+}
+
 #ifdef CURL
 #include <curl/curl.h>
 
@@ -61,10 +84,12 @@ static void sendDataToInfluxDB(influx_sink_config* cfg, const char* data)
  * @brief send data to InfluxDB v2 using libcurl
  * 
  * @param data 
+ * @return int, see influx_write_status(), ESVRERR on a transport error
  */
-static void sendDataToInfluxDBv2(influx_sink_config* cfg, const char* data) {
+static int sendDataToInfluxDBv2(influx_sink_config* cfg, const char* data) {
     CURL* curl;
     CURLcode res;
+    int ret = ESVRERR;
 
     curl_global_init(CURL_GLOBAL_ALL);
     curl = curl_easy_init();
@@ -88,12 +113,19 @@ static void sendDataToInfluxDBv2(influx_sink_config* cfg, const char* data) {
         if (res != CURLE_OK) {
             fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
         }
+        else {
+            long status = 0;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+            ret = influx_write_status((unsigned int) status);
+        }
 
         curl_slist_free_all(headers);
         curl_easy_cleanup(curl);
     }
 
     curl_global_cleanup();
+
+    return ret;
 }
 #endif
 
@@ -106,8 +138,9 @@ static void sendDataToInfluxDBv2(influx_sink_config* cfg, const char* data) {
  * @brief send data to InfluxDB v2 using libnng
  * 
  * @param data 
+ * @return int, see influx_write_status(), ESVRERR on a transport error
  */
-static void sendDataToInfluxDBv2(influx_sink_config* cfg, const char* data, int datalen) 
+static int sendDataToInfluxDBv2(influx_sink_config* cfg, const char* data, int datalen) 
 {
     nng_http_client *client = NULL;
 	nng_http_conn *  conn   = NULL;
@@ -116,6 +149,7 @@ static void sendDataToInfluxDBv2(influx_sink_config* cfg, const char* data, int
 	nng_http_req *   req    = NULL;
 	nng_http_res *   res    = NULL;
 	int              rv;
+	int              ret    = ESVRERR;
 
 	if (((rv = nng_url_parse(&url, cfg->url)) != 0) ||
 	    ((rv = nng_http_client_alloc(&client, url)) != 0) ||
@@ -154,8 +188,8 @@ static void sendDataToInfluxDBv2(influx_sink_config* cfg, const char* data, int
 
 	nng_http_req_set_method(req, "POST");
 	nng_http_req_set_data(req, data, datalen);
-	nng_http_conn_write_req(conn, req, aio);
-	nng_aio_set_timeout(aio, 1000);
+	nng_aio_set_timeout(aio, 5000);
+	nng_http_conn_transact(conn, req, res, aio);
 	nng_aio_wait(aio);
 
 	if ((rv = nng_aio_result(aio)) != 0) {
@@ -165,6 +199,11 @@ static void sendDataToInfluxDBv2(influx_sink_config* cfg, const char* data, int
 		goto out;
 	}
 
+	// the response tells if the lines were written
+	uint16_t status = nng_http_res_get_status(res);
+	if ((ret = influx_write_status(status)) != ENOERR)
+		log_message(LOG_ERR, "influx: write rejected, status %u\n", status);
+
 out:
 	if (url) {
 		nng_url_free(url);
@@ -184,6 +223,8 @@ out:
 	if (aio) {
 		nng_aio_free(aio);
 	}
+
+	return ret;
 }
 
 #endif
@@ -191,11 +232,13 @@ out:
 // Function to convert meter_data_log to InfluxDB line protocol
 static char* convert_to_influxdb_line(const char* measurement, struct meter_data_log* data) 
 {
-    // Create a buffer to hold the line protocol string
-    char* line_protocol = (char*)malloc(256);  // Adjust size as needed
+    // Create a buffer to hold the line protocol string, from the pool
+    char* line_protocol = (char*) slab_alloc(INFLUX_LINE_SIZE);
+    if (line_protocol == NULL)
+        return NULL;
 
     // Assuming "meter_measurement" is the name of your InfluxDB measurement
-    sprintf(line_protocol, "%s "
+    snprintf(line_protocol, INFLUX_LINE_SIZE, "%s "
                             "voltage=%f,"
                             "current=%f,"
                             "power=%f,"
@@ -207,9 +250,39 @@ static char* convert_to_influxdb_line(const char* measurement, struct meter_data
             measurement, data->voltage, data->current, data->power, data->reactive_power,
             data->power_factor, data->freq, data->import_active, data->export_active);
 
+    // poll time (ns precision), the server time is used without it
+    if (data->timestamp_ns != 0)
+    {
+        size_t len = strlen(line_protocol);
+        snprintf(line_protocol + len, INFLUX_LINE_SIZE - len, " %llu", (unsigned long long) data->timestamp_ns);
+    }
+
     return line_protocol;
 }
 
+/**
+ * @brief line protocol of the current sample
+ * 
+ * @param cfg 
+ * @param in 
+ * @param owned, set when the line is from the pool (slab_free it)
+ * @return const char*, NULL => not a sample / no memory
+ */
+static const char* influx_input_line(influx_sink_config* cfg, sink_input* in, char** owned)
+{
+    *owned = NULL;
+
+    if (in->datalen == sizeof(meter_data_log))
+        return *owned = convert_to_influxdb_line(cfg->measurement, (meter_data_log*) in->data);
+
+    // NUL terminated, shared with the other line protocol sinks of the fan-out
+    if ((in->datalen == sizeof(meter_sample) || in->datalen == sizeof(meter_fixed_sample)) &&
+        sink_input_encode(in, ENC_LINE, cfg->measurement) >= 0)
+        return (const char*) in->payload;
+
+    return NULL;
+}
+
 /**
  * @brief Influx Write function
  * 
@@ -221,37 +294,434 @@ static void* influxdb_write_task(void* arg)
     influx_sink_config* cfg = (influx_sink_config*) arg;
 
     // get queue 
-    BusReader* br = cfg->br;
+    sink_input* in = &cfg->in;
 
     while (1) 
     {        
-        meter_data_log* mdl;
-        void* data;
-        int datalen;
-
-        if (0 == bus_read(br, (void**) &data, &datalen))
+        if (0 == sink_input_read(in, -1, NULL, -1))
         {
-            if (datalen == sizeof(meter_data_log))
+            char* owned;
+            const char* inf_linedata = influx_input_line(cfg, in, &owned);
+            if (inf_linedata != NULL)
             {
-                mdl = (meter_data_log*) data;
-                
-                char* inf_linedata = convert_to_influxdb_line(cfg->measurement, mdl);
-
                 #ifdef DEBUG                
-                log_message(LOG_INFO, "%s\n", (char*) inf_linedata);
+                log_message(LOG_INFO, "%s\n", inf_linedata);
                 #endif // DEBUG
 
-                sendDataToInfluxDBv2(cfg, inf_linedata, strlen(inf_linedata));
-                free(inf_linedata);
+                int rc = sendDataToInfluxDBv2(cfg, inf_linedata, strlen(inf_linedata));
+                if (owned) slab_free(owned);
+
+                // not written: read again from the log (dropped when reading the bus)
+                if (rc == ESVRERR)
+                {
+                    sink_input_retry(in);
+                    if (in->cur != NULL)
+                        usleep(INFLUX_RETRY_MS * 1000);
+                    continue;
+                }
             }
 
-            if (data) free(data);
+            sink_input_done(in);
         }
     }
     
     return NULL;
 }
 
+#ifdef NNG
+
+#define INFLUX_BODY_MAX         (32 * 1024)     // lines sent in one POST
+#define INFLUX_LINE_MAX         ENC_MAX_PAYLOAD // longest line of a sample
+#define INFLUX_DRAIN_MAX        64              // bus messages per wake-up
+
+typedef enum {
+    INFLUX_IDLE = 0,
+    INFLUX_CONNECTING,
+    INFLUX_SENDING
+} influx_state;
+
+/**
+ * @brief reactor mode: the POST is a state machine driven by one nng_aio,
+ *        samples arriving meanwhile are packed into the next body
+ * 
+ */
+typedef struct {
+    nng_url*            url;
+    nng_http_client*    client;
+    nng_http_conn*      conn;       // kept open between POSTs
+    nng_http_req*       req;
+    nng_http_res*       res;
+    nng_aio*            aio;
+
+    pthread_mutex_t     lock;
+    int                 state;      // influx_state
+    char*               pending;    // lines waiting for the next POST
+    size_t              pending_len;
+    uint64_t            pending_seq;    // log position of its last sample, 0 => none
+    char*               inflight;   // body of the POST in progress (or to retry)
+    size_t              inflight_len;
+    uint64_t            inflight_seq;   // acknowledged on a 2xx
+    int                 paused;     // backlog full, the input is not read
+    unsigned long       dropped;
+
+    reactor_handler*    bus_h;
+    reactor_handler*    retry_h;
+} influx_async;
+
+static void influx_async_send(influx_sink_config* cfg, influx_async* a);
+
+/**
+ * @brief start the next step, called with the lock
+ * 
+ * @param cfg 
+ * @param a 
+ */
+static void influx_async_kick(influx_sink_config* cfg, influx_async* a)
+{
+    if (a->state != INFLUX_IDLE)
+        return;
+
+    // a failed body is sent again first
+    if (a->inflight_len == 0)
+    {
+        if (a->pending_len == 0)
+            return;
+
+        char* tmp = a->inflight;
+        a->inflight = a->pending;
+        a->inflight_len = a->pending_len;
+        a->inflight_seq = a->pending_seq;
+        a->pending = tmp;
+        a->pending_len = 0;
+        a->pending_seq = 0;
+    }
+
+    if (a->conn == NULL)
+    {
+        a->state = INFLUX_CONNECTING;
+        nng_http_client_connect(a->client, a->aio);
+        return;
+    }
+
+    influx_async_send(cfg, a);
+}
+
+/**
+ * @brief POST the in-flight body on the open connection, called with the lock
+ * 
+ * @param cfg 
+ * @param a 
+ */
+static void influx_async_send(influx_sink_config* cfg, influx_async* a)
+{
+    a->state = INFLUX_SENDING;
+
+    nng_http_req_set_data(a->req, a->inflight, a->inflight_len);
+    nng_aio_set_timeout(a->aio, 5000);
+    nng_http_conn_transact(a->conn, a->req, a->res, a->aio);
+}
+
+/**
+ * @brief aio completion (nng thread)
+ * 
+ * @param arg 
+ */
+static void influx_async_cb(void* arg)
+{
+    influx_sink_config* cfg = (influx_sink_config*) arg;
+    influx_async* a = (influx_async*) cfg->priv;
+    int rv = nng_aio_result(a->aio);
+
+    pthread_mutex_lock(&a->lock);
+
+    switch (a->state)
+    {
+    case INFLUX_CONNECTING:
+        if (rv != 0)
+        {
+            log_message(LOG_ERR, "influx: connect failed: %s\n", nng_strerror(rv));
+            conn_state_set(&cfg->conn, CONN_DISCONNECTED);
+
+            // the retry timer tries again
+            a->state = INFLUX_IDLE;
+            break;
+        }
+
+        a->conn = nng_aio_get_output(a->aio, 0);
+        conn_state_set(&cfg->conn, CONN_CONNECTED);
+
+        influx_async_send(cfg, a);
+        pthread_mutex_unlock(&a->lock);
+        return;
+
+    case INFLUX_SENDING:
+        a->state = INFLUX_IDLE;
+
+        if (rv != 0)
+        {
+            log_message(LOG_ERR, "influx: write failed: %s\n", nng_strerror(rv));
+            conn_state_set(&cfg->conn, CONN_DISCONNECTED);
+
+            nng_http_conn_close(a->conn);
+            a->conn = NULL;
+            break;
+        }
+
+        uint16_t status = nng_http_res_get_status(a->res);
+        int rc = influx_write_status(status);
+
+        if (rc != ENOERR)
+            log_message(LOG_ERR, "influx: write rejected, status %u\n", status);
+
+        // kept for the retry timer
+        if (rc == ESVRERR)
+            break;
+
+        // written: the samples of the body are delivered
+        if (rc == ENOERR)
+            sink_input_ack(&cfg->in, a->inflight_seq);
+
+        a->inflight_len = 0;
+        a->inflight_seq = 0;
+        influx_async_kick(cfg, a);
+
+        // room again for the input, read on the reactor thread
+        if (a->paused)
+            reactor_timer_set(a->retry_h, 0, INFLUX_RETRY_MS);
+        break;
+
+    default:
+        break;
+    }
+
+    pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * @brief room for one more line in the pending body, called with the lock
+ * 
+ * @param a 
+ * @return int 
+ */
+static inline int influx_async_room(const influx_async* a)
+{
+    return a->pending_len + INFLUX_LINE_MAX + 1 <= INFLUX_BODY_MAX;
+}
+
+/**
+ * @brief bus readable (reactor thread), pack the samples into the pending
+ *        body. While it is full the input is left unread (backpressure):
+ *        the log keeps the samples, the bus reader queue fills up
+ * 
+ * @param r 
+ * @param h 
+ * @param events 
+ * @param arg 
+ */
+static void influx_async_on_bus(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    influx_sink_config* cfg = (influx_sink_config*) arg;
+    influx_async* a = (influx_async*) cfg->priv;
+    sink_input* in = &cfg->in;
+
+    for (int i = 0; i < INFLUX_DRAIN_MAX; i++)
+    {
+        pthread_mutex_lock(&a->lock);
+        int room = influx_async_room(a);
+        if (!room)
+            a->paused = 1;
+        pthread_mutex_unlock(&a->lock);
+
+        // read again by the retry timer once the body is sent
+        if (!room)
+        {
+            reactor_mod(r, h, 0);
+            break;
+        }
+
+        if (0 != sink_input_read(in, -1, NULL, 0))
+            break;
+
+        char* owned;
+        const char* line = influx_input_line(cfg, in, &owned);
+        size_t len = line != NULL ? strlen(line) : 0;
+
+        pthread_mutex_lock(&a->lock);
+        if (line != NULL && a->pending_len + len + 1 <= INFLUX_BODY_MAX)
+        {
+            memcpy(a->pending + a->pending_len, line, len);
+            a->pending_len += len;
+            a->pending[a->pending_len++] = '\n';
+        }
+        else if (line != NULL && (a->dropped++ % 100) == 0)
+            log_message(LOG_WARNING, "influx: line too long, %lu samples dropped\n", a->dropped);
+
+        // acknowledged with the body it is in, at once when nothing is pending
+        if (in->cur != NULL)
+        {
+            if (a->pending_len == 0 && a->inflight_len == 0)
+                sink_input_ack(in, in->seq);
+            else
+                a->pending_seq = in->seq;
+        }
+        pthread_mutex_unlock(&a->lock);
+
+        if (owned) slab_free(owned);
+
+        sink_input_done(in);
+    }
+
+    pthread_mutex_lock(&a->lock);
+    influx_async_kick(cfg, a);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * @brief retry timer (reactor thread)
+ * 
+ * @param r 
+ * @param h 
+ * @param events 
+ * @param arg 
+ */
+static void influx_async_on_retry(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    influx_sink_config* cfg = (influx_sink_config*) arg;
+    influx_async* a = (influx_async*) cfg->priv;
+    int resume, paused;
+
+    pthread_mutex_lock(&a->lock);
+    influx_async_kick(cfg, a);
+
+    resume = a->paused && influx_async_room(a);
+    if (resume)
+        a->paused = 0;
+    paused = a->paused;
+    pthread_mutex_unlock(&a->lock);
+
+    if (resume)
+        reactor_mod(r, a->bus_h, EPOLLIN);
+
+    // what a pause or the drain limit left behind, its fd may not fire again
+    if (!paused)
+        influx_async_on_bus(r, a->bus_h, EPOLLIN, cfg);
+}
+
+static void influx_async_free(influx_sink_config* cfg);
+
+/**
+ * @brief Drive the sink from a reactor instead of its own thread. On
+ *        failure nothing stays attached
+ * 
+ * @param cfg 
+ * @param r 
+ * @return int 
+ */
+int influx_sink_attach(influx_sink_config* cfg, reactor_t* r)
+{
+    influx_async* a = (influx_async*) calloc(1, sizeof(influx_async));
+    int rc = ESYSERR;
+    int rv;
+
+    if (a == NULL)
+        return ESYSERR;
+
+    cfg->priv = (void*) a;
+    cfg->reactor = r;
+
+    // the log is acknowledged once a POST holding the samples succeeded
+    cfg->in.defer_ack = 1;
+
+    pthread_mutex_init(&a->lock, NULL);
+    a->pending = (char*) malloc(INFLUX_BODY_MAX);
+    a->inflight = (char*) malloc(INFLUX_BODY_MAX);
+    if (a->pending == NULL || a->inflight == NULL)
+    {
+        goto fail;
+    }
+
+	if (((rv = nng_url_parse(&a->url, cfg->url)) != 0) ||
+	    ((rv = nng_http_client_alloc(&a->client, a->url)) != 0) ||
+	    ((rv = nng_http_req_alloc(&a->req, a->url)) != 0) ||
+	    ((rv = nng_http_res_alloc(&a->res)) != 0) ||
+	    ((rv = nng_aio_alloc(&a->aio, influx_async_cb, cfg)) != 0)) 
+	{
+		log_message(LOG_ERR, "influx: init failed: %s\n", nng_strerror(rv));
+		rc = ESVRERR;
+		goto fail;
+	}
+
+    char auth[512];
+    snprintf(auth, sizeof(auth), "Token %s", cfg->token);
+
+    nng_http_req_add_header(a->req, "Authorization", auth);
+	nng_http_req_set_method(a->req, "POST");
+
+    a->bus_h = reactor_add(r, sink_input_fd(&cfg->in), EPOLLIN, influx_async_on_bus, cfg);
+    a->retry_h = reactor_timer_add(r, influx_async_on_retry, cfg);
+    if (a->bus_h == NULL || a->retry_h == NULL)
+        goto fail;
+
+    reactor_timer_set(a->retry_h, INFLUX_RETRY_MS, INFLUX_RETRY_MS);
+
+    // connect now, so the startup waits for it
+    pthread_mutex_lock(&a->lock);
+    a->state = INFLUX_CONNECTING;
+    conn_state_set(&cfg->conn, CONN_CONNECTING);
+    nng_http_client_connect(a->client, a->aio);
+    pthread_mutex_unlock(&a->lock);
+
+    return ENOERR;
+
+fail:
+    // back to nothing attached, the caller may run the thread instead
+    reactor_del(r, a->bus_h);
+    reactor_del(r, a->retry_h);
+    influx_async_free(cfg);
+    cfg->reactor = NULL;
+    cfg->in.defer_ack = 0;
+
+    return rc;
+}
+
+/**
+ * @brief release the reactor mode state
+ * 
+ * @param cfg 
+ */
+static void influx_async_free(influx_sink_config* cfg)
+{
+    influx_async* a = (influx_async*) cfg->priv;
+
+    if (a == NULL)
+        return;
+
+    if (a->aio)
+        nng_aio_stop(a->aio);
+
+    if (a->conn)
+        nng_http_conn_close(a->conn);
+    if (a->client)
+        nng_http_client_free(a->client);
+    if (a->req)
+        nng_http_req_free(a->req);
+    if (a->res)
+        nng_http_res_free(a->res);
+    if (a->url)
+        nng_url_free(a->url);
+    if (a->aio)
+        nng_aio_free(a->aio);
+
+    free(a->pending);
+    free(a->inflight);
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+
+    cfg->priv = NULL;
+}
+
+#endif // NNG
+
 /**
  * @brief Init Source task
  * 
@@ -267,7 +737,12 @@ int influx_sink_init(influx_sink_config* cfg, Bus* b, const char* host, int port
     memset(cfg, 0, sizeof (influx_sink_config));
 
     cfg->b = b;
-    create_bus_reader(&cfg->br, cfg->b);
+    sink_input_init(&cfg->in, cfg->b);
+    conn_state_init(&cfg->conn, "influx-sink");
+
+    // line protocol is written for the meter samples only
+    bus_filter f = { .types = BUS_TYPE_DATALOG | BUS_TYPE_SAMPLE | BUS_TYPE_FIXED };
+    sink_input_set_filter(&cfg->in, &f);
 
     if (host != NULL)
         cfg->host = strdup(host);
@@ -309,7 +784,12 @@ int influx_sink_init2(influx_sink_config* cfg, Bus* b, const char* url, const ch
     memset(cfg, 0, sizeof (influx_sink_config));
 
     cfg->b = b;
-    create_bus_reader(&cfg->br, cfg->b);
+    sink_input_init(&cfg->in, cfg->b);
+    conn_state_init(&cfg->conn, "influx-sink");
+
+    // line protocol is written for the meter samples only
+    bus_filter f = { .types = BUS_TYPE_DATALOG | BUS_TYPE_SAMPLE | BUS_TYPE_FIXED };
+    sink_input_set_filter(&cfg->in, &f);
 
     if (url != NULL)
         cfg->url = strdup(url);
@@ -349,6 +829,12 @@ int influx_sink_term(influx_sink_config* cfg)
     if (cfg->topic != NULL)
         free(cfg->topic);
 
+#ifdef NNG
+    influx_async_free(cfg);
+#endif // NNG
+
+    conn_state_destroy(&cfg->conn);
+
     return 0;
 }
 
@@ -373,6 +859,10 @@ int influx_sink_run(influx_sink_config* cfg)
  */
 int influx_sink_wait(influx_sink_config* cfg)
 {
+    // driven by a reactor, no thread of its own
+    if (cfg->reactor != NULL)
+        return 0;
+
     return 
         pthread_join(cfg->task_thread, NULL);    
 }
\ No newline at end of file
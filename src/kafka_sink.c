@@ -18,14 +18,102 @@
 
 #include <librdkafka/rdkafka.h>
 #include "kafka_sink.h"
-#include "error.h"
-#include "logger.h"
+#include "meter/meter_data.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+#include "utils/encoder.h"
 
 //FIXME
 extern char* strdup(const char*);
 
 #define DEBUG
 
+/**
+ * @brief delivery report (rd_kafka_poll / rd_kafka_flush): the sample is
+ *        delivered, or read again from the log
+ * 
+ * @param rk 
+ * @param m 
+ * @param opaque, the sink config
+ */
+static void kafka_dr_msg_cb(rd_kafka_t* rk, const rd_kafka_message_t* m, void* opaque)
+{
+    kafka_sync_config* cfg = (kafka_sync_config*) opaque;
+
+    if (m->err)
+        log_message(LOG_ERR, "kafka: delivery failed: %s\n", rd_kafka_err2str(m->err));
+
+    sink_input_confirmed(&cfg->in, (uint64_t) (uintptr_t) m->_private, m->err == 0);
+}
+
+/**
+ * @brief message key of a meter sample: meter id and sample time, the same
+ *        when the log is replayed
+ * 
+ * @param in 
+ * @param key 
+ * @param size 
+ * @return int, length, 0 => no key
+ */
+static int kafka_sample_key(const sink_input* in, char* key, size_t size)
+{
+    uint32_t meter_id;
+    uint64_t ts;
+
+    if (in->datalen == sizeof(meter_data_log))
+    {
+        meter_id = ((const meter_data_log*) in->data)->meter_id;
+        ts = ((const meter_data_log*) in->data)->timestamp_ns;
+    }
+    else if (in->datalen == sizeof(meter_sample))
+    {
+        meter_id = ((const meter_sample*) in->data)->meter_id;
+        ts = ((const meter_sample*) in->data)->timestamp_ns;
+    }
+    else if (in->datalen == sizeof(meter_fixed_sample))
+    {
+        meter_id = ((const meter_fixed_sample*) in->data)->meter_id;
+        ts = ((const meter_fixed_sample*) in->data)->timestamp_ns;
+    }
+    else
+        return 0;
+
+    return snprintf(key, size, "%u-%llu", meter_id, (unsigned long long) ts);
+}
+
+/**
+ * @brief hand the current sample to the producer, the log is acknowledged
+ *        by its delivery report
+ * 
+ * @param cfg 
+ * @param rkt 
+ * @return int, -1 => not queued, read again from the log
+ */
+static int kafka_produce(kafka_sync_config* cfg, rd_kafka_topic_t* rkt)
+{
+    sink_input* in = &cfg->in;
+    char key[48];
+    int keylen = kafka_sample_key(in, key, sizeof(key));
+    int rc;
+
+    // followed before the report can come
+    sink_input_sent(in, in->seq, in->seq);
+
+    rc = rd_kafka_produce(
+            rkt,                    // Topic
+            RD_KAFKA_PARTITION_UA,  // Let Kafka choose the partition
+            RD_KAFKA_MSG_F_COPY,    // Message flag (copies the payload)
+            (void *)in->payload, in->len,
+            keylen > 0 ? key : NULL, keylen,
+            (void *)(uintptr_t) in->seq     // kafka_dr_msg_cb
+        );
+
+    if (rc == -1)
+        sink_input_confirmed(in, in->seq, 0);
+
+    return rc;
+}
+
 /**
  * @brief sink thread (forward thread)
  * 
@@ -44,10 +132,9 @@ void* kafka_sink_task(void* arg) {
         exit(EGENERR);
     }
 
-    Queue* q = (Queue*) cfg->q;
-    char data[MAX_QUEUE_DATA_SIZE];
+    sink_input* in = &cfg->in;
 
-    if (q == NULL)
+    if (in->br == NULL && in->sub == NULL && in->cur == NULL)
     {
         #ifdef DEBUG
         printf("Error queue...\n");
@@ -56,6 +143,10 @@ void* kafka_sink_task(void* arg) {
         exit(EQUERR);
     }
 
+    // the log is acknowledged by the delivery reports, not as the samples are queued
+    if (sink_input_defer(in) != ENOERR)
+        log_message(LOG_ERR, "kafka: out of memory, acknowledging on hand-off\n");
+
     // kafka connect here
     while(1)
     {
@@ -66,18 +157,22 @@ void* kafka_sink_task(void* arg) {
 
         sprintf(broker, "%s:%d", cfg->host, cfg->port);
 
+        conn_state_set(&cfg->conn, CONN_CONNECTING);
+
         conf = rd_kafka_conf_new();
         if (rd_kafka_conf_set(conf, "bootstrap.servers", broker, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
             fprintf(stderr, "Error configuring Kafka: %s\n", errstr);
             
             exit(ESVRERR);
         }
+        rd_kafka_conf_set_dr_msg_cb(conf, kafka_dr_msg_cb);
+        rd_kafka_conf_set_opaque(conf, cfg);
 
         // Create a Kafka producer instance
         rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
         if (!rk) 
         {
-            log_message(LOG_ERROR, "Error creating Kafka producer: %s\n", errstr);
+            log_message(LOG_ERR, "Error creating Kafka producer: %s\n", errstr);
             exit(ESVRERR);
         }
 
@@ -86,51 +181,54 @@ void* kafka_sink_task(void* arg) {
         rkt = rd_kafka_topic_new(rk, cfg->topic, NULL);
         if (!rkt) 
         {
-            log_message(LOG_ERROR, "Error creating topic object: %s\n", rd_kafka_err2str(rd_kafka_last_error()));
+            log_message(LOG_ERR, "Error creating topic object: %s\n", rd_kafka_err2str(rd_kafka_last_error()));
             rd_kafka_destroy(rk);
 
             exit(ESVRERR);
         }
 
+        // the producer connects to the brokers in the background
+        conn_state_set(&cfg->conn, CONN_CONNECTED);
+
         while (1) 
         {
-            if (dequeue(q, data))
+            if (0 == sink_input_read(in, cfg->format, NULL, -1))
             {
-                #ifdef DEBUG
-                log_message(LOG_INFO, "%s\n", data);
-                #endif // DEBUG
-        
-                // Produce a message to Kafka
-                const char *message = data;
-                size_t len = strlen(message);
-
-                int partition = RD_KAFKA_PARTITION_UA; // Let Kafka choose the partition
-
-                if (rd_kafka_produce(
-                        rkt,         // Topic
-                        partition,   // Partition (RD_KAFKA_PARTITION_UA for automatic)
-                        RD_KAFKA_MSG_F_COPY, // Message flag (copies the payload)
-                        (void *)message, len, // Message payload and length
-                        NULL, 0,  // Optional key and key length (NULL for no key)
-                        NULL      // Optional message opaque (used for callbacks, can be NULL)
-                    ) == -1) 
+                int len = in->len;
+
+                if (len < 0)
+                {
+                    sink_input_done(in);
+                    sink_input_hold(in, 0);
+                    continue;
+                }
+
+                int rc = kafka_produce(cfg, rkt);
+                sink_input_done(in);
+                sink_input_hold(in, 0);
+
+                if (rc == -1) 
                 {
-                    log_message(LOG_ERROR, "Error producing message: %s\n", rd_kafka_err2str(rd_kafka_last_error()));
+                    log_message(LOG_ERR, "Error producing message: %s\n", rd_kafka_err2str(rd_kafka_last_error()));
                     break;
                 } 
                 else 
                 {
-                    log_message(LOG_ERROR, "Produced message: %s\n", message);
+                    #ifdef DEBUG
+                    log_message(LOG_INFO, "Produced message: %d bytes\n", len);
+                    #endif // DEBUG
+
                     // Wait for any outstanding messages to be delivered and delivery reports to be received
                     rd_kafka_flush(rk, 2000);
                 }
             }
-            else
-            {
-                usleep(10000);
-            }
         }
 
+        conn_state_set(&cfg->conn, CONN_DISCONNECTED);
+
+        // the reports of what is still queued, before it goes
+        rd_kafka_flush(rk, 2000);
+
         // Cleanup and destroy Kafka objects
         rd_kafka_topic_destroy(rkt);
         rd_kafka_destroy(rk);
@@ -139,6 +237,215 @@ void* kafka_sink_task(void* arg) {
     return NULL;
 }
 
+#define KAFKA_POLL_MS       100
+#define KAFKA_DRAIN_MAX     64
+
+/**
+ * @brief reactor mode: the producer queues internally, the reactor only
+ *        feeds it and serves the delivery reports
+ * 
+ */
+typedef struct {
+    rd_kafka_t*         rk;
+    rd_kafka_topic_t*   rkt;
+    unsigned long       dropped;
+    int                 paused;     // bus not read until the producer caught up
+
+    reactor_handler*    bus_h;
+    reactor_handler*    poll_h;
+} kafka_async;
+
+/**
+ * @brief bus readable (reactor thread)
+ * 
+ * @param r 
+ * @param h 
+ * @param events 
+ * @param arg 
+ */
+static void kafka_async_on_bus(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    kafka_sync_config* cfg = (kafka_sync_config*) arg;
+    kafka_async* a = (kafka_async*) cfg->priv;
+    sink_input* in = &cfg->in;
+
+    for (int i = 0; i < KAFKA_DRAIN_MAX; i++)
+    {
+        // too many reports pending, kafka_async_on_poll() resumes
+        if (sink_input_unacked(in) >= SINK_UNACKED_HIGH)
+        {
+            a->paused = 1;
+            reactor_mod(r, h, 0);
+            break;
+        }
+
+        if (0 != sink_input_read(in, cfg->format, NULL, 0))
+            break;
+
+        if (in->len < 0)
+        {
+            sink_input_done(in);
+            continue;
+        }
+
+        int rc = kafka_produce(cfg, a->rkt);
+        sink_input_done(in);
+
+        if (rc == -1)
+        {
+            // never block the loop, the local queue is the buffer
+            if (rd_kafka_last_error() == RD_KAFKA_RESP_ERR__QUEUE_FULL)
+            {
+                if ((a->dropped++ % 100) == 0)
+                    log_message(LOG_WARNING, "kafka: queue full, %lu message(s) %s\n", a->dropped,
+                        in->cur != NULL ? "to read again" : "dropped");
+
+                // until the reports made room
+                a->paused = 1;
+                reactor_mod(r, h, 0);
+                break;
+            }
+            else
+                log_message(LOG_ERR, "Error producing message: %s\n", rd_kafka_err2str(rd_kafka_last_error()));
+        }
+    }
+
+    sink_input_hold(in, 0);
+}
+
+/**
+ * @brief serve the delivery reports (reactor thread)
+ * 
+ * @param r 
+ * @param h 
+ * @param events 
+ * @param arg 
+ */
+static void kafka_async_on_poll(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    kafka_sync_config* cfg = (kafka_sync_config*) arg;
+    kafka_async* a = (kafka_async*) cfg->priv;
+
+    rd_kafka_poll(a->rk, 0);
+
+    // the reports made room
+    if (a->paused && sink_input_unacked(&cfg->in) < SINK_UNACKED_HIGH)
+    {
+        a->paused = 0;
+        reactor_mod(r, a->bus_h, EPOLLIN);
+    }
+}
+
+static void kafka_async_free(kafka_sync_config* cfg);
+
+/**
+ * @brief Drive the sink from a reactor instead of its own thread. On
+ *        failure nothing stays attached
+ * 
+ * @param cfg 
+ * @param r 
+ * @return int 
+ */
+int kafka_sink_attach(kafka_sync_config* cfg, reactor_t* r)
+{
+    kafka_async* a = (kafka_async*) calloc(1, sizeof(kafka_async));
+    rd_kafka_conf_t *conf;
+    char errstr[512];
+    char broker[128];
+    int rc = ESVRERR;
+
+    if (a == NULL)
+        return ESYSERR;
+
+    cfg->priv = (void*) a;
+    cfg->reactor = r;
+
+    sprintf(broker, "%s:%d", cfg->host, cfg->port);
+
+    conn_state_set(&cfg->conn, CONN_CONNECTING);
+
+    conf = rd_kafka_conf_new();
+    if (rd_kafka_conf_set(conf, "bootstrap.servers", broker, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) 
+    {
+        log_message(LOG_ERR, "Error configuring Kafka: %s\n", errstr);
+        rd_kafka_conf_destroy(conf);
+        goto fail;
+    }
+    rd_kafka_conf_set_dr_msg_cb(conf, kafka_dr_msg_cb);
+    rd_kafka_conf_set_opaque(conf, cfg);
+
+    // the log is acknowledged by the delivery reports, not as the samples are queued
+    if (sink_input_defer(&cfg->in) != ENOERR)
+    {
+        rd_kafka_conf_destroy(conf);
+        rc = ESYSERR;
+        goto fail;
+    }
+
+    a->rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+    if (a->rk == NULL) 
+    {
+        log_message(LOG_ERR, "Error creating Kafka producer: %s\n", errstr);
+        goto fail;
+    }
+
+    a->rkt = rd_kafka_topic_new(a->rk, cfg->topic, NULL);
+    if (a->rkt == NULL) 
+    {
+        log_message(LOG_ERR, "Error creating topic object: %s\n", rd_kafka_err2str(rd_kafka_last_error()));
+        goto fail;
+    }
+
+    // the producer connects to the brokers in the background
+    conn_state_set(&cfg->conn, CONN_CONNECTED);
+
+    a->bus_h = reactor_add(r, sink_input_fd(&cfg->in), EPOLLIN, kafka_async_on_bus, cfg);
+    a->poll_h = reactor_timer_add(r, kafka_async_on_poll, cfg);
+    if (a->bus_h == NULL || a->poll_h == NULL)
+    {
+        rc = ESYSERR;
+        goto fail;
+    }
+
+    reactor_timer_set(a->poll_h, KAFKA_POLL_MS, KAFKA_POLL_MS);
+
+    return ENOERR;
+
+fail:
+    // back to nothing attached, the caller may run the thread instead
+    reactor_del(r, a->bus_h);
+    reactor_del(r, a->poll_h);
+    kafka_async_free(cfg);
+    cfg->reactor = NULL;
+    conn_state_set(&cfg->conn, CONN_IDLE);
+
+    return rc;
+}
+
+/**
+ * @brief release the reactor mode state
+ * 
+ * @param cfg 
+ */
+static void kafka_async_free(kafka_sync_config* cfg)
+{
+    kafka_async* a = (kafka_async*) cfg->priv;
+
+    if (a == NULL)
+        return;
+
+    if (a->rk != NULL)
+        rd_kafka_flush(a->rk, 2000);
+
+    if (a->rkt != NULL)
+        rd_kafka_topic_destroy(a->rkt);
+    if (a->rk != NULL)
+        rd_kafka_destroy(a->rk);
+
+    free(a);
+    cfg->priv = NULL;
+}
+
 /**
  * @brief Init sync task
  * 
@@ -149,11 +456,15 @@ void* kafka_sink_task(void* arg) {
  * @param password 
  * @return int 
  */
-int kafka_sink_init(kafka_sync_config* cfg, Queue* q, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic)
+int kafka_sink_init(kafka_sync_config* cfg, Bus* b, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic)
 {
     memset(cfg, 0, sizeof (kafka_sync_config));
 
-    cfg->q = q;
+    cfg->b = b;
+    sink_input_init(&cfg->in, cfg->b);
+
+    cfg->format = ENC_JSON;
+    conn_state_init(&cfg->conn, "kafka-sink");
 
     if (host != NULL)
         cfg->host = strdup(host);
@@ -203,6 +514,9 @@ int kafka_sink_term(kafka_sync_config* cfg)
     if (cfg->topic != NULL)
         free(cfg->topic);
 
+    kafka_async_free(cfg);
+    conn_state_destroy(&cfg->conn);
+
     return 0;
 }
 
@@ -227,6 +541,10 @@ int kafka_sink_run(kafka_sync_config* cfg)
  */
 int kafka_sink_wait(kafka_sync_config* cfg)
 {
+    // driven by a reactor, no thread of its own
+    if (cfg->reactor != NULL)
+        return 0;
+
     return 
         pthread_join(cfg->task_thread, NULL);    
 }
\ No newline at end of file
@@ -26,6 +26,8 @@
 #include "utils/squeue.h"
 #include "meter/datalog.h"
 #include "data_forwarder.h"
+#include "utils/slab.h"
+#include "utils/rt_sched.h"
 
 
 static void daemonize();
@@ -72,11 +74,25 @@ int main(int argc, char* argv[]) {
     }
 
     init_logger("logfile.log", 0);
+
+    // before the threads start, so their stacks are locked too
+    int lock_memory = 0;
+    config_lookup_int(&cfg, "lock_memory", &lock_memory);
+    if (lock_memory)
+        task_sched_lock_memory();
+
     data_forwarder_task_init(&cfg);
 
+    // pool statistics to the log every N seconds, 0 => off
+    int slab_stats_interval = 0;
+    config_lookup_int(&cfg, "slab_stats_interval", &slab_stats_interval);
 
+    unsigned long ticks = 0;
     while (1) {
         sleep(1);
+
+        if (slab_stats_interval > 0 && (++ticks % slab_stats_interval) == 0)
+            slab_stats_log();
     }
 
     cleanup_logger();
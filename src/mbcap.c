@@ -0,0 +1,398 @@
+/**
+ * @file mbcap.c
+ * @author longdh
+ * @brief capture of the Modbus transactions of a reader to a file, and the
+ *        replay of a capture in place of the meters
+ * @version 0.1
+ * @date 2024-02-07
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * The readers (meter_reader.c, regmap.c) read through mbcap_read_registers().
+ * With no capture attached to the context it is the libmodbus call. Recording,
+ * the request goes out with modbus_send_raw_request() and the response frame
+ * is kept as received (CRC checked by libmodbus), both are appended to the
+ * file with their timing. Replaying, the context is never connected: the
+ * recorded responses are decoded in order, paced like the capture (speed 1),
+ * faster, or as fast as possible (speed 0), so the decode and pipeline path
+ * runs reproducibly without the meters.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "meter/mbcap.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+#define NSEC_PER_SEC        1000000000LL
+
+static mbcap* mbcap_attached[MBCAP_MAX_CTX];
+
+static int64_t mono_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static uint16_t crc16(const uint8_t* p, int n)
+{
+    uint16_t crc = 0xFFFF;
+
+    while (n-- > 0)
+    {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+
+    return crc;
+}
+
+static int mbcap_attach(mbcap* c)
+{
+    for (int i = 0; i < MBCAP_MAX_CTX; i++)
+    {
+        if (mbcap_attached[i] == NULL)
+        {
+            mbcap_attached[i] = c;
+            return ENOERR;
+        }
+    }
+
+    log_message(LOG_ERR, "mbcap: more than %d contexts\n", MBCAP_MAX_CTX);
+    return EGENERR;
+}
+
+static mbcap* mbcap_of(modbus_t* ctx)
+{
+    for (int i = 0; i < MBCAP_MAX_CTX; i++)
+        if (mbcap_attached[i] != NULL && mbcap_attached[i]->ctx == ctx)
+            return mbcap_attached[i];
+
+    return NULL;
+}
+
+/**
+ * @brief record the reads of a connected context
+ *
+ * @param c
+ * @param ctx
+ * @param path, truncated
+ * @return int
+ */
+int mbcap_record_open(mbcap* c, modbus_t* ctx, const char* path)
+{
+    mbcap_file_header h;
+    struct timespec now;
+
+    memset(c, 0, sizeof(mbcap));
+
+    if ((c->fp = fopen(path, "wb")) == NULL)
+    {
+        log_message(LOG_ERR, "mbcap: cannot create %s: %s\n", path, strerror(errno));
+        return ESYSERR;
+    }
+
+    c->mode = MBCAP_RECORD;
+    c->ctx = ctx;
+    c->header_length = modbus_get_header_length(ctx);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    c->t0 = mono_ns();
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MBCAP_MAGIC, sizeof(h.magic));
+    h.version = 1;
+    h.header_length = (uint32_t) c->header_length;
+    h.start_ns = (uint64_t) now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+
+    if (fwrite(&h, sizeof(h), 1, c->fp) != 1 || ENOERR != mbcap_attach(c))
+    {
+        fclose(c->fp);
+        c->fp = NULL;
+        return ESYSERR;
+    }
+
+    log_message(LOG_INFO, "mbcap: recording to %s\n", path);
+
+    return ENOERR;
+}
+
+/**
+ * @brief replay a capture on a context that is not connected
+ *
+ * @param c
+ * @param ctx, only the key of the reads
+ * @param path
+ * @param speed, 1 => recorded timing, 0 => as fast as possible
+ * @param loop, rewind at the end
+ * @return int
+ */
+int mbcap_replay_open(mbcap* c, modbus_t* ctx, const char* path, double speed, int loop)
+{
+    mbcap_file_header h;
+    FILE* fp;
+    long size;
+
+    memset(c, 0, sizeof(mbcap));
+
+    if ((fp = fopen(path, "rb")) == NULL)
+    {
+        log_message(LOG_ERR, "mbcap: cannot open %s: %s\n", path, strerror(errno));
+        return ESYSERR;
+    }
+
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < (long) sizeof(h) || fseek(fp, 0, SEEK_SET) != 0 ||
+        (c->data = (uint8_t*) malloc(size)) == NULL || fread(c->data, 1, size, fp) != (size_t) size)
+    {
+        log_message(LOG_ERR, "mbcap: cannot read %s\n", path);
+        fclose(fp);
+        free(c->data);
+        c->data = NULL;
+        return ESYSERR;
+    }
+    fclose(fp);
+
+    memcpy(&h, c->data, sizeof(h));
+    if (memcmp(h.magic, MBCAP_MAGIC, sizeof(h.magic)) != 0 || h.version != 1)
+    {
+        log_message(LOG_ERR, "mbcap: %s is not a capture\n", path);
+        free(c->data);
+        c->data = NULL;
+        return EGENERR;
+    }
+
+    c->mode = MBCAP_REPLAY;
+    c->ctx = ctx;
+    c->header_length = (int) h.header_length;
+    c->len = (size_t) size;
+    c->pos = sizeof(h);
+    c->speed = speed > 0 ? speed : 0;
+    c->loop = loop;
+    c->t0 = mono_ns();
+
+    if (ENOERR != mbcap_attach(c))
+    {
+        free(c->data);
+        c->data = NULL;
+        return EGENERR;
+    }
+
+    log_message(LOG_INFO, "mbcap: replaying %s (%ld bytes) at %s\n", path, size, c->speed > 0 ? "recorded pace" : "full speed");
+
+    return ENOERR;
+}
+
+/**
+ * @brief detach and release
+ *
+ * @param c
+ */
+void mbcap_close(mbcap* c)
+{
+    for (int i = 0; i < MBCAP_MAX_CTX; i++)
+        if (mbcap_attached[i] == c)
+            mbcap_attached[i] = NULL;
+
+    if (c->fp != NULL)
+        fclose(c->fp);
+    c->fp = NULL;
+
+    free(c->data);
+    c->data = NULL;
+
+    if (c->mode != 0)
+        log_message(LOG_INFO, "mbcap: %lu transactions, %lu mismatched\n", c->transactions, c->mismatches);
+    c->mode = 0;
+}
+
+/**
+ * @brief the replay reached the end of a capture that does not loop
+ *
+ * @param c
+ * @return int
+ */
+int mbcap_replay_done(const mbcap* c)
+{
+    return c->mode == MBCAP_REPLAY && !c->loop && c->pos >= c->len;
+}
+
+/**
+ * @brief registers of a response frame
+ *
+ * @param c
+ * @param fc
+ * @param nb
+ * @param rsp, whole frame
+ * @param len
+ * @param dest
+ * @return int, nb, -1 => errno set (exception code, bad frame)
+ */
+static int mbcap_decode(const mbcap* c, int fc, int nb, const uint8_t* rsp, int len, uint16_t* dest)
+{
+    const uint8_t* pdu = rsp + c->header_length;
+    int n = len - c->header_length;
+
+    if (n >= 2 && pdu[0] == (fc | 0x80))
+    {
+        errno = MODBUS_ENOBASE + pdu[1];
+        return -1;
+    }
+
+    if (n < 2 + 2 * nb || pdu[0] != fc || pdu[1] != 2 * nb)
+    {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    for (int i = 0; i < nb; i++)
+        dest[i] = (uint16_t) (pdu[2 + 2 * i] << 8 | pdu[3 + 2 * i]);
+
+    return nb;
+}
+
+static int mbcap_record(mbcap* c, const uint8_t* req, int req_len, int fc, int nb, uint16_t* dest)
+{
+    uint8_t frame[8];
+    uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+    mbcap_record_header rh;
+    int64_t start = mono_ns();
+    int n = -1;
+    int rc = -1;
+
+    memset(&rh, 0, sizeof(rh));
+
+    if (modbus_send_raw_request(c->ctx, req, req_len) >= 0)
+        n = modbus_receive_confirmation(c->ctx, rsp);
+
+    rh.t_ns = (uint64_t) (start - c->t0);
+    rh.dur_us = (uint32_t) ((mono_ns() - start) / 1000);
+
+    if (n > 0)
+        rc = mbcap_decode(c, fc, nb, rsp, n, dest);
+    else
+        rh.err = errno;
+
+    // the request as sent: RTU appends the CRC, low byte first
+    memcpy(frame, req, req_len);
+    rh.req_len = (uint16_t) req_len;
+    if (c->header_length == 1)
+    {
+        uint16_t crc = crc16(req, req_len);
+
+        frame[req_len] = (uint8_t) (crc & 0xFF);
+        frame[req_len + 1] = (uint8_t) (crc >> 8);
+        rh.req_len += 2;
+    }
+    rh.rsp_len = (uint16_t) (n > 0 ? n : 0);
+
+    if (fwrite(&rh, sizeof(rh), 1, c->fp) != 1 ||
+        fwrite(frame, 1, rh.req_len, c->fp) != rh.req_len ||
+        fwrite(rsp, 1, rh.rsp_len, c->fp) != rh.rsp_len ||
+        fflush(c->fp) != 0)
+        log_message(LOG_ERR, "mbcap: write failed: %s\n", strerror(errno));
+
+    c->transactions++;
+
+    return rc;
+}
+
+static int mbcap_replay(mbcap* c, const uint8_t* req, int req_len, int fc, int nb, uint16_t* dest)
+{
+    mbcap_record_header rh;
+    const uint8_t* frame;
+
+    if (c->pos >= c->len && c->loop)
+    {
+        c->pos = sizeof(mbcap_file_header);
+        c->t0 = mono_ns();
+    }
+
+    if (c->pos + sizeof(rh) > c->len)
+    {
+        errno = ENODATA;
+        return -1;
+    }
+
+    memcpy(&rh, c->data + c->pos, sizeof(rh));
+    frame = c->data + c->pos + sizeof(rh);
+
+    if (c->pos + sizeof(rh) + rh.req_len + rh.rsp_len > c->len)
+    {
+        log_message(LOG_ERR, "mbcap: truncated capture\n");
+        c->pos = c->len;
+        errno = ENODATA;
+        return -1;
+    }
+    c->pos += sizeof(rh) + rh.req_len + rh.rsp_len;
+    c->transactions++;
+
+    // at the recorded response time, scaled
+    if (c->speed > 0)
+    {
+        int64_t due = c->t0 + (int64_t) ((rh.t_ns + (uint64_t) rh.dur_us * 1000) / c->speed);
+        struct timespec ts = { .tv_sec = due / NSEC_PER_SEC, .tv_nsec = due % NSEC_PER_SEC };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+
+    if (rh.req_len < req_len || memcmp(frame, req, req_len) != 0)
+    {
+        if (c->mismatches++ == 0)
+            log_message(LOG_WARNING, "mbcap: the reads differ from the capture (fc %d, %d registers)\n", fc, nb);
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    if (rh.rsp_len == 0)
+    {
+        errno = rh.err;
+        return -1;
+    }
+
+    return mbcap_decode(c, fc, nb, frame + rh.req_len, rh.rsp_len, dest);
+}
+
+/**
+ * @brief modbus_read_registers() / modbus_read_input_registers(), captured
+ *        or replayed when the context has an mbcap attached
+ *
+ * @param ctx
+ * @param fc, MODBUS_FC_READ_HOLDING_REGISTERS, MODBUS_FC_READ_INPUT_REGISTERS
+ * @param addr
+ * @param nb
+ * @param dest
+ * @return int, nb, -1 => errno
+ */
+int mbcap_read_registers(modbus_t* ctx, int fc, int addr, int nb, uint16_t* dest)
+{
+    mbcap* c = mbcap_of(ctx);
+    uint8_t req[6];
+
+    if (c == NULL)
+        return fc == MODBUS_FC_READ_INPUT_REGISTERS ?
+            modbus_read_input_registers(ctx, addr, nb, dest) :
+            modbus_read_registers(ctx, addr, nb, dest);
+
+    if (nb < 1 || nb > MODBUS_MAX_READ_REGISTERS)
+    {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    req[0] = (uint8_t) modbus_get_slave(ctx);
+    req[1] = (uint8_t) fc;
+    req[2] = (uint8_t) (addr >> 8);
+    req[3] = (uint8_t) addr;
+    req[4] = (uint8_t) (nb >> 8);
+    req[5] = (uint8_t) nb;
+
+    return c->mode == MBCAP_RECORD ?
+        mbcap_record(c, req, sizeof(req), fc, nb, dest) :
+        mbcap_replay(c, req, sizeof(req), fc, nb, dest);
+}
@@ -1,5 +1,6 @@
 #include "utils/message.h"
 #include "utils/error.h"
+#include "utils/slab.h"
 
 
 //FIXME
@@ -16,7 +17,7 @@ extern char* strdup(const char*);
  */
 struct Message* create_message(const char* source_topic, const char* target_topic, void* data, int64_t datalen)
 {
-    struct Message* msg = malloc(sizeof(struct Message));
+    struct Message* msg = slab_alloc(sizeof(struct Message));
 
     if (msg == NULL)
     {
@@ -50,7 +51,7 @@ void free_message(struct Message* msg)
 {
     if (msg)
     {
-        // free pointer
-        free(msg);
+        // back to the pool
+        slab_free(msg);
     }
 }
\ No newline at end of file
@@ -0,0 +1,38 @@
+/**
+ * @file meter_data.c
+ * @author longdh
+ * @brief 
+ * @version 0.1
+ * @date 2024-01-08
+ * 
+ * @copyright Copyright (c) 2023
+ * 
+ */
+#include <stdio.h>
+#include "meter/meter_data.h"
+
+/**
+ * @brief meter data as JSON object
+ * 
+ * @param data 
+ * @param buf 
+ * @param size 
+ * @return int, length of the text (snprintf semantic)
+ */
+int meter_data_to_json(const meter_data_log* data, char* buf, size_t size)
+{
+    return snprintf(buf, size, "{"
+                            "\"meter\":%u,"
+                            "\"voltage\":%f,"
+                            "\"current\":%f,"
+                            "\"power\":%f,"
+                            "\"reactive_power\":%f,"
+                            "\"power_factor\":%f,"
+                            "\"freq\":%f,"
+                            "\"import_active\":%f,"
+                            "\"export_active\":%f,"
+                            "\"ts\":%llu}",
+            data->meter_id, data->voltage, data->current, data->power, data->reactive_power,
+            data->power_factor, data->freq, data->import_active, data->export_active,
+            (unsigned long long) data->timestamp_ns);
+}
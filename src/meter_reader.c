@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include "meter/meter_reader.h"
+#include "meter/mbcap.h"
 #include "utils/error.h"
 #include "utils/logger.h"
 
@@ -55,7 +56,7 @@ int read_dss666_meter_data(modbus_t *modbus_ctx, meter_data_log* data)
     uint16_t chint_meter_data[2*base_regs];
     
     
-    rc = modbus_read_registers(modbus_ctx, base_addr, base_regs * 2, (uint16_t*) chint_meter_data);
+    rc = mbcap_read_registers(modbus_ctx, MODBUS_FC_READ_HOLDING_REGISTERS, base_addr, base_regs * 2, (uint16_t*) chint_meter_data);
     if (rc == -1) 
     {
         log_message(LOG_ERR, "Modbus read error: %s\n", modbus_strerror(errno));
@@ -77,7 +78,7 @@ int read_dss666_meter_data(modbus_t *modbus_ctx, meter_data_log* data)
     data->freq             = modbus_get_float_dcba((uint16_t *)&chint_meter_data[0x0E]);
     
 
-    rc = modbus_read_registers(modbus_ctx, base_addr_impw, 2, (uint16_t*) chint_meter_regw);
+    rc = mbcap_read_registers(modbus_ctx, MODBUS_FC_READ_HOLDING_REGISTERS, base_addr_impw, 2, (uint16_t*) chint_meter_regw);
     if (rc == -1) 
     {
         log_message(LOG_ERR, "Modbus read error: %s\n", modbus_strerror(errno));
@@ -85,7 +86,7 @@ int read_dss666_meter_data(modbus_t *modbus_ctx, meter_data_log* data)
     }
     data->import_active = modbus_get_float_dcba(chint_meter_regw);
 
-    rc = modbus_read_registers(modbus_ctx, base_addr_expw, 2, (uint16_t*) chint_meter_regw);
+    rc = mbcap_read_registers(modbus_ctx, MODBUS_FC_READ_HOLDING_REGISTERS, base_addr_expw, 2, (uint16_t*) chint_meter_regw);
     if (rc == -1) 
     {
         log_message(LOG_ERR, "Modbus read error: %s\n", modbus_strerror(errno));
@@ -108,7 +109,7 @@ int read_pzem16_meter_data(modbus_t *modbus_ctx, meter_data_log* data)
     uint16_t chint_meter_data[2*base_regs];
     
     
-    rc = modbus_read_input_registers(modbus_ctx, base_addr, base_regs, (uint16_t*) chint_meter_data);
+    rc = mbcap_read_registers(modbus_ctx, MODBUS_FC_READ_INPUT_REGISTERS, base_addr, base_regs, (uint16_t*) chint_meter_data);
     if (rc == -1) 
     {
         log_message(LOG_ERR, "Modbus read error: %s\n", modbus_strerror(errno));
@@ -13,6 +13,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
 #include <modbus/modbus.h>
 #include "modbus_src.h"
 #include "utils/error.h"
@@ -27,6 +29,74 @@ extern char* strdup(const char*);
 
 #define DEBUG
 
+#define NSEC_PER_SEC        1000000000LL
+#define NSEC_PER_MSEC       1000000LL
+
+static int64_t clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return (int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief sleep until an absolute CLOCK_MONOTONIC time
+ * 
+ * @param deadline_ns 
+ */
+static void sleep_until(int64_t deadline_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = deadline_ns / NSEC_PER_SEC;
+    ts.tv_nsec = deadline_ns % NSEC_PER_SEC;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/**
+ * @brief first deadline, the next wall clock multiple of the period when aligned
+ * 
+ * @param cfg 
+ * @return int64_t, CLOCK_MONOTONIC ns
+ */
+static int64_t first_deadline(modbus_source_config* cfg)
+{
+    int64_t period = (int64_t) cfg->poll_ms * NSEC_PER_MSEC;
+    int64_t now = clock_ns(CLOCK_MONOTONIC);
+
+    if (!cfg->poll_align)
+        return now;
+
+    int64_t wall = clock_ns(CLOCK_REALTIME);
+
+    return now + (period - wall % period) % period;
+}
+
+/**
+ * @brief write a meter reading, as a sample with the derived fields when set
+ * 
+ * @param cfg 
+ * @param md_log 
+ */
+static void modbus_publish_meter_data(modbus_source_config* cfg, meter_data_log* md_log)
+{
+    if (cfg->derive != NULL)
+    {
+        meter_sample sample;
+
+        if (ENOERR == derive_meter_data(cfg->derive, cfg->derive_map, md_log, &sample))
+        {
+            bus_write_prio(cfg->bw, (void*) &sample, sizeof(sample), prio_rules_eval(cfg->urgent, &sample, sizeof(sample)));
+            return;
+        }
+    }
+
+    bus_write_prio(cfg->bw, (void*) md_log, sizeof(meter_data_log), prio_rules_eval(cfg->urgent, md_log, sizeof(meter_data_log)));
+}
+
 /**
  * @brief Main thread
  * 
@@ -39,6 +109,9 @@ static void* modbus_source_reader_task(void* arg)
     
     // modbus
     modbus_t *modbus_ctx = NULL;
+
+    // before the port is opened, no fault / preemption during a transaction
+    task_sched_apply_self(&cfg->sched, "modbus-src");
     
     if (0 == strcmp(cfg->mb_type, "RTU"))
     {        
@@ -52,35 +125,135 @@ static void* modbus_source_reader_task(void* arg)
 
         modbus_set_slave(modbus_ctx, cfg->slave_id);
 
-        if (modbus_connect(modbus_ctx) == -1) 
+        // replay: the context is not connected, the capture answers the reads
+        if (cfg->replay != NULL)
+        {
+            if (ENOERR != mbcap_replay_open(&cfg->cap, modbus_ctx, cfg->replay, cfg->replay_speed, cfg->replay_loop))
+            {
+                modbus_free(modbus_ctx);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (modbus_connect(modbus_ctx) == -1) 
         {
             log_message(LOG_ERR, "Modbus connection failed: %s\n", modbus_strerror(errno));
             modbus_free(modbus_ctx);
             exit(EXIT_FAILURE);
         }
+        else if (cfg->capture != NULL)
+            mbcap_record_open(&cfg->cap, modbus_ctx, cfg->capture);
 
         // save context
         cfg->mb_context = (void*) modbus_ctx;   
     }
 
-    // Main loop
+    int64_t period = (int64_t) cfg->poll_ms * NSEC_PER_MSEC;
+    int64_t deadline = first_deadline(cfg);
+    unsigned long polls = 0;
+    int replaying = (cfg->cap.mode == MBCAP_REPLAY);
+
+    // Main loop, deadlines are absolute: the read time does not drift the period
     while (1) 
     {
         int rc;
         meter_data_log md_log;
 
-        rc = read_meter_data(cfg->mtype, modbus_ctx, &md_log);
+        // a replay is paced by the capture itself
+        if (replaying)
+            deadline = clock_ns(CLOCK_MONOTONIC);
+        else
+            sleep_until(deadline);
 
-        if (rc == 0)
+        int64_t start = clock_ns(CLOCK_MONOTONIC);
+        histogram_record(&cfg->jitter, (start - deadline) / 1000);
+
+        memset(&md_log, 0, sizeof(md_log));
+        md_log.meter_id = cfg->slave_id;
+
+        // the sample is stamped with its deadline, so meters polled on the
+        // same boundary share the timestamp
+        int64_t ts = deadline + (clock_ns(CLOCK_REALTIME) - start);
+        if (cfg->poll_align)
+            ts = (ts + period / 2) / period * period;
+        md_log.timestamp_ns = (uint64_t) ts;
+
+        if (cfg->map != NULL && cfg->map_output == MAP_OUT_FIXED)
         {
-            //write to queue
-            bus_write(cfg->bw, (void*) &md_log, sizeof(md_log));
-        }        
-        
+            meter_fixed_sample fixed;
 
-        // sleep
-        usleep(1000000 * 10); // 10 second
-    
+            fixed.meter_id = cfg->slave_id;
+            fixed.timestamp_ns = md_log.timestamp_ns;
+
+            rc = regmap_fixed_sample(cfg->map, modbus_ctx, &fixed);
+
+            if (rc == 0 && cfg->derive != NULL)
+                derive_fixed(cfg->derive, cfg->derive_map, &fixed);
+
+            if (rc == 0)
+                bus_write_prio(cfg->bw, (void*) &fixed, sizeof(fixed), prio_rules_eval(cfg->urgent, &fixed, sizeof(fixed)));
+        }
+        else if (cfg->map != NULL)
+        {
+            meter_sample sample;
+
+            sample.meter_id = cfg->slave_id;
+            sample.timestamp_ns = md_log.timestamp_ns;
+
+            rc = regmap_sample(cfg->map, modbus_ctx, &sample);
+
+            if (rc == 0 && cfg->map_output == MAP_OUT_METER)
+            {
+                regmap_to_meter_data(cfg->map, sample.values, &md_log);
+                modbus_publish_meter_data(cfg, &md_log);
+            }
+            else if (rc == 0)
+            {
+                if (cfg->derive != NULL)
+                    derive_sample(cfg->derive, cfg->derive_map, &sample);
+
+                bus_write_prio(cfg->bw, (void*) &sample, sizeof(sample), prio_rules_eval(cfg->urgent, &sample, sizeof(sample)));
+            }
+        }
+        else
+        {
+            rc = read_meter_data(cfg->mtype, modbus_ctx, &md_log);
+
+            if (rc == 0)
+            {
+                //write to queue, alarms ahead of the telemetry
+                modbus_publish_meter_data(cfg, &md_log);
+            }        
+        }
+
+        int64_t end = clock_ns(CLOCK_MONOTONIC);
+        histogram_record(&cfg->read_time, (end - start) / 1000);
+
+        if (replaying && mbcap_replay_done(&cfg->cap))
+        {
+            log_message(LOG_INFO, "modbus: end of the replay, %lu transactions\n", cfg->cap.transactions);
+            break;
+        }
+
+        // next deadline, skip the ones already missed
+        deadline += period;
+        if (!replaying && deadline <= end)
+        {
+            int64_t missed = (end - deadline) / period + 1;
+
+            cfg->overruns += missed;
+            deadline += missed * period;
+            log_message(LOG_WARNING, "modbus: poll overrun, %lld deadline(s) skipped\n", (long long) missed);
+        }
+
+        if (cfg->stats_polls > 0 && (++polls % cfg->stats_polls) == 0)
+        {
+            histogram_log(&cfg->jitter, "us");
+            histogram_log(&cfg->read_time, "us");
+            log_message(LOG_INFO, "modbus: %lu overruns\n", cfg->overruns);
+
+            histogram_reset(&cfg->jitter);
+            histogram_reset(&cfg->read_time);
+        }
     }
 
     // Clean up
@@ -129,6 +302,11 @@ int modbus_source_init(modbus_source_config* cfg, Bus *b, int mtype, const char*
     cfg->stop_bit = stop_bit;
     cfg->slave_id = slave_id;
 
+    cfg->poll_ms = 10000;
+    task_sched_default(&cfg->sched);
+    histogram_init(&cfg->jitter, "modbus poll jitter");
+    histogram_init(&cfg->read_time, "modbus read time");
+
     return 0;
 }
 
@@ -146,6 +324,32 @@ int modbus_source_term(modbus_source_config* cfg)
     if (cfg->path != NULL)
         free(cfg->path);
 
+    histogram_destroy(&cfg->jitter);
+    histogram_destroy(&cfg->read_time);
+
+    free(cfg->urgent);
+    cfg->urgent = NULL;
+
+    mbcap_close(&cfg->cap);
+
+    if (cfg->capture != NULL)
+        free(cfg->capture);
+
+    if (cfg->replay != NULL)
+        free(cfg->replay);
+
+    if (cfg->derive != NULL && cfg->derive->invalid > 0)
+        log_message(LOG_WARNING, "modbus: %lu derived values not finite, sent as 0\n", cfg->derive->invalid);
+
+    free(cfg->derive);
+    cfg->derive = NULL;
+
+    if (cfg->derive_map != NULL)
+    {
+        regmap_free(cfg->derive_map);
+        free(cfg->derive_map);
+        cfg->derive_map = NULL;
+    }
 
     return 0;
 }
@@ -23,14 +23,14 @@
 #include "logger.h"
 #include "message.h"
 #include "mosq_sink.h"
+#include "meter/meter_data.h"
+#include "utils/encoder.h"
 
 //FIXME
 extern char* strdup(const char*);
 
 #define DEBUG
 
-volatile int _connected;
-
 /**
  * @brief connect callback
  * 
@@ -40,11 +40,12 @@ volatile int _connected;
  */
 static void on_connect(struct mosquitto *mosq, void *obj, int rc) 
 {
-    _connected = 1;
+    mosq_sync_config* cfg = (mosq_sync_config*) obj;
 
     if (rc == 0) 
     {
         log_message(LOG_INFO, "Sink: Connected successfully\n");        
+        conn_state_set(&cfg->conn, CONN_CONNECTED);
     } 
     else 
     {
@@ -61,7 +62,9 @@ static void on_connect(struct mosquitto *mosq, void *obj, int rc)
  */
 static void on_disconnect(struct mosquitto *mosq, void *obj, int rc) 
 {
-    _connected = 0;
+    mosq_sync_config* cfg = (mosq_sync_config*) obj;
+
+    conn_state_set(&cfg->conn, CONN_DISCONNECTED);
 
     if (rc == MOSQ_ERR_SUCCESS) 
     {
@@ -70,10 +73,40 @@ static void on_disconnect(struct mosquitto *mosq, void *obj, int rc)
     else 
     {
         log_message(LOG_ERR, "Disconnected unexpectedly, will try to reconnect...\n");
-        mosquitto_reconnect(mosq);
+
+        // in reactor mode the misc timer reconnects, never block the loop
+        if (cfg->reactor == NULL)
+            mosquitto_reconnect(mosq);
     }
 }
 
+/**
+ * @brief PUBACK (QoS 1) or written out (QoS 0): the samples in it are
+ *        delivered
+ * 
+ * @param mosq 
+ * @param obj 
+ * @param mid 
+ */
+static void on_publish(struct mosquitto *mosq, void *obj, int mid)
+{
+    mosq_sync_config* cfg = (mosq_sync_config*) obj;
+
+    sink_input_confirmed(&cfg->in, (uint64_t) mid, 1);
+}
+
+/**
+ * @brief QoS of the publishes: 1 when replaying the log, so that on_publish
+ *        means the broker has them
+ * 
+ * @param cfg 
+ * @return int 
+ */
+static int mosq_sink_qos(const mosq_sync_config* cfg)
+{
+    return cfg->in.cur != NULL ? 1 : 0;
+}
+
 /**
  * @brief send data to mqtt server
  * 
@@ -81,22 +114,99 @@ static void on_disconnect(struct mosquitto *mosq, void *obj, int rc)
  * @param topic 
  * @param message 
  * @param data_len 
+ * @param first, log seq of the first sample in it, 0 => none
  * @return int 
  */
-static int send_to_mqtt(struct mosquitto *mosq, const char* topic, void* message, int data_len) 
+static int send_to_mqtt(struct mosquitto *mosq, const char* topic, void* message, int data_len, uint64_t first) 
 {
-    int rc = mosquitto_publish(mosq, NULL, topic, data_len, message, 0, false);
+    mosq_sync_config* cfg = (mosq_sync_config*) mosquitto_userdata(mosq);
+    int mid = 0;
+    int rc = mosquitto_publish(mosq, &mid, topic, data_len, message, mosq_sink_qos(cfg), false);
     
     if (rc != MOSQ_ERR_SUCCESS) 
     {
         log_message(LOG_ERR, "Unable to publish (%d): %s\n", rc, mosquitto_strerror(rc));
+
+        // not queued by the client: read again from the log, unless it can never go
+        if (rc == MOSQ_ERR_NO_CONN || rc == MOSQ_ERR_CONN_LOST || rc == MOSQ_ERR_NOMEM)
+            sink_input_resend(&cfg->in, first);
+        return rc;
     }
 
-    log_message(LOG_INFO, "send ok to server\n");
+    sink_input_sent(&cfg->in, (uint64_t) mid, first);
+
+    #ifdef DEBUG
+    log_message(LOG_INFO, "send ok to server (%s, %d bytes)\n", topic, data_len);
+    #endif // DEBUG
 
     return rc;
 }
 
+/**
+ * @brief batcher publish callback
+ * 
+ * @param ctx 
+ * @param topic 
+ * @param payload 
+ * @param len 
+ * @param first 
+ * @return int 
+ */
+static int publish_batch(void* ctx, const char* topic, const void* payload, size_t len, uint64_t first)
+{
+    return send_to_mqtt((struct mosquitto*) ctx, topic, (void*) payload, (int) len, first);
+}
+
+/**
+ * @brief payload format of the published items
+ * 
+ * @param cfg 
+ * @return int, payload_format
+ */
+int mosq_sink_format(const mosq_sync_config* cfg)
+{
+    // a JSON array batch needs JSON items
+    if ((cfg->batch_count > 1 || cfg->batch_ms > 0) && cfg->batch_format == BATCH_FMT_JSON)
+        return ENC_JSON;
+
+    return cfg->format;
+}
+
+/**
+ * @brief resolve topic & payload of the current sample, then batch (or send) it
+ * 
+ * @param cfg 
+ * @param in 
+ * @return int 
+ */
+static int forward_bus_data(mosq_sync_config* cfg, sink_input* in)
+{
+    char topic[256];
+    const char* src_topic = cfg->topic;
+    uint32_t meter_id = 0;
+    void* data = in->data;
+    int datalen = in->datalen;
+
+    if (datalen == sizeof(struct Message))
+        src_topic = ((struct Message*) data)->source_topic;
+    else if (datalen == sizeof(meter_data_log))
+        meter_id = ((meter_data_log*) data)->meter_id;
+    else if (datalen == sizeof(meter_sample))
+        meter_id = ((meter_sample*) data)->meter_id;
+    else if (datalen == sizeof(meter_fixed_sample))
+        meter_id = ((meter_fixed_sample*) data)->meter_id;
+
+    if (in->len < 0)
+        return EGENERR;
+
+    if (cfg->topic_template != NULL)
+        topic_template_expand(cfg->topic_template, src_topic, meter_id, topic, sizeof(topic));
+    else
+        snprintf(topic, sizeof(topic), "%s", src_topic ? src_topic : "");
+
+    return batcher_add(&cfg->batcher, topic, in->payload, in->len, in->seq);
+}
+
 /**
  * @brief sink thread (forward thread)
  * 
@@ -116,8 +226,8 @@ void* mosq_sink_task(void* arg)
     }
 
     // get queue 
-    BusReader* br = cfg->br;
-    if (br == NULL)
+    sink_input* in = &cfg->in;
+    if (in->br == NULL && in->sub == NULL && in->cur == NULL)
     {
         #ifdef DEBUG
         log_message(LOG_ERR, "Error queue...\n");
@@ -133,7 +243,7 @@ void* mosq_sink_task(void* arg)
     int rc;
 
     // Create a mosquitto client instance
-    mosq = mosquitto_new(NULL, true, NULL);
+    mosq = mosquitto_new(NULL, true, (void*) cfg);
     if (!mosq) 
     {
         log_message(LOG_ERR, "Error: Out of memory.\n");
@@ -143,18 +253,22 @@ void* mosq_sink_task(void* arg)
     // Set callback functions
     mosquitto_connect_callback_set(mosq, on_connect);
     mosquitto_disconnect_callback_set(mosq, on_disconnect);
+    mosquitto_publish_callback_set(mosq, on_publish);
+
+    // the log is acknowledged by on_publish, not as the samples are queued
+    if (sink_input_defer(in) != ENOERR)
+        log_message(LOG_ERR, "mosq sink: out of memory, acknowledging on hand-off\n");
 
     if (cfg->username != NULL)
         mosquitto_username_pw_set(mosq, cfg->username, cfg->password);
 
-    _connected = 0;
+    // Connect to MQTT broker, the network thread finishes (or retries) it
+    conn_state_set(&cfg->conn, CONN_CONNECTING);
 
-    // Connect to MQTT broker
-    rc = mosquitto_connect(mosq, cfg->host, cfg->port, 60);
+    rc = mosquitto_connect_async(mosq, cfg->host, cfg->port, 60);
     if (rc != MOSQ_ERR_SUCCESS) 
     {
-        log_message(LOG_ERR, "Unable to connect (%d): %s\n", rc, mosquitto_strerror(rc));
-        exit(ESVRERR);
+        log_message(LOG_ERR, "Unable to connect (%d): %s, will retry\n", rc, mosquitto_strerror(rc));
     }
 
     rc = mosquitto_loop_start(mosq);
@@ -166,36 +280,34 @@ void* mosq_sink_task(void* arg)
         exit(ESVRERR);
 	}
 
-    // wait until connected
-    while (!_connected)
-        usleep(10000);
+    // wait until connected, woken up by on_connect
+    conn_state_wait(&cfg->conn, CONN_CONNECTED, -1);
+
+    batcher_init(&cfg->batcher, cfg->batch_count, cfg->batch_ms, cfg->batch_format, publish_batch, mosq);
 
     while (1) 
     {
-        struct Message* msg;
-        void* data;
-        int datalen;
+        // wake up for the oldest pending batch, or wait for data forever
+        int timeout = batcher_next_timeout(&cfg->batcher);
 
-        if (0 == bus_read(br, (void**) &data, &datalen))
+        // the broker is behind: only the batches go on until it confirmed
+        if (sink_input_unacked(in) >= SINK_UNACKED_HIGH)
+            sink_input_wait_unacked(in, SINK_UNACKED_HIGH, timeout);
+        else if (0 == sink_input_read(in, mosq_sink_format(cfg), NULL, timeout))
         {
-            if (datalen == sizeof(struct Message))
-            {
-                msg = (struct Message*) data;
+            forward_bus_data(cfg, in);
 
-                #ifdef DEBUG
-                // log_message(LOG_INFO, "%s\n", msg->source_topic);
-                // log_message(LOG_INFO, "%s\n", (char*) msg->data);
-                #endif // DEBUG
-
-                // Publish to MQTT broker and topic
-                send_to_mqtt(mosq, msg->source_topic, msg->data, msg->datalen);
-
-                // free
-                free(data);
-            }
+            // free
+            sink_input_done(in);
         }
+
+        batcher_flush_due(&cfg->batcher);
+        sink_input_hold(in, batcher_held(&cfg->batcher));
     }
 
+    batcher_flush_all(&cfg->batcher);
+    batcher_term(&cfg->batcher);
+
     // Clean up
     mosquitto_destroy(mosq);
     mosquitto_lib_cleanup();
@@ -204,6 +316,261 @@ void* mosq_sink_task(void* arg)
     return NULL;
 }
 
+#define MOSQ_MISC_MS        1000
+#define MOSQ_DRAIN_MAX      64
+
+/**
+ * @brief reactor mode: a non-threaded mosquitto client, its socket is
+ *        watched by the reactor
+ * 
+ */
+typedef struct {
+    reactor_t*          r;
+    struct mosquitto*   mosq;
+    int                 sock;       // socket registered in io_h, -1 => none
+    int                 paused;     // bus not read, too many publishes unconfirmed
+
+    reactor_handler*    io_h;
+    reactor_handler*    bus_h;
+    reactor_handler*    misc_h;     // keepalive & reconnect
+    reactor_handler*    batch_h;    // oldest pending batch
+} mosq_async;
+
+static void mosq_async_on_io(reactor_t* r, reactor_handler* h, uint32_t events, void* arg);
+
+/**
+ * @brief follow the client socket (new one on reconnect), the write
+ *        interest and the batch deadline
+ * 
+ * @param cfg 
+ */
+static void mosq_async_update(mosq_sync_config* cfg)
+{
+    mosq_async* a = (mosq_async*) cfg->priv;
+    int sock = mosquitto_socket(a->mosq);
+
+    // a closed socket leaves the epoll set by itself, its number may come back
+    if (sock != a->sock || conn_state_get(&cfg->conn) == CONN_DISCONNECTED)
+    {
+        reactor_del(a->r, a->io_h);
+        a->io_h = NULL;
+        a->sock = -1;
+
+        if (sock >= 0 && (a->io_h = reactor_add(a->r, sock, EPOLLIN, mosq_async_on_io, cfg)) != NULL)
+            a->sock = sock;
+    }
+
+    if (a->io_h != NULL)
+        reactor_mod(a->r, a->io_h, EPOLLIN | (mosquitto_want_write(a->mosq) ? EPOLLOUT : 0));
+
+    // the broker caught up, on_bus again
+    if (a->paused && sink_input_unacked(&cfg->in) < SINK_UNACKED_HIGH)
+    {
+        a->paused = 0;
+        reactor_mod(a->r, a->bus_h, EPOLLIN);
+    }
+
+    reactor_timer_set(a->batch_h, batcher_next_timeout(&cfg->batcher), 0);
+}
+
+/**
+ * @brief client socket ready (reactor thread)
+ * 
+ * @param r 
+ * @param h 
+ * @param events 
+ * @param arg 
+ */
+static void mosq_async_on_io(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    mosq_sync_config* cfg = (mosq_sync_config*) arg;
+    mosq_async* a = (mosq_async*) cfg->priv;
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        mosquitto_loop_read(a->mosq, 1);
+
+    if ((events & EPOLLOUT) && mosquitto_socket(a->mosq) >= 0)
+        mosquitto_loop_write(a->mosq, 1);
+
+    mosq_async_update(cfg);
+}
+
+/**
+ * @brief keepalive, reconnect (reactor thread)
+ * 
+ * @param r 
+ * @param h 
+ * @param events 
+ * @param arg 
+ */
+static void mosq_async_on_misc(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    mosq_sync_config* cfg = (mosq_sync_config*) arg;
+    mosq_async* a = (mosq_async*) cfg->priv;
+
+    mosquitto_loop_misc(a->mosq);
+
+    if (mosquitto_socket(a->mosq) < 0)
+    {
+        conn_state_set(&cfg->conn, CONN_CONNECTING);
+        mosquitto_reconnect_async(a->mosq);
+    }
+
+    mosq_async_update(cfg);
+}
+
+/**
+ * @brief bus readable (reactor thread)
+ * 
+ * @param r 
+ * @param h 
+ * @param events 
+ * @param arg 
+ */
+static void mosq_async_on_bus(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    mosq_sync_config* cfg = (mosq_sync_config*) arg;
+    mosq_async* a = (mosq_async*) cfg->priv;
+    sink_input* in = &cfg->in;
+
+    for (int i = 0; i < MOSQ_DRAIN_MAX; i++)
+    {
+        // the broker is behind, mosq_async_update() resumes
+        if (sink_input_unacked(in) >= SINK_UNACKED_HIGH)
+        {
+            a->paused = 1;
+            reactor_mod(r, h, 0);
+            break;
+        }
+
+        if (0 != sink_input_read(in, mosq_sink_format(cfg), NULL, 0))
+            break;
+
+        forward_bus_data(cfg, in);
+        sink_input_done(in);
+    }
+
+    sink_input_hold(in, batcher_held(&cfg->batcher));
+    mosq_async_update(cfg);
+}
+
+/**
+ * @brief batch deadline (reactor thread)
+ * 
+ * @param r 
+ * @param h 
+ * @param events 
+ * @param arg 
+ */
+static void mosq_async_on_batch(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    mosq_sync_config* cfg = (mosq_sync_config*) arg;
+
+    batcher_flush_due(&cfg->batcher);
+    sink_input_hold(&cfg->in, batcher_held(&cfg->batcher));
+    mosq_async_update(cfg);
+}
+
+static void mosq_async_free(mosq_sync_config* cfg);
+
+/**
+ * @brief Drive the sink from a reactor instead of its own thread. On
+ *        failure nothing stays attached
+ * 
+ * @param cfg 
+ * @param r 
+ * @return int 
+ */
+int mosq_sink_attach(mosq_sync_config* cfg, reactor_t* r)
+{
+    mosq_async* a = (mosq_async*) calloc(1, sizeof(mosq_async));
+    int rc;
+
+    if (a == NULL)
+        return ESYSERR;
+
+    a->r = r;
+    a->sock = -1;
+    cfg->priv = (void*) a;
+    cfg->reactor = r;
+
+    mosquitto_lib_init();
+
+    a->mosq = mosquitto_new(NULL, true, (void*) cfg);
+    if (a->mosq == NULL) 
+    {
+        log_message(LOG_ERR, "Error: Out of memory.\n");
+        mosquitto_lib_cleanup();
+        goto fail;
+    }
+
+    mosquitto_connect_callback_set(a->mosq, on_connect);
+    mosquitto_disconnect_callback_set(a->mosq, on_disconnect);
+    mosquitto_publish_callback_set(a->mosq, on_publish);
+
+    if (cfg->username != NULL)
+        mosquitto_username_pw_set(a->mosq, cfg->username, cfg->password);
+
+    // the log is acknowledged by on_publish, not as the samples are queued
+    if (sink_input_defer(&cfg->in) != ENOERR)
+        goto fail;
+
+    batcher_init(&cfg->batcher, cfg->batch_count, cfg->batch_ms, cfg->batch_format, publish_batch, a->mosq);
+
+    a->bus_h = reactor_add(r, sink_input_fd(&cfg->in), EPOLLIN, mosq_async_on_bus, cfg);
+    a->misc_h = reactor_timer_add(r, mosq_async_on_misc, cfg);
+    a->batch_h = reactor_timer_add(r, mosq_async_on_batch, cfg);
+    if (a->bus_h == NULL || a->misc_h == NULL || a->batch_h == NULL)
+        goto fail;
+
+    // CONNACK arrives through the reactor, on_connect sets CONNECTED
+    conn_state_set(&cfg->conn, CONN_CONNECTING);
+
+    rc = mosquitto_connect_async(a->mosq, cfg->host, cfg->port, 60);
+    if (rc != MOSQ_ERR_SUCCESS) 
+        log_message(LOG_ERR, "Unable to connect (%d): %s, will retry\n", rc, mosquitto_strerror(rc));
+
+    reactor_timer_set(a->misc_h, MOSQ_MISC_MS, MOSQ_MISC_MS);
+    mosq_async_update(cfg);
+
+    return ENOERR;
+
+fail:
+    // back to nothing attached, the caller may run the thread instead
+    reactor_del(r, a->bus_h);
+    reactor_del(r, a->misc_h);
+    reactor_del(r, a->batch_h);
+    mosq_async_free(cfg);
+    cfg->reactor = NULL;
+
+    return ESYSERR;
+}
+
+/**
+ * @brief release the reactor mode state, the reactor must be stopped
+ * 
+ * @param cfg 
+ */
+static void mosq_async_free(mosq_sync_config* cfg)
+{
+    mosq_async* a = (mosq_async*) cfg->priv;
+
+    if (a == NULL)
+        return;
+
+    if (a->mosq != NULL)
+    {
+        batcher_flush_all(&cfg->batcher);
+        batcher_term(&cfg->batcher);
+
+        mosquitto_destroy(a->mosq);
+        mosquitto_lib_cleanup();
+    }
+
+    free(a);
+    cfg->priv = NULL;
+}
+
 /**
  * @brief Init sync task
  * 
@@ -219,7 +586,10 @@ int mosq_sink_init(mosq_sync_config* cfg, Bus* b, const char* host, int port, co
     memset(cfg, 0, sizeof (mosq_sync_config));
 
     cfg->b = b;
-    create_bus_reader(&cfg->br, cfg->b);
+    sink_input_init(&cfg->in, cfg->b);
+
+    cfg->format = ENC_JSON;
+    conn_state_init(&cfg->conn, "mosq-sink");
 
     if (host != NULL)
         cfg->host = strdup(host);
@@ -269,6 +639,12 @@ int mosq_sink_term(mosq_sync_config* cfg)
     if (cfg->topic != NULL)
         free(cfg->topic);
 
+    if (cfg->topic_template != NULL)
+        free(cfg->topic_template);
+
+    mosq_async_free(cfg);
+    conn_state_destroy(&cfg->conn);
+
     return 0;
 }
 
@@ -293,6 +669,10 @@ int mosq_sink_run(mosq_sync_config* cfg)
  */
 int mosq_sink_wait(mosq_sync_config* cfg)
 {
+    // driven by a reactor, no thread of its own
+    if (cfg->reactor != NULL)
+        return 0;
+
     return 
         pthread_join(cfg->task_thread, NULL);    
 }
\ No newline at end of file
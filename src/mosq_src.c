@@ -23,8 +23,6 @@
 //FIXME
 extern char* strdup(const char*);
 
-static volatile int connected = 0;
-
 #define DEBUG
 
 /**
@@ -48,10 +46,19 @@ static void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto
 
     // create packet
     struct Message* msg = create_message(message->topic, NULL, message->payload, message->payloadlen);
+
+    // the message is zeroed past datalen: the text is NUL terminated when shorter
+    if (cfg->derive != NULL && msg->datalen > 0 && msg->datalen < (int) sizeof(msg->data))
+    {
+        int len = derive_json(cfg->derive, msg->data, sizeof(msg->data));
+        if (len >= 0)
+            msg->datalen = len;
+    }
+
     bus_write(bw, (void*) msg, sizeof(struct Message));
 
     // free
-    free(msg);    
+    free_message(msg);    
 }
 
 /**
@@ -226,6 +233,9 @@ int mosq_source_term(mosq_source_config* cfg)
     if (cfg->topic != NULL)
         free(cfg->topic);
 
+    free(cfg->derive);
+    cfg->derive = NULL;
+
     return 0;
 }
 
@@ -22,7 +22,10 @@
 #include "utils/error.h"
 #include "meter/datalog.h"
 #include "meter/meter_data.h"
+#include "utils/encoder.h"
 #include "utils/logger.h"
+#include "utils/message.h"
+#include "utils/ng_mqtt.h"
 
 #include "nng/mqtt/mqtt_client.h"
 #include "nng/nng.h"
@@ -30,11 +33,41 @@
 
 #define DEBUG
 
+#define MQTTC_RETRY_MS      1000    // failed PUBLISH sent again, once per period
+
 //FIXME
 extern char* strdup(const char*);
 
-static volatile int connected = 0;
-static int keepRunning = 1;
+/**
+ * @brief one slot of the send window. NanoNNG completes a send as soon as
+ *        its client took the message, the QoS 1 PUBACK and the retransmits
+ *        are handled inside: the window bounds the PUBLISH queued to the
+ *        client, not those the broker has yet to acknowledge
+ * 
+ */
+typedef struct {
+    nng_aio*            aio;
+    mqttc_sync_config*  cfg;
+    int                 index;
+    uint64_t            first;      // log seq of the first sample in it, 0 => none
+    nng_msg*            msg;        // failed, sent again by the task
+} mqttc_pub_slot;
+
+/**
+ * @brief per-instance state of the publisher
+ * 
+ */
+typedef struct {
+    nng_socket      sock;
+    nng_dialer      dialer;
+
+    mqttc_pub_slot* slots;
+    int*            free_slots;     // stack of free slot index
+    int             nfree;
+    int*            retry;          // slots holding a failed PUBLISH
+    int             nretry;
+    nng_time        next_retry;
+} mqttc_sink_ctx;
 
 
 static void
@@ -47,222 +80,322 @@ fatal(const char *msg, int rv)
 
 
 /**
- * @brief disconnect callback
+ * @brief PUBLISH completion, give the slot back. Its samples are delivered;
+ *        a failed one keeps the slot and is sent again by the task
  * 
- * @param p 
- * @param ev 
  * @param arg 
  */
 static void
-disconnect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
+publish_cb(void *arg)
 {
-	int reason = 0;
-	// get connect reason
-	nng_pipe_get_int(p, NNG_OPT_MQTT_DISCONNECT_REASON, &reason);
-	// property *prop;
-	// nng_pipe_get_ptr(p, NNG_OPT_MQTT_DISCONNECT_PROPERTY, &prop);
-	// nng_socket_get?
-	printf("%s: disconnected!\n", __FUNCTION__);
-
-    connected = 0;
-}
+    mqttc_pub_slot* slot = (mqttc_pub_slot*) arg;
+    mqttc_sync_config* cfg = slot->cfg;
+    mqttc_sink_ctx* ctx = (mqttc_sink_ctx*) cfg->priv;
+    int rv;
 
-/**
- * @brief 
- * 
- * @param p 
- * @param ev 
- * @param arg 
- */
-static void
-connect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
-{
-	int reason;
-	// get connect reason
-	nng_pipe_get_int(p, NNG_OPT_MQTT_CONNECT_REASON, &reason);
-	// get property for MQTT V5
-	// property *prop;
-	// nng_pipe_get_ptr(p, NNG_OPT_MQTT_CONNECT_PROPERTY, &prop);
-	printf("%s: connected!\n", __FUNCTION__);
+    if ((rv = nng_aio_result(slot->aio)) != 0)
+    {
+        // message is still owned by the aio on failure
+        nng_msg* msg = nng_aio_get_msg(slot->aio);
 
+        if (msg != NULL && rv != NNG_ECLOSED && rv != NNG_ECANCELED)
+        {
+            log_message(LOG_WARNING, "mqttc sink: publish failed: %s, sent again\n", nng_strerror(rv));
+
+            pthread_mutex_lock(&cfg->lock);
+            slot->msg = msg;
+            ctx->retry[ctx->nretry++] = slot->index;
+            pthread_cond_broadcast(&cfg->cond);
+            pthread_mutex_unlock(&cfg->lock);
+            return;
+        }
 
-    connected = 1;
+        // closing: read again from the log after the restart
+        if (msg != NULL)
+            nng_msg_free(msg);
+
+        log_message(LOG_ERR, "mqttc sink: publish failed: %s\n", nng_strerror(rv));
+    }
+
+    sink_input_confirmed(&cfg->in, slot->first, rv == 0);
+
+    pthread_mutex_lock(&cfg->lock);
+    ctx->free_slots[ctx->nfree++] = slot->index;
+    pthread_cond_broadcast(&cfg->cond);
+    pthread_mutex_unlock(&cfg->lock);
 }
 
 /**
- * @brief Connect to the given address. 
+ * @brief send the failed PUBLISH again (task), at most once per
+ *        MQTTC_RETRY_MS and once connected
  * 
- * @param sock 
- * @param dialer 
- * @param url 
- * @param username 
- * @param password 
- * @param verbose 
- * @return int 
+ * @param cfg 
+ * @param ctx 
+ * @param wait, 0 => return if the next round is not due
+ * @return int, failed PUBLISH waiting
  */
 static int
-client_connect(
-    nng_socket *sock, nng_dialer *dialer, const char *url, const char* username, const char* password, bool verbose)
+resend_failed(mqttc_sync_config* cfg, mqttc_sink_ctx* ctx, int wait)
 {
-	int        rv;
-
-	if ((rv = nng_mqtt_client_open(sock)) != 0) {
-		fatal("nng_socket", rv);
-	}
+    nng_time now = nng_clock();
+    int n;
 
-	if ((rv = nng_dialer_create(dialer, *sock, url)) != 0) {
-		fatal("nng_dialer_create", rv);
-	}
+    pthread_mutex_lock(&cfg->lock);
+    n = ctx->nretry;
+    pthread_mutex_unlock(&cfg->lock);
 
-	// create a CONNECT message
-	/* CONNECT */
-	nng_msg *connmsg;
-	nng_mqtt_msg_alloc(&connmsg, 0);
-	nng_mqtt_msg_set_packet_type(connmsg, NNG_MQTT_CONNECT);
-	nng_mqtt_msg_set_connect_proto_version(connmsg, 4);
-	nng_mqtt_msg_set_connect_keep_alive(connmsg, 60);
+    if (n == 0)
+        return 0;
 
-    if (username)
+    if (now < ctx->next_retry)
     {
-        nng_mqtt_msg_set_connect_user_name(connmsg, username);
-        nng_mqtt_msg_set_connect_password(connmsg, password);
+        if (!wait)
+            return n;
+        nng_msleep((nng_duration) (ctx->next_retry - now));
     }
 
-	nng_mqtt_msg_set_connect_will_msg(
-	    connmsg, (uint8_t *) "bye-bye", strlen("bye-bye"));
-	nng_mqtt_msg_set_connect_will_topic(connmsg, "will_topic");
-	nng_mqtt_msg_set_connect_clean_session(connmsg, true);
+    // no busy-wait on a link that is down, the connect callback wakes us up
+    conn_state_wait(&cfg->conn, CONN_CONNECTED, -1);
+    ctx->next_retry = nng_clock() + MQTTC_RETRY_MS;
 
-	nng_mqtt_set_connect_cb(*sock, connect_cb, sock);
-	nng_mqtt_set_disconnect_cb(*sock, disconnect_cb, connmsg);
+    // those failed so far, a new failure waits for the next round
+    pthread_mutex_lock(&cfg->lock);
+    while (n-- > 0 && ctx->nretry > 0)
+    {
+        mqttc_pub_slot* slot = &ctx->slots[ctx->retry[--ctx->nretry]];
+        nng_msg* msg = slot->msg;
 
-	uint8_t buff[1024] = { 0 };
+        slot->msg = NULL;
+        pthread_mutex_unlock(&cfg->lock);
 
-#ifdef DEBUG
-	if (verbose) {
-		nng_mqtt_msg_dump(connmsg, buff, sizeof(buff), true);
-		printf("%s\n", buff);
-	}
-	printf("Connecting to server ...\n");
-#endif // DEBUG
-	
-	nng_dialer_set_ptr(*dialer, NNG_OPT_MQTT_CONNMSG, connmsg);
-	nng_dialer_start(*dialer, NNG_FLAG_NONBLOCK);
+        nng_aio_set_msg(slot->aio, msg);
+        nng_send_aio(ctx->sock, slot->aio);
 
-	return (0);
+        pthread_mutex_lock(&cfg->lock);
+    }
+    n = ctx->nretry;
+    pthread_mutex_unlock(&cfg->lock);
+
+    return n;
 }
 
+/**
+ * @brief Wait until connected and a slot of the send window is free
+ * 
+ * @param cfg 
+ * @param ctx 
+ * @return mqttc_pub_slot* 
+ */
+static mqttc_pub_slot*
+acquire_slot(mqttc_sync_config* cfg, mqttc_sink_ctx* ctx)
+{
+    mqttc_pub_slot* slot;
+
+    // no busy-wait, the connect callback wakes us up
+    conn_state_wait(&cfg->conn, CONN_CONNECTED, -1);
+
+    pthread_mutex_lock(&cfg->lock);
+    while (ctx->nfree == 0)
+    {
+        // the window is held by failed ones, they go first
+        if (ctx->nretry > 0)
+        {
+            pthread_mutex_unlock(&cfg->lock);
+            resend_failed(cfg, ctx, 1);
+            pthread_mutex_lock(&cfg->lock);
+            continue;
+        }
+
+        pthread_cond_wait(&cfg->cond, &cfg->lock);
+    }
+
+    slot = &ctx->slots[ctx->free_slots[--ctx->nfree]];
+    pthread_mutex_unlock(&cfg->lock);
+
+    return slot;
+}
 
 /**
- * @brief Publish a message to the given topic and with the given QoS. 
+ * @brief Publish a message to the given topic, completion in publish_cb
  * 
- * @param sock 
+ * @param cfg 
+ * @param ctx 
  * @param topic 
  * @param payload 
  * @param payload_len 
- * @param qos 
- * @param verbose 
+ * @param first, log seq of the first sample in it, 0 => none
  * @return int 
  */
 static int
-client_publish(nng_socket sock, const char *topic, uint8_t *payload,
-    uint32_t payload_len, uint8_t qos, bool verbose)
+client_publish(mqttc_sync_config* cfg, mqttc_sink_ctx* ctx, const char *topic, uint8_t *payload,
+    uint32_t payload_len, uint64_t first)
 {
-	int rv;
-
 	// create a PUBLISH message
 	nng_msg *pubmsg;
-	nng_mqtt_msg_alloc(&pubmsg, 0);
+	int rv;
+
+	if ((rv = nng_mqtt_msg_alloc(&pubmsg, 0)) != 0) {
+		fatal("nng_mqtt_msg_alloc", rv);
+		sink_input_resend(&cfg->in, first);
+		return rv;
+	}
+
 	nng_mqtt_msg_set_packet_type(pubmsg, NNG_MQTT_PUBLISH);
 	nng_mqtt_msg_set_publish_dup(pubmsg, 0);
-	nng_mqtt_msg_set_publish_qos(pubmsg, qos);
+	nng_mqtt_msg_set_publish_qos(pubmsg, cfg->qos);
 	nng_mqtt_msg_set_publish_retain(pubmsg, 0);
 	nng_mqtt_msg_set_publish_payload(
 	    pubmsg, (uint8_t *) payload, payload_len);
 	nng_mqtt_msg_set_publish_topic(pubmsg, topic);
 
-#ifdef DEBUG
-	if (verbose) 
-	{
-		uint8_t print[1024] = { 0 };
-		nng_mqtt_msg_dump(pubmsg, print, 1024, true);
-		printf("%s\n", print);
-	}
+    mqttc_pub_slot* slot = acquire_slot(cfg, ctx);
 
-	printf("Publishing to '%s' ...\n", topic);
-#endif // DEBUG
-	
-	if ((rv = nng_sendmsg(sock, pubmsg, NNG_FLAG_NONBLOCK)) != 0) 
-	{
-		fatal("nng_sendmsg", rv);
-	}
+    // followed before it can complete
+    slot->first = first;
+    sink_input_sent(&cfg->in, first, first);
 
-	return rv;
+	nng_aio_set_msg(slot->aio, pubmsg);
+	nng_send_aio(ctx->sock, slot->aio);
+
+	return 0;
 }
 
 /**
- * @brief callback
+ * @brief batcher publish callback
  * 
- * @param client 
- * @param msg 
  * @param arg 
+ * @param topic 
+ * @param payload 
+ * @param len 
+ * @param first 
+ * @return int 
+ */
+static int
+publish_batch(void* arg, const char* topic, const void* payload, size_t len, uint64_t first)
+{
+    mqttc_sync_config* cfg = (mqttc_sync_config*) arg;
+
+    return client_publish(cfg, (mqttc_sink_ctx*) cfg->priv, topic, (uint8_t*) payload, (uint32_t) len, first);
+}
+
+/**
+ * @brief payload format of the published items
+ * 
+ * @param cfg 
+ * @return int, payload_format
+ */
+int mqttc_sink_format(const mqttc_sync_config* cfg)
+{
+    // a JSON array batch needs JSON items
+    if ((cfg->batch_count > 1 || cfg->batch_ms > 0) && cfg->batch_format == BATCH_FMT_JSON)
+        return ENC_JSON;
+
+    return cfg->format;
+}
+
+/**
+ * @brief resolve topic & payload of the current sample, then batch (or send) it
+ * 
+ * @param cfg 
+ * @param in 
+ * @return int 
+ */
+static int
+forward_bus_data(mqttc_sync_config* cfg, sink_input* in)
+{
+    char topic[256];
+    const char* src_topic = cfg->topic;
+    uint32_t meter_id = 0;
+    void* data = in->data;
+    int datalen = in->datalen;
+
+    if (datalen == sizeof(struct Message))
+        src_topic = ((struct Message*) data)->source_topic;
+    else if (datalen == sizeof(meter_data_log))
+        meter_id = ((meter_data_log*) data)->meter_id;
+    else if (datalen == sizeof(meter_sample))
+        meter_id = ((meter_sample*) data)->meter_id;
+    else if (datalen == sizeof(meter_fixed_sample))
+        meter_id = ((meter_fixed_sample*) data)->meter_id;
+
+    if (in->len < 0)
+        return EGENERR;
+
+    if (cfg->topic_template != NULL)
+        topic_template_expand(cfg->topic_template, src_topic, meter_id, topic, sizeof(topic));
+    else
+        snprintf(topic, sizeof(topic), "%s", src_topic ? src_topic : "");
+
+    return batcher_add(&cfg->batcher, topic, in->payload, in->len, in->seq);
+}
+
+/**
+ * @brief release the publisher state, the socket is closed by the caller
+ * 
+ * @param cfg 
+ * @param ctx 
  */
 static void
-send_callback (nng_mqtt_client *client, nng_msg *msg, void *arg) 
+sink_ctx_free(mqttc_sync_config* cfg, mqttc_sink_ctx* ctx)
 {
-	nng_aio *        aio    = client->send_aio;
-	uint32_t         count;
-	uint8_t *        code;
-	uint8_t          type;
-
-	if (msg == NULL)
-		return;
-	
-    switch (nng_mqtt_msg_get_packet_type(msg)) 
+    if (ctx->slots != NULL)
     {
-	case NNG_MQTT_SUBACK:
-		code = (reason_code *) nng_mqtt_msg_get_suback_return_codes(
-		    msg, &count);
-
-#ifdef DEBUG
-		printf("SUBACK reason codes are");
-		for (int i = 0; i < count; ++i)
-			printf("%d ", code[i]);
-		printf("\n");
-#endif
-		break;
-
-	case NNG_MQTT_UNSUBACK:
-		code = (reason_code *) nng_mqtt_msg_get_unsuback_return_codes(
-		    msg, &count);
-#ifdef DEBUG
-		printf("UNSUBACK reason codes are");
-		for (int i = 0; i < count; ++i)
-			printf("%d ", code[i]);
-		printf("\n");
-#endif		
-		break;
-
-	case NNG_MQTT_PUBACK:
-#ifdef DEBUG
-		printf("PUBACK");
-#endif // DEBUG	
-		break;
-
-	default:
-	#ifdef DEBUG
-		printf("Sending in async way is done.\n");
-	#endif // DEBUG
-
-		break;
-	}
+        for (int i = 0; i < cfg->inflight; i++)
+        {
+            if (ctx->slots[i].aio != NULL)
+                nng_aio_free(ctx->slots[i].aio);
+            if (ctx->slots[i].msg != NULL)
+                nng_msg_free(ctx->slots[i].msg);
+        }
+    }
+
+    free(ctx->slots);
+    free(ctx->free_slots);
+    free(ctx->retry);
+    free(ctx);
+}
+
+/**
+ * @brief allocate the publisher state
+ * 
+ * @param cfg 
+ * @return mqttc_sink_ctx* 
+ */
+static mqttc_sink_ctx*
+sink_ctx_alloc(mqttc_sync_config* cfg)
+{
+    mqttc_sink_ctx* ctx = (mqttc_sink_ctx*) calloc(1, sizeof(mqttc_sink_ctx));
+    if (ctx == NULL)
+        return NULL;
+
+    ctx->slots = (mqttc_pub_slot*) calloc(cfg->inflight, sizeof(mqttc_pub_slot));
+    ctx->free_slots = (int*) calloc(cfg->inflight, sizeof(int));
+    ctx->retry = (int*) calloc(cfg->inflight, sizeof(int));
+    if (ctx->slots == NULL || ctx->free_slots == NULL || ctx->retry == NULL)
+    {
+        sink_ctx_free(cfg, ctx);
+        return NULL;
+    }
+
+    for (int i = 0; i < cfg->inflight; i++)
+    {
+        mqttc_pub_slot* slot = &ctx->slots[i];
+        int rv;
 
-	#ifdef DEBUG
-	printf("aio mqtt result %d \n", nng_aio_result(aio));
-	// printf("suback %d \n", *code);
-	#endif // DEBUG	
+        slot->cfg = cfg;
+        slot->index = i;
 
-	nng_msg_free(msg);
+        if ((rv = nng_aio_alloc(&slot->aio, publish_cb, slot)) != 0)
+        {
+            fatal("nng_aio_alloc", rv);
+            sink_ctx_free(cfg, ctx);
+            return NULL;
+        }
+
+        ctx->free_slots[ctx->nfree++] = i;
+    }
+
+    return ctx;
 }
 
 /**
@@ -284,43 +417,59 @@ void* mqttc_sink_task(void* arg) {
     }
 
     // get queue 
-    BusReader* br = cfg->br;
+    sink_input* in = &cfg->in;
     
     char mqttc_addr[256];
-    sprintf(mqttc_addr, "mqtt-tcp://%s:%d", cfg->host, cfg->port);
+    snprintf(mqttc_addr, sizeof(mqttc_addr), "mqtt-tcp://%s:%d", cfg->host, cfg->port);
     
     #ifdef DEBUG
     log_message(LOG_INFO, "sink connect to %s\n", mqttc_addr);
     #endif // DEBUG
 
-    while(1)
+    mqttc_sink_ctx* ctx = sink_ctx_alloc(cfg);
+    if (ctx == NULL)
     {
-        nng_socket sock;
-        nng_dialer dailer;
+        log_message(LOG_ERR, "mqttc sink: out of memory\n");
+        exit(ESYSERR);
+    }
+    cfg->priv = (void*) ctx;
 
-        client_connect(&sock, &dailer, mqttc_addr,cfg->username, cfg->password, false);
-        while (!connected) 
-        {            
-            nng_msleep(100); // Sleep for a short period to avoid busy-waiting
-        }
-    
-        while (connected) 
+    // the log is acknowledged as the publishes complete, not as they are queued
+    if (sink_input_defer(in) != ENOERR)
+        log_message(LOG_ERR, "mqttc sink: out of memory, acknowledging on hand-off\n");
+
+    // does not block, the readiness is published to cfg->conn
+    if (ng_mqtt_connect(&ctx->sock, &ctx->dialer, &cfg->conn, mqttc_addr,
+            cfg->client_id, cfg->username, cfg->password, false) != 0)
+    {
+        conn_state_set(&cfg->conn, CONN_CLOSED);
+        exit(ESVRERR);
+    }
+
+    batcher_init(&cfg->batcher, cfg->batch_count, cfg->batch_ms, cfg->batch_format, publish_batch, cfg);
+
+    while (1) 
+    {
+        // block until the next sample arrives, or the oldest batch is due
+        int timeout = batcher_next_timeout(&cfg->batcher);
+
+        // the failed PUBLISH first, looked at again in a while
+        if (resend_failed(cfg, ctx, 0) > 0 && (timeout < 0 || timeout > MQTTC_RETRY_MS))
+            timeout = MQTTC_RETRY_MS;
+
+        if (0 == sink_input_read(in, mqttc_sink_format(cfg), NULL, timeout))
         {
-            // struct Message* data;
-
-            // if (dequeue(q, (void**) &data))
-            // {
-            //     client_publish(sock, data->source_topic, (void*) data->data, data->datalen, 0, 0);
-            // }
-            // else
-            // {
-            //     nng_msleep(100);
-            // }
+            forward_bus_data(cfg, in);
+
+            sink_input_done(in);
         }
 
-        // connect fail, reconnect
+        batcher_flush_due(&cfg->batcher);
+        sink_input_hold(in, batcher_held(&cfg->batcher));
     }
 
+    batcher_flush_all(&cfg->batcher);
+    batcher_term(&cfg->batcher);
 
     return NULL;
 }
@@ -340,7 +489,15 @@ int mqttc_sink_init(mqttc_sync_config* cfg, Bus* b, const char* host, int port,
     memset(cfg, 0, sizeof (mqttc_sync_config));
 
     cfg->b = b;
-	create_bus_reader(&cfg->br, cfg->b);
+	sink_input_init(&cfg->in, cfg->b);
+
+    cfg->format = ENC_JSON;
+    cfg->qos = MQTTC_DEFAULT_QOS;
+    cfg->inflight = MQTTC_DEFAULT_INFLIGHT;
+
+    pthread_mutex_init(&cfg->lock, NULL);
+    pthread_cond_init(&cfg->cond, NULL);
+    conn_state_init(&cfg->conn, "mqttc-sink");
 
     if (host != NULL)
         cfg->host = strdup(host);
@@ -390,6 +547,21 @@ int mqttc_sink_term(mqttc_sync_config* cfg)
     if (cfg->topic != NULL)
         free(cfg->topic);
 
+    if (cfg->topic_template != NULL)
+        free(cfg->topic_template);
+
+    mqttc_sink_ctx* ctx = (mqttc_sink_ctx*) cfg->priv;
+    if (ctx != NULL)
+    {
+        nng_close(ctx->sock);
+        sink_ctx_free(cfg, ctx);
+        cfg->priv = NULL;
+    }
+
+    conn_state_destroy(&cfg->conn);
+    pthread_mutex_destroy(&cfg->lock);
+    pthread_cond_destroy(&cfg->cond);
+
     return 0;
 }
 
@@ -401,6 +573,16 @@ int mqttc_sink_term(mqttc_sync_config* cfg)
  */
 int mqttc_sink_run(mqttc_sync_config* cfg)
 {   
+    if (cfg->qos < 0 || cfg->qos > 1)
+        cfg->qos = MQTTC_DEFAULT_QOS;
+
+    if (cfg->inflight <= 0)
+        cfg->inflight = MQTTC_DEFAULT_INFLIGHT;
+
+    // each in-flight publish is followed until it completes
+    if (cfg->inflight > SINK_UNACKED_MAX)
+        cfg->inflight = SINK_UNACKED_MAX;
+
     return 
         pthread_create(&cfg->task_thread, NULL, mqttc_sink_task, cfg);
     
@@ -20,6 +20,7 @@
 #include "utils/squeue.h"
 #include "utils/error.h"
 #include "utils/logger.h"
+#include "utils/ng_mqtt.h"
 
 #include "nng/mqtt/mqtt_client.h"
 #include "nng/nng.h"
@@ -30,7 +31,6 @@
 //FIXME
 extern char* strdup(const char*);
 
-static volatile int connected = 0;
 static int keepRunning = 1;
 
 static void
@@ -43,151 +43,6 @@ fatal(const char *msg, int rv)
 	log_message(LOG_ERR, "%s: %s\n", msg, nng_strerror(rv));
 }
 
-/**
- * @brief 
- * 
- * @param p 
- * @param ev 
- * @param arg 
- */
-static void
-disconnect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
-{
-#ifdef DEBUG
-	int reason = 0;
-	// get connect reason
-	nng_pipe_get_int(p, NNG_OPT_MQTT_DISCONNECT_REASON, &reason);
-	// property *prop;
-	// nng_pipe_get_ptr(p, NNG_OPT_MQTT_DISCONNECT_PROPERTY, &prop);
-	// nng_socket_get?
-	printf("%s: disconnected!\n", __FUNCTION__);
-#endif // DEBUG	
-
-    connected = 0;
-}
-
-/**
- * @brief 
- * 
- * @param p 
- * @param ev 
- * @param arg 
- */
-static void
-connect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
-{
-#ifdef DEBUG
-	int reason;
-	// get connect reason
-	nng_pipe_get_int(p, NNG_OPT_MQTT_CONNECT_REASON, &reason);
-	// get property for MQTT V5
-	// property *prop;
-	// nng_pipe_get_ptr(p, NNG_OPT_MQTT_CONNECT_PROPERTY, &prop);
-	printf("%s: connected!\n", __FUNCTION__);
-#endif // DEBUG	
-
-
-    connected = 1;
-}
-
-// Connect to the given address.
-static int
-client_connect(
-    nng_socket *sock, nng_dialer *dialer, const char *url, const char* username, const char* password, bool verbose)
-{
-	int        rv;
-
-	if ((rv = nng_mqtt_client_open(sock)) != 0) {
-		fatal("nng_socket", rv);
-	}
-
-	if ((rv = nng_dialer_create(dialer, *sock, url)) != 0) {
-		fatal("nng_dialer_create", rv);
-	}
-
-	// create a CONNECT message
-	/* CONNECT */
-	nng_msg *connmsg;
-	nng_mqtt_msg_alloc(&connmsg, 0);
-	nng_mqtt_msg_set_packet_type(connmsg, NNG_MQTT_CONNECT);
-	nng_mqtt_msg_set_connect_proto_version(connmsg, 4);
-	nng_mqtt_msg_set_connect_keep_alive(connmsg, 60);
-
-    if (username)
-    {
-        nng_mqtt_msg_set_connect_user_name(connmsg, username);
-        nng_mqtt_msg_set_connect_password(connmsg, password);
-    }
-
-	nng_mqtt_msg_set_connect_will_msg(
-	    connmsg, (uint8_t *) "bye-bye", strlen("bye-bye"));
-	nng_mqtt_msg_set_connect_will_topic(connmsg, "will_topic");
-	nng_mqtt_msg_set_connect_clean_session(connmsg, true);
-
-	nng_mqtt_set_connect_cb(*sock, connect_cb, sock);
-	nng_mqtt_set_disconnect_cb(*sock, disconnect_cb, connmsg);
-
-	uint8_t buff[1024] = { 0 };
-
-#ifdef DEBUG
-	if (verbose) {
-		nng_mqtt_msg_dump(connmsg, buff, sizeof(buff), true);
-		printf("%s\n", buff);
-	}
-
-	printf("Connecting to server ...\n");
-#endif // DEBUG
-
-	nng_dialer_set_ptr(*dialer, NNG_OPT_MQTT_CONNMSG, connmsg);
-	nng_dialer_start(*dialer, NNG_FLAG_NONBLOCK);
-
-	return (0);
-}
-
-/**
- * @brief Publish a message to the given topic and with the given QoS. 
- * 
- * @param sock 
- * @param topic 
- * @param payload 
- * @param payload_len 
- * @param qos 
- * @param verbose 
- * @return int 
- */
-static int
-client_publish(nng_socket sock, const char *topic, uint8_t *payload,
-    uint32_t payload_len, uint8_t qos, bool verbose)
-{
-	int rv;
-
-	// create a PUBLISH message
-	nng_msg *pubmsg;
-	nng_mqtt_msg_alloc(&pubmsg, 0);
-	nng_mqtt_msg_set_packet_type(pubmsg, NNG_MQTT_PUBLISH);
-	nng_mqtt_msg_set_publish_dup(pubmsg, 0);
-	nng_mqtt_msg_set_publish_qos(pubmsg, qos);
-	nng_mqtt_msg_set_publish_retain(pubmsg, 0);
-	nng_mqtt_msg_set_publish_payload(
-	    pubmsg, (uint8_t *) payload, payload_len);
-	nng_mqtt_msg_set_publish_topic(pubmsg, topic);
-
-#ifdef DEBUG
-	if (verbose) {
-		uint8_t print[1024] = { 0 };
-		nng_mqtt_msg_dump(pubmsg, print, 1024, true);
-		printf("%s\n", print);
-	}
-	printf("Publishing to '%s' ...\n", topic);
-#endif // DEBUG
-
-	if ((rv = nng_sendmsg(sock, pubmsg, NNG_FLAG_NONBLOCK)) != 0) {
-		fatal("nng_sendmsg", rv);
-	}
-
-	return rv;
-}
-
 /**
  * @brief send callback
  * 
@@ -276,12 +131,16 @@ static void* mqttc_source_reader_task(void* arg)
         nng_socket sock;
         nng_dialer dailer;
 
-        client_connect(&sock, &dailer, mqttc_addr, cfg->username, cfg->password, false);
-        while (!connected) 
-        {            
-            nng_msleep(100); // Sleep for a short period to avoid busy-waiting
+        if (ng_mqtt_connect(&sock, &dailer, &cfg->conn, mqttc_addr, 
+                cfg->client_id, cfg->username, cfg->password, false) != 0)
+        {
+            nng_msleep(1000);
+            continue;
         }
 
+        // woken up by the connect callback
+        conn_state_wait(&cfg->conn, CONN_CONNECTED, -1);
+
         nng_mqtt_topic_qos subscriptions[] = {
             {
                 .qos   = 0,
@@ -381,6 +240,7 @@ int mqttc_source_init(mqttc_source_config* cfg, Bus* b, const char* host, int po
 
     cfg->b = b;
 	create_bus_reader(&cfg->br, cfg->b);
+    conn_state_init(&cfg->conn, "mqttc-source");
 
     if (host != NULL)
         cfg->host = strdup(host);
@@ -431,6 +291,8 @@ int mqttc_source_term(mqttc_source_config* cfg)
     if (cfg->topic != NULL)
         free(cfg->topic);
 
+    conn_state_destroy(&cfg->conn);
+
     return 0;
 }
 
@@ -20,8 +20,9 @@
 
 #include <nats/nats.h>
 #include "nats_sink.h"
-#include "error.h"
-#include "logger.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+#include "utils/encoder.h"
 
 //FIXME
 extern char* strdup(const char*);
@@ -46,10 +47,9 @@ void* nats_sink_task(void* arg) {
         exit(EGENERR);
     }
 
-    Queue* q = (Queue*) cfg->q;
-    char data[MAX_QUEUE_DATA_SIZE];
+    sink_input* in = &cfg->in;
 
-    if (q == NULL)
+    if (in->br == NULL && in->sub == NULL && in->cur == NULL)
     {
         #ifdef DEBUG
         log_message(LOG_ERR, "Error queue...\n");
@@ -69,39 +69,43 @@ void* nats_sink_task(void* arg) {
         sprintf(url, "nats://%s:%d", cfg->host, cfg->port);
 
         // Connect to NATS server
+        conn_state_set(&cfg->conn, CONN_CONNECTING);
+
         natsStatus status = natsConnection_ConnectTo(&nc, url);
         if (status != NATS_OK) 
         {
-            fprintf(stderr, "Failed to connect to NATS: %s\n", natsStatus_GetText(status));
-            nats_Close();
+            log_message(LOG_ERR, "Failed to connect to NATS: %s\n", natsStatus_GetText(status));
+            conn_state_set(&cfg->conn, CONN_DISCONNECTED);
 
-            exit(ESVRERR);
+            sleep(1);
+            continue;
         }
 
+        conn_state_set(&cfg->conn, CONN_CONNECTED);
+
         while (1) 
         {
-            if (dequeue(q, data))
+            if (0 == sink_input_read(in, cfg->format, NULL, -1))
             {
-                #ifdef DEBUG
-                printf("%s\n", data);
-                #endif // DEBUG
-        
+                if (in->len < 0)
+                {
+                    sink_input_done(in);
+                    continue;
+                }
+
                 // Produce a message to nats
-                const char *message = data;
-                status = natsConnection_PublishString(nc, cfg->topic, message);
+                status = natsConnection_Publish(nc, cfg->topic, in->payload, in->len);
+                sink_input_done(in);
 
                 if (status != NATS_OK)
                 {
-                    fprintf(stderr, "Error publishing message: %s\n", natsStatus_GetText(status));
+                    log_message(LOG_ERR, "Error publishing message: %s\n", natsStatus_GetText(status));
                     natsConnection_Destroy(nc);
+                    conn_state_set(&cfg->conn, CONN_DISCONNECTED);
                     
                     break;
                 }
             }
-            else
-            {
-                usleep(10000);
-            }
         }
 
         // Cleanup and destroy nats objects
@@ -111,6 +115,162 @@ void* nats_sink_task(void* arg) {
     return NULL;
 }
 
+#define NATS_DRAIN_MAX      64
+
+/**
+ * @brief reactor mode: the client library reconnects and buffers in the
+ *        background, publish never blocks the loop
+ * 
+ */
+typedef struct {
+    natsOptions*        opts;
+    natsConnection*     nc;
+    unsigned long       dropped;
+
+    reactor_handler*    bus_h;
+} nats_async;
+
+static void nats_async_connected(natsConnection* nc, void* closure)
+{
+    nats_sync_config* cfg = (nats_sync_config*) closure;
+
+    conn_state_set(&cfg->conn, CONN_CONNECTED);
+}
+
+static void nats_async_disconnected(natsConnection* nc, void* closure)
+{
+    nats_sync_config* cfg = (nats_sync_config*) closure;
+
+    conn_state_set(&cfg->conn, CONN_DISCONNECTED);
+}
+
+/**
+ * @brief bus readable (reactor thread)
+ * 
+ * @param r 
+ * @param h 
+ * @param events 
+ * @param arg 
+ */
+static void nats_async_on_bus(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    nats_sync_config* cfg = (nats_sync_config*) arg;
+    nats_async* a = (nats_async*) cfg->priv;
+    sink_input* in = &cfg->in;
+
+    for (int i = 0; i < NATS_DRAIN_MAX; i++)
+    {
+        if (0 != sink_input_read(in, cfg->format, NULL, 0))
+            break;
+
+        if (in->len < 0)
+        {
+            sink_input_done(in);
+            continue;
+        }
+
+        // buffered by the library while reconnecting, dropped when it is full
+        natsStatus status = natsConnection_Publish(a->nc, cfg->topic, in->payload, in->len);
+        sink_input_done(in);
+        if (status != NATS_OK && (a->dropped++ % 100) == 0)
+            log_message(LOG_WARNING, "nats: publish failed (%s), %lu messages dropped\n", natsStatus_GetText(status), a->dropped);
+    }
+}
+
+static void nats_async_free(nats_sync_config* cfg);
+
+/**
+ * @brief Drive the sink from a reactor instead of its own thread. On
+ *        failure nothing stays attached
+ * 
+ * @param cfg 
+ * @param r 
+ * @return int 
+ */
+int nats_sink_attach(nats_sync_config* cfg, reactor_t* r)
+{
+    nats_async* a = (nats_async*) calloc(1, sizeof(nats_async));
+    natsStatus status;
+    char url[128];
+    int rc = ESVRERR;
+
+    if (a == NULL)
+        return ESYSERR;
+
+    cfg->priv = (void*) a;
+    cfg->reactor = r;
+
+    sprintf(url, "nats://%s:%d", cfg->host, cfg->port);
+
+    if ((status = natsOptions_Create(&a->opts)) != NATS_OK ||
+        (status = natsOptions_SetURL(a->opts, url)) != NATS_OK ||
+        (status = natsOptions_SetMaxReconnect(a->opts, -1)) != NATS_OK ||
+        (status = natsOptions_SetRetryOnFailedConnect(a->opts, 1, nats_async_connected, cfg)) != NATS_OK ||
+        (status = natsOptions_SetDisconnectedCB(a->opts, nats_async_disconnected, cfg)) != NATS_OK ||
+        (status = natsOptions_SetReconnectedCB(a->opts, nats_async_connected, cfg)) != NATS_OK)
+    {
+        log_message(LOG_ERR, "nats: options: %s\n", natsStatus_GetText(status));
+        goto fail;
+    }
+
+    if (cfg->username != NULL && 
+        (status = natsOptions_SetUserInfo(a->opts, cfg->username, cfg->password)) != NATS_OK)
+    {
+        log_message(LOG_ERR, "nats: options: %s\n", natsStatus_GetText(status));
+        goto fail;
+    }
+
+    conn_state_set(&cfg->conn, CONN_CONNECTING);
+
+    // with retry on failed connect the connection completes in the background
+    status = natsConnection_Connect(&a->nc, a->opts);
+    if (status == NATS_OK)
+        conn_state_set(&cfg->conn, CONN_CONNECTED);
+    else if (status != NATS_NOT_YET_CONNECTED)
+    {
+        log_message(LOG_ERR, "Failed to connect to NATS: %s\n", natsStatus_GetText(status));
+        goto fail;
+    }
+
+    a->bus_h = reactor_add(r, sink_input_fd(&cfg->in), EPOLLIN, nats_async_on_bus, cfg);
+    if (a->bus_h == NULL)
+    {
+        rc = ESYSERR;
+        goto fail;
+    }
+
+    return ENOERR;
+
+fail:
+    // back to nothing attached, the caller may run the thread instead
+    nats_async_free(cfg);
+    cfg->reactor = NULL;
+    conn_state_set(&cfg->conn, CONN_IDLE);
+
+    return rc;
+}
+
+/**
+ * @brief release the reactor mode state
+ * 
+ * @param cfg 
+ */
+static void nats_async_free(nats_sync_config* cfg)
+{
+    nats_async* a = (nats_async*) cfg->priv;
+
+    if (a == NULL)
+        return;
+
+    if (a->nc != NULL)
+        natsConnection_Destroy(a->nc);
+    if (a->opts != NULL)
+        natsOptions_Destroy(a->opts);
+
+    free(a);
+    cfg->priv = NULL;
+}
+
 /**
  * @brief Init sync task
  * 
@@ -121,11 +281,15 @@ void* nats_sink_task(void* arg) {
  * @param password 
  * @return int 
  */
-int nats_sink_init(nats_sync_config* cfg, Queue* q, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic)
+int nats_sink_init(nats_sync_config* cfg, Bus* b, const char* host, int port, const char* username, const char* password, const char* client_id, const char* topic)
 {
     memset(cfg, 0, sizeof (nats_sync_config));
 
-    cfg->q = q;
+    cfg->b = b;
+    sink_input_init(&cfg->in, cfg->b);
+
+    cfg->format = ENC_JSON;
+    conn_state_init(&cfg->conn, "nats-sink");
 
     if (host != NULL)
         cfg->host = strdup(host);
@@ -175,6 +339,9 @@ int nats_sink_term(nats_sync_config* cfg)
     if (cfg->topic != NULL)
         free(cfg->topic);
 
+    nats_async_free(cfg);
+    conn_state_destroy(&cfg->conn);
+
     return 0;
 }
 
@@ -199,6 +366,10 @@ int nats_sink_run(nats_sync_config* cfg)
  */
 int nats_sink_wait(nats_sync_config* cfg)
 {
+    // driven by a reactor, no thread of its own
+    if (cfg->reactor != NULL)
+        return 0;
+
     return 
         pthread_join(cfg->task_thread, NULL);    
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
+#include <stdio.h>
+#include <string.h>
+
 #include "utils/ng_mqtt.h"
 
-#include "utils/squeue.h"
 #include "utils/error.h"
 #include "utils/logger.h"
 
@@ -13,9 +15,6 @@
 //FIXME
 extern char* strdup(const char*);
 
-static volatile int connected = 0;
-static int keepRunning = 1;
-
 static void
 fatal(const char *msg, int rv)
 {
@@ -27,65 +26,83 @@ fatal(const char *msg, int rv)
 }
 
 /**
- * @brief 
+ * @brief disconnect callback, the dialer re-connects by itself
  * 
  * @param p 
  * @param ev 
- * @param arg 
+ * @param arg, conn_state of the client
  */
 static void
 disconnect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
 {
-#ifdef DEBUG
 	int reason = 0;
 	// get connect reason
 	nng_pipe_get_int(p, NNG_OPT_MQTT_DISCONNECT_REASON, &reason);
 	// property *prop;
 	// nng_pipe_get_ptr(p, NNG_OPT_MQTT_DISCONNECT_PROPERTY, &prop);
-	// nng_socket_get?
-	printf("%s: disconnected!\n", __FUNCTION__);
+
+#ifdef DEBUG
+	printf("%s: disconnected, reason %d!\n", __FUNCTION__, reason);
 #endif // DEBUG	
 
-    connected = 0;
+    conn_state_set((conn_state*) arg, CONN_DISCONNECTED);
 }
 
 /**
- * @brief 
+ * @brief connect callback
  * 
  * @param p 
  * @param ev 
- * @param arg 
+ * @param arg, conn_state of the client
  */
 static void
 connect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
 {
-#ifdef DEBUG
-	int reason;
+	int reason = 0;
 	// get connect reason
 	nng_pipe_get_int(p, NNG_OPT_MQTT_CONNECT_REASON, &reason);
 	// get property for MQTT V5
 	// property *prop;
 	// nng_pipe_get_ptr(p, NNG_OPT_MQTT_CONNECT_PROPERTY, &prop);
-	printf("%s: connected!\n", __FUNCTION__);
-#endif // DEBUG	
 
+#ifdef DEBUG
+	printf("%s: connected, reason %d!\n", __FUNCTION__, reason);
+#endif // DEBUG	
 
-    connected = 1;
+    conn_state_set((conn_state*) arg, CONN_CONNECTED);
 }
 
-// Connect to the given address.
-static int
-client_connect(
-    nng_socket *sock, nng_dialer *dialer, const char *url, const char* username, const char* password, bool verbose)
+/**
+ * @brief Start connecting to the given address, without blocking.
+ * 
+ * The state of the connection is published to conn, wait for it with
+ * conn_state_wait(conn, CONN_CONNECTED, ...).
+ * 
+ * @param sock 
+ * @param dialer 
+ * @param conn 
+ * @param url 
+ * @param client_id 
+ * @param username 
+ * @param password 
+ * @param verbose 
+ * @return int 
+ */
+int
+ng_mqtt_connect(nng_socket *sock, nng_dialer *dialer, conn_state* conn, const char *url, 
+    const char* client_id, const char* username, const char* password, bool verbose)
 {
 	int        rv;
 
 	if ((rv = nng_mqtt_client_open(sock)) != 0) {
 		fatal("nng_socket", rv);
+		return rv;
 	}
 
 	if ((rv = nng_dialer_create(dialer, *sock, url)) != 0) {
 		fatal("nng_dialer_create", rv);
+		nng_close(*sock);
+		return rv;
 	}
 
 	// create a CONNECT message
@@ -96,6 +113,9 @@ client_connect(
 	nng_mqtt_msg_set_connect_proto_version(connmsg, 4);
 	nng_mqtt_msg_set_connect_keep_alive(connmsg, 60);
 
+	if (client_id)
+		nng_mqtt_msg_set_connect_client_id(connmsg, client_id);
+
     if (username)
     {
         nng_mqtt_msg_set_connect_user_name(connmsg, username);
@@ -107,20 +127,21 @@ client_connect(
 	nng_mqtt_msg_set_connect_will_topic(connmsg, "will_topic");
 	nng_mqtt_msg_set_connect_clean_session(connmsg, true);
 
-	nng_mqtt_set_connect_cb(*sock, connect_cb, sock);
-	nng_mqtt_set_disconnect_cb(*sock, disconnect_cb, connmsg);
-
-	uint8_t buff[1024] = { 0 };
+	nng_mqtt_set_connect_cb(*sock, connect_cb, conn);
+	nng_mqtt_set_disconnect_cb(*sock, disconnect_cb, conn);
 
 #ifdef DEBUG
 	if (verbose) {
+		uint8_t buff[1024] = { 0 };
 		nng_mqtt_msg_dump(connmsg, buff, sizeof(buff), true);
 		printf("%s\n", buff);
 	}
 
-	printf("Connecting to server ...\n");
+	printf("Connecting to server %s ...\n", url);
 #endif // DEBUG
 
+	conn_state_set(conn, CONN_CONNECTING);
+
 	nng_dialer_set_ptr(*dialer, NNG_OPT_MQTT_CONNMSG, connmsg);
 	nng_dialer_start(*dialer, NNG_FLAG_NONBLOCK);
 
@@ -135,18 +156,21 @@ client_connect(
  * @param payload 
  * @param payload_len 
  * @param qos 
- * @param verbose 
  * @return int 
  */
-static int
-client_publish(nng_socket sock, const char *topic, uint8_t *payload,
-    uint32_t payload_len, uint8_t qos, bool verbose)
+int
+ng_mqtt_publish(nng_socket sock, const char *topic, const uint8_t *payload,
+    uint32_t payload_len, uint8_t qos)
 {
 	int rv;
 
 	// create a PUBLISH message
 	nng_msg *pubmsg;
-	nng_mqtt_msg_alloc(&pubmsg, 0);
+	if ((rv = nng_mqtt_msg_alloc(&pubmsg, 0)) != 0) {
+		fatal("nng_mqtt_msg_alloc", rv);
+		return rv;
+	}
+
 	nng_mqtt_msg_set_packet_type(pubmsg, NNG_MQTT_PUBLISH);
 	nng_mqtt_msg_set_publish_dup(pubmsg, 0);
 	nng_mqtt_msg_set_publish_qos(pubmsg, qos);
@@ -155,78 +179,10 @@ client_publish(nng_socket sock, const char *topic, uint8_t *payload,
 	    pubmsg, (uint8_t *) payload, payload_len);
 	nng_mqtt_msg_set_publish_topic(pubmsg, topic);
 
-#ifdef DEBUG
-	if (verbose) {
-		uint8_t print[1024] = { 0 };
-		nng_mqtt_msg_dump(pubmsg, print, 1024, true);
-		printf("%s\n", print);
-	}
-	printf("Publishing to '%s' ...\n", topic);
-#endif // DEBUG
-
 	if ((rv = nng_sendmsg(sock, pubmsg, NNG_FLAG_NONBLOCK)) != 0) {
 		fatal("nng_sendmsg", rv);
+		nng_msg_free(pubmsg);
 	}
 
 	return rv;
 }
-
-/**
- * @brief send callback
- * 
- * @param client 
- * @param msg 
- * @param arg 
- */
-static void
-send_callback (nng_mqtt_client *client, nng_msg *msg, void *arg) {
-	nng_aio *        aio    = client->send_aio;
-	uint32_t         count;
-	uint8_t *        code;
-	uint8_t          type;
-
-	if (msg == NULL)
-		return;
-	
-    switch (nng_mqtt_msg_get_packet_type(msg)) 
-    {
-	case NNG_MQTT_SUBACK:
-		code = (uint8_t*)(reason_code *) nng_mqtt_msg_get_suback_return_codes(
-		    msg, &count);
-#ifdef DEBUG
-		printf("SUBACK reason codes are");
-		for (int i = 0; i < count; ++i)
-			printf("%d ", code[i]);
-		printf("\n");
-#endif // DEBUG			
-		break;
-
-	case NNG_MQTT_UNSUBACK:
-		code = (uint8_t*)(reason_code *) nng_mqtt_msg_get_unsuback_return_codes(
-		    msg, &count);
-#ifdef DEBUG
-		printf("UNSUBACK reason codes are");
-		for (int i = 0; i < count; ++i)
-			printf("%d ", code[i]);
-		printf("\n");
-#endif // DEBUG
-		break;
-
-	case NNG_MQTT_PUBACK:
-#ifdef DEBUG
-		printf("PUBACK");
-#endif // DEBUG
-		break;
-
-	default:
-#ifdef DEBUG
-		printf("Sending in async way is done.\n");
-#endif // DEBUG
-		break;
-	}
-
-	printf("aio mqtt result %d \n", nng_aio_result(aio));
-	// printf("suback %d \n", *code);
-
-	nng_msg_free(msg);
-}
@@ -0,0 +1,106 @@
+/**
+ * @file prio_rules.c
+ * @author longdh
+ * @brief tag urgent samples (over voltage, under frequency ...) for the
+ *        priority lane of the bus
+ * @version 0.1
+ * @date 2024-01-30
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Same rule grammar as the alarms (rules.c), only the stateless part: a
+ * threshold rule matching its set level tags the sample.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "meter/prio_rules.h"
+#include "meter/rules.h"
+#include "meter/regmap.h"
+#include "utils/sbus.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+/**
+ * @brief rules from their config string, each one compiled by rules.c
+ *
+ * @param r
+ * @param spec, "voltage>253, voltage<207, freq<49.5", op: > >= < <= == !=
+ * @return int, EGENERR => syntax error / rate rule / too many rules
+ */
+int prio_rules_parse(prio_rules* r, const char* spec)
+{
+    const char* p = spec;
+
+    memset(r, 0, sizeof(prio_rules));
+
+    while (*p != '\0')
+    {
+        char expr[64];
+        size_t n;
+
+        p += strspn(p, ", ");
+        if (*p == '\0')
+            break;
+
+        n = strcspn(p, ",");
+        if (n >= sizeof(expr))
+            goto bad;
+
+        memcpy(expr, p, n);
+        expr[n] = '\0';
+        p += n;
+
+        if (ENOERR != rules_compile(&r->program, "urgent", expr, NULL, 1))
+            goto bad;
+
+        // a rate needs the previous sample of the meter, not kept here
+        if (r->program.insn[r->program.ninsn - 1].kind != RULE_THRESHOLD)
+            goto bad;
+
+        r->nrules = r->program.ninsn;
+    }
+
+    return ENOERR;
+
+bad:
+    log_message(LOG_ERR, "prio rules: bad rule in '%s'\n", spec);
+    return EGENERR;
+}
+
+/**
+ * @brief lane of a sample
+ *
+ * @param r
+ * @param data
+ * @param datalen
+ * @return int, BUS_PRIO_URGENT when a rule matches, BUS_PRIO_BULK otherwise
+ */
+int prio_rules_eval(prio_rules* r, const void* data, int datalen)
+{
+    const char* names[METER_SAMPLE_MAX];
+    double values[METER_SAMPLE_MAX];
+    double fv[RULES_MAX_FIELDS];
+    const int8_t* slot;
+    uint32_t meter_id;
+    uint64_t ts;
+    int n;
+
+    if (r == NULL || r->nrules == 0)
+        return BUS_PRIO_BULK;
+
+    if ((n = bus_data_values(data, datalen, &meter_id, &ts, names, values)) <= 0)
+        return BUS_PRIO_BULK;
+
+    if ((slot = rules_bind(&r->program, rules_layout(data, datalen), names, n)) == NULL)
+        return BUS_PRIO_BULK;
+
+    rules_gather(&r->program, slot, values, fv);
+
+    if (rules_match_any(&r->program, fv) < 0)
+        return BUS_PRIO_BULK;
+
+    r->urgent++;
+    return BUS_PRIO_URGENT;
+}
@@ -0,0 +1,317 @@
+/**
+ * @file reactor.c
+ * @author longdh
+ * @brief epoll event loop, drives the sinks as non-blocking state machines
+ * @version 0.1
+ * @date 2024-01-18
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Handlers are registered/changed from any thread (epoll is thread safe),
+ * callbacks always run on the reactor thread. Remove a handler only from
+ * the reactor thread (or when the reactor is stopped).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "utils/reactor.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+/**
+ * @brief Init the reactor (not started)
+ *
+ * @param r
+ * @param name, for logging (not copied)
+ * @return int
+ */
+int reactor_init(reactor_t* r, const char* name)
+{
+    struct epoll_event ev;
+
+    memset(r, 0, sizeof(reactor_t));
+    r->name = name;
+
+    if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        log_message(LOG_ERR, "%s: epoll_create1: %s\n", name, strerror(errno));
+        return ESYSERR;
+    }
+
+    if ((r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        close(r->epfd);
+        return ESYSERR;
+    }
+
+    // data.ptr == NULL => wake up
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev);
+
+    return ENOERR;
+}
+
+/**
+ * @brief free what's left, the handlers still registered are owned by their users
+ *
+ * @param r
+ */
+void reactor_term(reactor_t* r)
+{
+    while (r->zombies != NULL)
+    {
+        reactor_handler* h = r->zombies;
+        r->zombies = h->next;
+        free(h);
+    }
+
+    close(r->wakefd);
+    close(r->epfd);
+}
+
+/**
+ * @brief Watch fd
+ *
+ * @param r
+ * @param fd
+ * @param events, EPOLLIN / EPOLLOUT
+ * @param cb
+ * @param arg
+ * @return reactor_handler*, NULL => error
+ */
+reactor_handler* reactor_add(reactor_t* r, int fd, uint32_t events, reactor_cb cb, void* arg)
+{
+    struct epoll_event ev;
+    reactor_handler* h = (reactor_handler*) calloc(1, sizeof(reactor_handler));
+
+    if (h == NULL)
+        return NULL;
+
+    h->fd = fd;
+    h->events = events;
+    h->cb = cb;
+    h->arg = arg;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = h;
+
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        log_message(LOG_ERR, "%s: epoll_ctl add %d: %s\n", r->name, fd, strerror(errno));
+        free(h);
+        return NULL;
+    }
+
+    return h;
+}
+
+/**
+ * @brief Change the watched events (0 => paused)
+ *
+ * @param r
+ * @param h
+ * @param events
+ * @return int
+ */
+int reactor_mod(reactor_t* r, reactor_handler* h, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if (h->events == events)
+        return ENOERR;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = h;
+
+    if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, h->fd, &ev) != 0)
+        return ESYSERR;
+
+    h->events = events;
+
+    return ENOERR;
+}
+
+/**
+ * @brief Stop watching, the handler is released after the current dispatch.
+ *        A timer fd is closed too.
+ *
+ * @param r
+ * @param h
+ */
+void reactor_del(reactor_t* r, reactor_handler* h)
+{
+    if (h == NULL)
+        return;
+
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+
+    if (h->timer)
+        close(h->fd);
+
+    h->fd = -1;
+    h->cb = NULL;
+    h->next = r->zombies;
+    r->zombies = h;
+}
+
+/**
+ * @brief Add a (disarmed) timer, see reactor_timer_set()
+ *
+ * @param r
+ * @param cb
+ * @param arg
+ * @return reactor_handler*
+ */
+reactor_handler* reactor_timer_add(reactor_t* r, reactor_cb cb, void* arg)
+{
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0)
+        return NULL;
+
+    reactor_handler* h = reactor_add(r, tfd, EPOLLIN, cb, arg);
+    if (h == NULL)
+    {
+        close(tfd);
+        return NULL;
+    }
+    h->timer = 1;
+
+    return h;
+}
+
+/**
+ * @brief Arm the timer
+ *
+ * @param h
+ * @param timeout_ms, first expiry, < 0 => disarm, 0 => as soon as possible
+ * @param period_ms, 0 => one shot
+ * @return int
+ */
+int reactor_timer_set(reactor_handler* h, int timeout_ms, int period_ms)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+
+    if (timeout_ms >= 0)
+    {
+        // 0 would disarm it
+        if (timeout_ms == 0)
+            its.it_value.tv_nsec = 1;
+        else
+        {
+            its.it_value.tv_sec = timeout_ms / 1000;
+            its.it_value.tv_nsec = (long) (timeout_ms % 1000) * 1000000L;
+        }
+
+        its.it_interval.tv_sec = period_ms / 1000;
+        its.it_interval.tv_nsec = (long) (period_ms % 1000) * 1000000L;
+    }
+
+    return timerfd_settime(h->fd, 0, &its, NULL) == 0 ? ENOERR : ESYSERR;
+}
+
+/**
+ * @brief event loop
+ *
+ * @param arg
+ * @return void*
+ */
+static void* reactor_task(void* arg)
+{
+    reactor_t* r = (reactor_t*) arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (r->running)
+    {
+        int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, -1);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            log_message(LOG_ERR, "%s: epoll_wait: %s\n", r->name, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            reactor_handler* h = (reactor_handler*) events[i].data.ptr;
+            uint64_t v;
+
+            if (h == NULL)
+            {
+                // reactor_stop()
+                if (read(r->wakefd, &v, sizeof(v)) < 0) { /* drained */ }
+                continue;
+            }
+
+            // removed by a previous callback of this round
+            if (h->cb == NULL)
+                continue;
+
+            if (h->timer && read(h->fd, &v, sizeof(v)) < 0)
+                continue;
+
+            h->cb(r, h, events[i].events, h->arg);
+        }
+
+        while (r->zombies != NULL)
+        {
+            reactor_handler* h = r->zombies;
+            r->zombies = h->next;
+            free(h);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start the loop thread
+ *
+ * @param r
+ * @return int
+ */
+int reactor_run(reactor_t* r)
+{
+    r->running = 1;
+
+    return
+        pthread_create(&r->thread, NULL, reactor_task, r);
+}
+
+/**
+ * @brief Ask the loop to exit
+ *
+ * @param r
+ */
+void reactor_stop(reactor_t* r)
+{
+    uint64_t v = 1;
+
+    r->running = 0;
+    if (write(r->wakefd, &v, sizeof(v)) < 0) { /* already signalled */ }
+}
+
+/**
+ * @brief Wait until the loop exits
+ *
+ * @param r
+ * @return int
+ */
+int reactor_wait(reactor_t* r)
+{
+    return
+        pthread_join(r->thread, NULL);
+}
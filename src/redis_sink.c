@@ -17,9 +17,11 @@
 #include <time.h>
 
 #include <hiredis/hiredis.h>
+#include <hiredis/async.h>
 #include "redis_sink.h"
-#include "error.h"
-#include "logger.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+#include "utils/encoder.h"
 
 //FIXME
 extern char* strdup(const char*);
@@ -37,20 +39,19 @@ void* redis_sink_task(void* arg)
     if (cfg == NULL)
     {
         #ifdef DEBUG
-        log_message(LOG_ERROR, "Config error ...\n");
+        log_message(LOG_ERR, "Config error ...\n");
         #endif // DEBUG
         
         exit(EGENERR);
     }
 
     // redis task
-    Queue* q = (Queue*) cfg->q;
-    char data[MAX_QUEUE_DATA_SIZE];
+    sink_input* in = &cfg->in;
 
-    if (q == NULL)
+    if (in->br == NULL && in->sub == NULL && in->cur == NULL)
     {
         #ifdef DEBUG
-        log_message(LOG_ERROR, "Error queue...\n");
+        log_message(LOG_ERR, "Error queue...\n");
         #endif // DEBUG
         
         exit(EQUERR);
@@ -62,6 +63,8 @@ void* redis_sink_task(void* arg)
         redisReply *reply;
 
         // Connect to Redis
+        conn_state_set(&cfg->conn, CONN_CONNECTING);
+
         ctx = redisConnect(cfg->host, cfg->port);
         if (ctx == NULL || ctx->err) 
         {
@@ -75,38 +78,311 @@ void* redis_sink_task(void* arg)
                 log_message(LOG_INFO, "Connection error: Can't allocate redis context\n");
             }
 
+            conn_state_set(&cfg->conn, CONN_DISCONNECTED);
+
             sleep(1);
             continue;
         }
 
-        // 2. get data from queue
-        if (dequeue(q, data))
+        conn_state_set(&cfg->conn, CONN_CONNECTED);
+
+        // 2. get data from bus, keep the last sample under the key
+        while (1)
         {
-            #ifdef DEBUG
-            log_message(LOG_INFO, "%s\n", data);
-            #endif // DEBUG
+            if (0 != sink_input_read(in, cfg->format, NULL, -1))
+                continue;
+
+            if (in->len < 0)
+            {
+                sink_input_done(in);
+                continue;
+            }
 
             // Perform Redis operation to set the key with binary data
-            reply = redisCommand(ctx, "SET %s %s", cfg->key, data);
+            reply = redisCommand(ctx, "SET %s %b", cfg->key, in->payload, (size_t) in->len);
 
             if (reply == NULL) 
             {
+                // sent again after the reconnect when read from the log
+                sink_input_retry(in);
                 log_message(LOG_INFO, "Error: %s\n", ctx->errstr);
-                redisFree(ctx);
-
-                continue;
+                break;
             }
 
+            sink_input_done(in);
+
             // Free the reply
             freeReplyObject(reply);
         }
+
+        conn_state_set(&cfg->conn, CONN_DISCONNECTED);
+        redisFree(ctx);
+    }
+}
+
+#define REDIS_RETRY_MS      1000
+#define REDIS_DRAIN_MAX     64
+#define REDIS_MAX_PENDING   1024    // commands without reply
+
+/**
+ * @brief reactor mode: hiredis async context, its socket is watched by the reactor
+ * 
+ */
+typedef struct {
+    reactor_t*          r;
+    redisAsyncContext*  ac;         // NULL => not connected
+    reactor_handler*    io_h;       // ac's socket
+    int                 pending;
+    unsigned long       dropped;
+
+    reactor_handler*    bus_h;
+    reactor_handler*    retry_h;
+} redis_async;
+
+/* hiredis event hooks, ev.data is the config */
+
+static void redis_async_io(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    redis_sync_config* cfg = (redis_sync_config*) arg;
+    redis_async* a = (redis_async*) cfg->priv;
+
+    // HandleRead may free the context (disconnect), check again before writing
+    if (a->ac != NULL && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        redisAsyncHandleRead(a->ac);
+
+    if (a->ac != NULL && (events & EPOLLOUT))
+        redisAsyncHandleWrite(a->ac);
+}
+
+static void redis_ev_set(redis_sync_config* cfg, uint32_t set, uint32_t clear)
+{
+    redis_async* a = (redis_async*) cfg->priv;
+
+    if (a->io_h != NULL)
+        reactor_mod(a->r, a->io_h, (a->io_h->events | set) & ~clear);
+}
+
+static void redis_ev_add_read(void* privdata)   { redis_ev_set((redis_sync_config*) privdata, EPOLLIN, 0); }
+static void redis_ev_del_read(void* privdata)   { redis_ev_set((redis_sync_config*) privdata, 0, EPOLLIN); }
+static void redis_ev_add_write(void* privdata)  { redis_ev_set((redis_sync_config*) privdata, EPOLLOUT, 0); }
+static void redis_ev_del_write(void* privdata)  { redis_ev_set((redis_sync_config*) privdata, 0, EPOLLOUT); }
+
+static void redis_ev_cleanup(void* privdata)
+{
+    redis_sync_config* cfg = (redis_sync_config*) privdata;
+    redis_async* a = (redis_async*) cfg->priv;
+
+    reactor_del(a->r, a->io_h);
+    a->io_h = NULL;
+}
+
+static void redis_async_connected(const redisAsyncContext* ac, int status)
+{
+    redis_sync_config* cfg = (redis_sync_config*) ac->ev.data;
+    redis_async* a = (redis_async*) cfg->priv;
+
+    if (status != REDIS_OK)
+    {
+        log_message(LOG_INFO, "Connection error: %s\n", ac->errstr);
+
+        // hiredis frees the context after this callback
+        a->ac = NULL;
+        conn_state_set(&cfg->conn, CONN_DISCONNECTED);
+        return;
+    }
+
+    conn_state_set(&cfg->conn, CONN_CONNECTED);
+}
+
+static void redis_async_disconnected(const redisAsyncContext* ac, int status)
+{
+    redis_sync_config* cfg = (redis_sync_config*) ac->ev.data;
+    redis_async* a = (redis_async*) cfg->priv;
+
+    if (status != REDIS_OK)
+        log_message(LOG_INFO, "Error: %s\n", ac->errstr);
+
+    a->ac = NULL;
+    a->pending = 0;
+    conn_state_set(&cfg->conn, CONN_DISCONNECTED);
+}
+
+static void redis_async_reply(redisAsyncContext* ac, void* reply, void* privdata)
+{
+    redis_sync_config* cfg = (redis_sync_config*) privdata;
+    redis_async* a = (redis_async*) cfg->priv;
+
+    if (a->pending > 0)
+        a->pending--;
+}
+
+/**
+ * @brief start connecting (reactor thread or before the reactor runs)
+ * 
+ * @param cfg 
+ * @return int 
+ */
+static int redis_async_connect(redis_sync_config* cfg)
+{
+    redis_async* a = (redis_async*) cfg->priv;
+    redisAsyncContext* ac;
+
+    conn_state_set(&cfg->conn, CONN_CONNECTING);
+
+    ac = redisAsyncConnect(cfg->host, cfg->port);
+    if (ac == NULL || ac->err)
+    {
+        if (ac) 
+        {
+            log_message(LOG_INFO, "Connection error: %s\n", ac->errstr);
+            redisAsyncFree(ac);
+        }
         else
+            log_message(LOG_INFO, "Connection error: Can't allocate redis context\n");
+
+        conn_state_set(&cfg->conn, CONN_DISCONNECTED);
+        return ESVRERR;
+    }
+
+    a->io_h = reactor_add(a->r, ac->c.fd, 0, redis_async_io, cfg);
+    if (a->io_h == NULL)
+    {
+        redisAsyncFree(ac);
+        conn_state_set(&cfg->conn, CONN_DISCONNECTED);
+        return ESYSERR;
+    }
+
+    ac->ev.data = cfg;
+    ac->ev.addRead = redis_ev_add_read;
+    ac->ev.delRead = redis_ev_del_read;
+    ac->ev.addWrite = redis_ev_add_write;
+    ac->ev.delWrite = redis_ev_del_write;
+    ac->ev.cleanup = redis_ev_cleanup;
+
+    a->ac = ac;
+    a->pending = 0;
+
+    redisAsyncSetConnectCallback(ac, redis_async_connected);
+    redisAsyncSetDisconnectCallback(ac, redis_async_disconnected);
+
+    // the non-blocking connect completes on the first writable event
+    redis_ev_add_write(cfg);
+
+    return ENOERR;
+}
+
+/**
+ * @brief bus readable (reactor thread)
+ * 
+ * @param r 
+ * @param h 
+ * @param events 
+ * @param arg 
+ */
+static void redis_async_on_bus(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    redis_sync_config* cfg = (redis_sync_config*) arg;
+    redis_async* a = (redis_async*) cfg->priv;
+    sink_input* in = &cfg->in;
+
+    for (int i = 0; i < REDIS_DRAIN_MAX; i++)
+    {
+        if (0 != sink_input_read(in, cfg->format, NULL, 0))
+            break;
+
+        // only the last sample is kept under the key, drop while not connected
+        if (in->len < 0 || a->ac == NULL || conn_state_get(&cfg->conn) != CONN_CONNECTED || a->pending >= REDIS_MAX_PENDING)
         {
-            usleep(10000);
+            if (in->len >= 0)
+                a->dropped++;
+            sink_input_done(in);
+            continue;
         }
 
+        // the command is formatted (copied) before it returns
+        if (REDIS_OK == redisAsyncCommand(a->ac, redis_async_reply, cfg, "SET %s %b", cfg->key, in->payload, (size_t) in->len))
+            a->pending++;
+        sink_input_done(in);
+    }
+}
+
+/**
+ * @brief reconnect timer (reactor thread)
+ * 
+ * @param r 
+ * @param h 
+ * @param events 
+ * @param arg 
+ */
+static void redis_async_on_retry(reactor_t* r, reactor_handler* h, uint32_t events, void* arg)
+{
+    redis_sync_config* cfg = (redis_sync_config*) arg;
+    redis_async* a = (redis_async*) cfg->priv;
+
+    if (a->ac == NULL)
+        redis_async_connect(cfg);
+}
+
+static void redis_async_free(redis_sync_config* cfg);
+
+/**
+ * @brief Drive the sink from a reactor instead of its own thread. On
+ *        failure nothing stays attached
+ * 
+ * @param cfg 
+ * @param r 
+ * @return int 
+ */
+int redis_sink_attach(redis_sync_config* cfg, reactor_t* r)
+{
+    redis_async* a = (redis_async*) calloc(1, sizeof(redis_async));
+
+    if (a == NULL)
+        return ESYSERR;
+
+    a->r = r;
+    cfg->priv = (void*) a;
+    cfg->reactor = r;
+
+    a->bus_h = reactor_add(r, sink_input_fd(&cfg->in), EPOLLIN, redis_async_on_bus, cfg);
+    a->retry_h = reactor_timer_add(r, redis_async_on_retry, cfg);
+    if (a->bus_h == NULL || a->retry_h == NULL)
+    {
+        // back to nothing attached, the caller may run the thread instead
+        reactor_del(r, a->bus_h);
+        reactor_del(r, a->retry_h);
+        redis_async_free(cfg);
+        cfg->reactor = NULL;
+        return ESYSERR;
     }
+
+    reactor_timer_set(a->retry_h, REDIS_RETRY_MS, REDIS_RETRY_MS);
+
+    // failures are retried by the timer
+    redis_async_connect(cfg);
+
+    return ENOERR;
 }
+
+/**
+ * @brief release the reactor mode state, the reactor must be stopped
+ * 
+ * @param cfg 
+ */
+static void redis_async_free(redis_sync_config* cfg)
+{
+    redis_async* a = (redis_async*) cfg->priv;
+
+    if (a == NULL)
+        return;
+
+    if (a->ac != NULL)
+        redisAsyncFree(a->ac);
+
+    free(a);
+    cfg->priv = NULL;
+}
+
 /**
  * @brief Init sync task
  * 
@@ -117,11 +393,15 @@ void* redis_sink_task(void* arg)
  * @param password 
  * @return int 
  */
-int redis_sink_init(redis_sync_config* cfg, Queue* q, const char* host, int port, const char* username, const char* password, const char* client_id, const char* key)
+int redis_sink_init(redis_sync_config* cfg, Bus* b, const char* host, int port, const char* username, const char* password, const char* client_id, const char* key)
 {
     memset(cfg, 0, sizeof (redis_sync_config));
 
-    cfg->q = q;
+    cfg->b = b;
+    sink_input_init(&cfg->in, cfg->b);
+
+    cfg->format = ENC_JSON;
+    conn_state_init(&cfg->conn, "redis-sink");
 
     if (host != NULL)
         cfg->host = strdup(host);
@@ -171,6 +451,9 @@ int redis_sink_term(redis_sync_config* cfg)
     if (cfg->key != NULL)
         free(cfg->key);
 
+    redis_async_free(cfg);
+    conn_state_destroy(&cfg->conn);
+
     return 0;
 }
 
@@ -195,6 +478,10 @@ int redis_sink_run(redis_sync_config* cfg)
  */
 int redis_sink_wait(redis_sync_config* cfg)
 {
+    // driven by a reactor, no thread of its own
+    if (cfg->reactor != NULL)
+        return 0;
+
     return 
         pthread_join( cfg->task_thread, NULL);    
 }
\ No newline at end of file
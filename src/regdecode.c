@@ -0,0 +1,354 @@
+/**
+ * @file regdecode.c
+ * @author longdh
+ * @brief batch register decode: byte swap, word order, int/float to double, scale
+ * @version 0.1
+ * @date 2024-01-22
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * 16 and 32 bit types go through SSE2 (x86_64) or NEON (aarch64), 4 values
+ * per step, the tail and the 64 bit types through the scalar code. 32 bit
+ * ARM has no double precision NEON and uses the scalar code.
+ */
+#include <string.h>
+
+#include "meter/regdecode.h"
+#include "meter/regmap.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define REGDECODE_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define REGDECODE_NEON
+#endif
+
+/**
+ * @brief raw bits of one value, A = most significant byte
+ */
+static inline uint64_t reg_raw(const uint16_t* w, int nregs, int order)
+{
+    uint64_t v = 0;
+
+    for (int i = 0; i < nregs; i++)
+    {
+        uint16_t word = (order & REG_ORDER_CDAB) ? w[nregs - 1 - i] : w[i];
+
+        if (order & REG_ORDER_BADC)
+            word = (uint16_t) ((word >> 8) | (word << 8));
+
+        v = (v << 16) | word;
+    }
+
+    return v;
+}
+
+static inline double reg_value(uint64_t raw, int type)
+{
+    switch (type)
+    {
+    case REG_U16:       return (double) (uint16_t) raw;
+    case REG_S16:       return (double) (int16_t) raw;
+    case REG_U32:       return (double) (uint32_t) raw;
+    case REG_S32:       return (double) (int32_t) raw;
+    case REG_U64:       return (double) raw;
+    case REG_S64:       return (double) (int64_t) raw;
+
+    case REG_FLOAT32:
+        {
+            uint32_t u = (uint32_t) raw;
+            float f;
+
+            memcpy(&f, &u, sizeof(f));
+            return f;
+        }
+
+    case REG_FLOAT64:
+        {
+            double d;
+
+            memcpy(&d, &raw, sizeof(d));
+            return d;
+        }
+
+    default:
+        return 0;
+    }
+}
+
+static inline int reg_width(int type)
+{
+    switch (type)
+    {
+    case REG_U16:
+    case REG_S16:
+        return 1;
+    case REG_U64:
+    case REG_S64:
+    case REG_FLOAT64:
+        return 4;
+    default:
+        return 2;
+    }
+}
+
+/**
+ * @brief one integer register value, sign extended (fixed point path)
+ *
+ * @param regs
+ * @param type, integer reg_type
+ * @param order
+ * @return int64_t
+ */
+int64_t regdecode_int(const uint16_t* regs, int type, int order)
+{
+    uint64_t raw = reg_raw(regs, reg_width(type), order);
+
+    switch (type)
+    {
+    case REG_U16:       return (uint16_t) raw;
+    case REG_S16:       return (int16_t) raw;
+    case REG_U32:       return (uint32_t) raw;
+    case REG_S32:       return (int32_t) raw;
+    default:            return (int64_t) raw;
+    }
+}
+
+/**
+ * @brief reference implementation, one value at a time
+ */
+void regdecode_block_scalar(const uint16_t* regs, int n, int type, int order,
+                            const double* scale, const double* offset, double* out)
+{
+    int w = reg_width(type);
+
+    for (int i = 0; i < n; i++)
+        out[i] = reg_value(reg_raw(regs + i * w, w, order), type) * scale[i] + offset[i];
+}
+
+#ifdef REGDECODE_SSE2
+
+/* 4 x 32 bit lanes, the value of each lane in host order */
+static inline __m128i sse_load32(const uint16_t* w, int order)
+{
+    __m128i x = _mm_loadu_si128((const __m128i*) w);
+
+    if (order & REG_ORDER_BADC)
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+
+    // the first register lands in the low half of the lane: rotate unless CDAB
+    if (!(order & REG_ORDER_CDAB))
+        x = _mm_or_si128(_mm_slli_epi32(x, 16), _mm_srli_epi32(x, 16));
+
+    return x;
+}
+
+/* 4 x 16 bit registers widened to 32 bit lanes */
+static inline __m128i sse_load16(const uint16_t* w, int order, int is_signed)
+{
+    __m128i x = _mm_loadl_epi64((const __m128i*) w);
+
+    if (order & REG_ORDER_BADC)
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+
+    x = _mm_unpacklo_epi16(x, x);
+
+    return is_signed ? _mm_srai_epi32(x, 16) : _mm_srli_epi32(x, 16);
+}
+
+static inline void sse_store(__m128d lo, __m128d hi, const double* scale, const double* offset, double* out)
+{
+    lo = _mm_add_pd(_mm_mul_pd(lo, _mm_loadu_pd(scale)), _mm_loadu_pd(offset));
+    hi = _mm_add_pd(_mm_mul_pd(hi, _mm_loadu_pd(scale + 2)), _mm_loadu_pd(offset + 2));
+
+    _mm_storeu_pd(out, lo);
+    _mm_storeu_pd(out + 2, hi);
+}
+
+static int regdecode_sse2(const uint16_t* regs, int n, int type, int order,
+                          const double* scale, const double* offset, double* out)
+{
+    const __m128i sign = _mm_set1_epi32((int) 0x80000000u);
+    const __m128d two31 = _mm_set1_pd(2147483648.0);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i x;
+        __m128d lo, hi;
+
+        switch (type)
+        {
+        case REG_U16:
+        case REG_S16:
+            x = sse_load16(regs + i, order, type == REG_S16);
+            lo = _mm_cvtepi32_pd(x);
+            hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+            break;
+
+        case REG_S32:
+            x = sse_load32(regs + 2 * i, order);
+            lo = _mm_cvtepi32_pd(x);
+            hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+            break;
+
+        case REG_U32:
+            // as signed after flipping the top bit, then add 2^31 back
+            x = _mm_xor_si128(sse_load32(regs + 2 * i, order), sign);
+            lo = _mm_add_pd(_mm_cvtepi32_pd(x), two31);
+            hi = _mm_add_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2))), two31);
+            break;
+
+        case REG_FLOAT32:
+            {
+                __m128 f = _mm_castsi128_ps(sse_load32(regs + 2 * i, order));
+                lo = _mm_cvtps_pd(f);
+                hi = _mm_cvtps_pd(_mm_movehl_ps(f, f));
+            }
+            break;
+
+        default:
+            return i;
+        }
+
+        sse_store(lo, hi, scale + i, offset + i, out + i);
+    }
+
+    return i;
+}
+
+#endif // REGDECODE_SSE2
+
+#ifdef REGDECODE_NEON
+
+static inline uint32x4_t neon_load32(const uint16_t* w, int order)
+{
+    uint16x8_t x = vld1q_u16(w);
+
+    if (order & REG_ORDER_BADC)
+        x = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(x)));
+
+    // the first register lands in the low half of the lane: swap unless CDAB
+    if (!(order & REG_ORDER_CDAB))
+        x = vrev32q_u16(x);
+
+    return vreinterpretq_u32_u16(x);
+}
+
+static inline uint16x4_t neon_load16(const uint16_t* w, int order)
+{
+    uint16x4_t x = vld1_u16(w);
+
+    if (order & REG_ORDER_BADC)
+        x = vreinterpret_u16_u8(vrev16_u8(vreinterpret_u8_u16(x)));
+
+    return x;
+}
+
+static inline void neon_store(float64x2_t lo, float64x2_t hi, const double* scale, const double* offset, double* out)
+{
+    lo = vfmaq_f64(vld1q_f64(offset), lo, vld1q_f64(scale));
+    hi = vfmaq_f64(vld1q_f64(offset + 2), hi, vld1q_f64(scale + 2));
+
+    vst1q_f64(out, lo);
+    vst1q_f64(out + 2, hi);
+}
+
+static int regdecode_neon(const uint16_t* regs, int n, int type, int order,
+                          const double* scale, const double* offset, double* out)
+{
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        float64x2_t lo, hi;
+
+        switch (type)
+        {
+        case REG_U16:
+            {
+                uint32x4_t x = vmovl_u16(neon_load16(regs + i, order));
+                lo = vcvtq_f64_u64(vmovl_u32(vget_low_u32(x)));
+                hi = vcvtq_f64_u64(vmovl_u32(vget_high_u32(x)));
+            }
+            break;
+
+        case REG_S16:
+            {
+                int32x4_t x = vmovl_s16(vreinterpret_s16_u16(neon_load16(regs + i, order)));
+                lo = vcvtq_f64_s64(vmovl_s32(vget_low_s32(x)));
+                hi = vcvtq_f64_s64(vmovl_s32(vget_high_s32(x)));
+            }
+            break;
+
+        case REG_U32:
+            {
+                uint32x4_t x = neon_load32(regs + 2 * i, order);
+                lo = vcvtq_f64_u64(vmovl_u32(vget_low_u32(x)));
+                hi = vcvtq_f64_u64(vmovl_u32(vget_high_u32(x)));
+            }
+            break;
+
+        case REG_S32:
+            {
+                int32x4_t x = vreinterpretq_s32_u32(neon_load32(regs + 2 * i, order));
+                lo = vcvtq_f64_s64(vmovl_s32(vget_low_s32(x)));
+                hi = vcvtq_f64_s64(vmovl_s32(vget_high_s32(x)));
+            }
+            break;
+
+        case REG_FLOAT32:
+            {
+                float32x4_t f = vreinterpretq_f32_u32(neon_load32(regs + 2 * i, order));
+                lo = vcvt_f64_f32(vget_low_f32(f));
+                hi = vcvt_high_f64_f32(f);
+            }
+            break;
+
+        default:
+            return i;
+        }
+
+        neon_store(lo, hi, scale + i, offset + i, out + i);
+    }
+
+    return i;
+}
+
+#endif // REGDECODE_NEON
+
+/**
+ * @brief batch decode, vector path for the 16/32 bit types
+ */
+void regdecode_block(const uint16_t* regs, int n, int type, int order,
+                     const double* scale, const double* offset, double* out)
+{
+    int done = 0;
+
+#if defined(REGDECODE_SSE2)
+    done = regdecode_sse2(regs, n, type, order, scale, offset, out);
+#elif defined(REGDECODE_NEON)
+    done = regdecode_neon(regs, n, type, order, scale, offset, out);
+#endif
+
+    if (done < n)
+        regdecode_block_scalar(regs + done * reg_width(type), n - done, type, order, 
+                               scale + done, offset + done, out + done);
+}
+
+/**
+ * @brief name of the vector path compiled in
+ *
+ * @return const char*
+ */
+const char* regdecode_impl()
+{
+#if defined(REGDECODE_SSE2)
+    return "sse2";
+#elif defined(REGDECODE_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
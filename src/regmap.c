@@ -0,0 +1,717 @@
+/**
+ * @file regmap.c
+ * @author longdh
+ * @brief generic Modbus device driver: register map from the config,
+ *        compiled into a merged read plan and a decode table
+ * @version 0.1
+ * @date 2024-01-21
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Map file:
+ *
+ *   name = "dtsu666";
+ *   max_gap = 8;
+ *   points = (
+ *     { name = "voltage_a"; address = 0x2006; type = "float32"; order = "ABCD"; scale = 0.1; },
+ *     { name = "freq"; address = 0x2044; type = "float32"; scale = 0.01; function = "holding"; }
+ *   );
+ *
+ * The points are sorted by (function, address) and covered by as few
+ * requests as possible: two ranges are merged when the hole between them is
+ * at most max_gap registers and the request stays within 125 registers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+
+#include "meter/regmap.h"
+#include "meter/regdecode.h"
+#include "meter/mbcap.h"
+#include "utils/encoder.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+static reg_map* regmap_registry[REGMAP_MAX_MAPS];
+static int regmap_count = 0;
+
+/* meter_data_log fields a point may feed, see regmap_to_meter_data() */
+static const char* meter_field_names[] = {
+    [METER_FID_VOLTAGE]        = "voltage",
+    [METER_FID_CURRENT]        = "current",
+    [METER_FID_POWER]          = "power",
+    [METER_FID_REACTIVE_POWER] = "reactive_power",
+    [METER_FID_POWER_FACTOR]   = "power_factor",
+    [METER_FID_FREQ]           = "freq",
+    [METER_FID_IMPORT_ACTIVE]  = "import_active",
+    [METER_FID_EXPORT_ACTIVE]  = "export_active",
+};
+
+#define METER_NFIELDS (sizeof(meter_field_names) / sizeof(meter_field_names[0]))
+
+static int meter_field_id(const char* name)
+{
+    for (size_t i = 0; i < METER_NFIELDS; i++)
+    {
+        if (meter_field_names[i] != NULL && 0 == strcmp(meter_field_names[i], name))
+            return (int) i;
+    }
+
+    return -1;
+}
+
+static int reg_type_from_string(const char* s, uint8_t* nregs)
+{
+    static const struct { const char* name; int type; int nregs; } types[] = {
+        { "u16", REG_U16, 1 },      { "uint16", REG_U16, 1 },
+        { "s16", REG_S16, 1 },      { "int16", REG_S16, 1 },
+        { "u32", REG_U32, 2 },      { "uint32", REG_U32, 2 },
+        { "s32", REG_S32, 2 },      { "int32", REG_S32, 2 },
+        { "float32", REG_FLOAT32, 2 }, { "float", REG_FLOAT32, 2 },
+        { "u64", REG_U64, 4 },      { "uint64", REG_U64, 4 },
+        { "s64", REG_S64, 4 },      { "int64", REG_S64, 4 },
+        { "float64", REG_FLOAT64, 4 }, { "double", REG_FLOAT64, 4 },
+    };
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if (0 == strcasecmp(types[i].name, s))
+        {
+            *nregs = (uint8_t) types[i].nregs;
+            return types[i].type;
+        }
+    }
+
+    return -1;
+}
+
+static int reg_order_from_string(const char* s)
+{
+    if (0 == strcasecmp(s, "ABCD"))
+        return REG_ORDER_ABCD;
+    if (0 == strcasecmp(s, "CDAB"))
+        return REG_ORDER_CDAB;
+    if (0 == strcasecmp(s, "BADC"))
+        return REG_ORDER_BADC;
+    if (0 == strcasecmp(s, "DCBA"))
+        return REG_ORDER_DCBA;
+
+    return -1;
+}
+
+static const int64_t pow10_tab[] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL, 100000000LL,
+    1000000000LL, 10000000000LL, 100000000000LL, 1000000000000LL
+};
+
+#define FX_MAX_EXP  12
+
+/**
+ * @brief k when scale == 10^k
+ */
+static int scale_exponent(double scale, int* k)
+{
+    for (int e = -FX_MAX_EXP; e <= FX_MAX_EXP; e++)
+    {
+        double p = pow(10.0, e);
+
+        if (fabs(scale - p) <= p * 1e-9)
+        {
+            *k = e;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief fixed point form of a point: exact integer arithmetic when the
+ *        register is an integer scaled by a power of ten, rounded otherwise
+ * 
+ * @param p 
+ * @param has_exp, exponent given by the map
+ * @param exp 
+ */
+static void point_fixed(reg_point* p, int has_exp, int exp)
+{
+    int is_int = p->type != REG_FLOAT32 && p->type != REG_FLOAT64;
+    int k = 0;
+    int pow10 = scale_exponent(p->scale, &k);
+
+    if (!has_exp)
+        exp = (is_int && pow10) ? k : -3;
+
+    if (exp < -FX_MAX_EXP)
+        exp = -FX_MAX_EXP;
+    if (exp > FX_MAX_EXP)
+        exp = FX_MAX_EXP;
+
+    p->exponent = (int8_t) exp;
+    p->fx_mul = 0;
+    p->fx_add = 0;
+
+    if (!is_int || !pow10 || k < exp || k - exp > FX_MAX_EXP)
+        return;
+
+    // the offset must be a whole number of 10^exp too
+    double add = p->offset * pow(10.0, -exp);
+    if (fabs(add - round(add)) > 1e-9)
+        return;
+
+    p->fx_mul = pow10_tab[k - exp];
+    p->fx_add = (int64_t) llround(add);
+}
+
+/**
+ * @brief int or float setting as double
+ */
+static double lookup_number(const config_setting_t* s, const char* name, double def)
+{
+    double d;
+    int i;
+
+    if (config_setting_lookup_float(s, name, &d))
+        return d;
+    if (config_setting_lookup_int(s, name, &i))
+        return (double) i;
+
+    return def;
+}
+
+/**
+ * @brief Build (and compile) a map from a config group
+ * 
+ * @param map 
+ * @param s, group with name, max_gap and the points list
+ * @return int 
+ */
+int regmap_from_setting(reg_map* map, const config_setting_t* s)
+{
+    const char* str;
+    int max_gap = REGMAP_DEFAULT_GAP;
+
+    memset(map, 0, sizeof(reg_map));
+
+    if (config_setting_lookup_string(s, "name", &str))
+        snprintf(map->name, sizeof(map->name), "%s", str);
+    else
+        snprintf(map->name, sizeof(map->name), "regmap");
+
+    config_setting_lookup_int(s, "max_gap", &max_gap);
+
+    config_setting_t* points = config_setting_get_member(s, "points");
+    int n = points ? config_setting_length(points) : 0;
+
+    if (n <= 0 || n > METER_SAMPLE_MAX)
+    {
+        log_message(LOG_ERR, "%s: 1..%d points expected\n", map->name, METER_SAMPLE_MAX);
+        return EGENERR;
+    }
+
+    map->points = (reg_point*) calloc(n, sizeof(reg_point));
+    if (map->points == NULL)
+        return ESYSERR;
+
+    for (int i = 0; i < n; i++)
+    {
+        config_setting_t* ps = config_setting_get_elem(points, i);
+        reg_point* p = &map->points[i];
+        int address;
+        int v;
+
+        if (!config_setting_lookup_string(ps, "name", &str) || !config_setting_lookup_int(ps, "address", &address))
+        {
+            log_message(LOG_ERR, "%s: point %d needs a name and an address\n", map->name, i);
+            regmap_free(map);
+            return EGENERR;
+        }
+
+        snprintf(p->name, sizeof(p->name), "%s", str);
+        p->address = (uint16_t) address;
+        p->fc = REG_FC_HOLDING;
+        p->type = REG_U16;
+        p->nregs = 1;
+        p->order = REG_ORDER_ABCD;
+
+        if (config_setting_lookup_string(ps, "type", &str))
+        {
+            if ((v = reg_type_from_string(str, &p->nregs)) < 0)
+            {
+                log_message(LOG_ERR, "%s: %s: unknown type '%s'\n", map->name, p->name, str);
+                regmap_free(map);
+                return EGENERR;
+            }
+            p->type = (uint8_t) v;
+        }
+
+        if (config_setting_lookup_string(ps, "order", &str))
+        {
+            if ((v = reg_order_from_string(str)) < 0)
+            {
+                log_message(LOG_ERR, "%s: %s: unknown word order '%s'\n", map->name, p->name, str);
+                regmap_free(map);
+                return EGENERR;
+            }
+            p->order = (uint8_t) v;
+        }
+
+        if (config_setting_lookup_string(ps, "function", &str) && 0 == strcasecmp(str, "input"))
+            p->fc = REG_FC_INPUT;
+
+        p->scale = lookup_number(ps, "scale", 1.0);
+        p->offset = lookup_number(ps, "offset", 0.0);
+        p->field = meter_field_id(p->name);
+
+        int exponent = 0;
+        int has_exp = config_setting_lookup_int(ps, "exponent", &exponent);
+        point_fixed(p, has_exp, exponent);
+    }
+
+    map->npoints = n;
+
+    return regmap_compile(map, max_gap);
+}
+
+/**
+ * @brief Load a map file
+ * 
+ * @param map 
+ * @param path 
+ * @return int 
+ */
+int regmap_load_file(reg_map* map, const char* path)
+{
+    config_t cfg;
+    int rc;
+
+    config_init(&cfg);
+
+    if (!config_read_file(&cfg, path))
+    {
+        log_message(LOG_ERR, "%s: %s\n", path, config_error_text(&cfg));
+        config_destroy(&cfg);
+        return EGENERR;
+    }
+
+    rc = regmap_from_setting(map, cfg.root);
+    config_destroy(&cfg);
+
+    if (rc == ENOERR)
+        log_message(LOG_INFO, "%s: %d points in %d reads (%d registers)\n", 
+            map->name, map->npoints, map->nreads, map->nregs);
+
+    return rc;
+}
+
+static int point_cmp(const void* a, const void* b)
+{
+    const reg_point* x = *(const reg_point* const*) a;
+    const reg_point* y = *(const reg_point* const*) b;
+
+    if (x->fc != y->fc)
+        return (int) x->fc - (int) y->fc;
+
+    return (int) x->address - (int) y->address;
+}
+
+/**
+ * @brief Build the decode table: runs of points decoded as one block
+ * 
+ * @param map 
+ * @return int 
+ */
+static int regmap_compile_decode(reg_map* map)
+{
+    free(map->runs);
+    free(map->scales);
+    free(map->offsets);
+
+    map->nruns = 0;
+    map->runs = (reg_run*) calloc(map->npoints, sizeof(reg_run));
+    map->scales = (double*) malloc(map->npoints * sizeof(double));
+    map->offsets = (double*) malloc(map->npoints * sizeof(double));
+
+    if (map->runs == NULL || map->scales == NULL || map->offsets == NULL)
+        return ESYSERR;
+
+    for (int i = 0; i < map->npoints; i++)
+    {
+        const reg_point* p = &map->points[i];
+        reg_run* r = map->nruns ? &map->runs[map->nruns - 1] : NULL;
+
+        map->scales[i] = p->scale;
+        map->offsets[i] = p->offset;
+
+        if (r != NULL && r->type == p->type && r->order == p->order &&
+            p->buf_off == r->buf_off + r->count * p->nregs)
+        {
+            r->count++;
+            continue;
+        }
+
+        r = &map->runs[map->nruns++];
+        r->type = p->type;
+        r->order = p->order;
+        r->buf_off = p->buf_off;
+        r->first = (uint16_t) i;
+        r->count = 1;
+    }
+
+    return ENOERR;
+}
+
+/**
+ * @brief Build the read plan: merged ranges + buffer offset of each point
+ * 
+ * @param map 
+ * @param max_gap, registers read for nothing to save a request
+ * @return int 
+ */
+int regmap_compile(reg_map* map, int max_gap)
+{
+    reg_point** sorted = (reg_point**) malloc(map->npoints * sizeof(reg_point*));
+    int cur = -1;
+
+    free(map->reads);
+    map->reads = (reg_read*) calloc(map->npoints, sizeof(reg_read));
+    map->nreads = 0;
+    map->nregs = 0;
+
+    if (sorted == NULL || map->reads == NULL)
+    {
+        free(sorted);
+        return ESYSERR;
+    }
+
+    for (int i = 0; i < map->npoints; i++)
+        sorted[i] = &map->points[i];
+
+    qsort(sorted, map->npoints, sizeof(reg_point*), point_cmp);
+
+    for (int i = 0; i < map->npoints; i++)
+    {
+        reg_point* p = sorted[i];
+        uint32_t end = (uint32_t) p->address + p->nregs;
+
+        if (cur >= 0)
+        {
+            reg_read* r = &map->reads[cur];
+            uint32_t r_end = (uint32_t) r->start + r->count;
+
+            if (p->fc == r->fc && p->address <= r_end + (uint32_t) max_gap && end - r->start <= REGMAP_MAX_READ)
+            {
+                if (end > r_end)
+                    r->count = (uint16_t) (end - r->start);
+
+                continue;
+            }
+        }
+
+        cur = map->nreads++;
+        map->reads[cur].fc = p->fc;
+        map->reads[cur].start = p->address;
+        map->reads[cur].count = p->nregs;
+    }
+
+    // lay the reads out one after the other
+    for (int i = 0; i < map->nreads; i++)
+    {
+        map->reads[i].buf_off = (uint16_t) map->nregs;
+        map->nregs += map->reads[i].count;
+    }
+
+    for (int i = 0; i < map->npoints; i++)
+    {
+        reg_point* p = &map->points[i];
+
+        for (int j = 0; j < map->nreads; j++)
+        {
+            reg_read* r = &map->reads[j];
+
+            if (p->fc == r->fc && p->address >= r->start && p->address + p->nregs <= r->start + r->count)
+            {
+                p->buf_off = (uint16_t) (r->buf_off + (p->address - r->start));
+                break;
+            }
+        }
+    }
+
+    free(sorted);
+
+    return regmap_compile_decode(map);
+}
+
+void regmap_free(reg_map* map)
+{
+    free(map->points);
+    free(map->reads);
+    free(map->runs);
+    free(map->scales);
+    free(map->offsets);
+
+    map->points = NULL;
+    map->reads = NULL;
+    map->runs = NULL;
+    map->scales = map->offsets = NULL;
+    map->npoints = map->nreads = map->nruns = 0;
+}
+
+/**
+ * @brief make the map known to the encoders (names of a meter_sample)
+ * 
+ * @param map, must stay alive
+ * @return int, id or -1
+ */
+int regmap_register(reg_map* map)
+{
+    if (regmap_count >= REGMAP_MAX_MAPS)
+        return -1;
+
+    map->id = (uint16_t) regmap_count;
+    regmap_registry[regmap_count++] = map;
+
+    return map->id;
+}
+
+const reg_map* regmap_by_id(uint16_t id)
+{
+    return id < regmap_count ? regmap_registry[id] : NULL;
+}
+
+/**
+ * @brief run the read plan
+ * 
+ * @param map 
+ * @param ctx 
+ * @param regs, map->nregs registers
+ * @return int 
+ */
+int regmap_read(const reg_map* map, modbus_t* ctx, uint16_t* regs)
+{
+    for (int i = 0; i < map->nreads; i++)
+    {
+        const reg_read* r = &map->reads[i];
+        int rc;
+
+        rc = mbcap_read_registers(ctx, r->fc == REG_FC_INPUT ? MODBUS_FC_READ_INPUT_REGISTERS : MODBUS_FC_READ_HOLDING_REGISTERS,
+            r->start, r->count, regs + r->buf_off);
+
+        if (rc != r->count)
+        {
+            log_message(LOG_ERR, "%s: read %u@0x%04X failed: %s\n", map->name, r->count, r->start, modbus_strerror(errno));
+            return ESVRERR;
+        }
+    }
+
+    return ENOERR;
+}
+
+/**
+ * @brief table driven decode of the plan buffer, one batch per run
+ * 
+ * @param map 
+ * @param regs 
+ * @param values, map->npoints values
+ */
+void regmap_decode(const reg_map* map, const uint16_t* regs, double* values)
+{
+    for (int i = 0; i < map->nruns; i++)
+    {
+        const reg_run* r = &map->runs[i];
+
+        regdecode_block(regs + r->buf_off, r->count, r->type, r->order,
+                        map->scales + r->first, map->offsets + r->first, values + r->first);
+    }
+}
+
+/**
+ * @brief exact mantissa of an integer point, raw * fx_mul + fx_add
+ * 
+ * @param p 
+ * @param regs, of the point
+ * @param mant 
+ * @return int, 0 => does not fit in an int64
+ */
+static int fixed_int(const reg_point* p, const uint16_t* regs, int64_t* mant)
+{
+    int64_t raw = regdecode_int(regs, p->type, p->order);
+
+    // above INT64_MAX, wrapped by regdecode_int()
+    if (p->type == REG_U64 && raw < 0)
+        return 0;
+
+    return !__builtin_mul_overflow(raw, p->fx_mul, mant) &&
+           !__builtin_add_overflow(*mant, p->fx_add, mant);
+}
+
+/**
+ * @brief decode in fixed point, value = mant * 10^exp
+ * 
+ * @param map 
+ * @param regs 
+ * @param mant, map->npoints mantissas
+ * @param exp, map->npoints exponents
+ */
+void regmap_decode_fixed(const reg_map* map, const uint16_t* regs, int64_t* mant, int8_t* exp)
+{
+    for (int i = 0; i < map->npoints; i++)
+    {
+        const reg_point* p = &map->points[i];
+
+        exp[i] = p->exponent;
+
+        if (p->fx_mul != 0 && fixed_int(p, regs + p->buf_off, &mant[i]))
+            continue;
+
+        // not exact, or out of the int64 range: rounded, saturated
+        double v;
+
+        regdecode_block_scalar(regs + p->buf_off, 1, p->type, p->order, &p->scale, &p->offset, &v);
+        v *= pow(10.0, -p->exponent);
+
+        if (!isfinite(v))
+            mant[i] = 0;
+        else if (v >= 9223372036854775807.0)
+            mant[i] = INT64_MAX;
+        else if (v <= -9223372036854775808.0)
+            mant[i] = INT64_MIN;
+        else
+            mant[i] = (int64_t) llround(v);
+    }
+}
+
+/**
+ * @brief read & decode one sample in fixed point
+ * 
+ * @param map 
+ * @param ctx 
+ * @param sample, meter_id / timestamp are left to the caller
+ * @return int 
+ */
+int regmap_fixed_sample(const reg_map* map, modbus_t* ctx, meter_fixed_sample* sample)
+{
+    uint16_t regs[map->nregs];
+    int rc;
+
+    if ((rc = regmap_read(map, ctx, regs)) != ENOERR)
+        return rc;
+
+    sample->map_id = map->id;
+    sample->count = (uint16_t) map->npoints;
+    regmap_decode_fixed(map, regs, sample->mant, sample->exp);
+
+    return ENOERR;
+}
+
+/**
+ * @brief read & decode one sample
+ * 
+ * @param map 
+ * @param ctx 
+ * @param sample, meter_id / timestamp are left to the caller
+ * @return int 
+ */
+int regmap_sample(const reg_map* map, modbus_t* ctx, meter_sample* sample)
+{
+    uint16_t regs[map->nregs];
+    int rc;
+
+    if ((rc = regmap_read(map, ctx, regs)) != ENOERR)
+        return rc;
+
+    sample->map_id = map->id;
+    sample->count = (uint16_t) map->npoints;
+    regmap_decode(map, regs, sample->values);
+
+    return ENOERR;
+}
+
+/**
+ * @brief the points named like meter_data_log fields, for the sinks
+ *        that only know the single phase meter
+ * 
+ * @param map 
+ * @param values 
+ * @param data 
+ */
+void regmap_to_meter_data(const reg_map* map, const double* values, meter_data_log* data)
+{
+    for (int i = 0; i < map->npoints; i++)
+    {
+        float v = (float) values[i];
+
+        switch (map->points[i].field)
+        {
+        case METER_FID_VOLTAGE:         data->voltage = v; break;
+        case METER_FID_CURRENT:         data->current = v; break;
+        case METER_FID_POWER:           data->power = v; break;
+        case METER_FID_REACTIVE_POWER:  data->reactive_power = v; break;
+        case METER_FID_POWER_FACTOR:    data->power_factor = v; break;
+        case METER_FID_FREQ:            data->freq = v; break;
+        case METER_FID_IMPORT_ACTIVE:   data->import_active = v; break;
+        case METER_FID_EXPORT_ACTIVE:   data->export_active = v; break;
+        default: break;
+        }
+    }
+}
+
+/**
+ * @brief named values of a bus sample (meter_data_log, meter_sample,
+ *        meter_fixed_sample), for the stores that keep columns
+ * 
+ * @param data 
+ * @param datalen 
+ * @param meter_id 
+ * @param ts, 0 => not set
+ * @param names, METER_SAMPLE_MAX, point names / literals
+ * @param values, METER_SAMPLE_MAX
+ * @return int, number of values, -1 => not a sample / unknown map
+ */
+int bus_data_values(const void* data, int datalen, uint32_t* meter_id, uint64_t* ts, const char** names, double* values)
+{
+    int n = 0;
+
+    if (datalen == sizeof(meter_data_log))
+    {
+        const meter_data_log* md = (const meter_data_log*) data;
+        const float* f = &md->voltage;
+
+        // the float members are in METER_FID_* order
+        for (int fid = METER_FID_VOLTAGE; fid <= METER_FID_EXPORT_ACTIVE; fid++, n++)
+        {
+            names[n] = meter_field_names[fid];
+            values[n] = f[n];
+        }
+
+        *meter_id = md->meter_id;
+        *ts = md->timestamp_ns;
+    }
+    else if (datalen == sizeof(meter_sample) || datalen == sizeof(meter_fixed_sample))
+    {
+        const meter_sample* s = (const meter_sample*) data;
+        const meter_fixed_sample* x = (const meter_fixed_sample*) data;
+        int fixed = (datalen == sizeof(meter_fixed_sample));
+        const reg_map* map = regmap_by_id(fixed ? x->map_id : s->map_id);
+
+        n = fixed ? x->count : s->count;
+        if (map == NULL || n > map->npoints || n > METER_SAMPLE_MAX)
+            return -1;
+
+        for (int i = 0; i < n; i++)
+        {
+            names[i] = map->points[i].name;
+            values[i] = fixed ? (double) x->mant[i] * pow(10.0, x->exp[i]) : s->values[i];
+        }
+
+        *meter_id = fixed ? x->meter_id : s->meter_id;
+        *ts = fixed ? x->timestamp_ns : s->timestamp_ns;
+    }
+    else
+        return -1;
+
+    return n;
+}
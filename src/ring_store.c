@@ -0,0 +1,712 @@
+/**
+ * @file ring_store.c
+ * @author longdh
+ * @brief recent samples per meter kept in memory, queried over local HTTP
+ * @version 0.1
+ * @date 2024-01-24
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * The bus reader thread appends every sample to the ring of its meter, the
+ * NanoNNG HTTP server threads answer the queries under the ring read lock.
+ * Times are unix ns (the sample timestamps), 'last' and 'step' are ms.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+
+#include <nng/nng.h>
+#include <nng/supplemental/http/http.h>
+
+#include "ring_store.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+#include "meter/regmap.h"
+
+//FIXME
+extern char* strdup(const char*);
+
+#define RING_QUERY_LIMIT        10000   // samples per range reply
+#define RING_MAX_BUCKETS        4096    // buckets per downsample reply
+
+/**
+ * @brief growing reply text, err is set once out of memory
+ *
+ */
+typedef struct {
+    char*   p;
+    size_t  len;
+    size_t  cap;
+    int     err;
+} text_buf;
+
+static void tb_printf(text_buf* tb, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (tb->err)
+        return;
+
+    for (;;)
+    {
+        va_start(ap, fmt);
+        n = vsnprintf(tb->p + tb->len, tb->cap - tb->len, fmt, ap);
+        va_end(ap);
+
+        if (n < 0)
+        {
+            tb->err = 1;
+            return;
+        }
+
+        if ((size_t) n < tb->cap - tb->len)
+            break;
+
+        size_t cap = tb->cap ? tb->cap * 2 : 4096;
+        while (cap - tb->len <= (size_t) n)
+            cap *= 2;
+
+        char* p = (char*) realloc(tb->p, cap);
+        if (p == NULL)
+        {
+            tb->err = 1;
+            return;
+        }
+
+        tb->p = p;
+        tb->cap = cap;
+    }
+
+    tb->len += n;
+}
+
+static void tb_number(text_buf* tb, const char* sep, double v)
+{
+    if (isfinite(v))
+        tb_printf(tb, "%s%.9g", sep, v);
+    else
+        tb_printf(tb, "%snull", sep);
+}
+
+/**
+ * @brief value of a query parameter, %xx decoded
+ *
+ * @param uri
+ * @param name
+ * @param out
+ * @param size
+ * @return int, 1 => found
+ */
+static int query_param(const char* uri, const char* name, char* out, size_t size)
+{
+    const char* q = strchr(uri, '?');
+    size_t nlen = strlen(name);
+
+    while (q != NULL)
+    {
+        q++;
+
+        if (0 == strncmp(q, name, nlen) && q[nlen] == '=')
+        {
+            const char* v = q + nlen + 1;
+            size_t n = 0;
+
+            while (*v && *v != '&' && n + 1 < size)
+            {
+                unsigned int c;
+
+                if (*v == '%' && v[1] && v[2] && sscanf(v + 1, "%2x", &c) == 1)
+                {
+                    out[n++] = (char) c;
+                    v += 3;
+                }
+                else
+                    out[n++] = *v++;
+            }
+
+            out[n] = '\0';
+            return 1;
+        }
+
+        q = strchr(q, '&');
+    }
+
+    return 0;
+}
+
+static int64_t query_int(const char* uri, const char* name, int64_t def)
+{
+    char v[32];
+
+    if (!query_param(uri, name, v, sizeof(v)))
+        return def;
+
+    return strtoll(v, NULL, 10);
+}
+
+/**
+ * @brief ring of a meter
+ *
+ * @param cfg
+ * @param meter_id
+ * @return sample_ring*, NULL => none yet
+ */
+sample_ring* ring_store_get(ring_store_config* cfg, uint32_t meter_id)
+{
+    char key[16];
+
+    sprintf(key, "%u", meter_id);
+
+    return (sample_ring*) hashtable_lookup(cfg->rings, key);
+}
+
+/**
+ * @brief ring of a meter, created on its first sample (bus reader thread)
+ *
+ * @param cfg
+ * @param meter_id
+ * @param nfields
+ * @param names
+ * @return sample_ring*
+ */
+static sample_ring* ring_store_ring(ring_store_config* cfg, uint32_t meter_id, int nfields, const char* const* names)
+{
+    static unsigned long mismatched = 0;
+    sample_ring* r = ring_store_get(cfg, meter_id);
+    char key[16];
+
+    if (r != NULL)
+    {
+        if (sample_ring_same_fields(r, nfields, names))
+            return r;
+
+        if ((mismatched++ % 1000) == 0)
+            log_message(LOG_WARNING, "ring-store: meter %u changed its fields, sample dropped\n", meter_id);
+        return NULL;
+    }
+
+    if (cfg->nrings >= RING_MAX_METERS)
+        return NULL;
+
+    r = (sample_ring*) malloc(sizeof(sample_ring));
+    if (r == NULL)
+        return NULL;
+
+    if (ENOERR != sample_ring_init(r, meter_id, cfg->capacity, nfields, names))
+    {
+        free(r);
+        return NULL;
+    }
+
+    sprintf(key, "%u", meter_id);
+    hashtable_add(cfg->rings, key, r, 0);
+
+    pthread_mutex_lock(&cfg->lock);
+    cfg->all[cfg->nrings++] = r;
+    pthread_mutex_unlock(&cfg->lock);
+
+    log_message(LOG_INFO, "ring-store: meter %u, %d fields x %u samples\n", meter_id, nfields, cfg->capacity);
+
+    return r;
+}
+
+/**
+ * @brief append whatever arrived on the bus
+ *
+ * @param cfg
+ * @param data
+ * @param datalen
+ */
+static void ring_store_feed(ring_store_config* cfg, const void* data, int datalen)
+{
+    const char* names[METER_SAMPLE_MAX];
+    double values[METER_SAMPLE_MAX];
+    uint32_t meter_id;
+    uint64_t ts;
+    int n = bus_data_values(data, datalen, &meter_id, &ts, names, values);
+
+    if (n <= 0)
+        return;
+
+    if (ts == 0)
+    {
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        ts = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+
+    sample_ring* r = ring_store_ring(cfg, meter_id, n, names);
+    if (r != NULL)
+        sample_ring_push(r, (int64_t) ts, values);
+}
+
+/**
+ * @brief bus reader thread
+ *
+ * @param arg
+ * @return void*
+ */
+static void* ring_store_task(void* arg)
+{
+    ring_store_config* cfg = (ring_store_config*) arg;
+
+    while (1)
+    {
+        void* data;
+        int datalen;
+
+        if (0 == bus_read(cfg->br, &data, &datalen))
+        {
+            ring_store_feed(cfg, data, datalen);
+            bus_free(data);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief finish a request with a JSON body
+ *
+ * @param aio
+ * @param status
+ * @param tb, NULL => error object of msg
+ * @param msg
+ */
+static void http_reply(nng_aio* aio, uint16_t status, text_buf* tb, const char* msg)
+{
+    nng_http_res* res;
+    char err[128];
+    const char* body;
+    size_t len;
+    int rv;
+
+    if (tb != NULL && tb->err)
+    {
+        status = 500;
+        msg = "out of memory";
+        tb = NULL;
+    }
+
+    if (tb != NULL)
+    {
+        body = tb->p;
+        len = tb->len;
+    }
+    else
+    {
+        len = snprintf(err, sizeof(err), "{\"error\":\"%s\"}", msg);
+        body = err;
+    }
+
+    if ((rv = nng_http_res_alloc(&res)) != 0)
+    {
+        nng_aio_finish(aio, rv);
+        return;
+    }
+
+    if (((rv = nng_http_res_set_status(res, status)) != 0) ||
+        ((rv = nng_http_res_set_header(res, "Content-Type", "application/json")) != 0) ||
+        ((rv = nng_http_res_copy_data(res, body, len)) != 0))
+    {
+        nng_http_res_free(res);
+        nng_aio_finish(aio, rv);
+        return;
+    }
+
+    nng_aio_set_output(aio, 0, res);
+    nng_aio_finish(aio, 0);
+}
+
+/**
+ * @brief request uri and the store of a handler
+ *
+ * @param aio
+ * @param cfg
+ * @return const char*
+ */
+static const char* http_request(nng_aio* aio, ring_store_config** cfg)
+{
+    nng_http_req* req = (nng_http_req*) nng_aio_get_input(aio, 0);
+    nng_http_handler* h = (nng_http_handler*) nng_aio_get_input(aio, 1);
+
+    *cfg = (ring_store_config*) nng_http_handler_get_data(h);
+
+    return nng_http_req_get_uri(req);
+}
+
+/**
+ * @brief [from, to] of a query, 'last' (ms) counts back from the newest sample.
+ *        Caller holds the read lock.
+ *
+ * @param r
+ * @param uri
+ * @param from
+ * @param to
+ */
+static void query_window(const sample_ring* r, const char* uri, int64_t* from, int64_t* to)
+{
+    int64_t last = query_int(uri, "last", 0);
+
+    *from = query_int(uri, "from", INT64_MIN);
+    *to = query_int(uri, "to", INT64_MAX);
+
+    if (last > 0 && r->count > 0)
+        *from = r->ts[sample_ring_slot(r, r->count - 1)] - last * 1000000LL;
+}
+
+/**
+ * @brief GET <prefix>/meters
+ *
+ * @param aio
+ */
+static void http_meters(nng_aio* aio)
+{
+    ring_store_config* cfg;
+    text_buf tb = { 0 };
+    int n;
+
+    http_request(aio, &cfg);
+
+    pthread_mutex_lock(&cfg->lock);
+    n = cfg->nrings;
+    pthread_mutex_unlock(&cfg->lock);
+
+    tb_printf(&tb, "[");
+    for (int i = 0; i < n; i++)
+    {
+        sample_ring* r = cfg->all[i];
+
+        pthread_rwlock_rdlock(&r->lock);
+
+        tb_printf(&tb, "%s{\"meter\":%u,\"count\":%u", i ? "," : "", r->meter_id, r->count);
+        if (r->count > 0)
+            tb_printf(&tb, ",\"first\":%lld,\"last\":%lld",
+                (long long) r->ts[sample_ring_slot(r, 0)], (long long) r->ts[sample_ring_slot(r, r->count - 1)]);
+
+        tb_printf(&tb, ",\"fields\":[");
+        for (int f = 0; f < r->nfields; f++)
+            tb_printf(&tb, "%s\"%s\"", f ? "," : "", r->names[f]);
+        tb_printf(&tb, "]}");
+
+        pthread_rwlock_unlock(&r->lock);
+    }
+    tb_printf(&tb, "]");
+
+    http_reply(aio, 200, &tb, NULL);
+    free(tb.p);
+}
+
+/**
+ * @brief GET <prefix>/range?meter=..[&from][&to][&last][&fields=a,b][&limit]
+ *        the newest 'limit' samples of the window, one array per column
+ *
+ * @param aio
+ */
+static void http_range(nng_aio* aio)
+{
+    ring_store_config* cfg;
+    const char* uri = http_request(aio, &cfg);
+    text_buf tb = { 0 };
+    char list[512];
+    int cols[METER_SAMPLE_MAX];
+    int ncols = 0;
+
+    sample_ring* r = ring_store_get(cfg, (uint32_t) query_int(uri, "meter", -1));
+    if (r == NULL)
+    {
+        http_reply(aio, 404, NULL, "unknown meter");
+        return;
+    }
+
+    int64_t limit = query_int(uri, "limit", RING_QUERY_LIMIT);
+    if (limit <= 0 || limit > RING_QUERY_LIMIT)
+        limit = RING_QUERY_LIMIT;
+
+    // names are fixed for the life of the ring, no lock needed
+    if (query_param(uri, "fields", list, sizeof(list)))
+    {
+        char* save;
+
+        for (char* name = strtok_r(list, ",", &save); name != NULL && ncols < METER_SAMPLE_MAX; name = strtok_r(NULL, ",", &save))
+        {
+            if ((cols[ncols++] = sample_ring_field(r, name)) < 0)
+            {
+                http_reply(aio, 400, NULL, "unknown field");
+                return;
+            }
+        }
+    }
+    else
+    {
+        for (ncols = 0; ncols < r->nfields; ncols++)
+            cols[ncols] = ncols;
+    }
+
+    pthread_rwlock_rdlock(&r->lock);
+
+    int64_t from, to;
+    uint32_t first, n;
+
+    query_window(r, uri, &from, &to);
+    n = sample_ring_range(r, from, to, &first);
+    if (n > (uint32_t) limit)
+    {
+        first += n - (uint32_t) limit;
+        n = (uint32_t) limit;
+    }
+
+    tb_printf(&tb, "{\"meter\":%u,\"count\":%u,\"ts\":[", r->meter_id, n);
+    for (uint32_t i = 0; i < n; i++)
+        tb_printf(&tb, "%s%lld", i ? "," : "", (long long) r->ts[sample_ring_slot(r, first + i)]);
+    tb_printf(&tb, "]");
+
+    // column by column, each one a contiguous walk of its array
+    for (int c = 0; c < ncols; c++)
+    {
+        const double* col = r->cols + (size_t) cols[c] * r->cap;
+
+        tb_printf(&tb, ",\"%s\":[", r->names[cols[c]]);
+        for (uint32_t i = 0; i < n; i++)
+            tb_number(&tb, i ? "," : "", col[sample_ring_slot(r, first + i)]);
+        tb_printf(&tb, "]");
+    }
+    tb_printf(&tb, "}");
+
+    pthread_rwlock_unlock(&r->lock);
+
+    http_reply(aio, 200, &tb, NULL);
+    free(tb.p);
+}
+
+/**
+ * @brief GET <prefix>/downsample?meter=..&field=..&step=ms[&agg][&from][&to][&last]
+ *
+ * @param aio
+ */
+static void http_downsample(nng_aio* aio)
+{
+    ring_store_config* cfg;
+    const char* uri = http_request(aio, &cfg);
+    text_buf tb = { 0 };
+    char name[64], agg_name[16];
+
+    sample_ring* r = ring_store_get(cfg, (uint32_t) query_int(uri, "meter", -1));
+    if (r == NULL)
+    {
+        http_reply(aio, 404, NULL, "unknown meter");
+        return;
+    }
+
+    int has_agg = query_param(uri, "agg", agg_name, sizeof(agg_name));
+    int field = query_param(uri, "field", name, sizeof(name)) ? sample_ring_field(r, name) : -1;
+    int agg = ring_agg_from_string(has_agg ? agg_name : NULL);
+    int64_t step = query_int(uri, "step", 0) * 1000000LL;
+
+    if (field < 0 || agg < 0 || step <= 0)
+    {
+        http_reply(aio, 400, NULL, "field, step (ms) and agg=avg|min|max|last|count expected");
+        return;
+    }
+
+    int64_t* bts = (int64_t*) malloc(RING_MAX_BUCKETS * sizeof(int64_t));
+    double* out = (double*) malloc(RING_MAX_BUCKETS * sizeof(double));
+    if (bts == NULL || out == NULL)
+    {
+        free(bts);
+        free(out);
+        http_reply(aio, 500, NULL, "out of memory");
+        return;
+    }
+
+    pthread_rwlock_rdlock(&r->lock);
+
+    int64_t from, to;
+    query_window(r, uri, &from, &to);
+    uint32_t nb = sample_ring_downsample(r, field, from, to, step, agg, bts, out, RING_MAX_BUCKETS);
+
+    pthread_rwlock_unlock(&r->lock);
+
+    tb_printf(&tb, "{\"meter\":%u,\"field\":\"%s\",\"step\":%lld,\"ts\":[",
+        r->meter_id, r->names[field], (long long) (step / 1000000LL));
+    for (uint32_t i = 0; i < nb; i++)
+        tb_printf(&tb, "%s%lld", i ? "," : "", (long long) bts[i]);
+    tb_printf(&tb, "],\"%s\":[", has_agg ? agg_name : "avg");
+    for (uint32_t i = 0; i < nb; i++)
+        tb_number(&tb, i ? "," : "", out[i]);
+    tb_printf(&tb, "]}");
+
+    http_reply(aio, 200, &tb, NULL);
+
+    free(tb.p);
+    free(bts);
+    free(out);
+}
+
+/**
+ * @brief register one GET handler
+ *
+ * @param cfg
+ * @param server
+ * @param path, appended to the prefix
+ * @param cb
+ * @return int
+ */
+static int ring_store_handler(ring_store_config* cfg, nng_http_server* server, const char* path, void (*cb)(nng_aio*))
+{
+    nng_http_handler* h;
+    char uri[256];
+    int rv;
+
+    snprintf(uri, sizeof(uri), "%s%s", cfg->prefix, path);
+
+    if ((rv = nng_http_handler_alloc(&h, uri, cb)) != 0)
+        return rv;
+
+    if (((rv = nng_http_handler_set_method(h, "GET")) != 0) ||
+        ((rv = nng_http_handler_set_data(h, cfg, NULL)) != 0) ||
+        ((rv = nng_http_server_add_handler(server, h)) != 0))
+    {
+        nng_http_handler_free(h);
+        return rv;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Init
+ *
+ * @param cfg
+ * @param b
+ * @param capacity, samples kept per meter
+ * @param url, address of the HTTP server
+ * @param prefix, of the query paths
+ * @return int
+ */
+int ring_store_init(ring_store_config* cfg, Bus* b, uint32_t capacity, const char* url, const char* prefix)
+{
+    memset(cfg, 0, sizeof(ring_store_config));
+
+    cfg->b = b;
+    create_bus_reader(&cfg->br, cfg->b);
+
+    // meter samples only, the source messages are not copied out
+    bus_filter f = { .types = BUS_TYPE_DATALOG | BUS_TYPE_SAMPLE | BUS_TYPE_FIXED };
+    bus_reader_set_filter(cfg->br, &f);
+
+    cfg->capacity = capacity > 0 ? capacity : 360;
+    cfg->url = strdup(url != NULL ? url : "http://0.0.0.0:8088");
+    cfg->prefix = strdup(prefix != NULL ? prefix : "/api");
+
+    pthread_mutex_init(&cfg->lock, NULL);
+
+    cfg->rings = hashtable_create(RING_MAX_METERS, false);
+    if (cfg->rings == NULL)
+        return ESYSERR;
+
+    return ENOERR;
+}
+
+/**
+ * @brief Free task's data
+ *
+ * @param cfg
+ * @return int
+ */
+int ring_store_term(ring_store_config* cfg)
+{
+    if (cfg->server != NULL)
+    {
+        nng_http_server_stop((nng_http_server*) cfg->server);
+        nng_http_server_release((nng_http_server*) cfg->server);
+        cfg->server = NULL;
+    }
+
+    for (int i = 0; i < cfg->nrings; i++)
+    {
+        sample_ring_free(cfg->all[i]);
+        free(cfg->all[i]);
+    }
+    cfg->nrings = 0;
+
+    if (cfg->rings != NULL)
+        hashtable_release(cfg->rings);
+
+    if (cfg->url != NULL)
+        free(cfg->url);
+
+    if (cfg->prefix != NULL)
+        free(cfg->prefix);
+
+    pthread_mutex_destroy(&cfg->lock);
+
+    return 0;
+}
+
+/**
+ * @brief start the HTTP server and the bus reader
+ *
+ * @param cfg
+ * @return int
+ */
+int ring_store_run(ring_store_config* cfg)
+{
+    nng_http_server* server;
+    nng_url* url;
+    int rv;
+
+    if ((rv = nng_url_parse(&url, cfg->url)) != 0)
+    {
+        log_message(LOG_ERR, "ring-store: bad url %s: %s\n", cfg->url, nng_strerror(rv));
+        return ESVRERR;
+    }
+
+    rv = nng_http_server_hold(&server, url);
+    nng_url_free(url);
+
+    if (rv != 0)
+    {
+        log_message(LOG_ERR, "ring-store: http server %s: %s\n", cfg->url, nng_strerror(rv));
+        return ESVRERR;
+    }
+
+    cfg->server = server;
+
+    if (((rv = ring_store_handler(cfg, server, "/meters", http_meters)) != 0) ||
+        ((rv = ring_store_handler(cfg, server, "/range", http_range)) != 0) ||
+        ((rv = ring_store_handler(cfg, server, "/downsample", http_downsample)) != 0) ||
+        ((rv = nng_http_server_start(server)) != 0))
+    {
+        log_message(LOG_ERR, "ring-store: http server %s: %s\n", cfg->url, nng_strerror(rv));
+        nng_http_server_release(server);
+        cfg->server = NULL;
+        return ESVRERR;
+    }
+
+    log_message(LOG_INFO, "ring-store: serving %s%s\n", cfg->url, cfg->prefix);
+
+    return
+        pthread_create(&cfg->task_thread, NULL, ring_store_task, cfg);
+}
+
+/**
+ * @brief Wait until end
+ *
+ * @param cfg
+ * @return int
+ */
+int ring_store_wait(ring_store_config* cfg)
+{
+    // not started
+    if (cfg->server == NULL)
+        return 0;
+
+    return
+        pthread_join(cfg->task_thread, NULL);
+}
@@ -0,0 +1,162 @@
+/**
+ * @file rt_sched.c
+ * @author longdh
+ * @brief scheduling policy, priority and CPU affinity of the task threads
+ * @version 0.1
+ * @date 2024-01-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * A serial transaction must not wait behind the sinks (TLS, JSON) nor take a
+ * page fault: the reader gets a real-time policy, its own CPU, a locked and
+ * prefaulted stack. Needs CAP_SYS_NICE / CAP_IPC_LOCK, without them the
+ * thread keeps running with the default scheduling.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "utils/rt_sched.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+/**
+ * @brief SCHED_OTHER, no affinity, no prefault
+ *
+ * @param ts
+ */
+void task_sched_default(task_sched* ts)
+{
+    memset(ts, 0, sizeof(task_sched));
+    ts->policy = SCHED_OTHER;
+}
+
+/**
+ * @brief "other", "fifo", "rr"
+ *
+ * @param s
+ * @return int, SCHED_OTHER when unknown
+ */
+int task_sched_policy_from_string(const char* s)
+{
+    if (s == NULL || 0 == strcasecmp(s, "other"))
+        return SCHED_OTHER;
+    if (0 == strcasecmp(s, "fifo"))
+        return SCHED_FIFO;
+    if (0 == strcasecmp(s, "rr"))
+        return SCHED_RR;
+
+    log_message(LOG_WARNING, "Unknown scheduling policy '%s'\n", s);
+
+    return SCHED_OTHER;
+}
+
+/**
+ * @brief Set policy, priority and affinity of a thread
+ *
+ * @param thread
+ * @param ts
+ * @param name, for logging
+ * @return int, ENOERR or ESYSERR (the settings that failed are logged)
+ */
+int task_sched_apply(pthread_t thread, const task_sched* ts, const char* name)
+{
+    int rc = ENOERR;
+    int err;
+
+    if (ts->cpus != 0)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        for (int i = 0; i < RT_MAX_CPUS; i++)
+        {
+            if (ts->cpus & ((uint64_t) 1 << i))
+                CPU_SET(i, &set);
+        }
+
+        if ((err = pthread_setaffinity_np(thread, sizeof(set), &set)) != 0)
+        {
+            log_message(LOG_WARNING, "%s: cpu affinity: %s\n", name, strerror(err));
+            rc = ESYSERR;
+        }
+    }
+
+    if (ts->policy != SCHED_OTHER)
+    {
+        struct sched_param param;
+        int lo = sched_get_priority_min(ts->policy);
+        int hi = sched_get_priority_max(ts->policy);
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = ts->priority < lo ? lo : (ts->priority > hi ? hi : ts->priority);
+
+        if ((err = pthread_setschedparam(thread, ts->policy, &param)) != 0)
+        {
+            log_message(LOG_WARNING, "%s: scheduling policy: %s\n", name, strerror(err));
+            rc = ESYSERR;
+        }
+        else
+            log_message(LOG_INFO, "%s: %s priority %d\n", name, 
+                ts->policy == SCHED_FIFO ? "fifo" : "rr", param.sched_priority);
+    }
+
+    return rc;
+}
+
+/**
+ * @brief task_sched_apply() on the calling thread, then prefault its stack
+ *
+ * @param ts
+ * @param name
+ * @return int
+ */
+int task_sched_apply_self(const task_sched* ts, const char* name)
+{
+    int rc = task_sched_apply(pthread_self(), ts, name);
+
+    if (ts->prefault_stack > 0)
+        task_sched_prefault_stack(ts->prefault_stack);
+
+    return rc;
+}
+
+/**
+ * @brief touch the next bytes of the stack, so the pages are mapped
+ *        (and locked with MCL_FUTURE) before the time critical work
+ *
+ * @param bytes
+ */
+__attribute__((noinline)) void task_sched_prefault_stack(size_t bytes)
+{
+    if (bytes == 0)
+        return;
+
+    char buf[bytes];
+
+    // the writes must stay, the compiler sees the buffer escape
+    memset(buf, 0, bytes);
+    __asm__ __volatile__("" : : "r"(buf) : "memory");
+}
+
+/**
+ * @brief lock the current and future pages of the process in RAM
+ *
+ * @return int
+ */
+int task_sched_lock_memory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        log_message(LOG_WARNING, "mlockall: %s\n", strerror(errno));
+        return ESYSERR;
+    }
+
+    log_message(LOG_INFO, "memory locked\n");
+
+    return ENOERR;
+}
@@ -0,0 +1,325 @@
+/**
+ * @file rules.c
+ * @author longdh
+ * @brief threshold / rate of change rules with hysteresis and debounce,
+ *        evaluated on every sample crossing the bus
+ * @version 0.1
+ * @date 2024-01-31
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * A rule is compiled once from its text ("voltage > 253", "rate(power) > 500",
+ * "bms_event_1 != 0") into a rule_insn. The field names are resolved to value
+ * slots per sample layout (meter_data_log, register map, DataLog) on the first
+ * sample of that layout, after that a sample costs one array read and one
+ * compare per rule.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "meter/rules.h"
+#include "meter/regmap.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+/**
+ * @brief index of a field, added when new
+ *
+ * @param p
+ * @param name
+ * @param len
+ * @return int, -1 => too many fields
+ */
+static int rules_field(rules_program* p, const char* name, size_t len)
+{
+    for (int f = 0; f < p->nfields; f++)
+        if (strlen(p->field[f]) == len && 0 == strncmp(p->field[f], name, len))
+            return f;
+
+    if (p->nfields >= RULES_MAX_FIELDS || len >= RULES_NAME_LEN)
+        return -1;
+
+    memcpy(p->field[p->nfields], name, len);
+    p->field[p->nfields][len] = '\0';
+
+    return p->nfields++;
+}
+
+/**
+ * @brief compile a rule into the program
+ *
+ * @param p, zeroed before the first rule
+ * @param name, reported in the events
+ * @param expr, "field op value" or "rate(field) op value", op: > >= < <= == !=
+ * @param clear, hysteresis level, NULL => clear as soon as the rule is false
+ * @param debounce, consecutive samples to raise / clear, < 1 => 1
+ * @return int, EGENERR => syntax error / too many rules
+ */
+int rules_compile(rules_program* p, const char* name, const char* expr, const double* clear, int debounce)
+{
+    static const struct { const char* text; rule_op op; } ops[] = {
+        { ">=", RULE_GE }, { "<=", RULE_LE }, { "==", RULE_EQ }, { "!=", RULE_NE },
+        { ">",  RULE_GT }, { "<",  RULE_LT },
+    };
+    rule_insn* insn = &p->insn[p->ninsn];
+    const char* s = expr;
+    const char* id;
+    size_t len;
+    char* end;
+    int f;
+    size_t i;
+
+    if (p->ninsn >= RULES_MAX)
+        goto bad;
+
+    memset(insn, 0, sizeof(rule_insn));
+
+    while (isspace((unsigned char) *s)) s++;
+
+    if (0 == strncmp(s, "rate(", 5))
+    {
+        insn->kind = RULE_RATE;
+        s += 5;
+        while (isspace((unsigned char) *s)) s++;
+    }
+
+    for (id = s; isalnum((unsigned char) *s) || *s == '_'; s++);
+    len = (size_t) (s - id);
+    if (len == 0)
+        goto bad;
+
+    while (isspace((unsigned char) *s)) s++;
+    if (insn->kind == RULE_RATE)
+    {
+        if (*s++ != ')')
+            goto bad;
+        while (isspace((unsigned char) *s)) s++;
+    }
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+        if (0 == strncmp(s, ops[i].text, strlen(ops[i].text)))
+            break;
+    if (i == sizeof(ops) / sizeof(ops[0]))
+        goto bad;
+
+    insn->op = ops[i].op;
+    s += strlen(ops[i].text);
+
+    insn->set = strtod(s, &end);
+    if (end == s)
+        goto bad;
+
+    for (s = end; isspace((unsigned char) *s); s++);
+    if (*s != '\0')
+        goto bad;
+
+    if ((f = rules_field(p, id, len)) < 0)
+        goto bad;
+
+    insn->field = (uint8_t) f;
+    if (insn->kind == RULE_RATE)
+        p->rate_field[f] = 1;
+
+    insn->debounce = (uint8_t) (debounce < 1 ? 1 : debounce > 255 ? 255 : debounce);
+
+    // the clear level must be on the safe side of the set level
+    insn->clear = insn->set;
+    if (clear != NULL)
+    {
+        if (((insn->op == RULE_GT || insn->op == RULE_GE) && *clear <= insn->set) ||
+            ((insn->op == RULE_LT || insn->op == RULE_LE) && *clear >= insn->set))
+            insn->clear = *clear;
+        else
+            log_message(LOG_WARNING, "rules: %s: clear level %g ignored\n", name, *clear);
+    }
+
+    snprintf(p->name[p->ninsn], RULES_NAME_LEN, "%s", name);
+    p->ninsn++;
+
+    return ENOERR;
+
+bad:
+    log_message(LOG_ERR, "rules: %s: cannot compile '%s'\n", name, expr);
+    return EGENERR;
+}
+
+/**
+ * @brief layout key of a bus sample, for rules_bind()
+ *
+ * @param data
+ * @param datalen
+ * @return int, RULES_LAYOUT_*
+ */
+int rules_layout(const void* data, int datalen)
+{
+    if (datalen == sizeof(meter_sample))
+        return RULES_LAYOUT_MAP + ((const meter_sample*) data)->map_id;
+
+    if (datalen == sizeof(meter_fixed_sample))
+        return RULES_LAYOUT_MAP + ((const meter_fixed_sample*) data)->map_id;
+
+    return RULES_LAYOUT_DATALOG;
+}
+
+/**
+ * @brief value slots of the rule fields in a layout, resolved on first use
+ *
+ * @param p
+ * @param layout, RULES_LAYOUT_*
+ * @param names, value names of the layout
+ * @param n
+ * @return const int8_t*, RULES_MAX_FIELDS slots, NULL => too many layouts
+ */
+const int8_t* rules_bind(rules_program* p, int layout, const char* const* names, int n)
+{
+    int l;
+
+    for (l = 0; l < p->nlayouts; l++)
+        if (p->layout[l].key == layout)
+            return p->layout[l].slot;
+
+    if (p->nlayouts >= RULES_MAX_LAYOUTS)
+        return NULL;
+
+    p->layout[l].key = layout;
+
+    for (int f = 0; f < p->nfields; f++)
+    {
+        p->layout[l].slot[f] = -1;
+
+        for (int i = 0; i < n && i < 128; i++)
+        {
+            if (0 == strcmp(names[i], p->field[f]))
+            {
+                p->layout[l].slot[f] = (int8_t) i;
+                break;
+            }
+        }
+    }
+
+    p->nlayouts++;
+
+    return p->layout[l].slot;
+}
+
+/**
+ * @brief values of the rule fields
+ *
+ * @param p
+ * @param slot, rules_bind()
+ * @param values, of the layout
+ * @param fv, RULES_MAX_FIELDS, NAN => not in the sample
+ */
+void rules_gather(const rules_program* p, const int8_t* slot, const double* values, double* fv)
+{
+    for (int f = 0; f < p->nfields; f++)
+        fv[f] = slot[f] >= 0 ? values[slot[f]] : NAN;
+}
+
+static inline int rule_match(int op, double x, double level)
+{
+    switch (op)
+    {
+    case RULE_GT: return x > level;
+    case RULE_GE: return x >= level;
+    case RULE_LT: return x < level;
+    case RULE_LE: return x <= level;
+    case RULE_EQ: return x == level;
+    default:      return x != level;
+    }
+}
+
+/**
+ * @brief run the rules on a sample of a meter
+ *
+ * @param p
+ * @param s, state of the meter
+ * @param ts, sample time (ns)
+ * @param fv, rules_gather()
+ * @param ev, raised / cleared rules
+ * @param max
+ * @return int, number of events
+ */
+int rules_eval(const rules_program* p, rules_series* s, uint64_t ts, const double* fv, rule_event* ev, int max)
+{
+    int n = 0;
+
+    for (int i = 0; i < p->ninsn; i++)
+    {
+        const rule_insn* insn = &p->insn[i];
+        double x = fv[insn->field];
+
+        if (isnan(x))
+            continue;
+
+        if (insn->kind == RULE_RATE)
+        {
+            double prev = s->prev[insn->field];
+
+            if (s->ts_prev == 0 || ts <= s->ts_prev || isnan(prev))
+                continue;
+
+            x = (x - prev) / ((double) (ts - s->ts_prev) / 1e9);
+        }
+
+        // inactive: toward the set level, active: past the clear level
+        int toward = s->active[i] ? !rule_match(insn->op, x, insn->clear)
+                                  : rule_match(insn->op, x, insn->set);
+
+        if (!toward)
+        {
+            s->count[i] = 0;
+            continue;
+        }
+
+        if (++s->count[i] < insn->debounce)
+            continue;
+
+        // no room, changes on the next sample
+        if (n >= max)
+        {
+            s->count[i]--;
+            continue;
+        }
+
+        s->count[i] = 0;
+        s->active[i] = !s->active[i];
+
+        ev[n].rule = i;
+        ev[n].raised = s->active[i];
+        ev[n].value = x;
+        n++;
+    }
+
+    for (int f = 0; f < p->nfields; f++)
+        if (p->rate_field[f])
+            s->prev[f] = fv[f];
+    s->ts_prev = ts;
+
+    return n;
+}
+
+/**
+ * @brief first rule matching its set level, no state: the threshold rules
+ *        without debounce nor hysteresis
+ *
+ * @param p
+ * @param fv, rules_gather()
+ * @return int, rule index, -1 => none
+ */
+int rules_match_any(const rules_program* p, const double* fv)
+{
+    for (int i = 0; i < p->ninsn; i++)
+    {
+        const rule_insn* insn = &p->insn[i];
+        double x = fv[insn->field];
+
+        if (insn->kind == RULE_THRESHOLD && !isnan(x) && rule_match(insn->op, x, insn->set))
+            return i;
+    }
+
+    return -1;
+}
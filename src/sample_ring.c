@@ -0,0 +1,287 @@
+/**
+ * @file sample_ring.c
+ * @author longdh
+ * @brief columnar ring of the recent samples of a meter
+ * @version 0.1
+ * @date 2024-01-24
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Index i of the queries is logical: 0 is the oldest sample kept,
+ * sample_ring_slot() maps it to the column slot.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "meter/sample_ring.h"
+#include "utils/error.h"
+
+/**
+ * @brief Init
+ *
+ * @param r
+ * @param meter_id
+ * @param cap, samples kept
+ * @param nfields
+ * @param names, field names, not copied
+ * @return int
+ */
+int sample_ring_init(sample_ring* r, uint32_t meter_id, uint32_t cap, int nfields, const char* const* names)
+{
+    memset(r, 0, sizeof(sample_ring));
+
+    if (cap == 0 || nfields <= 0 || nfields > METER_SAMPLE_MAX)
+        return EGENERR;
+
+    r->meter_id = meter_id;
+    r->cap = cap;
+    r->nfields = nfields;
+    memcpy(r->names, names, nfields * sizeof(const char*));
+
+    r->ts = (int64_t*) malloc(cap * sizeof(int64_t));
+    r->cols = (double*) malloc((size_t) cap * nfields * sizeof(double));
+    if (r->ts == NULL || r->cols == NULL)
+    {
+        free(r->ts);
+        free(r->cols);
+        return ESYSERR;
+    }
+
+    pthread_rwlock_init(&r->lock, NULL);
+
+    return ENOERR;
+}
+
+void sample_ring_free(sample_ring* r)
+{
+    free(r->ts);
+    free(r->cols);
+    pthread_rwlock_destroy(&r->lock);
+
+    r->ts = NULL;
+    r->cols = NULL;
+}
+
+/**
+ * @brief same columns as a sample?
+ *
+ * @param r
+ * @param nfields
+ * @param names
+ * @return int
+ */
+int sample_ring_same_fields(const sample_ring* r, int nfields, const char* const* names)
+{
+    if (r->nfields != nfields)
+        return 0;
+
+    for (int f = 0; f < nfields; f++)
+    {
+        if (r->names[f] != names[f] && strcmp(r->names[f], names[f]) != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief append a sample, the oldest one is overwritten once full
+ *
+ * @param r
+ * @param ts
+ * @param values, r->nfields values
+ */
+void sample_ring_push(sample_ring* r, int64_t ts, const double* values)
+{
+    pthread_rwlock_wrlock(&r->lock);
+
+    // out of order (clock step back): restart, the searches need order
+    if (r->count > 0 && ts < r->ts[(r->head + r->cap - 1) % r->cap])
+        r->count = 0;
+
+    uint32_t slot = r->head;
+
+    r->ts[slot] = ts;
+    for (int f = 0; f < r->nfields; f++)
+        r->cols[(size_t) f * r->cap + slot] = values[f];
+
+    r->head = (slot + 1) % r->cap;
+    if (r->count < r->cap)
+        r->count++;
+
+    pthread_rwlock_unlock(&r->lock);
+}
+
+/**
+ * @brief column of a field
+ *
+ * @param r
+ * @param name
+ * @return int, -1 => unknown
+ */
+int sample_ring_field(const sample_ring* r, const char* name)
+{
+    for (int f = 0; f < r->nfields; f++)
+    {
+        if (0 == strcmp(r->names[f], name))
+            return f;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief slot of logical index i
+ *
+ * @param r
+ * @param i
+ * @return uint32_t
+ */
+uint32_t sample_ring_slot(const sample_ring* r, uint32_t i)
+{
+    return (r->head + r->cap - r->count + i) % r->cap;
+}
+
+/**
+ * @brief first logical index with a timestamp >= ts
+ *
+ * @param r
+ * @param ts
+ * @return uint32_t, r->count => none
+ */
+uint32_t sample_ring_lower_bound(const sample_ring* r, int64_t ts)
+{
+    uint32_t lo = 0, hi = r->count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (r->ts[sample_ring_slot(r, mid)] < ts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * @brief samples in [from, to], caller holds the read lock
+ *
+ * @param r
+ * @param from
+ * @param to
+ * @param first, logical index of the first one
+ * @return uint32_t, number of samples
+ */
+uint32_t sample_ring_range(const sample_ring* r, int64_t from, int64_t to, uint32_t* first)
+{
+    uint32_t a = sample_ring_lower_bound(r, from);
+    uint32_t b = (to == INT64_MAX) ? r->count : sample_ring_lower_bound(r, to + 1);
+
+    *first = a;
+
+    return b > a ? b - a : 0;
+}
+
+/**
+ * @brief aggregate one field per step, buckets aligned to multiples of step,
+ *        empty buckets are left out. Caller holds the read lock.
+ *
+ * @param r
+ * @param field
+ * @param from
+ * @param to
+ * @param step, ns
+ * @param agg, ring_agg
+ * @param bucket_ts, start of the buckets
+ * @param out, aggregates
+ * @param max, size of bucket_ts / out
+ * @return uint32_t, buckets written
+ */
+uint32_t sample_ring_downsample(const sample_ring* r, int field, int64_t from, int64_t to, int64_t step, int agg,
+                                int64_t* bucket_ts, double* out, uint32_t max)
+{
+    const double* col = r->cols + (size_t) field * r->cap;
+    uint32_t first, n = sample_ring_range(r, from, to, &first);
+    uint32_t nb = 0;
+    int64_t bucket = 0;
+    double acc = 0;
+    uint32_t cnt = 0;
+
+    if (step <= 0 || max == 0)
+        return 0;
+
+    for (uint32_t i = 0; i <= n; i++)
+    {
+        uint32_t slot = 0;
+        int64_t b = 0;
+
+        if (i < n)
+        {
+            slot = sample_ring_slot(r, first + i);
+            b = r->ts[slot] - (r->ts[slot] % step + step) % step;
+        }
+
+        // close the bucket
+        if (cnt > 0 && (i == n || b != bucket))
+        {
+            bucket_ts[nb] = bucket;
+            out[nb] = (agg == RING_AGG_AVG) ? acc / cnt :
+                      (agg == RING_AGG_COUNT) ? (double) cnt : acc;
+            cnt = 0;
+
+            if (++nb == max)
+                break;
+        }
+
+        if (i == n)
+            break;
+
+        double v = col[slot];
+        if (isnan(v))
+            continue;
+
+        if (cnt == 0)
+        {
+            bucket = b;
+            acc = (agg == RING_AGG_AVG || agg == RING_AGG_COUNT) ? 0 : v;
+        }
+
+        switch (agg)
+        {
+        case RING_AGG_MIN:  if (v < acc) acc = v;  break;
+        case RING_AGG_MAX:  if (v > acc) acc = v;  break;
+        case RING_AGG_LAST: acc = v;               break;
+        default:            acc += v;              break;
+        }
+        cnt++;
+    }
+
+    return nb;
+}
+
+/**
+ * @brief agg=avg|min|max|last|count
+ *
+ * @param s
+ * @return int, -1 => unknown
+ */
+int ring_agg_from_string(const char* s)
+{
+    static const char* names[] = { "avg", "min", "max", "last", "count" };
+
+    if (s == NULL)
+        return RING_AGG_AVG;
+
+    for (int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++)
+    {
+        if (0 == strcasecmp(names[i], s))
+            return i;
+    }
+
+    return -1;
+}
@@ -10,44 +10,103 @@
  */
 #include "utils/sbus.h"
 #include "meter/datalog.h"
+#include "meter/meter_data.h"
+#include "utils/message.h"
 #include "utils/logger.h"
 #include "utils/error.h"
+#include "utils/slab.h"
+#include "utils/wal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 
 #include <nng/nng.h>
 #include <nng/protocol/bus0/bus.h>
+#include <nng/supplemental/util/platform.h>
 
 //FIXME
 extern char* strdup(const char*);
 
 typedef struct {
-    nng_socket bus_socket; 
+    nng_socket lane[BUS_PRIO_LANES];    // BUS_PRIO_*
+
+    // reader only
+    int             epfd;       // readable while any lane has messages
+    int             last_prio;  // lane of the last message read
+    bus_filter*     filter;     // NULL => everything
+    unsigned long   filtered;   // messages not wanted, dropped before the copy
+
+    // writer only
+    wal_t*          wal;        // NULL => no write-ahead log
 
 } BusPrivateData;
 
+/**
+ * @brief address of a lane, the bulk lane keeps the bus address
+ * 
+ * @param address 
+ * @param prio 
+ * @param buf 
+ * @param size 
+ * @return const char* 
+ */
+static const char* lane_address(const char* address, int prio, char* buf, size_t size)
+{
+    if (prio == BUS_PRIO_BULK)
+        return address;
+
+    snprintf(buf, size, "%s.%d", address, prio);
+    return buf;
+}
+
 int init_bus(Bus* b, const char* b_name)
 {
-    BusPrivateData* priv = (BusPrivateData*) malloc (sizeof (BusPrivateData));
+    BusPrivateData* priv = (BusPrivateData*) calloc (1, sizeof (BusPrivateData));
 
     b->bus_address = strdup(b_name);
 
-    if (nng_bus0_open(&priv->bus_socket) != 0) 
+    for (int prio = 0; prio < BUS_PRIO_LANES; prio++)
     {
-        log_message(LOG_ERR, "Error: nng_req0_open\n");
-        exit(EQUERR);
-    }
+        char addr[256];
 
-    if (nng_listen(priv->bus_socket, b->bus_address, NULL, 0) != 0) 
-    {
-        log_message(LOG_ERR, "Error: nng_listen\n");
-        nng_close(priv->bus_socket);
+        if (nng_bus0_open(&priv->lane[prio]) != 0) 
+        {
+            log_message(LOG_ERR, "Error: nng_req0_open\n");
+            exit(EQUERR);
+        }
 
-        exit(EQUERR);
+        if (nng_listen(priv->lane[prio], lane_address(b->bus_address, prio, addr, sizeof(addr)), NULL, 0) != 0) 
+        {
+            log_message(LOG_ERR, "Error: nng_listen\n");
+            nng_close(priv->lane[prio]);
+
+            exit(EQUERR);
+        }
     }
     b->data = (void*) priv;
 
     return ENOERR;
 }
 
+/**
+ * @brief log every message written to the bus, before the writers start
+ * 
+ * @param b 
+ * @param w 
+ * @return int 
+ */
+int bus_attach_wal(Bus* b, wal_t* w)
+{
+    ((BusPrivateData*) b->data)->wal = w;
+
+    return ENOERR;
+}
+
 int create_bus_writer(BusWriter** bw, Bus* b)
 {
     *bw = (BusWriter*) nng_alloc(sizeof(BusWriter));
@@ -61,22 +120,43 @@ int create_bus_writer(BusWriter** bw, Bus* b)
 int create_bus_reader(BusReader** br, Bus* b)
 {
     *br = (BusReader*) nng_alloc(sizeof(BusReader));
-    BusPrivateData* priv = (BusPrivateData*) malloc (sizeof (BusPrivateData));
+    BusPrivateData* priv = (BusPrivateData*) calloc (1, sizeof (BusPrivateData));
     (*br)->bus_address = nng_strdup(b->bus_address);
 
-    if (nng_bus0_open(&priv->bus_socket) != 0) 
+    // one fd for the reactors / poll, whatever lane has data
+    priv->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (priv->epfd < 0)
     {
-        log_message(LOG_ERR, "Error: nng_rep0_open\n");
+        log_message(LOG_ERR, "Error: epoll_create1\n");
 
         exit(EQUERR);
     }
 
-    if (nng_dial(priv->bus_socket, (*br)->bus_address, NULL, 0) != 0) 
+    for (int prio = 0; prio < BUS_PRIO_LANES; prio++)
     {
-        log_message(LOG_ERR, "Error: nng_dial\n");
-        nng_close(priv->bus_socket);
-        
-        exit(EQUERR);
+        char addr[256];
+        int fd;
+
+        if (nng_bus0_open(&priv->lane[prio]) != 0) 
+        {
+            log_message(LOG_ERR, "Error: nng_rep0_open\n");
+
+            exit(EQUERR);
+        }
+
+        if (nng_dial(priv->lane[prio], lane_address((*br)->bus_address, prio, addr, sizeof(addr)), NULL, 0) != 0) 
+        {
+            log_message(LOG_ERR, "Error: nng_dial\n");
+            nng_close(priv->lane[prio]);
+            
+            exit(EQUERR);
+        }
+
+        if (nng_socket_get_int(priv->lane[prio], NNG_OPT_RECVFD, &fd) == 0)
+        {
+            struct epoll_event ev = { .events = EPOLLIN, .data.u32 = prio };
+            epoll_ctl(priv->epfd, EPOLL_CTL_ADD, fd, &ev);
+        }
     }
 
     (*br)->data = (void*) priv;
@@ -91,11 +171,31 @@ int create_bus_reader(BusReader** br, Bus* b)
  * @param bw 
  * @param data 
  * @param datalen 
- * @return int, 0 => no error, 1-x: error code
+ * @return int, 0 => no error, 1-x: error code, see bus_write_prio()
  */
 int bus_write(BusWriter* bw, void* data, int datalen)
+{
+    return bus_write_prio(bw, data, datalen, BUS_PRIO_BULK);
+}
+
+/**
+ * @brief write data to a priority lane of the bus
+ * 
+ * @param bw 
+ * @param data 
+ * @param datalen 
+ * @param prio, BUS_PRIO_*
+ * @return int, 0 => no error, 1-x: error code, ESYSERR => sent to the bus
+ *         readers but not logged: the sinks reading the log miss it
+ */
+int bus_write_prio(BusWriter* bw, void* data, int datalen, int prio)
 {
     nng_msg *msg = NULL;
+    int rc = 0;
+
+    if (prio < 0 || prio >= BUS_PRIO_LANES)
+        prio = BUS_PRIO_BULK;
+
     if (nng_msg_alloc(&msg, datalen) != 0) 
     {
         log_message(LOG_ERR, "Error: nng_msg_alloc\n");
@@ -106,7 +206,14 @@ int bus_write(BusWriter* bw, void* data, int datalen)
 
     BusPrivateData* priv = (BusPrivateData*) bw->data;
 
-    if (nng_sendmsg(priv->bus_socket, msg, 0) != 0) 
+    // logged before the sinks see it, the ones reading the log replay it after a crash
+    if (priv->wal != NULL && wal_append(priv->wal, data, datalen, NULL) != ENOERR)
+    {
+        log_message(LOG_ERR, "Error: wal_append\n");
+        rc = ESYSERR;
+    }
+
+    if (nng_sendmsg(priv->lane[prio], msg, 0) != 0) 
     {
         log_message(LOG_ERR, "Error: nng_sendmsg\n");
 
@@ -117,6 +224,228 @@ int bus_write(BusWriter* bw, void* data, int datalen)
 
     //sendok: nng_msg_free(msg);
     
+    return rc;
+}
+
+/**
+ * @brief type of a bus message
+ * 
+ * @param data 
+ * @param datalen 
+ * @param meter_id, set for the meter samples, may be NULL
+ * @return int, BUS_TYPE_*, 0 => unknown
+ */
+int bus_type_of(const void* data, int datalen, uint32_t* meter_id)
+{
+    int type = 0;
+    uint32_t id = 0;
+
+    if (datalen == sizeof(meter_data_log))
+    {
+        type = BUS_TYPE_DATALOG;
+        id = ((const meter_data_log*) data)->meter_id;
+    }
+    else if (datalen == sizeof(meter_sample))
+    {
+        type = BUS_TYPE_SAMPLE;
+        id = ((const meter_sample*) data)->meter_id;
+    }
+    else if (datalen == sizeof(meter_fixed_sample))
+    {
+        type = BUS_TYPE_FIXED;
+        id = ((const meter_fixed_sample*) data)->meter_id;
+    }
+    else if (datalen == sizeof(struct Message))
+        type = BUS_TYPE_MESSAGE;
+
+    if (meter_id != NULL)
+        *meter_id = id;
+
+    return type;
+}
+
+/**
+ * @brief does a message pass the filter
+ * 
+ * @param f, NULL => everything
+ * @param data 
+ * @param datalen 
+ * @return int, 1 => wanted
+ */
+int bus_filter_match(const bus_filter* f, const void* data, int datalen)
+{
+    uint32_t meter_id;
+    int type;
+
+    if (f == NULL)
+        return 1;
+
+    type = bus_type_of(data, datalen, &meter_id);
+
+    if (f->types != 0 && (f->types & type) == 0)
+        return 0;
+
+    if (f->nmeters > 0)
+    {
+        int i;
+
+        if (type == BUS_TYPE_MESSAGE || type == 0)
+            return 0;
+
+        for (i = 0; i < f->nmeters && f->meters[i] != meter_id; i++);
+        if (i == f->nmeters)
+            return 0;
+    }
+
+    if (f->topic[0] != '\0')
+    {
+        const struct Message* msg = (const struct Message*) data;
+
+        if (type != BUS_TYPE_MESSAGE ||
+            strncmp(msg->source_topic, f->topic, strnlen(f->topic, sizeof(f->topic))) != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief filter from its config strings
+ * 
+ * @param f 
+ * @param types, "datalog,sample,fixed,message", NULL / "" => any
+ * @param meters, "1,2,5", NULL / "" => any
+ * @param topic, prefix, NULL / "" => any
+ * @return int, EGENERR => unknown type / too many meters
+ */
+int bus_filter_from_string(bus_filter* f, const char* types, const char* meters, const char* topic)
+{
+    static const struct { const char* name; unsigned type; } names[] = {
+        { "datalog", BUS_TYPE_DATALOG },
+        { "sample",  BUS_TYPE_SAMPLE  },
+        { "fixed",   BUS_TYPE_FIXED   },
+        { "message", BUS_TYPE_MESSAGE },
+    };
+    const char* p;
+
+    memset(f, 0, sizeof(bus_filter));
+
+    for (p = types; p != NULL && *p != '\0'; )
+    {
+        size_t n = strcspn(p, ", ");
+        size_t i;
+
+        for (i = 0; n > 0 && i < sizeof(names) / sizeof(names[0]); i++)
+            if (strlen(names[i].name) == n && 0 == strncasecmp(p, names[i].name, n))
+                break;
+
+        if (n > 0 && i == sizeof(names) / sizeof(names[0]))
+        {
+            log_message(LOG_ERR, "bus filter: unknown type '%.*s'\n", (int) n, p);
+            return EGENERR;
+        }
+
+        if (n > 0)
+            f->types |= names[i].type;
+
+        p += n;
+        p += strspn(p, ", ");
+    }
+
+    for (p = meters; p != NULL && *p != '\0'; )
+    {
+        char* end;
+        unsigned long id = strtoul(p, &end, 10);
+
+        if (end == p || f->nmeters >= BUS_FILTER_MAX_METERS)
+        {
+            log_message(LOG_ERR, "bus filter: bad meter list '%s'\n", meters);
+            return EGENERR;
+        }
+
+        f->meters[f->nmeters++] = (uint32_t) id;
+
+        p = end + strspn(end, ", ");
+    }
+
+    if (topic != NULL)
+        snprintf(f->topic, sizeof(f->topic), "%s", topic);
+
+    return ENOERR;
+}
+
+/**
+ * @brief only read what passes the filter, set before the reader is used
+ * 
+ * @param br 
+ * @param f, NULL => everything
+ * @return int 
+ */
+int bus_reader_set_filter(BusReader* br, const bus_filter* f)
+{
+    BusPrivateData* priv = (BusPrivateData*) br->data;
+
+    free(priv->filter);
+    priv->filter = NULL;
+
+    if (f == NULL)
+        return ENOERR;
+
+    priv->filter = (bus_filter*) malloc(sizeof(bus_filter));
+    if (priv->filter == NULL)
+        return ESYSERR;
+
+    memcpy(priv->filter, f, sizeof(bus_filter));
+
+    return ENOERR;
+}
+
+/**
+ * @brief messages dropped by the filter so far
+ * 
+ * @param br 
+ * @return unsigned long 
+ */
+unsigned long bus_reader_filtered(BusReader* br)
+{
+    return ((BusPrivateData*) br->data)->filtered;
+}
+
+/**
+ * @brief copy a received message out, unless the filter drops it
+ * 
+ * @param priv 
+ * @param msg, freed
+ * @param data 
+ * @param datalen 
+ * @return int 0=> copied, EQEMPTY => filtered, other => msg error
+ */
+static int bus_take(BusPrivateData* priv, nng_msg* msg, void** data, int* datalen)
+{
+    int len = nng_msg_len(msg);
+
+    if (!bus_filter_match(priv->filter, nng_msg_body(msg), len))
+    {
+        priv->filtered++;
+        nng_msg_free(msg);
+
+        return EQEMPTY;
+    }
+
+    *datalen = len;
+    *data = slab_alloc(len);
+
+    if (*data == NULL)
+    {
+        log_message(LOG_ERR, "Error: nng_recvmsg\n");
+        nng_msg_free(msg);
+
+        return EQUERR;
+    }
+
+    memcpy(*data, nng_msg_body(msg), len);
+    nng_msg_free(msg);
+
     return 0;
 }
 
@@ -130,41 +459,141 @@ int bus_write(BusWriter* bw, void* data, int datalen)
  */
 int bus_read(BusReader* br, void** data, int* datalen)
 {
-    nng_msg *msg = NULL;
+    return bus_read_timeout(br, data, datalen, -1);
+}
+
+/**
+ * @brief Read data from bus, wait at most timeout_ms. Release data with bus_free()
+ * 
+ * @param br 
+ * @param data 
+ * @param datalen 
+ * @param timeout_ms, < 0 => wait forever
+ * @return int 0=> no error, EQTIMEDOUT => nothing arrived, other => msg error
+ */
+int bus_read_timeout(BusReader* br, void** data, int* datalen, int timeout_ms)
+{
+    nng_time deadline = nng_clock() + (timeout_ms < 0 ? 0 : timeout_ms);
+    int rv;
 
     BusPrivateData* priv = (BusPrivateData*) br->data;
 
-    if (nng_recvmsg(priv->bus_socket, &msg, 0) != 0) 
+    while ((rv = bus_try_read(br, data, datalen)) == EQEMPTY)
     {
-        log_message(LOG_ERR, "Error: nng_recvmsg\n");
-        return EQUERR;
+        struct epoll_event ev[BUS_PRIO_LANES];
+        int wait = -1;
+
+        // what is left of the timeout after the filtered messages
+        if (timeout_ms >= 0)
+        {
+            nng_time now = nng_clock();
+            wait = now < deadline ? (int) (deadline - now) : 0;
+        }
+
+        rv = epoll_wait(priv->epfd, ev, BUS_PRIO_LANES, wait);
+        if (rv == 0)
+            return EQTIMEDOUT;
+
+        if (rv < 0 && errno != EINTR)
+        {
+            log_message(LOG_ERR, "Error: epoll_wait\n");
+            return EQUERR;
+        }
     }
 
-    int len = nng_msg_len(msg);
-    if (len >= 0) 
+    return rv;
+}
+
+/**
+ * @brief Release data returned by bus_read()
+ * 
+ * @param data 
+ */
+void bus_free(void* data)
+{
+    slab_free(data);
+}
+
+/**
+ * @brief fd readable while messages are pending (poll/epoll), drain with bus_try_read()
+ * 
+ * @param br 
+ * @return int, < 0 => error
+ */
+int bus_reader_fd(BusReader* br)
+{
+    BusPrivateData* priv = (BusPrivateData*) br->data;
+
+    return priv->epfd;
+}
+
+/**
+ * @brief lane of the message returned by the last read
+ * 
+ * @param br 
+ * @return int, BUS_PRIO_*
+ */
+int bus_reader_prio(BusReader* br)
+{
+    return ((BusPrivateData*) br->data)->last_prio;
+}
+
+/**
+ * @brief Read data from bus without blocking. Release data with bus_free()
+ * 
+ * @param br 
+ * @param data 
+ * @param datalen 
+ * @return int 0=> no error, EQEMPTY => nothing pending, other => msg error
+ */
+int bus_try_read(BusReader* br, void** data, int* datalen)
+{
+    nng_msg *msg = NULL;
+    int rv;
+
+    BusPrivateData* priv = (BusPrivateData*) br->data;
+
+    // urgent lane first, the bulk backlog does not delay it
+    for (int prio = BUS_PRIO_LANES - 1; prio >= 0; prio--)
     {
-        *datalen = nng_msg_len(msg);
-        *data = (void*) malloc(nng_msg_len(msg));
-        
-        if (*data == NULL)
+        while ((rv = nng_recvmsg(priv->lane[prio], &msg, NNG_FLAG_NONBLOCK)) == 0)
+        {
+            if ((rv = bus_take(priv, msg, data, datalen)) != EQEMPTY)
+            {
+                priv->last_prio = prio;
+                return rv;
+            }
+        }
+
+        if (rv != NNG_EAGAIN)
         {
             log_message(LOG_ERR, "Error: nng_recvmsg\n");
             return EQUERR;
         }
+    }
 
-        memcpy(*data, nng_msg_body(msg), nng_msg_len(msg));
-
-        nng_msg_free(msg);
+    return EQEMPTY;
+}
 
-        return 0;
-    } 
-    else 
-    {
-        log_message(LOG_ERR, "Received message with incorrect size\n");
+/**
+ * @brief Close a reader created by create_bus_reader(), the bus stops
+ *        copying messages to it
+ * 
+ * @param br 
+ */
+void close_bus_reader(BusReader* br)
+{
+    if (br == NULL)
+        return;
 
-        nng_msg_free(msg);
+    BusPrivateData* priv = (BusPrivateData*) br->data;
 
-        return EQUERR;
-    }
+    for (int prio = 0; prio < BUS_PRIO_LANES; prio++)
+        nng_close(priv->lane[prio]);
+    close(priv->epfd);
+    free(priv->filter);
+    free(priv);
 
-}
\ No newline at end of file
+    nng_strfree(br->bus_address);
+    nng_free(br, sizeof(BusReader));
+}
@@ -0,0 +1,368 @@
+/**
+ * @file site_agg.c
+ * @author longdh
+ * @brief site totals (import, export, net power, ...) of a group of meters,
+ *        one coherent record per aligned tick
+ * @version 0.1
+ * @date 2024-02-05
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * The meters are polled on their own schedule, so their timestamps never
+ * line up. The stage keeps the latest sample of every member and running
+ * sums of their fields: a sample only swaps the contribution of its meter
+ * (old values out, new in). On each tick (wall clock multiple of tick_ms)
+ * the members not heard from for stale_ms are taken out of the sums and the
+ * totals are written back on the bus as a meter_sample of the site, which the
+ * sinks ship like any other meter.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "site_agg.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+//FIXME
+extern char* strdup(const char*);
+
+#define NSEC_PER_MSEC       1000000ULL
+#define SITE_LAYOUT_DATALOG -2      // meter_data_log, the others are map ids
+
+static uint64_t realtime_ns()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief field slots of a member for the layout of its samples
+ *
+ * @param cfg
+ * @param m
+ * @param layout
+ * @param names
+ * @param n
+ */
+static void site_bind(site_agg_config* cfg, site_member* m, int layout, const char** names, int n)
+{
+    m->layout = layout;
+
+    for (int f = 0; f < cfg->nfields; f++)
+    {
+        m->slot[f] = -1;
+
+        for (int i = 0; i < n; i++)
+        {
+            if (0 == strcmp(names[i], cfg->field[f]))
+            {
+                m->slot[f] = (int8_t) i;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * @brief swap the contribution of the meter of a sample
+ *
+ * @param cfg
+ * @param data
+ * @param datalen
+ */
+static void site_feed(site_agg_config* cfg, const void* data, int datalen)
+{
+    const char* names[METER_SAMPLE_MAX];
+    double values[METER_SAMPLE_MAX];
+    uint32_t meter_id;
+    uint64_t ts;
+    char key[16];
+    site_member* m;
+    int n = bus_data_values(data, datalen, &meter_id, &ts, names, values);
+
+    if (n <= 0)
+        return;
+
+    sprintf(key, "%u", meter_id);
+    if ((m = (site_member*) hashtable_lookup(cfg->ids, key)) == NULL)
+        return;
+
+    if (ts == 0)
+        ts = realtime_ns();
+
+    if (ts < m->ts)
+    {
+        cfg->late++;
+        return;
+    }
+
+    int layout = (datalen == sizeof(meter_data_log)) ? SITE_LAYOUT_DATALOG :
+                 (datalen == sizeof(meter_sample)) ? ((const meter_sample*) data)->map_id :
+                 ((const meter_fixed_sample*) data)->map_id;
+
+    if (layout != m->layout)
+        site_bind(cfg, m, layout, names, n);
+
+    for (int f = 0; f < cfg->nfields; f++)
+    {
+        double v = m->slot[f] >= 0 ? values[m->slot[f]] : 0.0;
+
+        cfg->total[f] += m->fresh ? v - m->v[f] : v;
+        m->v[f] = v;
+    }
+
+    if (!m->fresh)
+    {
+        m->fresh = 1;
+        cfg->nfresh++;
+
+        if (m->ts != 0)
+            log_message(LOG_INFO, "site %s: meter %u back\n", cfg->name, m->meter_id);
+    }
+
+    m->ts = ts;
+    cfg->samples++;
+}
+
+/**
+ * @brief leave out the stale members and write the record of the tick
+ *
+ * @param cfg
+ * @param tick, ns
+ */
+static void site_tick(site_agg_config* cfg, uint64_t tick)
+{
+    uint64_t stale = (uint64_t) cfg->stale_ms * NSEC_PER_MSEC;
+    uint64_t limit = tick > stale ? tick - stale : 0;
+    meter_sample rec;
+
+    for (int i = 0; i < cfg->nmembers; i++)
+    {
+        site_member* m = &cfg->member[i];
+
+        if (!m->fresh || m->ts >= limit)
+            continue;
+
+        for (int f = 0; f < cfg->nfields; f++)
+            cfg->total[f] -= m->v[f];
+
+        m->fresh = 0;
+        cfg->nfresh--;
+
+        log_message(LOG_WARNING, "site %s: meter %u stale\n", cfg->name, m->meter_id);
+    }
+
+    // the sums of an empty site are reset, no rounding left over
+    if (cfg->nfresh == 0)
+    {
+        memset(cfg->total, 0, sizeof(cfg->total));
+        return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.meter_id = cfg->site_id;
+    rec.map_id = cfg->map.id;
+    rec.timestamp_ns = tick;
+    rec.count = (uint16_t) (cfg->nfields + 2);
+
+    memcpy(rec.values, cfg->total, cfg->nfields * sizeof(double));
+    rec.values[cfg->nfields] = cfg->nfresh;
+    rec.values[cfg->nfields + 1] = cfg->nmembers - cfg->nfresh;
+
+    bus_write(cfg->bw, (void*) &rec, sizeof(rec));
+    cfg->records++;
+}
+
+/**
+ * @brief bus reader thread, reads until the next tick
+ *
+ * @param arg
+ * @return void*
+ */
+static void* site_agg_task(void* arg)
+{
+    site_agg_config* cfg = (site_agg_config*) arg;
+    uint64_t period = (uint64_t) cfg->tick_ms * NSEC_PER_MSEC;
+    uint64_t tick = (realtime_ns() / period + 1) * period;
+
+    while (1)
+    {
+        uint64_t now = realtime_ns();
+        void* data;
+        int datalen;
+
+        if (now >= tick)
+        {
+            site_tick(cfg, tick);
+
+            // skip the ticks missed
+            tick = (now / period + 1) * period;
+            continue;
+        }
+
+        int timeout = (int) ((tick - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+
+        if (0 == bus_read_timeout(cfg->br, &data, &datalen, timeout))
+        {
+            site_feed(cfg, data, datalen);
+            bus_free(data);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Init site task
+ *
+ * @param cfg
+ * @param b
+ * @param name, of the site
+ * @param site_id, meter id of the records
+ * @param meters, "1,2,3"
+ * @param fields, "power,import_active,export_active"
+ * @param tick_ms
+ * @param stale_ms, <= 0 => 3 ticks
+ * @return int
+ */
+int site_agg_init(site_agg_config* cfg, Bus* b, const char* name, uint32_t site_id, const char* meters, const char* fields, int tick_ms, int stale_ms)
+{
+    const char* p;
+
+    memset(cfg, 0, sizeof(site_agg_config));
+
+    cfg->b = b;
+    cfg->name = strdup(name != NULL ? name : "site");
+    cfg->site_id = site_id;
+    cfg->tick_ms = tick_ms > 0 ? tick_ms : 10000;
+    cfg->stale_ms = stale_ms > 0 ? stale_ms : 3 * cfg->tick_ms;
+
+    cfg->ids = hashtable_create(SITE_MAX_MEMBERS, false);
+    if (cfg->ids == NULL)
+        return ESYSERR;
+
+    for (p = meters; p != NULL && *p != '\0'; )
+    {
+        char* end;
+        unsigned long id = strtoul(p, &end, 10);
+        char key[16];
+
+        if (end == p || cfg->nmembers >= SITE_MAX_MEMBERS || id == site_id)
+        {
+            log_message(LOG_ERR, "site %s: bad meter list '%s'\n", cfg->name, meters);
+            return EGENERR;
+        }
+
+        site_member* m = &cfg->member[cfg->nmembers++];
+        m->meter_id = (uint32_t) id;
+        m->layout = -1;
+
+        sprintf(key, "%u", m->meter_id);
+        hashtable_add(cfg->ids, key, m, 0);
+
+        p = end + strspn(end, ", ");
+    }
+
+    for (p = fields; p != NULL && *p != '\0'; )
+    {
+        size_t n = strcspn(p, ", ");
+
+        if (n == 0 || n >= REGMAP_NAME_LEN || cfg->nfields >= SITE_MAX_FIELDS)
+        {
+            log_message(LOG_ERR, "site %s: bad field list '%s'\n", cfg->name, fields);
+            return EGENERR;
+        }
+
+        memcpy(cfg->field[cfg->nfields], p, n);
+        cfg->field[cfg->nfields++][n] = '\0';
+
+        p += n;
+        p += strspn(p, ", ");
+    }
+
+    if (cfg->nmembers == 0 || cfg->nfields == 0)
+    {
+        log_message(LOG_ERR, "site %s: no meters / fields\n", cfg->name);
+        return EGENERR;
+    }
+
+    // names of the records: the totals, then the member counts
+    snprintf(cfg->map.name, sizeof(cfg->map.name), "%s", cfg->name);
+    cfg->map.npoints = cfg->nfields + 2;
+    cfg->map.points = (reg_point*) calloc(cfg->map.npoints, sizeof(reg_point));
+    if (cfg->map.points == NULL)
+        return ESYSERR;
+
+    for (int i = 0; i < cfg->map.npoints; i++)
+    {
+        snprintf(cfg->map.points[i].name, REGMAP_NAME_LEN, "%s",
+            i < cfg->nfields ? cfg->field[i] : (i == cfg->nfields ? "members" : "stale"));
+        cfg->map.points[i].scale = 1.0;
+        cfg->map.points[i].field = -1;
+    }
+
+    if (regmap_register(&cfg->map) < 0)
+        return EGENERR;
+
+    create_bus_reader(&cfg->br, cfg->b);
+    create_bus_writer(&cfg->bw, cfg->b);
+
+    // meter samples only, the site records are told apart by site_id
+    bus_filter f = { .types = BUS_TYPE_DATALOG | BUS_TYPE_SAMPLE | BUS_TYPE_FIXED };
+    bus_reader_set_filter(cfg->br, &f);
+
+    return ENOERR;
+}
+
+/**
+ * @brief Free task's data
+ *
+ * @param cfg
+ * @return int
+ */
+int site_agg_term(site_agg_config* cfg)
+{
+    if (cfg->samples > 0)
+        log_message(LOG_INFO, "site %s: %lu samples, %lu late, %lu records\n", cfg->name, cfg->samples, cfg->late, cfg->records);
+
+    if (cfg->br != NULL)
+        close_bus_reader(cfg->br);
+
+    if (cfg->ids != NULL)
+        hashtable_release(cfg->ids);
+
+    regmap_free(&cfg->map);
+
+    if (cfg->name != NULL)
+        free(cfg->name);
+
+    return 0;
+}
+
+/**
+ * @brief Do the task
+ *
+ * @param cfg
+ * @return int
+ */
+int site_agg_run(site_agg_config* cfg)
+{
+    return
+        pthread_create(&cfg->task_thread, NULL, site_agg_task, cfg);
+}
+
+/**
+ * @brief Wait until end
+ *
+ * @param cfg
+ * @return int
+ */
+int site_agg_wait(site_agg_config* cfg)
+{
+    return
+        pthread_join(cfg->task_thread, NULL);
+}
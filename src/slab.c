@@ -0,0 +1,361 @@
+/**
+ * @file slab.c
+ * @author longdh
+ * @brief size-classed, thread-caching allocator for the hot objects
+ *        (bus messages, meter samples, line buffers)
+ * @version 0.1
+ * @date 2024-01-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Memory is taken from the system in chunks and never given back: freed
+ * objects go to a per-thread cache, then to the shared depot of the class.
+ * The heap does not fragment and RSS stays at the peak of in-flight objects.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "utils/slab.h"
+#include "utils/logger.h"
+
+#define SLAB_MAGIC          0x5AB0u
+#define SLAB_LARGE          0xFFFFu
+
+/* in front of every object, keeps the 16 bytes alignment */
+typedef struct {
+    uint16_t    magic;
+    uint16_t    cls;        // class index, SLAB_LARGE => malloc
+    uint32_t    reserved;
+    uint64_t    pad;
+} slab_hdr;
+
+typedef struct {
+    pthread_mutex_t lock;
+    void*           free;       // free objects, linked through their first word
+    size_t          nfree;
+
+    size_t          chunks;
+    size_t          in_use;     // atomic
+    size_t          peak;       // atomic
+    uint64_t        allocs;     // atomic
+    uint64_t        frees;      // atomic
+} slab_depot;
+
+typedef struct {
+    void*   objs[SLAB_TCACHE_MAX];
+    int     n;
+} slab_tcache;
+
+static const size_t slab_sizes[SLAB_NCLASSES] = SLAB_CLASS_SIZES;
+
+static slab_depot depots[SLAB_NCLASSES] = {
+    [0 ... SLAB_NCLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static slab_depot large_depot = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread slab_tcache tcaches[SLAB_NCLASSES];
+static __thread int tcache_registered = 0;
+
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+
+/**
+ * @brief smallest class holding size bytes (header included)
+ *
+ * @param size
+ * @return int, -1 => too large
+ */
+static int slab_class_of(size_t size)
+{
+    size += sizeof(slab_hdr);
+
+    for (int i = 0; i < SLAB_NCLASSES; i++)
+    {
+        if (size <= slab_sizes[i])
+            return i;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief give n objects of the cache back to the depot
+ *
+ * @param cls
+ * @param tc
+ * @param n
+ */
+static void tcache_flush(int cls, slab_tcache* tc, int n)
+{
+    slab_depot* d = &depots[cls];
+
+    pthread_mutex_lock(&d->lock);
+    while (n-- > 0 && tc->n > 0)
+    {
+        void* obj = tc->objs[--tc->n];
+
+        *(void**) obj = d->free;
+        d->free = obj;
+        d->nfree++;
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+/**
+ * @brief thread exit: the cached objects go back to the depots
+ *
+ * @param arg
+ */
+static void tcache_destroy(void* arg)
+{
+    slab_tcache* tc = (slab_tcache*) arg;
+
+    for (int i = 0; i < SLAB_NCLASSES; i++)
+        tcache_flush(i, &tc[i], tc[i].n);
+}
+
+static void tcache_key_create()
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/**
+ * @brief take up to half a cache of objects from the depot, carve a new chunk if empty
+ *
+ * @param cls
+ * @param tc
+ * @return int, number of objects moved to the cache
+ */
+static int tcache_refill(int cls, slab_tcache* tc)
+{
+    slab_depot* d = &depots[cls];
+    size_t size = slab_sizes[cls];
+    int want = SLAB_TCACHE_MAX / 2;
+
+    pthread_mutex_lock(&d->lock);
+
+    if (d->free == NULL)
+    {
+        char* chunk = (char*) malloc(SLAB_CHUNK_SIZE);
+        if (chunk != NULL)
+        {
+            for (size_t off = 0; off + size <= SLAB_CHUNK_SIZE; off += size)
+            {
+                *(void**) (chunk + off) = d->free;
+                d->free = chunk + off;
+                d->nfree++;
+            }
+            d->chunks++;
+        }
+    }
+
+    while (want-- > 0 && d->free != NULL)
+    {
+        void* obj = d->free;
+
+        d->free = *(void**) obj;
+        d->nfree--;
+        tc->objs[tc->n++] = obj;
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    return tc->n;
+}
+
+/**
+ * @brief cache of the calling thread, flushed when the thread exits
+ *
+ * @return slab_tcache*
+ */
+static slab_tcache* tcache_get()
+{
+    if (!tcache_registered)
+    {
+        pthread_once(&tcache_once, tcache_key_create);
+        pthread_setspecific(tcache_key, tcaches);
+        tcache_registered = 1;
+    }
+
+    return tcaches;
+}
+
+/**
+ * @brief account one more object in use
+ *
+ * @param d
+ */
+static void stats_alloc(slab_depot* d)
+{
+    size_t in_use = __atomic_add_fetch(&d->in_use, 1, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&d->peak, __ATOMIC_RELAXED);
+
+    while (in_use > peak &&
+        !__atomic_compare_exchange_n(&d->peak, &peak, in_use, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    __atomic_add_fetch(&d->allocs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief account one object given back
+ *
+ * @param d
+ */
+static void stats_free(slab_depot* d)
+{
+    __atomic_sub_fetch(&d->in_use, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&d->frees, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Allocate size bytes (not initialized), aligned on 16 bytes
+ *
+ * @param size
+ * @return void*, NULL => out of memory
+ */
+void* slab_alloc(size_t size)
+{
+    slab_hdr* h;
+    int cls = slab_class_of(size);
+
+    if (cls < 0)
+    {
+        h = (slab_hdr*) malloc(sizeof(slab_hdr) + size);
+        if (h == NULL)
+            return NULL;
+
+        h->magic = SLAB_MAGIC;
+        h->cls = SLAB_LARGE;
+        stats_alloc(&large_depot);
+
+        return (void*) (h + 1);
+    }
+
+    slab_tcache* tc = &tcache_get()[cls];
+    if (tc->n == 0 && tcache_refill(cls, tc) == 0)
+        return NULL;
+
+    h = (slab_hdr*) tc->objs[--tc->n];
+    h->magic = SLAB_MAGIC;
+    h->cls = (uint16_t) cls;
+    stats_alloc(&depots[cls]);
+
+    return (void*) (h + 1);
+}
+
+/**
+ * @brief Allocate size bytes, zeroed
+ *
+ * @param size
+ * @return void*
+ */
+void* slab_calloc(size_t size)
+{
+    void* p = slab_alloc(size);
+
+    if (p != NULL)
+        memset(p, 0, size);
+
+    return p;
+}
+
+/**
+ * @brief Give an object of slab_alloc() back
+ *
+ * @param ptr
+ */
+void slab_free(void* ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    slab_hdr* h = ((slab_hdr*) ptr) - 1;
+
+    if (h->magic != SLAB_MAGIC)
+    {
+        log_message(LOG_ERR, "slab: bad free %p\n", ptr);
+        return;
+    }
+
+    if (h->cls == SLAB_LARGE)
+    {
+        stats_free(&large_depot);
+        h->magic = 0;
+        free(h);
+        return;
+    }
+
+    int cls = h->cls;
+    slab_tcache* tc = &tcache_get()[cls];
+
+    h->magic = 0;
+    stats_free(&depots[cls]);
+
+    if (tc->n == SLAB_TCACHE_MAX)
+        tcache_flush(cls, tc, SLAB_TCACHE_MAX / 2);
+
+    tc->objs[tc->n++] = (void*) h;
+}
+
+/**
+ * @brief Get statistics of the classes, the last one is for the large objects
+ *
+ * @param stats
+ * @param n
+ * @return int, number of entries filled
+ */
+int slab_stats(slab_stats_t* stats, int n)
+{
+    int i;
+
+    for (i = 0; i < n && i <= SLAB_NCLASSES; i++)
+    {
+        slab_depot* d = (i < SLAB_NCLASSES) ? &depots[i] : &large_depot;
+
+        pthread_mutex_lock(&d->lock);
+        stats[i].size = (i < SLAB_NCLASSES) ? slab_sizes[i] : 0;
+        stats[i].chunks = d->chunks;
+        stats[i].depot = d->nfree;
+        pthread_mutex_unlock(&d->lock);
+
+        stats[i].in_use = __atomic_load_n(&d->in_use, __ATOMIC_RELAXED);
+        stats[i].peak = __atomic_load_n(&d->peak, __ATOMIC_RELAXED);
+        stats[i].allocs = __atomic_load_n(&d->allocs, __ATOMIC_RELAXED);
+        stats[i].frees = __atomic_load_n(&d->frees, __ATOMIC_RELAXED);
+    }
+
+    return i;
+}
+
+/**
+ * @brief Log the statistics of the used classes
+ *
+ */
+void slab_stats_log()
+{
+    slab_stats_t stats[SLAB_NCLASSES + 1];
+    int n = slab_stats(stats, SLAB_NCLASSES + 1);
+    size_t total = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (stats[i].allocs == 0)
+            continue;
+
+        total += stats[i].chunks * SLAB_CHUNK_SIZE;
+
+        if (stats[i].size == 0)
+            log_message(LOG_INFO, "slab large: in_use=%zu peak=%zu allocs=%llu\n",
+                stats[i].in_use, stats[i].peak, (unsigned long long) stats[i].allocs);
+        else
+            log_message(LOG_INFO, "slab %4zu: chunks=%zu in_use=%zu peak=%zu depot=%zu allocs=%llu\n",
+                stats[i].size, stats[i].chunks, stats[i].in_use, stats[i].peak, stats[i].depot,
+                (unsigned long long) stats[i].allocs);
+    }
+
+    log_message(LOG_INFO, "slab: %zu KB reserved\n", total / 1024);
+}
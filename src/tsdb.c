@@ -0,0 +1,834 @@
+/**
+ * @file tsdb.c
+ * @author longdh
+ * @brief on-device time series store: per meter append only chunks,
+ *        Gorilla compressed (utils/gorilla.h), sparse time index, mmap reads
+ * @version 0.1
+ * @date 2024-01-26
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * <dir>/m<meter>.tsd    file header (field names) + chunks
+ * <dir>/m<meter>.tsi    one tsdb_index_entry per chunk
+ *
+ * A chunk is a header and the compressed columns: the timestamps, then each
+ * field (1 bit: float column, then its values). The files are written in host byte order, they stay on the device.
+ * A chunk is indexed only once fully written; at open the index is checked
+ * against the data file and rebuilt from the chunk headers (crc) after a
+ * crash, a torn chunk at the end is cut off.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "meter/tsdb.h"
+#include "utils/gorilla.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+//FIXME
+extern char* strdup(const char*);
+
+#define TSDB_FILE_MAGIC     0x31445354  // "TSD1"
+#define TSDB_CHUNK_MAGIC    0x31435354  // "TSC1"
+#define TSDB_VERSION        1
+#define TSDB_MAX_CHUNK      4096        // points
+
+// chunks start 8 byte aligned, their headers are read in place from the mapping
+#define CHUNK_SIZE(nbytes)  ((sizeof(tsdb_chunk_hdr) + (nbytes) + 7) & ~(size_t) 7)
+
+typedef struct {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    nfields;
+    uint32_t    names_len;  // NUL separated names that follow, padded to 8
+    uint32_t    reserved;
+} tsdb_file_hdr;
+
+typedef struct {
+    uint32_t    magic;
+    uint16_t    npoints;
+    uint16_t    nfields;
+    int64_t     t_first;
+    int64_t     t_last;
+    uint32_t    nbytes;     // compressed payload
+    uint32_t    crc;        // of the payload
+} tsdb_chunk_hdr;
+
+static uint32_t tsdb_crc32(const uint8_t* p, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (len--)
+    {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+
+    return ~crc;
+}
+
+static int write_all(int fd, const void* buf, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return ESYSERR;
+
+        p += n;
+        len -= n;
+    }
+
+    return ENOERR;
+}
+
+static int read_at(int fd, void* buf, size_t len, uint64_t off)
+{
+    return pread(fd, buf, len, (off_t) off) == (ssize_t) len ? ENOERR : ESYSERR;
+}
+
+static size_t names_size(int nfields, char* const* names)
+{
+    size_t len = 0;
+
+    for (int f = 0; f < nfields; f++)
+        len += strlen(names[f]) + 1;
+
+    return (len + 7) & ~(size_t) 7;
+}
+
+/**
+ * @brief write the file header of an empty data file
+ *
+ * @param s
+ * @return int
+ */
+static int series_write_header(tsdb_series* s)
+{
+    size_t len = names_size(s->nfields, s->names);
+    uint8_t buf[sizeof(tsdb_file_hdr) + len];
+    tsdb_file_hdr* h = (tsdb_file_hdr*) buf;
+    size_t pos = sizeof(tsdb_file_hdr);
+
+    memset(buf, 0, sizeof(buf));
+    h->magic = TSDB_FILE_MAGIC;
+    h->version = TSDB_VERSION;
+    h->nfields = (uint16_t) s->nfields;
+    h->names_len = (uint32_t) len;
+
+    for (int f = 0; f < s->nfields; f++)
+    {
+        size_t n = strlen(s->names[f]) + 1;
+
+        memcpy(buf + pos, s->names[f], n);
+        pos += n;
+    }
+
+    s->size = sizeof(buf);
+
+    return write_all(s->fd, buf, sizeof(buf));
+}
+
+/**
+ * @brief the names of an existing data file match the series?
+ *
+ * @param s
+ * @param data_start, set to the offset of the first chunk
+ * @return int
+ */
+static int series_check_header(tsdb_series* s, uint64_t* data_start)
+{
+    tsdb_file_hdr h;
+
+    if (ENOERR != read_at(s->fd, &h, sizeof(h), 0) || h.magic != TSDB_FILE_MAGIC ||
+        h.version != TSDB_VERSION || h.nfields != s->nfields || h.names_len != names_size(s->nfields, s->names))
+        return 0;
+
+    char names[h.names_len];
+    size_t pos = 0;
+
+    if (ENOERR != read_at(s->fd, names, h.names_len, sizeof(h)))
+        return 0;
+
+    for (int f = 0; f < s->nfields; f++)
+    {
+        if (0 != strcmp(names + pos, s->names[f]))
+            return 0;
+        pos += strlen(s->names[f]) + 1;
+    }
+
+    *data_start = sizeof(h) + h.names_len;
+
+    return 1;
+}
+
+/**
+ * @brief take the fields of an existing data file (series opened to be read)
+ *
+ * @param s
+ * @param data_start
+ * @return int
+ */
+static int series_load_header(tsdb_series* s, uint64_t* data_start)
+{
+    tsdb_file_hdr h;
+
+    if (ENOERR != read_at(s->fd, &h, sizeof(h), 0) || h.magic != TSDB_FILE_MAGIC ||
+        h.version != TSDB_VERSION || h.nfields == 0 || h.nfields > METER_SAMPLE_MAX || h.names_len > 4096)
+        return EGENERR;
+
+    char names[h.names_len + 1];
+    size_t pos = 0;
+
+    if (ENOERR != read_at(s->fd, names, h.names_len, sizeof(h)))
+        return EGENERR;
+    names[h.names_len] = '\0';
+
+    for (int f = 0; f < h.nfields; f++)
+    {
+        if (pos >= h.names_len || (s->names[f] = strdup(names + pos)) == NULL)
+            return EGENERR;
+
+        s->nfields = f + 1;
+        pos += strlen(names + pos) + 1;
+    }
+
+    *data_start = sizeof(h) + h.names_len;
+
+    return ENOERR;
+}
+
+static int series_index_push(tsdb_series* s, const tsdb_index_entry* e)
+{
+    if (s->nindex == s->index_cap)
+    {
+        uint32_t cap = s->index_cap ? s->index_cap * 2 : 256;
+        tsdb_index_entry* p = (tsdb_index_entry*) realloc(s->index, cap * sizeof(tsdb_index_entry));
+
+        if (p == NULL)
+            return ESYSERR;
+
+        s->index = p;
+        s->index_cap = cap;
+    }
+
+    s->index[s->nindex++] = *e;
+
+    return ENOERR;
+}
+
+/**
+ * @brief load the index, re-index the chunks written after it and cut a
+ *        torn chunk at the end of the data file
+ *
+ * @param s
+ * @param data_start
+ * @return int
+ */
+static int series_recover(tsdb_series* s, uint64_t data_start)
+{
+    struct stat st;
+    uint64_t pos = data_start;
+    tsdb_index_entry e;
+    uint32_t nvalid = 0;
+
+    if (fstat(s->fd, &st) != 0)
+        return ESYSERR;
+
+    s->size = (uint64_t) st.st_size;
+
+    // indexed chunks, they follow each other
+    while (read_at(s->ifd, &e, sizeof(e), (uint64_t) nvalid * sizeof(e)) == ENOERR)
+    {
+        if (e.offset != pos || e.offset + e.size > s->size)
+            break;
+
+        if (ENOERR != series_index_push(s, &e))
+            return ESYSERR;
+
+        pos += e.size;
+        nvalid++;
+    }
+
+    if (ftruncate(s->ifd, (off_t) nvalid * sizeof(e)) != 0)
+        return ESYSERR;
+
+    // chunks written but not indexed (crash between the two writes)
+    for (;;)
+    {
+        tsdb_chunk_hdr h;
+
+        if (ENOERR != read_at(s->fd, &h, sizeof(h), pos) || h.magic != TSDB_CHUNK_MAGIC ||
+            h.nfields != s->nfields || h.npoints == 0 || pos + CHUNK_SIZE(h.nbytes) > s->size)
+            break;
+
+        uint8_t* payload = (uint8_t*) malloc(h.nbytes);
+        int ok = payload != NULL && ENOERR == read_at(s->fd, payload, h.nbytes, pos + sizeof(h)) &&
+                 tsdb_crc32(payload, h.nbytes) == h.crc;
+        free(payload);
+
+        if (!ok)
+            break;
+
+        e.t_first = h.t_first;
+        e.t_last = h.t_last;
+        e.offset = pos;
+        e.npoints = h.npoints;
+        e.size = (uint32_t) CHUNK_SIZE(h.nbytes);
+
+        if (ENOERR != write_all(s->ifd, &e, sizeof(e)) || ENOERR != series_index_push(s, &e))
+            return ESYSERR;
+
+        pos += e.size;
+        log_message(LOG_INFO, "tsdb: meter %u, chunk at %llu re-indexed\n", s->meter_id, (unsigned long long) e.offset);
+    }
+
+    if (pos < s->size)
+    {
+        log_message(LOG_WARNING, "tsdb: meter %u, %llu bytes of torn chunk dropped\n",
+            s->meter_id, (unsigned long long) (s->size - pos));
+
+        if (ftruncate(s->fd, (off_t) pos) != 0)
+            return ESYSERR;
+        s->size = pos;
+    }
+
+    return ENOERR;
+}
+
+static void series_free(tsdb_series* s)
+{
+    if (s->fd >= 0)
+        close(s->fd);
+    if (s->ifd >= 0)
+        close(s->ifd);
+
+    for (int f = 0; f < s->nfields; f++)
+        free(s->names[f]);
+
+    free(s->index);
+    free(s->ts);
+    free(s->values);
+    pthread_rwlock_destroy(&s->lock);
+    free(s);
+}
+
+/**
+ * @brief open (create) the files of a meter, a file with other fields is
+ *        moved aside as m<meter>-<unix time>.tsd / .tsi
+ *
+ * @param db
+ * @param meter_id
+ * @param nfields
+ * @param names, NULL => existing files only, fields taken from the file
+ * @return tsdb_series*
+ */
+static tsdb_series* series_open(tsdb_t* db, uint32_t meter_id, int nfields, const char* const* names)
+{
+    char data_path[512], index_path[512];
+    uint64_t data_start = 0;
+    struct stat st;
+
+    tsdb_series* s = (tsdb_series*) calloc(1, sizeof(tsdb_series));
+    if (s == NULL)
+        return NULL;
+
+    s->meter_id = meter_id;
+    s->fd = s->ifd = -1;
+    pthread_rwlock_init(&s->lock, NULL);
+
+    snprintf(data_path, sizeof(data_path), "%s/m%u.tsd", db->dir, meter_id);
+    snprintf(index_path, sizeof(index_path), "%s/m%u.tsi", db->dir, meter_id);
+
+    if (names == NULL)
+    {
+        // history of a meter not written since start
+        if ((s->fd = open(data_path, O_RDWR | O_APPEND)) < 0 || fstat(s->fd, &st) != 0 ||
+            ENOERR != series_load_header(s, &data_start))
+        {
+            series_free(s);
+            return NULL;
+        }
+    }
+    else
+    {
+        s->nfields = nfields;
+        for (int f = 0; f < nfields; f++)
+        {
+            if ((s->names[f] = strdup(names[f])) == NULL)
+                goto fail;
+        }
+
+        if ((s->fd = open(data_path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0 || fstat(s->fd, &st) != 0)
+            goto fail;
+
+        if (st.st_size > 0 && !series_check_header(s, &data_start))
+        {
+            char aside[600];
+            long long now = (long long) time(NULL);
+
+            log_message(LOG_WARNING, "tsdb: meter %u changed its fields, %s moved aside\n", meter_id, data_path);
+
+            close(s->fd);
+            snprintf(aside, sizeof(aside), "%s/m%u-%lld.tsd", db->dir, meter_id, now);
+            rename(data_path, aside);
+            snprintf(aside, sizeof(aside), "%s/m%u-%lld.tsi", db->dir, meter_id, now);
+            rename(index_path, aside);
+
+            if ((s->fd = open(data_path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0)
+                goto fail;
+            st.st_size = 0;
+        }
+    }
+
+    s->ts = (int64_t*) malloc(db->chunk_points * sizeof(int64_t));
+    s->values = (double*) malloc((size_t) db->chunk_points * s->nfields * sizeof(double));
+    if (s->ts == NULL || s->values == NULL)
+        goto fail;
+
+    if ((s->ifd = open(index_path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0)
+        goto fail;
+
+    if (st.st_size == 0)
+    {
+        if (ftruncate(s->ifd, 0) != 0 || ENOERR != series_write_header(s))
+            goto fail;
+    }
+    else if (ENOERR != series_recover(s, data_start))
+        goto fail;
+
+    log_message(LOG_INFO, "tsdb: meter %u, %u chunks, %llu bytes\n", meter_id, s->nindex, (unsigned long long) s->size);
+
+    return s;
+
+fail:
+    log_message(LOG_ERR, "tsdb: meter %u, cannot open %s: %s\n", meter_id, data_path, strerror(errno));
+    series_free(s);
+
+    return NULL;
+}
+
+/**
+ * @brief series of a meter, opened on first use
+ *
+ * @param db
+ * @param meter_id
+ * @param nfields
+ * @param names, NULL => only if its files exist
+ * @return tsdb_series*
+ */
+static tsdb_series* series_get_or_open(tsdb_t* db, uint32_t meter_id, int nfields, const char* const* names)
+{
+    tsdb_series* s;
+
+    pthread_mutex_lock(&db->lock);
+
+    for (int i = 0; i < db->nseries; i++)
+    {
+        if (db->series[i]->meter_id == meter_id)
+        {
+            s = db->series[i];
+            pthread_mutex_unlock(&db->lock);
+            return s;
+        }
+    }
+
+    s = NULL;
+    if (db->nseries < TSDB_MAX_SERIES && (s = series_open(db, meter_id, nfields, names)) != NULL)
+        db->series[db->nseries++] = s;
+
+    pthread_mutex_unlock(&db->lock);
+
+    return s;
+}
+
+/**
+ * @brief compress and append the open chunk, caller holds the write lock
+ *
+ * @param db
+ * @param s
+ * @return int
+ */
+static int series_seal(tsdb_t* db, tsdb_series* s)
+{
+    uint32_t n = s->npending;
+
+    if (n == 0)
+        return ENOERR;
+
+    // worst case: 78 bits a value, 69 a timestamp
+    size_t cap = (size_t) n * (s->nfields + 1) * 10 + 16;
+    uint8_t* buf = (uint8_t*) calloc(1, sizeof(tsdb_chunk_hdr) + cap + 8);
+    tsdb_chunk_hdr* h = (tsdb_chunk_hdr*) buf;
+    bit_writer w;
+    int rc;
+
+    if (buf == NULL)
+        return ESYSERR;
+
+    bw_init(&w, buf + sizeof(tsdb_chunk_hdr), cap);
+
+    gorilla_ts gts = { 0 };
+    for (uint32_t i = 0; i < n; i++)
+        gorilla_ts_put(&w, &gts, s->ts[i]);
+
+    for (int f = 0; f < s->nfields; f++)
+    {
+        gorilla_val gv = { 0 };
+        int f32 = 1;
+
+        // values that came as floats lose nothing on 32 bits
+        for (uint32_t i = 0; i < n && f32; i++)
+        {
+            double v = s->values[(size_t) i * s->nfields + f];
+            f32 = ((double) (float) v == v);
+        }
+
+        bw_put(&w, (uint64_t) f32, 1);
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            if (f32)
+                gorilla_f32_put(&w, &gv, (float) s->values[(size_t) i * s->nfields + f]);
+            else
+                gorilla_val_put(&w, &gv, s->values[(size_t) i * s->nfields + f]);
+        }
+    }
+
+    memset(h, 0, sizeof(tsdb_chunk_hdr));
+    h->magic = TSDB_CHUNK_MAGIC;
+    h->npoints = (uint16_t) n;
+    h->nfields = (uint16_t) s->nfields;
+    h->t_first = s->ts[0];
+    h->t_last = s->ts[n - 1];
+    h->nbytes = (uint32_t) bw_bytes(&w);
+    h->crc = tsdb_crc32(buf + sizeof(tsdb_chunk_hdr), h->nbytes);
+
+    tsdb_index_entry e = {
+        .t_first = h->t_first,
+        .t_last = h->t_last,
+        .offset = s->size,
+        .npoints = n,
+        .size = (uint32_t) CHUNK_SIZE(h->nbytes)
+    };
+
+    s->npending = 0;
+
+    rc = w.err ? EGENERR : write_all(s->fd, buf, e.size);
+    if (rc == ENOERR && db->sync)
+        fdatasync(s->fd);
+
+    if (rc == ENOERR)
+        rc = write_all(s->ifd, &e, sizeof(e));
+
+    free(buf);
+
+    if (rc != ENOERR)
+    {
+        log_message(LOG_ERR, "tsdb: meter %u, chunk of %u samples lost: %s\n", s->meter_id, n, strerror(errno));
+
+        // keep the files consistent for the next chunk
+        if (ftruncate(s->fd, (off_t) s->size) != 0 || ftruncate(s->ifd, (off_t) s->nindex * sizeof(e)) != 0)
+            log_message(LOG_ERR, "tsdb: meter %u, cannot truncate\n", s->meter_id);
+        return rc;
+    }
+
+    s->size += e.size;
+
+    return series_index_push(s, &e);
+}
+
+/**
+ * @brief Open the store
+ *
+ * @param db
+ * @param dir, must exist
+ * @param chunk_points, samples per chunk
+ * @param sync, fdatasync every chunk
+ * @return int
+ */
+int tsdb_open(tsdb_t* db, const char* dir, uint32_t chunk_points, int sync)
+{
+    memset(db, 0, sizeof(tsdb_t));
+
+    if (chunk_points < 2)
+        chunk_points = TSDB_CHUNK_POINTS;
+    if (chunk_points > TSDB_MAX_CHUNK)
+        chunk_points = TSDB_MAX_CHUNK;
+
+    db->dir = strdup(dir);
+    db->chunk_points = chunk_points;
+    db->sync = sync;
+    pthread_mutex_init(&db->lock, NULL);
+
+    if (db->dir == NULL)
+        return ESYSERR;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        log_message(LOG_ERR, "tsdb: %s: %s\n", dir, strerror(errno));
+        return ESYSERR;
+    }
+
+    return ENOERR;
+}
+
+/**
+ * @brief seal the open chunks and close
+ *
+ * @param db
+ */
+void tsdb_close(tsdb_t* db)
+{
+    tsdb_flush(db);
+
+    for (int i = 0; i < db->nseries; i++)
+        series_free(db->series[i]);
+
+    db->nseries = 0;
+    free(db->dir);
+    db->dir = NULL;
+    pthread_mutex_destroy(&db->lock);
+}
+
+/**
+ * @brief series of a meter
+ *
+ * @param db
+ * @param meter_id
+ * @return tsdb_series*, NULL => never written since open
+ */
+tsdb_series* tsdb_series_get(tsdb_t* db, uint32_t meter_id)
+{
+    tsdb_series* s = NULL;
+
+    pthread_mutex_lock(&db->lock);
+    for (int i = 0; i < db->nseries; i++)
+    {
+        if (db->series[i]->meter_id == meter_id)
+        {
+            s = db->series[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&db->lock);
+
+    return s;
+}
+
+/**
+ * @brief append a sample, its chunk is written once full
+ *
+ * @param db
+ * @param meter_id
+ * @param ts, ns, increasing per meter
+ * @param nfields
+ * @param names
+ * @param values
+ * @return int
+ */
+int tsdb_append(tsdb_t* db, uint32_t meter_id, int64_t ts, int nfields, const char* const* names, const double* values)
+{
+    static unsigned long out_of_order = 0;
+    tsdb_series* s = series_get_or_open(db, meter_id, nfields, names);
+    int rc = ENOERR;
+
+    if (s == NULL || s->nfields != nfields)
+        return EGENERR;
+
+    pthread_rwlock_wrlock(&s->lock);
+
+    int64_t last = s->npending > 0 ? s->ts[s->npending - 1] :
+                   s->nindex > 0 ? s->index[s->nindex - 1].t_last : INT64_MIN;
+
+    // the index is searched by time
+    if (ts <= last)
+    {
+        if ((out_of_order++ % 1000) == 0)
+            log_message(LOG_WARNING, "tsdb: meter %u, sample out of order dropped\n", meter_id);
+        pthread_rwlock_unlock(&s->lock);
+        return EGENERR;
+    }
+
+    s->ts[s->npending] = ts;
+    memcpy(&s->values[(size_t) s->npending * nfields], values, nfields * sizeof(double));
+
+    if (++s->npending == db->chunk_points)
+        rc = series_seal(db, s);
+
+    pthread_rwlock_unlock(&s->lock);
+
+    return rc;
+}
+
+/**
+ * @brief write the open chunks (shutdown, bounded loss on power cut)
+ *
+ * @param db
+ * @return int
+ */
+int tsdb_flush(tsdb_t* db)
+{
+    int rc = ENOERR;
+    int n;
+
+    pthread_mutex_lock(&db->lock);
+    n = db->nseries;
+    pthread_mutex_unlock(&db->lock);
+
+    for (int i = 0; i < n; i++)
+    {
+        tsdb_series* s = db->series[i];
+
+        pthread_rwlock_wrlock(&s->lock);
+        if (series_seal(db, s) != ENOERR)
+            rc = EGENERR;
+        pthread_rwlock_unlock(&s->lock);
+    }
+
+    return rc;
+}
+
+/**
+ * @brief decode a chunk into ts[] and column major values[]
+ *
+ * @param h
+ * @param nfields
+ * @param ts
+ * @param values
+ * @return int
+ */
+static int chunk_decode(const tsdb_chunk_hdr* h, int nfields, int64_t* ts, double* values)
+{
+    const uint8_t* payload = (const uint8_t*) (h + 1);
+    bit_reader r;
+    gorilla_ts gts = { 0 };
+
+    if (h->magic != TSDB_CHUNK_MAGIC || h->nfields != nfields || tsdb_crc32(payload, h->nbytes) != h->crc)
+        return EGENERR;
+
+    br_init(&r, payload, h->nbytes);
+
+    for (uint32_t i = 0; i < h->npoints; i++)
+        ts[i] = gorilla_ts_get(&r, &gts);
+
+    for (int f = 0; f < nfields; f++)
+    {
+        gorilla_val gv = { 0 };
+        int f32 = (int) br_get(&r, 1);
+
+        for (uint32_t i = 0; i < h->npoints; i++)
+            values[(size_t) f * h->npoints + i] = f32 ? gorilla_f32_get(&r, &gv) : gorilla_val_get(&r, &gv);
+    }
+
+    return r.err ? EGENERR : ENOERR;
+}
+
+/**
+ * @brief samples of a meter in [from, to], oldest first. The chunks are
+ *        found with the index and read through a mapping of the data file,
+ *        the appends of the meter wait for the scan.
+ *
+ * @param db
+ * @param meter_id
+ * @param from
+ * @param to
+ * @param fn
+ * @param arg
+ * @return int, samples passed to fn, -1 => error
+ */
+int tsdb_scan(tsdb_t* db, uint32_t meter_id, int64_t from, int64_t to, tsdb_scan_fn fn, void* arg)
+{
+    tsdb_series* s = series_get_or_open(db, meter_id, 0, NULL);
+    double row[METER_SAMPLE_MAX];
+    int64_t* ts = NULL;
+    double* values = NULL;
+    uint32_t lo = 0, hi;
+    int count = 0, stop = 0, rc = ENOERR;
+
+    if (s == NULL)
+        return -1;
+
+    pthread_rwlock_rdlock(&s->lock);
+
+    // first chunk ending at or after 'from'
+    hi = s->nindex;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (s->index[mid].t_last < from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < s->nindex && s->index[lo].t_first <= to)
+    {
+        uint8_t* map = (uint8_t*) mmap(NULL, s->size, PROT_READ, MAP_SHARED, s->fd, 0);
+
+        ts = (int64_t*) malloc(TSDB_MAX_CHUNK * sizeof(int64_t));
+        values = (double*) malloc((size_t) TSDB_MAX_CHUNK * s->nfields * sizeof(double));
+
+        if (map == MAP_FAILED || ts == NULL || values == NULL)
+            rc = ESYSERR;
+        else
+            madvise(map + (s->index[lo].offset & ~(uint64_t) 4095), s->size - (s->index[lo].offset & ~(uint64_t) 4095), MADV_SEQUENTIAL);
+
+        for (uint32_t c = lo; rc == ENOERR && !stop && c < s->nindex && s->index[c].t_first <= to; c++)
+        {
+            const tsdb_chunk_hdr* h = (const tsdb_chunk_hdr*) (map + s->index[c].offset);
+
+            if (h->npoints > TSDB_MAX_CHUNK || ENOERR != chunk_decode(h, s->nfields, ts, values))
+            {
+                log_message(LOG_ERR, "tsdb: meter %u, corrupt chunk at %llu\n", meter_id, (unsigned long long) s->index[c].offset);
+                continue;
+            }
+
+            for (uint32_t i = 0; i < h->npoints && !stop; i++)
+            {
+                if (ts[i] < from || ts[i] > to)
+                    continue;
+
+                for (int f = 0; f < s->nfields; f++)
+                    row[f] = values[(size_t) f * h->npoints + i];
+
+                stop = fn(arg, ts[i], row, s->nfields);
+                count++;
+            }
+        }
+
+        if (map != MAP_FAILED)
+            munmap(map, s->size);
+    }
+
+    // the open chunk
+    for (uint32_t i = 0; rc == ENOERR && !stop && i < s->npending; i++)
+    {
+        if (s->ts[i] < from || s->ts[i] > to)
+            continue;
+
+        stop = fn(arg, s->ts[i], &s->values[(size_t) i * s->nfields], s->nfields);
+        count++;
+    }
+
+    pthread_rwlock_unlock(&s->lock);
+
+    free(ts);
+    free(values);
+
+    return rc == ENOERR ? count : -1;
+}
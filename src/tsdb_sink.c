@@ -0,0 +1,144 @@
+/**
+ * @file tsdb_sink.c
+ * @author longdh
+ * @brief sink into the on-device time series store (meter/tsdb.h)
+ * @version 0.1
+ * @date 2024-01-26
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tsdb_sink.h"
+#include "meter/regmap.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+//FIXME
+extern char* strdup(const char*);
+
+#define TSDB_SINK_POLL_MS   1000
+
+/**
+ * @brief sink thread
+ *
+ * @param arg
+ * @return void*
+ */
+static void* tsdb_sink_task(void* arg)
+{
+    tsdb_sink_config* cfg = (tsdb_sink_config*) arg;
+    time_t last_flush = time(NULL);
+
+    while (1)
+    {
+        const char* names[METER_SAMPLE_MAX];
+        double values[METER_SAMPLE_MAX];
+        uint32_t meter_id;
+        uint64_t ts;
+        void* data;
+        int datalen;
+
+        if (0 == bus_read_timeout(cfg->br, &data, &datalen, TSDB_SINK_POLL_MS))
+        {
+            int n = bus_data_values(data, datalen, &meter_id, &ts, names, values);
+            bus_free(data);
+
+            if (n > 0)
+            {
+                if (ts == 0)
+                {
+                    struct timespec now;
+
+                    clock_gettime(CLOCK_REALTIME, &now);
+                    ts = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+                }
+
+                tsdb_append(&cfg->db, meter_id, (int64_t) ts, n, names, values);
+            }
+        }
+
+        // bound what a power cut loses
+        if (cfg->flush_s > 0 && time(NULL) - last_flush >= cfg->flush_s)
+        {
+            tsdb_flush(&cfg->db);
+            last_flush = time(NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Init sink task
+ *
+ * @param cfg
+ * @param b
+ * @param dir
+ * @param chunk_points
+ * @param flush_s
+ * @param sync
+ * @return int
+ */
+int tsdb_sink_init(tsdb_sink_config* cfg, Bus* b, const char* dir, int chunk_points, int flush_s, int sync)
+{
+    memset(cfg, 0, sizeof(tsdb_sink_config));
+
+    cfg->b = b;
+    create_bus_reader(&cfg->br, cfg->b);
+
+    // meter samples only, the source messages are not copied out
+    bus_filter f = { .types = BUS_TYPE_DATALOG | BUS_TYPE_SAMPLE | BUS_TYPE_FIXED };
+    bus_reader_set_filter(cfg->br, &f);
+
+    cfg->dir = strdup(dir);
+    cfg->chunk_points = chunk_points;
+    cfg->flush_s = flush_s;
+    cfg->sync = sync;
+
+    return tsdb_open(&cfg->db, cfg->dir, (uint32_t) chunk_points, sync);
+}
+
+/**
+ * @brief Free task's data, the open chunks are written
+ *
+ * @param cfg
+ * @return int
+ */
+int tsdb_sink_term(tsdb_sink_config* cfg)
+{
+    tsdb_close(&cfg->db);
+
+    if (cfg->dir != NULL)
+        free(cfg->dir);
+
+    return 0;
+}
+
+/**
+ * @brief Do the task
+ *
+ * @param cfg
+ * @return int
+ */
+int tsdb_sink_run(tsdb_sink_config* cfg)
+{
+    return
+        pthread_create(&cfg->task_thread, NULL, tsdb_sink_task, cfg);
+}
+
+/**
+ * @brief Wait until end
+ *
+ * @param cfg
+ * @return int
+ */
+int tsdb_sink_wait(tsdb_sink_config* cfg)
+{
+    return
+        pthread_join(cfg->task_thread, NULL);
+}
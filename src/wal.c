@@ -0,0 +1,979 @@
+/**
+ * @file wal.c
+ * @author longdh
+ * @brief write-ahead log of the bus messages: sequence numbers, group
+ *        commit, per sink cursors and replay after a restart
+ * @version 0.1
+ * @date 2024-02-14
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * <dir>/wal-<first seq, hex>.log   records { len, crc, seq } + bytes, host order
+ * <dir>/<sink>.cursor              last seq the sink delivered, text
+ *
+ * A record is durable once a commit (fdatasync of the segment) covers it, the
+ * commits are grouped: every commit_ms, or sooner past commit_kb appended,
+ * so the flash sees one sync per group instead of one per sample. A full
+ * segment is handed to the commit thread as well, the appending thread (the
+ * RT reader) never waits for the flash. The
+ * cursors are persisted with the same commits; after a crash a sink resumes
+ * from its last persisted cursor, the few samples delivered after it are sent
+ * again (the sinks write them idempotently: timestamped lines, keyed SETs).
+ * At open, a torn record at the end of the last segment is cut off. A bad
+ * record met by a cursor later on only costs that record: the reading goes
+ * on at the next valid one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "utils/wal.h"
+#include "utils/error.h"
+#include "utils/logger.h"
+
+//FIXME
+extern char* strdup(const char*);
+
+typedef struct {
+    uint32_t    len;        // bytes after the header
+    uint32_t    crc;        // of seq + bytes
+    uint64_t    seq;
+} wal_rec_hdr;
+
+static uint32_t wal_crc32(uint32_t crc, const uint8_t* p, size_t len)
+{
+    while (len--)
+    {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+
+    return crc;
+}
+
+static uint32_t wal_rec_crc(uint64_t seq, const void* data, size_t len)
+{
+    uint32_t crc = wal_crc32(0xFFFFFFFF, (const uint8_t*) &seq, sizeof(seq));
+
+    return ~wal_crc32(crc, (const uint8_t*) data, len);
+}
+
+static void wal_seg_path(const wal_t* w, uint64_t first, char* buf, size_t size)
+{
+    snprintf(buf, size, "%s/wal-%016llx.log", w->dir, (unsigned long long) first);
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+    return x < y ? -1 : (x > y);
+}
+
+/**
+ * @brief make the created / renamed entries of the directory durable
+ *
+ * @param w
+ * @return int
+ */
+static int wal_sync_dir(const wal_t* w)
+{
+    int fd = open(w->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int rc = ENOERR;
+
+    if (fd < 0 || fsync(fd) != 0)
+    {
+        log_message(LOG_ERR, "wal: %s: %s\n", w->dir, strerror(errno));
+        rc = ESYSERR;
+    }
+
+    if (fd >= 0)
+        close(fd);
+
+    return rc;
+}
+
+/**
+ * @brief wake the readers, called with the lock
+ *
+ * @param w
+ */
+static void wal_notify(wal_t* w)
+{
+    uint64_t one = 1;
+
+    for (int i = 0; i < w->ncursors; i++)
+        if (write(w->cursors[i]->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            log_message(LOG_ERR, "wal: cursor %s notify: %s\n", w->cursors[i]->name, strerror(errno));
+}
+
+/**
+ * @brief remove the oldest segment, called with the lock
+ *
+ * @param w
+ */
+static void wal_drop_oldest(wal_t* w)
+{
+    char path[512];
+
+    wal_seg_path(w, w->segs[0], path, sizeof(path));
+    if (unlink(path) != 0 && errno != ENOENT)
+        log_message(LOG_ERR, "wal: %s: %s\n", path, strerror(errno));
+
+    memmove(&w->segs[0], &w->segs[1], (w->nsegs - 1) * sizeof(uint64_t));
+    memmove(&w->seg_bytes[0], &w->seg_bytes[1], (w->nsegs - 1) * sizeof(uint64_t));
+    w->nsegs--;
+}
+
+/**
+ * @brief start a segment at next_seq, called with the lock. Not synced
+ *        here, its directory entry is with the next commit
+ *
+ * @param w
+ * @return int
+ */
+static int wal_new_segment(wal_t* w)
+{
+    char path[512];
+
+    if (w->nsegs == WAL_MAX_SEGMENTS)
+    {
+        log_message(LOG_WARNING, "wal: %d segments, dropping the oldest\n", WAL_MAX_SEGMENTS);
+        w->dropped += w->segs[1] - w->segs[0];
+        wal_drop_oldest(w);
+    }
+
+    wal_seg_path(w, w->next_seq, path, sizeof(path));
+
+    w->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (w->fd < 0)
+    {
+        log_message(LOG_ERR, "wal: %s: %s\n", path, strerror(errno));
+        return ESYSERR;
+    }
+
+    w->segs[w->nsegs] = w->next_seq;
+    w->seg_bytes[w->nsegs] = 0;
+    w->nsegs++;
+    w->seg_size = 0;
+    w->dir_dirty = 1;
+
+    return ENOERR;
+}
+
+/**
+ * @brief check the last segment, cut a torn tail off, find next_seq
+ *
+ * @param w
+ * @return int
+ */
+static int wal_recover(wal_t* w)
+{
+    uint64_t first = w->segs[w->nsegs - 1];
+    uint64_t seq = first;
+    uint64_t off = 0;
+    uint8_t buf[WAL_MAX_RECORD];
+    wal_rec_hdr h;
+    char path[512];
+    int fd;
+
+    wal_seg_path(w, first, path, sizeof(path));
+
+    if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+    {
+        log_message(LOG_ERR, "wal: %s: %s\n", path, strerror(errno));
+        return ESYSERR;
+    }
+
+    while (pread(fd, &h, sizeof(h), (off_t) off) == (ssize_t) sizeof(h))
+    {
+        if (h.seq != seq || h.len > WAL_MAX_RECORD
+            || pread(fd, buf, h.len, (off_t) (off + sizeof(h))) != (ssize_t) h.len
+            || wal_rec_crc(h.seq, buf, h.len) != h.crc)
+            break;
+
+        off += sizeof(h) + h.len;
+        seq++;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (uint64_t) st.st_size > off)
+    {
+        log_message(LOG_WARNING, "wal: %s: %llu torn byte(s) cut off after seq %llu\n",
+            path, (unsigned long long) (st.st_size - off), (unsigned long long) (seq - 1));
+
+        if (ftruncate(fd, (off_t) off) != 0 || fdatasync(fd) != 0)
+            log_message(LOG_ERR, "wal: %s: %s\n", path, strerror(errno));
+    }
+
+    close(fd);
+
+    w->fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (w->fd < 0)
+        return ESYSERR;
+
+    w->seg_size = off;
+    w->seg_bytes[w->nsegs - 1] = off;
+    w->next_seq = seq;
+    w->committed = seq - 1;
+
+    return ENOERR;
+}
+
+/**
+ * @brief open the log in dir (created if missing), recover what is there
+ *
+ * @param w
+ * @param dir
+ * @param segment_kb, segment size before rotation
+ * @param commit_ms, max time an append waits for its commit
+ * @param commit_kb, commit sooner past this many bytes appended
+ * @param max_mb, bound of the files, the oldest segments go first
+ * @return int
+ */
+int wal_init(wal_t* w, const char* dir, int segment_kb, int commit_ms, int commit_kb, int max_mb)
+{
+    DIR* d;
+    struct dirent* e;
+
+    memset(w, 0, sizeof(wal_t));
+    w->fd = -1;
+    w->sealed_fd = -1;
+    w->dir = strdup(dir);
+    w->segment_bytes = (uint64_t) (segment_kb > 0 ? segment_kb : WAL_DEFAULT_SEGMENT_KB) * 1024;
+    w->commit_ms = commit_ms > 0 ? commit_ms : WAL_DEFAULT_COMMIT_MS;
+    w->commit_bytes = (uint64_t) (commit_kb > 0 ? commit_kb : WAL_DEFAULT_COMMIT_KB) * 1024;
+    w->max_bytes = (uint64_t) (max_mb > 0 ? max_mb : WAL_DEFAULT_MAX_MB) * 1024 * 1024;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    if (w->dir == NULL)
+        return ESYSERR;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        log_message(LOG_ERR, "wal: %s: %s\n", dir, strerror(errno));
+        return ESYSERR;
+    }
+
+    if ((d = opendir(dir)) == NULL)
+    {
+        log_message(LOG_ERR, "wal: %s: %s\n", dir, strerror(errno));
+        return ESYSERR;
+    }
+
+    while ((e = readdir(d)) != NULL && w->nsegs < WAL_MAX_SEGMENTS)
+    {
+        unsigned long long first;
+        char tail[8];
+
+        if (sscanf(e->d_name, "wal-%16llx.%7s", &first, tail) == 2 && strcmp(tail, "log") == 0 && first > 0)
+            w->segs[w->nsegs++] = first;
+    }
+    closedir(d);
+
+    qsort(w->segs, w->nsegs, sizeof(uint64_t), cmp_u64);
+
+    for (int i = 0; i + 1 < w->nsegs; i++)
+    {
+        char path[512];
+        struct stat st;
+
+        wal_seg_path(w, w->segs[i], path, sizeof(path));
+        w->seg_bytes[i] = stat(path, &st) == 0 ? (uint64_t) st.st_size : 0;
+    }
+
+    if (w->nsegs == 0)
+    {
+        w->next_seq = 1;
+        return wal_new_segment(w);
+    }
+
+    if (wal_recover(w) != ENOERR)
+        return ESYSERR;
+
+    log_message(LOG_INFO, "wal: %s, %d segment(s), seq %llu..%llu\n", dir, w->nsegs,
+        (unsigned long long) w->segs[0], (unsigned long long) w->committed);
+
+    return ENOERR;
+}
+
+/**
+ * @brief append a message, durable with the next commit
+ *
+ * @param w
+ * @param data
+ * @param len
+ * @param seq, its sequence number, may be NULL
+ * @return int
+ */
+int wal_append(wal_t* w, const void* data, int len, uint64_t* seq)
+{
+    wal_rec_hdr h;
+    struct iovec iov[2];
+    ssize_t n;
+
+    if (len < 0 || len > WAL_MAX_RECORD)
+        return EGENERR;
+
+    pthread_mutex_lock(&w->lock);
+
+    // the last rotation failed (flash full ...), tried again
+    if (w->fd < 0 && wal_new_segment(w) != ENOERR)
+    {
+        pthread_mutex_unlock(&w->lock);
+        return ESYSERR;
+    }
+
+    h.len = (uint32_t) len;
+    h.seq = w->next_seq;
+    h.crc = wal_rec_crc(h.seq, data, (size_t) len);
+
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = (void*) data;
+    iov[1].iov_len = (size_t) len;
+
+    n = writev(w->fd, iov, 2);
+    if (n != (ssize_t) (sizeof(h) + len))
+    {
+        log_message(LOG_ERR, "wal: append: %s\n", n < 0 ? strerror(errno) : "short write");
+
+        // no half record in the middle of the segment
+        if (n > 0 && ftruncate(w->fd, (off_t) w->seg_size) != 0)
+            log_message(LOG_ERR, "wal: truncate: %s\n", strerror(errno));
+
+        pthread_mutex_unlock(&w->lock);
+        return ESYSERR;
+    }
+
+    if (seq != NULL)
+        *seq = h.seq;
+
+    w->next_seq++;
+    w->appends++;
+    w->seg_size += (uint64_t) n;
+    w->seg_bytes[w->nsegs - 1] += (uint64_t) n;
+    w->pending += (uint64_t) n;
+
+    // the full segment is synced and closed by the commit thread; while the
+    // previous one still waits for it, this one grows a bit past the size
+    if (w->seg_size >= w->segment_bytes && w->sealed_fd < 0)
+    {
+        w->sealed_fd = w->fd;
+        w->fd = -1;
+        pthread_cond_signal(&w->cond);
+
+        wal_new_segment(w);
+    }
+    else if (w->pending >= w->commit_bytes)
+        pthread_cond_signal(&w->cond);
+
+    pthread_mutex_unlock(&w->lock);
+
+    return ENOERR;
+}
+
+/**
+ * @brief persist a cursor: temporary file, synced, renamed over the old one
+ *
+ * @param w
+ * @param name
+ * @param acked
+ * @return int
+ */
+static int wal_save_cursor(wal_t* w, const char* name, uint64_t acked)
+{
+    char path[512], tmp[520];
+    char buf[32];
+    int fd, n, rc = ENOERR;
+
+    snprintf(path, sizeof(path), "%s/%s.cursor", w->dir, name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    n = snprintf(buf, sizeof(buf), "%llu\n", (unsigned long long) acked);
+
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return ESYSERR;
+
+    if (write(fd, buf, n) != n || fdatasync(fd) != 0)
+        rc = ESYSERR;
+    close(fd);
+
+    if (rc == ENOERR && rename(tmp, path) != 0)
+        rc = ESYSERR;
+
+    if (rc != ENOERR)
+    {
+        log_message(LOG_ERR, "wal: cursor %s: %s\n", path, strerror(errno));
+        return rc;
+    }
+
+    // the rename itself
+    return wal_sync_dir(w);
+}
+
+/**
+ * @brief make the appends durable, persist the moved cursors and remove the
+ *        segments no sink needs any more
+ *
+ * @param w
+ * @return int
+ */
+int wal_commit(wal_t* w)
+{
+    struct { char name[WAL_NAME_LEN]; uint64_t acked; wal_cursor* c; } save[WAL_MAX_CURSORS];
+    int nsave = 0;
+    uint64_t target = 0;
+    int sealed = -1, fd = -1;
+    int dirsync = 0;
+    int rc = ENOERR;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->pending > 0 || w->sealed_fd >= 0)
+    {
+        // synced outside the lock, the appends go on meanwhile
+        sealed = w->sealed_fd;
+        w->sealed_fd = -1;
+        if (w->fd >= 0)
+            fd = dup(w->fd);
+        dirsync = w->dir_dirty;
+        w->dir_dirty = 0;
+        target = w->next_seq - 1;
+        w->pending = 0;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    // the older records first, then the segment holding the newest
+    if (sealed >= 0)
+    {
+        if (fdatasync(sealed) != 0)
+        {
+            log_message(LOG_ERR, "wal: sync: %s\n", strerror(errno));
+            rc = ESYSERR;
+        }
+        close(sealed);
+    }
+
+    if (fd >= 0)
+    {
+        if (fdatasync(fd) != 0)
+        {
+            log_message(LOG_ERR, "wal: sync: %s\n", strerror(errno));
+            rc = ESYSERR;
+        }
+        close(fd);
+    }
+
+    if (dirsync && wal_sync_dir(w) != ENOERR)
+        rc = ESYSERR;
+
+    pthread_mutex_lock(&w->lock);
+
+    // tried again with the next commit
+    if (dirsync && rc != ENOERR)
+        w->dir_dirty = 1;
+
+    if (rc == ENOERR && target > w->committed)
+    {
+        w->committed = target;
+        w->commits++;
+        wal_notify(w);
+    }
+
+    uint64_t min = w->committed;
+
+    for (int i = 0; i < w->ncursors; i++)
+    {
+        wal_cursor* c = w->cursors[i];
+
+        if (c->acked < min)
+            min = c->acked;
+
+        if (c->acked != c->saved)
+        {
+            snprintf(save[nsave].name, WAL_NAME_LEN, "%s", c->name);
+            save[nsave].acked = c->acked;
+            save[nsave].c = c;
+            nsave++;
+        }
+    }
+
+    // segments all of whose records every sink delivered
+    while (w->nsegs > 1 && w->segs[1] <= min + 1)
+        wal_drop_oldest(w);
+
+    // bounded on flash, even if a sink is away for long
+    uint64_t total = 0;
+    for (int i = 0; i < w->nsegs; i++)
+        total += w->seg_bytes[i];
+
+    while (w->nsegs > 1 && total > w->max_bytes)
+    {
+        uint64_t lost = w->segs[1] > min + 1 ? w->segs[1] - (w->segs[0] > min + 1 ? w->segs[0] : min + 1) : 0;
+
+        log_message(LOG_WARNING, "wal: over %llu MB, %llu undelivered record(s) dropped\n",
+            (unsigned long long) (w->max_bytes >> 20), (unsigned long long) lost);
+
+        w->dropped += lost;
+        total -= w->seg_bytes[0];
+        wal_drop_oldest(w);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    for (int i = 0; i < nsave; i++)
+    {
+        if (wal_save_cursor(w, save[i].name, save[i].acked) == ENOERR)
+        {
+            pthread_mutex_lock(&w->lock);
+            save[i].c->saved = save[i].acked;
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+
+    return rc;
+}
+
+static void* wal_task(void* arg)
+{
+    wal_t* w = (wal_t*) arg;
+    int running = 1;
+
+    while (running)
+    {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += w->commit_ms / 1000;
+        deadline.tv_nsec += (long) (w->commit_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        // one commit per period, sooner if enough piled up
+        pthread_mutex_lock(&w->lock);
+        while (w->running && w->pending < w->commit_bytes && w->sealed_fd < 0)
+        {
+            if (pthread_cond_timedwait(&w->cond, &w->lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+        running = w->running;
+        pthread_mutex_unlock(&w->lock);
+
+        wal_commit(w);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Do the task (group commits)
+ *
+ * @param w
+ * @return int
+ */
+int wal_run(wal_t* w)
+{
+    w->running = 1;
+
+    return
+        pthread_create(&w->task_thread, NULL, wal_task, w);
+}
+
+/**
+ * @brief stop the commits and wait for the last one
+ *
+ * @param w
+ * @return int
+ */
+int wal_wait(wal_t* w)
+{
+    if (!w->running)
+        return 0;
+
+    pthread_mutex_lock(&w->lock);
+    w->running = 0;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    return
+        pthread_join(w->task_thread, NULL);
+}
+
+/**
+ * @brief Free task's data, after a last commit
+ *
+ * @param w
+ * @return int
+ */
+int wal_term(wal_t* w)
+{
+    wal_commit(w);
+
+    log_message(LOG_INFO, "wal: %lu appends, %lu commits, %lu dropped\n", w->appends, w->commits, w->dropped);
+
+    for (int i = 0; i < w->ncursors; i++)
+    {
+        wal_cursor* c = w->cursors[i];
+
+        if (c->fd >= 0)
+            close(c->fd);
+        close(c->efd);
+        free(c);
+    }
+    w->ncursors = 0;
+
+    if (w->fd >= 0)
+        close(w->fd);
+    w->fd = -1;
+
+    if (w->sealed_fd >= 0)
+        close(w->sealed_fd);
+    w->sealed_fd = -1;
+
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+
+    free(w->dir);
+    w->dir = NULL;
+
+    return 0;
+}
+
+/**
+ * @brief cursor of a sink, resumes after its persisted position. A new
+ *        sink starts at the end of the log
+ *
+ * @param w
+ * @param name, file name safe
+ * @return wal_cursor*, NULL => error
+ */
+wal_cursor* wal_cursor_open(wal_t* w, const char* name)
+{
+    wal_cursor* c = (wal_cursor*) calloc(1, sizeof(wal_cursor));
+    char path[512];
+    unsigned long long acked;
+    FILE* f;
+
+    if (c == NULL)
+        return NULL;
+
+    c->w = w;
+    c->fd = -1;
+    snprintf(c->name, sizeof(c->name), "%s", name);
+
+    if ((c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        free(c);
+        return NULL;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s.cursor", w->dir, name);
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->ncursors == WAL_MAX_CURSORS)
+    {
+        pthread_mutex_unlock(&w->lock);
+        close(c->efd);
+        free(c);
+        return NULL;
+    }
+
+    if ((f = fopen(path, "r")) != NULL && fscanf(f, "%llu", &acked) == 1)
+    {
+        c->acked = acked;
+        c->saved = acked;
+
+        // the log was reset / trimmed meanwhile
+        if (c->acked > w->next_seq - 1)
+            c->acked = w->next_seq - 1;
+        if (c->acked + 1 < w->segs[0])
+        {
+            log_message(LOG_WARNING, "wal: cursor %s: records %llu..%llu no longer in the log\n",
+                name, (unsigned long long) (c->acked + 1), (unsigned long long) (w->segs[0] - 1));
+            c->acked = w->segs[0] - 1;
+        }
+    }
+    else
+    {
+        c->acked = w->next_seq - 1;
+        c->saved = (uint64_t) -1;   // written with the first commit
+    }
+
+    if (f != NULL)
+        fclose(f);
+
+    c->next = c->acked + 1;
+    w->cursors[w->ncursors++] = c;
+
+    log_message(LOG_INFO, "wal: cursor %s at %llu, %llu record(s) to replay\n", name,
+        (unsigned long long) c->acked, (unsigned long long) (w->committed - c->acked));
+
+    if (w->committed >= c->next)
+        wal_notify(w);
+
+    pthread_mutex_unlock(&w->lock);
+
+    return c;
+}
+
+/**
+ * @brief open the segment holding c->next
+ *
+ * @param c
+ * @return int
+ */
+static int wal_cursor_seek(wal_cursor* c)
+{
+    wal_t* w = c->w;
+    char path[512];
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+
+    if (c->next < w->segs[0])
+    {
+        log_message(LOG_WARNING, "wal: cursor %s: skipped to %llu, older records dropped\n",
+            c->name, (unsigned long long) w->segs[0]);
+        c->next = w->segs[0];
+    }
+
+    for (i = w->nsegs - 1; i > 0 && w->segs[i] > c->next; i--)
+        ;
+
+    c->seg_first = w->segs[i];
+    wal_seg_path(w, c->seg_first, path, sizeof(path));
+
+    pthread_mutex_unlock(&w->lock);
+
+    c->off = 0;
+    c->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (c->fd < 0)
+    {
+        log_message(LOG_ERR, "wal: %s: %s\n", path, strerror(errno));
+        return ESYSERR;
+    }
+
+    return ENOERR;
+}
+
+/**
+ * @brief go on in the segment after the current one
+ *
+ * @param c
+ * @return int, EQEMPTY => none yet
+ */
+static int wal_cursor_next_segment(wal_cursor* c)
+{
+    wal_t* w = c->w;
+    uint64_t first = 0;
+
+    pthread_mutex_lock(&w->lock);
+    for (int i = 0; i < w->nsegs; i++)
+    {
+        if (w->segs[i] > c->seg_first)
+        {
+            first = w->segs[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if (first == 0)
+        return EQEMPTY;
+
+    close(c->fd);
+    c->fd = -1;
+
+    if (c->next < first)
+        c->next = first;
+
+    return wal_cursor_seek(c);
+}
+
+/**
+ * @brief first valid record after a bad one in the cursor's segment: its
+ *        seq is between c->next and committed and its checksum matches
+ *
+ * @param c
+ * @param committed
+ * @return int, ENOERR => c->off on it, EQEMPTY => none
+ */
+static int wal_cursor_resync(wal_cursor* c, uint64_t committed)
+{
+    uint8_t chunk[16384];
+    uint8_t rec[WAL_MAX_RECORD];
+    uint64_t off = c->off + 1;
+    ssize_t n;
+
+    while ((n = pread(c->fd, chunk, sizeof(chunk), (off_t) off)) >= (ssize_t) sizeof(wal_rec_hdr))
+    {
+        for (ssize_t i = 0; i + (ssize_t) sizeof(wal_rec_hdr) <= n; i++)
+        {
+            wal_rec_hdr h;
+
+            memcpy(&h, chunk + i, sizeof(h));
+            if (h.seq < c->next || h.seq > committed || h.len > WAL_MAX_RECORD)
+                continue;
+
+            if (pread(c->fd, rec, h.len, (off_t) (off + i + sizeof(h))) != (ssize_t) h.len
+                || wal_rec_crc(h.seq, rec, h.len) != h.crc)
+                continue;
+
+            log_message(LOG_WARNING, "wal: cursor %s: record(s) %llu..%llu lost\n", c->name,
+                (unsigned long long) c->next, (unsigned long long) (h.seq - 1));
+
+            c->off = off + i;
+            return ENOERR;
+        }
+
+        // the last header may straddle the chunks
+        off += (uint64_t) (n - sizeof(wal_rec_hdr) + 1);
+    }
+
+    return EQEMPTY;
+}
+
+/**
+ * @brief next committed record of the cursor. A bad record is skipped up to
+ *        the next valid one; at the end of the log it is left as the end
+ *        until valid records follow it
+ *
+ * @param c
+ * @param buf
+ * @param size
+ * @param len
+ * @param seq
+ * @return int, ENOERR => *len bytes in buf, EQEMPTY => nothing committed yet,
+ *         EBUFSIZE => *len / *seq of a record larger than size, not read
+ */
+int wal_cursor_read(wal_cursor* c, void* buf, int size, int* len, uint64_t* seq)
+{
+    wal_t* w = c->w;
+    uint64_t committed;
+    uint8_t big[WAL_MAX_RECORD];
+    wal_rec_hdr h;
+
+    pthread_mutex_lock(&w->lock);
+    committed = w->committed;
+    pthread_mutex_unlock(&w->lock);
+
+    if (c->next > committed)
+        return EQEMPTY;
+
+    if (c->fd < 0 && wal_cursor_seek(c) != ENOERR)
+        return ESYSERR;
+
+    while (1)
+    {
+        ssize_t n = pread(c->fd, &h, sizeof(h), (off_t) c->off);
+        int rc;
+
+        // end of the segment
+        if (n == 0)
+        {
+            if ((rc = wal_cursor_next_segment(c)) != ENOERR)
+                return rc;
+            continue;
+        }
+
+        // checked in a buffer of ours, the length may be the bad part
+        uint8_t* rec = (n == (ssize_t) sizeof(h) && (int) h.len > size) ? big : (uint8_t*) buf;
+
+        if (n != (ssize_t) sizeof(h) || h.len > WAL_MAX_RECORD
+            || pread(c->fd, rec, h.len, (off_t) (c->off + sizeof(h))) != (ssize_t) h.len
+            || wal_rec_crc(h.seq, rec, h.len) != h.crc)
+        {
+            int known = c->bad_off == c->off + 1;
+
+            if (!known)
+                log_message(LOG_ERR, "wal: cursor %s: bad record at %llu of segment %llu\n",
+                    c->name, (unsigned long long) c->off, (unsigned long long) c->seg_first);
+            c->bad_off = c->off + 1;
+
+            if (wal_cursor_resync(c, committed) == ENOERR)
+                continue;
+
+            // nothing valid after it in this segment: its tail
+            uint64_t first = c->seg_first;
+
+            if ((rc = wal_cursor_next_segment(c)) == ENOERR)
+            {
+                log_message(LOG_WARNING, "wal: cursor %s: tail of segment %llu skipped\n",
+                    c->name, (unsigned long long) first);
+                continue;
+            }
+
+            if (rc == EQEMPTY && !known)
+                log_message(LOG_WARNING, "wal: cursor %s: the log ends with a bad record, waiting for the next ones\n", c->name);
+            return rc;
+        }
+
+        // valid but not durable yet, e.g. the head of the segment after a
+        // skipped tail: read again after the commit covering it
+        if (h.seq > committed)
+            return EQEMPTY;
+
+        if (rec == big)
+        {
+            *len = (int) h.len;
+            *seq = h.seq;
+            return EBUFSIZE;
+        }
+
+        c->off += sizeof(h) + h.len;
+
+        // skipping up to the resume point
+        if (h.seq < c->next)
+            continue;
+
+        c->next = h.seq + 1;
+        *len = (int) h.len;
+        *seq = h.seq;
+
+        return ENOERR;
+    }
+}
+
+/**
+ * @brief the sink delivered everything up to seq
+ *
+ * @param c
+ * @param seq
+ */
+void wal_cursor_ack(wal_cursor* c, uint64_t seq)
+{
+    pthread_mutex_lock(&c->w->lock);
+    if (seq > c->acked)
+        c->acked = seq;
+    pthread_mutex_unlock(&c->w->lock);
+}
+
+/**
+ * @brief read again from seq (failed delivery), by the cursor's reader
+ *
+ * @param c
+ * @param seq
+ */
+void wal_cursor_rewind(wal_cursor* c, uint64_t seq)
+{
+    if (c->fd >= 0)
+        close(c->fd);
+
+    c->fd = -1;
+    c->next = seq;
+}